@@ -0,0 +1,72 @@
+#include "SonarFrameSource.hh"
+#include <chrono>
+
+namespace
+{
+// メールボックスと利用側が持つフレーム
+constexpr int kHeldFrames = 2;
+} // namespace
+
+SonarFrameSource::SonarFrameSource()
+    : mReceiver(kHeldFrames, [this](const SonarFramePtr& frame) { accept(frame); })
+{
+}
+
+// virtual
+SonarFrameSource::~SonarFrameSource()
+{
+    close();
+}
+
+bool
+SonarFrameSource::open(const std::string& uri)
+{
+    close();
+    return mReceiver.open(uri);
+}
+
+void
+SonarFrameSource::close()
+{
+    mReceiver.close();
+    mMailbox.take();
+}
+
+bool
+SonarFrameSource::isOpen() const
+{
+    return mReceiver.isOpen();
+}
+
+SonarFramePtr
+SonarFrameSource::waitFrame(int64_t timeoutUs)
+{
+    SonarFramePtr frame;
+    std::unique_lock<std::mutex> lock(mWaitMutex);
+    mWaitCondition.wait_for(lock, std::chrono::microseconds(timeoutUs),
+                            [&] { return (frame = mMailbox.take()) != nullptr; });
+    return frame;
+}
+
+uint64_t
+SonarFrameSource::receivedFrames() const
+{
+    return mReceiver.receivedFrames();
+}
+
+uint64_t
+SonarFrameSource::droppedFrames() const
+{
+    return mMailbox.droppedFrames();
+}
+
+// 受信スレッドから呼ばれる
+void
+SonarFrameSource::accept(const SonarFramePtr& frame)
+{
+    if (mMailbox.put(frame))
+    {
+        std::lock_guard<std::mutex> lock(mWaitMutex);
+        mWaitCondition.notify_one();
+    }
+}
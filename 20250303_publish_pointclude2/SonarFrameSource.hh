@@ -0,0 +1,47 @@
+#if !defined(SONAR_FRAME_SOURCE_HH)
+#define SONAR_FRAME_SOURCE_HH
+
+#include "SonarFrameMailbox.hh"
+#include "SonarLiveReceiver.hh"
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+#include <string>
+
+// ライブ入力 (UDP / 共有メモリ) から最新のフレームを受け取る
+// (URI は SonarLiveReceiver 参照。扱うのは 1 ストリームだけ)
+//
+// 受信と再構築は SonarLiveReceiver のスレッドで行い、完成したフレームをメールボックスへ入れる
+// 利用側 (ROS の publish 等) が遅れても受信は止まらず、古いフレームは捨てて最新だけを渡す
+class SonarFrameSource
+{
+public:
+    SonarFrameSource();
+    virtual ~SonarFrameSource();
+
+    SonarFrameSource(const SonarFrameSource&) = delete;
+    SonarFrameSource& operator=(const SonarFrameSource&) = delete;
+
+    // 受信スレッドを開始する (URI が不正か UDP ソケットを開けなければ false)
+    bool open(const std::string& uri);
+    void close();
+    bool isOpen() const;
+
+    // 次のフレームを最大 timeoutUs 待つ (届かなければ nullptr)
+    SonarFramePtr waitFrame(int64_t timeoutUs);
+
+    // 受け取ったフレーム数と、取り出される前に新しいフレームで上書きされた数
+    uint64_t receivedFrames() const;
+    uint64_t droppedFrames() const;
+
+private:
+    void accept(const SonarFramePtr& frame);
+
+    SonarFrameMailbox mMailbox;
+    std::mutex mWaitMutex;
+    std::condition_variable mWaitCondition;
+    // 受信スレッドが mMailbox より先に止まるよう最後に置く
+    SonarLiveReceiver mReceiver;
+};
+
+#endif // !defined(SONAR_FRAME_SOURCE_HH)
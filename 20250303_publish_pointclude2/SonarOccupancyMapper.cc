@@ -0,0 +1,274 @@
+#include "SonarOccupancyMapper.hh"
+#include <rclcpp_components/register_node_macro.hpp>
+#include <sensor_msgs/point_cloud2_iterator.hpp>
+#include <chrono>
+#include <stdexcept>
+
+namespace
+{
+// 組になっていない画像 / ジオメトリを保持する数 (古いものから捨てる)
+constexpr size_t kMaxUnpaired = 16;
+// 姿勢を待つフレームの数 (超えたら古いものから捨てる)
+constexpr size_t kMaxPending = 64;
+// 購読した姿勢を保持する数
+constexpr size_t kPoseCapacity = 10000;
+
+inline int64_t
+stampUs(const builtin_interfaces::msg::Time& stamp)
+{
+    return rclcpp::Time(stamp).nanoseconds() / 1000;
+}
+} // namespace
+
+SonarOccupancyMapper::SonarOccupancyMapper(const rclcpp::NodeOptions& options)
+    : Node("sonar_occupancy_mapper", options)
+{
+    SonarVoxelMapConfig config;
+    map_frame_ = this->declare_parameter<std::string>("map_frame", "map");
+    const std::string pose_topic = this->declare_parameter<std::string>("pose_topic", "sonar/pose");
+    const std::string pose_csv = this->declare_parameter<std::string>("pose_csv", "");
+    const double max_pose_gap = this->declare_parameter<double>("max_pose_gap", 0.5);
+    config.voxelSize = this->declare_parameter<double>("voxel_size", config.voxelSize);
+    config.threshold = this->declare_parameter<int>("threshold", config.threshold);
+    config.minRange = this->declare_parameter<double>("min_range", config.minRange);
+    config.maxRange = this->declare_parameter<double>("max_range", config.maxRange);
+    config.freeSpace = this->declare_parameter<bool>("free_space", config.freeSpace);
+    config.threads = this->declare_parameter<int>("threads", config.threads);
+    const double publish_period = this->declare_parameter<double>("publish_period", 2.0);
+    downsample_ = this->declare_parameter<int>("downsample", 1);
+    min_probability_ = this->declare_parameter<double>("min_probability", 0.7);
+    save_path_ = this->declare_parameter<std::string>("save_path", "");
+    if (config.voxelSize <= 0.0)
+        throw std::invalid_argument("voxel_size must be positive");
+    if (publish_period <= 0.0)
+        throw std::invalid_argument("publish_period must be positive");
+
+    const int64_t max_gap_us = static_cast<int64_t>(max_pose_gap * 1e6);
+    pose_from_csv_ = !pose_csv.empty();
+    if (pose_from_csv_)
+    {
+        track_ = SonarPoseTrack(max_gap_us);
+        if (!track_.loadCsv(pose_csv))
+            throw std::runtime_error("Cannot read poses from " + pose_csv);
+        RCLCPP_INFO(this->get_logger(), "%zu poses from %s", track_.size(), pose_csv.c_str());
+    }
+    else
+    {
+        track_ = SonarPoseTrack(max_gap_us, kPoseCapacity);
+        pose_subscription_ = this->create_subscription<geometry_msgs::msg::PoseStamped>(
+            pose_topic, 100,
+            [this](geometry_msgs::msg::PoseStamped::ConstSharedPtr msg) { on_pose(msg); });
+        RCLCPP_INFO(this->get_logger(), "Poses from %s", pose_topic.c_str());
+    }
+
+    map_ = std::make_unique<SonarVoxelMap>(config);
+    image_subscription_ = this->create_subscription<sensor_msgs::msg::Image>(
+        "sonar/image", 10, [this](sensor_msgs::msg::Image::ConstSharedPtr msg) { on_image(msg); });
+    info_subscription_ = this->create_subscription<sonar_ros_bridge::msg::SonarPolarInfo>(
+        "sonar/polar_info", 10,
+        [this](sonar_ros_bridge::msg::SonarPolarInfo::ConstSharedPtr msg) { on_polar_info(msg); });
+    map_publisher_ = this->create_publisher<sensor_msgs::msg::PointCloud2>("sonar/map", 1);
+    timer_ = this->create_wall_timer(
+        std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::duration<double>(publish_period)),
+        [this]() { publish_map(); });
+}
+
+SonarOccupancyMapper::~SonarOccupancyMapper()
+{
+    if (!save_path_.empty() && map_ && map_->insertedFrames() != saved_frames_)
+    {
+        map_->exportOccupied(min_probability_, downsample_, voxels_);
+        save_map();
+    }
+}
+
+void
+SonarOccupancyMapper::on_image(sensor_msgs::msg::Image::ConstSharedPtr msg)
+{
+    images_[stampUs(msg->header.stamp)] = msg;
+    pair_frames();
+    insert_pending();
+}
+
+void
+SonarOccupancyMapper::on_polar_info(sonar_ros_bridge::msg::SonarPolarInfo::ConstSharedPtr msg)
+{
+    infos_[stampUs(msg->header.stamp)] = msg;
+    pair_frames();
+    insert_pending();
+}
+
+void
+SonarOccupancyMapper::on_pose(geometry_msgs::msg::PoseStamped::ConstSharedPtr msg)
+{
+    if (!msg->header.frame_id.empty() && msg->header.frame_id != map_frame_)
+    {
+        RCLCPP_WARN_THROTTLE(this->get_logger(), *this->get_clock(), 10000,
+                             "Pose in %s, expected %s (not transformed)",
+                             msg->header.frame_id.c_str(), map_frame_.c_str());
+    }
+    SonarPose pose;
+    pose.timeUs = stampUs(msg->header.stamp);
+    pose.x = msg->pose.position.x;
+    pose.y = msg->pose.position.y;
+    pose.z = msg->pose.position.z;
+    pose.qx = msg->pose.orientation.x;
+    pose.qy = msg->pose.orientation.y;
+    pose.qz = msg->pose.orientation.z;
+    pose.qw = msg->pose.orientation.w;
+    track_.add(pose);
+    insert_pending();
+}
+
+void
+SonarOccupancyMapper::pair_frames()
+{
+    for (auto image = images_.begin(); image != images_.end();)
+    {
+        const auto info = infos_.find(image->first);
+        if (info == infos_.end())
+        {
+            ++image;
+            continue;
+        }
+        pending_.push_back(Frame{image->first, image->second, info->second});
+        infos_.erase(info);
+        image = images_.erase(image);
+    }
+    while (images_.size() > kMaxUnpaired)
+        images_.erase(images_.begin());
+    while (infos_.size() > kMaxUnpaired)
+        infos_.erase(infos_.begin());
+    while (pending_.size() > kMaxPending)
+    {
+        pending_.pop_front();
+        ++dropped_frames_;
+        RCLCPP_WARN_THROTTLE(this->get_logger(), *this->get_clock(), 5000,
+                             "Frames waiting for a pose dropped (%lu in total)",
+                             static_cast<unsigned long>(dropped_frames_));
+    }
+}
+
+void
+SonarOccupancyMapper::insert_pending()
+{
+    while (!pending_.empty())
+    {
+        const Frame& frame = pending_.front();
+        // 購読した姿勢ならフレームより新しい姿勢が届くまで待つ (届けば前後で補間できる)
+        if (!pose_from_csv_ && track_.isPending(frame.timeUs))
+            break;
+        SonarPose pose;
+        if (!track_.lookup(frame.timeUs, pose))
+        {
+            ++dropped_frames_;
+            RCLCPP_WARN_THROTTLE(this->get_logger(), *this->get_clock(), 5000,
+                                 "No pose at %.3f s (frame dropped)", frame.timeUs * 1e-6);
+        }
+        else if (!insert(frame, pose))
+        {
+            ++dropped_frames_;
+        }
+        pending_.pop_front();
+    }
+}
+
+bool
+SonarOccupancyMapper::insert(const Frame& frame, const SonarPose& pose)
+{
+    const sensor_msgs::msg::Image& image = *frame.image;
+    const sonar_ros_bridge::msg::SonarPolarInfo& info = *frame.info;
+    const bool is16bit = image.encoding == "mono16";
+    if (!is16bit && image.encoding != "mono8")
+    {
+        RCLCPP_WARN_THROTTLE(this->get_logger(), *this->get_clock(), 5000,
+                             "Unsupported encoding %s", image.encoding.c_str());
+        return false;
+    }
+    if (is16bit && image.is_bigendian != (__BYTE_ORDER__ == __ORDER_BIG_ENDIAN__))
+    {
+        RCLCPP_WARN_THROTTLE(this->get_logger(), *this->get_clock(), 5000,
+                             "Image byte order differs from the host");
+        return false;
+    }
+    const size_t step = static_cast<size_t>(image.width) * (is16bit ? 2 : 1);
+    if (image.step != step || image.data.size() < step * image.height ||
+        info.beam_angles.size() != image.width)
+    {
+        RCLCPP_WARN_THROTTLE(this->get_logger(), *this->get_clock(), 5000,
+                             "Image %ux%u does not match its polar info (%zu beams)",
+                             image.width, image.height, info.beam_angles.size());
+        return false;
+    }
+
+    SonarPolarScan scan;
+    scan.width = static_cast<int>(image.width);
+    scan.height = static_cast<int>(image.height);
+    scan.is16bit = is16bit;
+    scan.pixels = image.data.data();
+    scan.beamAngles = info.beam_angles.data();
+    scan.binSize = info.range_resolution;
+    const auto start = std::chrono::steady_clock::now();
+    map_->insertFrame(scan, pose);
+    insert_seconds_ += std::chrono::duration<double>(std::chrono::steady_clock::now() - start)
+                           .count();
+    return true;
+}
+
+void
+SonarOccupancyMapper::publish_map()
+{
+    const uint64_t frames = map_->insertedFrames();
+    if (frames > 0)
+    {
+        RCLCPP_INFO(this->get_logger(), "%zu voxels from %lu frames (%.1f ms/frame), %lu dropped",
+                    map_->voxelCount(), static_cast<unsigned long>(frames),
+                    insert_seconds_ * 1e3 / static_cast<double>(frames),
+                    static_cast<unsigned long>(dropped_frames_));
+    }
+    const bool publish = map_publisher_->get_subscription_count() > 0;
+    const bool save = !save_path_.empty() && frames != saved_frames_;
+    if (!publish && !save)
+        return;
+    map_->exportOccupied(min_probability_, downsample_, voxels_);
+
+    if (publish)
+    {
+        map_msg_.header.stamp = this->now();
+        map_msg_.header.frame_id = map_frame_;
+        if (map_msg_.fields.size() != 4)
+        {
+            sensor_msgs::PointCloud2Modifier modifier(map_msg_);
+            modifier.setPointCloud2Fields(4,
+                                          "x", 1, sensor_msgs::msg::PointField::FLOAT32,
+                                          "y", 1, sensor_msgs::msg::PointField::FLOAT32,
+                                          "z", 1, sensor_msgs::msg::PointField::FLOAT32,
+                                          "probability", 1, sensor_msgs::msg::PointField::FLOAT32);
+        }
+        map_msg_.is_bigendian = false;
+        map_msg_.is_dense = true;
+        map_msg_.height = 1;
+        map_msg_.width = static_cast<uint32_t>(voxels_.size());
+        map_msg_.row_step = map_msg_.width * map_msg_.point_step;
+        const uint8_t* bytes = reinterpret_cast<const uint8_t*>(voxels_.data());
+        map_msg_.data.assign(bytes, bytes + map_msg_.row_step);
+        map_publisher_->publish(map_msg_);
+    }
+    if (save)
+        save_map();
+}
+
+// voxels_ (exportOccupied() の結果) を save_path_ へ保存する
+void
+SonarOccupancyMapper::save_map()
+{
+    if (!SonarVoxelMap::savePly(save_path_, voxels_))
+    {
+        RCLCPP_ERROR(this->get_logger(), "Cannot save the map to %s", save_path_.c_str());
+        return;
+    }
+    saved_frames_ = map_->insertedFrames();
+}
+
+RCLCPP_COMPONENTS_REGISTER_NODE(SonarOccupancyMapper)
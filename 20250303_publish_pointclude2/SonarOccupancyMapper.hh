@@ -0,0 +1,76 @@
+#if !defined(SONAR_OCCUPANCY_MAPPER_HH)
+#define SONAR_OCCUPANCY_MAPPER_HH
+
+#include "SonarPoseTrack.hh"
+#include "SonarVoxelMap.hh"
+#include "sonar_ros_bridge/msg/sonar_polar_info.hpp"
+#include <geometry_msgs/msg/pose_stamped.hpp>
+#include <rclcpp/rclcpp.hpp>
+#include <sensor_msgs/msg/image.hpp>
+#include <sensor_msgs/msg/point_cloud2.hpp>
+#include <cstdint>
+#include <deque>
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+
+// 極座標のソナー画像を姿勢で world (map_frame) へ置き、3 次元の占有地図に積み上げるノード
+// (トピックとパラメータは mapper.cc 参照)
+//   sonar/image + sonar/polar_info  header.stamp が同じものを 1 フレームとして組にする
+//   姿勢                            PoseStamped (pose_topic) か CSV (pose_csv)
+//   sonar/map                       占有しているボクセル (PointCloud2: x, y, z, probability)
+// 姿勢を購読する場合、フレームより新しい姿勢が届くまでフレームを待たせてから補間する
+// 地図は publish_period 毎に publish し、save_path があれば PLY で保存する (終了時にも保存する)
+class SonarOccupancyMapper : public rclcpp::Node
+{
+public:
+    explicit SonarOccupancyMapper(const rclcpp::NodeOptions& options = rclcpp::NodeOptions());
+    ~SonarOccupancyMapper() override;
+
+private:
+    struct Frame
+    {
+        int64_t timeUs;
+        sensor_msgs::msg::Image::ConstSharedPtr image;
+        sonar_ros_bridge::msg::SonarPolarInfo::ConstSharedPtr info;
+    };
+
+    void on_image(sensor_msgs::msg::Image::ConstSharedPtr msg);
+    void on_polar_info(sonar_ros_bridge::msg::SonarPolarInfo::ConstSharedPtr msg);
+    void on_pose(geometry_msgs::msg::PoseStamped::ConstSharedPtr msg);
+    // 組になった画像とジオメトリを pending_ へ移す
+    void pair_frames();
+    // 姿勢が決まったフレームを地図に入れる
+    void insert_pending();
+    bool insert(const Frame& frame, const SonarPose& pose);
+    void publish_map();
+    void save_map();
+
+    rclcpp::Subscription<sensor_msgs::msg::Image>::SharedPtr image_subscription_;
+    rclcpp::Subscription<sonar_ros_bridge::msg::SonarPolarInfo>::SharedPtr info_subscription_;
+    rclcpp::Subscription<geometry_msgs::msg::PoseStamped>::SharedPtr pose_subscription_;
+    rclcpp::Publisher<sensor_msgs::msg::PointCloud2>::SharedPtr map_publisher_;
+    rclcpp::TimerBase::SharedPtr timer_;
+
+    std::string map_frame_;
+    std::string save_path_;
+    double min_probability_{0.7};
+    int downsample_{1};
+    bool pose_from_csv_{false};
+
+    // header.stamp [us] → まだ組になっていないメッセージ
+    std::map<int64_t, sensor_msgs::msg::Image::ConstSharedPtr> images_;
+    std::map<int64_t, sonar_ros_bridge::msg::SonarPolarInfo::ConstSharedPtr> infos_;
+    std::deque<Frame> pending_;
+    SonarPoseTrack track_;
+    std::unique_ptr<SonarVoxelMap> map_;
+    std::vector<SonarMapVoxel> voxels_;
+    sensor_msgs::msg::PointCloud2 map_msg_;
+
+    uint64_t dropped_frames_{0};
+    uint64_t saved_frames_{0};
+    double insert_seconds_{0.0};
+};
+
+#endif // !defined(SONAR_OCCUPANCY_MAPPER_HH)
@@ -0,0 +1,322 @@
+#include "SonarPointCloud.hh"
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <limits>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#include <xmmintrin.h>
+#endif
+
+namespace
+{
+// 行 r (1 レンジビン) のビーム [begin, end) をスカラーで埋める
+template <typename T>
+void
+fillScalar(const T* pixels, const float* cosTable, const float* sinTable, float range,
+           int begin, int end, SonarPoint* out)
+{
+    for (int b = begin; b < end; ++b)
+    {
+        out[b].x = range * cosTable[b];
+        out[b].y = range * sinTable[b];
+        out[b].z = 0.0f;
+        out[b].intensity = float(pixels[b]);
+    }
+}
+
+#if defined(__SSE2__)
+// 4 画素を float へ広げる
+inline __m128
+loadIntensity(const uint8_t* p)
+{
+    int32_t v;
+    memcpy(&v, p, 4);
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i w = _mm_unpacklo_epi8(_mm_cvtsi32_si128(v), zero);
+    return _mm_cvtepi32_ps(_mm_unpacklo_epi16(w, zero));
+}
+
+inline __m128
+loadIntensity(const uint16_t* p)
+{
+    const __m128i w = _mm_loadl_epi64(reinterpret_cast<const __m128i*>(p));
+    return _mm_cvtepi32_ps(_mm_unpacklo_epi16(w, _mm_setzero_si128()));
+}
+#endif
+
+// 行 r の全ビームを埋める
+// SSE2 では 4 ビーム分の x, y, z, intensity を 4x4 転置して 4 点 (64 バイト) ずつ書く
+template <typename T>
+void
+fillRow(const T* pixels, const float* cosTable, const float* sinTable, float range, int width,
+        SonarPoint* out)
+{
+    int b = 0;
+#if defined(__SSE2__)
+    const __m128 r = _mm_set1_ps(range);
+    for (; b + 4 <= width; b += 4)
+    {
+        __m128 x = _mm_mul_ps(r, _mm_loadu_ps(cosTable + b));
+        __m128 y = _mm_mul_ps(r, _mm_loadu_ps(sinTable + b));
+        __m128 z = _mm_setzero_ps();
+        __m128 i = loadIntensity(pixels + b);
+        _MM_TRANSPOSE4_PS(x, y, z, i);
+        float* dst = &out[b].x;
+        _mm_storeu_ps(dst, x);
+        _mm_storeu_ps(dst + 4, y);
+        _mm_storeu_ps(dst + 8, z);
+        _mm_storeu_ps(dst + 12, i);
+    }
+#endif
+    fillScalar(pixels, cosTable, sinTable, range, b, width, out);
+}
+
+#if defined(__SSE2__)
+inline __m128i
+load128(const void* p)
+{
+    return _mm_loadu_si128(reinterpret_cast<const __m128i*>(p));
+}
+
+// pixels[i] > limits[i] (符号なし) を 16 バイト分比較したビットマスク
+inline uint32_t
+aboveMask(const uint8_t* pixels, const uint8_t* limits)
+{
+    const __m128i bias = _mm_set1_epi8(char(0x80));
+    const __m128i p = _mm_xor_si128(load128(pixels), bias);
+    const __m128i l = _mm_xor_si128(load128(limits), bias);
+    return uint32_t(_mm_movemask_epi8(_mm_cmpgt_epi8(p, l)));
+}
+
+inline uint32_t
+aboveMask(const uint16_t* pixels, const uint16_t* limits)
+{
+    const __m128i bias = _mm_set1_epi16(short(0x8000));
+    const __m128i p = _mm_xor_si128(load128(pixels), bias);
+    const __m128i l = _mm_xor_si128(load128(limits), bias);
+    const __m128i above = _mm_cmpgt_epi16(p, l);
+    return uint32_t(_mm_movemask_epi8(_mm_packs_epi16(above, _mm_setzero_si128())));
+}
+#endif
+
+// pixels[b] > limits[b] となるビーム b 毎に f(b) を呼ぶ
+// SSE2 では 16 バイト分をまとめて比較し、立ったビットだけを順に取り出す
+template <typename T, typename F>
+void
+forEachAbove(const T* pixels, const T* limits, int width, F f)
+{
+    int b = 0;
+#if defined(__SSE2__)
+    const int lanes = int(16 / sizeof(T));
+    for (; b + lanes <= width; b += lanes)
+    {
+        uint32_t mask = aboveMask(pixels + b, limits + b);
+        while (mask != 0)
+        {
+            f(b + __builtin_ctz(mask));
+            mask &= mask - 1;
+        }
+    }
+#endif
+    for (; b < width; ++b)
+    {
+        if (pixels[b] > limits[b])
+            f(b);
+    }
+}
+
+template <typename T>
+T
+clampToPixel(int value)
+{
+    return T(std::min<int>(std::max(value, 0), std::numeric_limits<T>::max()));
+}
+} // namespace
+
+bool
+SonarPolarTable::update(const SonarFrame& frame)
+{
+    if (frame.width == mWidth && frame.height == mHeight && frame.swath == mSwath &&
+        frame.range == mRange)
+        return false;
+    mWidth = frame.width;
+    mHeight = frame.height;
+    mSwath = frame.swath;
+    mRange = frame.range;
+
+    mAngles.resize(size_t(mWidth));
+    mCos.resize(size_t(mWidth));
+    mSin.resize(size_t(mWidth));
+    const double step = mWidth > 1 ? double(mSwath) / (mWidth - 1) : 0.0;
+    for (int b = 0; b < mWidth; ++b)
+    {
+        // 表示の角度は右が正、sonar_frame は左が正
+        const double angle = -M_PI / 180.0 * (-mSwath / 2.0 + b * step);
+        mAngles[size_t(b)] = float(angle);
+        mCos[size_t(b)] = float(std::cos(angle));
+        mSin[size_t(b)] = float(std::sin(angle));
+    }
+    mRanges.resize(size_t(mHeight));
+    const double binSize = mHeight > 1 ? double(mRange) / (mHeight - 1) : 0.0;
+    mBinSize = float(binSize);
+    for (int r = 0; r < mHeight; ++r)
+        mRanges[size_t(r)] = float(r * binSize);
+    return true;
+}
+
+void
+SonarPolarTable::fill(const SonarFrame& frame, SonarPoint* out) const
+{
+    const size_t width = size_t(mWidth);
+    for (int r = 0; r < mHeight; ++r)
+    {
+        const size_t row = size_t(r) * width;
+        if (frame.is16bit)
+            fillRow(reinterpret_cast<const uint16_t*>(frame.pixels()) + row, mCos.data(),
+                    mSin.data(), mRanges[size_t(r)], mWidth, out + row);
+        else
+            fillRow(frame.pixels() + row, mCos.data(), mSin.data(), mRanges[size_t(r)], mWidth,
+                    out + row);
+    }
+}
+
+void
+SonarPolarTable::point(int bin, int beam, float intensity, SonarPoint& out) const
+{
+    const float range = mRanges[size_t(bin)];
+    out.x = range * mCos[size_t(beam)];
+    out.y = range * mSin[size_t(beam)];
+    out.z = 0.0f;
+    out.intensity = intensity;
+}
+
+size_t
+SonarPolarTable::fillAbove(const SonarFrame& frame, int threshold, SonarPoint* out)
+{
+    return frame.is16bit ? fillAboveT<uint16_t>(frame, threshold, out)
+                         : fillAboveT<uint8_t>(frame, threshold, out);
+}
+
+size_t
+SonarPolarTable::fillStrongest(const SonarFrame& frame, int threshold, int count, SonarPoint* out)
+{
+    return frame.is16bit ? fillStrongestT<uint16_t>(frame, threshold, count, out)
+                         : fillStrongestT<uint8_t>(frame, threshold, count, out);
+}
+
+size_t
+SonarPolarTable::fillFirstPeak(const SonarFrame& frame, int threshold, SonarPoint* out)
+{
+    return frame.is16bit ? fillFirstPeakT<uint16_t>(frame, threshold, out)
+                         : fillFirstPeakT<uint8_t>(frame, threshold, out);
+}
+
+template <typename T>
+size_t
+SonarPolarTable::fillAboveT(const SonarFrame& frame, int threshold, SonarPoint* out)
+{
+    mLimits.resize(size_t(mWidth));
+    T* limits = reinterpret_cast<T*>(mLimits.data());
+    std::fill(limits, limits + mWidth, clampToPixel<T>(threshold));
+
+    const T* pixels = reinterpret_cast<const T*>(frame.pixels());
+    size_t n = 0;
+    for (int r = 0; r < mHeight; ++r)
+    {
+        const T* row = pixels + size_t(r) * size_t(mWidth);
+        forEachAbove(row, limits, mWidth, [&](int b) { point(r, b, float(row[b]), out[n++]); });
+    }
+    return n;
+}
+
+// ビーム毎に強い方から count 個を持ち、満杯になったらその最小値をビームの下限にする
+// (以降はそれより強いビンだけが比較を通る)
+template <typename T>
+size_t
+SonarPolarTable::fillStrongestT(const SonarFrame& frame, int threshold, int count,
+                                SonarPoint* out)
+{
+    count = std::max(1, count);
+    mLimits.resize(size_t(mWidth));
+    T* limits = reinterpret_cast<T*>(mLimits.data());
+    std::fill(limits, limits + mWidth, clampToPixel<T>(threshold));
+    mPeaks.resize(size_t(mWidth) * size_t(count));
+    mPeakCounts.assign(size_t(mWidth), 0);
+
+    auto weakest = [count](const Peak* peaks) {
+        int w = 0;
+        for (int i = 1; i < count; ++i)
+        {
+            if (peaks[i].value < peaks[w].value)
+                w = i;
+        }
+        return w;
+    };
+    const T* pixels = reinterpret_cast<const T*>(frame.pixels());
+    for (int r = 0; r < mHeight; ++r)
+    {
+        const T* row = pixels + size_t(r) * size_t(mWidth);
+        forEachAbove(row, limits, mWidth, [&](int b) {
+            Peak* peaks = &mPeaks[size_t(b) * size_t(count)];
+            int& k = mPeakCounts[size_t(b)];
+            const Peak peak = {uint16_t(row[b]), uint16_t(r)};
+            if (k < count)
+                peaks[k++] = peak;
+            else
+                peaks[weakest(peaks)] = peak;
+            if (k == count)
+                limits[b] = T(peaks[weakest(peaks)].value);
+        });
+    }
+
+    size_t n = 0;
+    for (int b = 0; b < mWidth; ++b)
+    {
+        const Peak* peaks = &mPeaks[size_t(b) * size_t(count)];
+        for (int i = 0; i < mPeakCounts[size_t(b)]; ++i)
+            point(peaks[i].bin, b, float(peaks[i].value), out[n++]);
+    }
+    return n;
+}
+
+// 近い方から行毎に比較し、最初に threshold を超えたビームはその区間 (threshold 以下になる
+// まで) を下って最大のビンを点にする。見つかったビームは下限を最大値にして比較から外す
+template <typename T>
+size_t
+SonarPolarTable::fillFirstPeakT(const SonarFrame& frame, int threshold, SonarPoint* out)
+{
+    const T floor = clampToPixel<T>(threshold);
+    mLimits.resize(size_t(mWidth));
+    T* limits = reinterpret_cast<T*>(mLimits.data());
+    std::fill(limits, limits + mWidth, floor);
+
+    const T* pixels = reinterpret_cast<const T*>(frame.pixels());
+    const size_t width = size_t(mWidth);
+    size_t n = 0;
+    int remaining = mWidth;
+    for (int r = 0; r < mHeight && remaining > 0; ++r)
+    {
+        const T* row = pixels + size_t(r) * width;
+        forEachAbove(row, limits, mWidth, [&](int b) {
+            int best = r;
+            T value = row[b];
+            for (int rr = r + 1; rr < mHeight; ++rr)
+            {
+                const T v = pixels[size_t(rr) * width + size_t(b)];
+                if (v <= floor)
+                    break;
+                if (v > value)
+                {
+                    value = v;
+                    best = rr;
+                }
+            }
+            point(best, b, float(value), out[n++]);
+            limits[b] = std::numeric_limits<T>::max();
+            --remaining;
+        });
+    }
+    return n;
+}
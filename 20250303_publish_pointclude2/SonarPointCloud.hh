@@ -0,0 +1,92 @@
+#if !defined(SONAR_POINT_CLOUD_HH)
+#define SONAR_POINT_CLOUD_HH
+
+#include "SonarFrame.hh"
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+// PointCloud2 の 1 点 (x, y, z, intensity: FLOAT32, point_step 16)
+// メッセージの data をこの配列として直接書く
+struct SonarPoint
+{
+    float x;
+    float y;
+    float z;
+    float intensity;
+};
+static_assert(sizeof(SonarPoint) == 16, "SonarPoint must match the PointCloud2 layout");
+
+// 点にするビンの選び方
+enum SonarCloudMode
+{
+    kSonarCloudDense = 0,     // 全ビン (organized cloud)
+    kSonarCloudThreshold = 1, // threshold を超えるビン
+    kSonarCloudStrongest = 2, // ビーム毎に threshold を超える強い方から N 個
+    kSonarCloudFirstPeak = 3, // ビーム毎に最初に threshold を超えた区間の最大 (最初の反射)
+};
+
+// 極座標 (ビーム × レンジ) から sonar_frame の直交座標への変換表
+//
+// ビーム毎の cos / sin とレンジビン毎の距離をジオメトリ (width, height, swath, range) 毎に
+// 1 度だけ計算し、フレーム毎には乗算だけで点を埋める
+// 座標と角度は受信側の表示 (Widget) と同じ
+//   ビーム i の角度 = -swath / 2 + i * swath / (width - 1)  (左端から右端へ)
+//   ビン r の距離   = r * range / (height - 1)
+// sonar_frame は REP 103 に従い x が前方、y が左 (左端のビームが +y)、z は 0
+class SonarPolarTable
+{
+public:
+    // frame のジオメトリが前回と違えば表を作り直す (作り直したら true)
+    bool update(const SonarFrame& frame);
+
+    int width() const { return mWidth; }
+    int height() const { return mHeight; }
+    size_t pointCount() const { return size_t(mWidth) * size_t(mHeight); }
+    // ビーム毎の方位角 [rad] (sonar_frame の z 軸回り、x から +y (左) が正)
+    const std::vector<float>& beamAngles() const { return mAngles; }
+    // ビン間隔 [m]
+    float binSize() const { return mBinSize; }
+
+    // 全ビン (width * height 点) を out へ書く。並びは画素と同じ (レンジ行毎にビーム順)
+    // 事前に update(frame) しておくこと
+    void fill(const SonarFrame& frame, SonarPoint* out) const;
+
+    // 疎な点群。いずれも out へ書いた点数を返す (out は pointCount() 点分あればよい)
+    // 画素を 16 バイトずつ SIMD でビーム毎の下限と比較し、超えたビンだけを点にする
+    // (水柱の大部分は比較だけで読み飛ばす)
+    size_t fillAbove(const SonarFrame& frame, int threshold, SonarPoint* out);
+    size_t fillStrongest(const SonarFrame& frame, int threshold, int count, SonarPoint* out);
+    size_t fillFirstPeak(const SonarFrame& frame, int threshold, SonarPoint* out);
+
+private:
+    int mWidth{0};
+    int mHeight{0};
+    int mSwath{0};
+    int mRange{0};
+    float mBinSize{0.0f};
+    std::vector<float> mAngles; // ビーム毎 [rad]
+    std::vector<float> mCos;    // ビーム毎
+    std::vector<float> mSin;    // ビーム毎
+    std::vector<float> mRanges; // ビン毎 [m]
+
+    // 疎な点群の作業領域
+    struct Peak
+    {
+        uint16_t value;
+        uint16_t bin;
+    };
+    std::vector<uint16_t> mLimits; // ビーム毎の下限 (8bit の画素なら先頭 width バイトを使う)
+    std::vector<Peak> mPeaks;      // ビーム毎に N 個
+    std::vector<int> mPeakCounts;
+
+    template <typename T>
+    size_t fillAboveT(const SonarFrame& frame, int threshold, SonarPoint* out);
+    template <typename T>
+    size_t fillStrongestT(const SonarFrame& frame, int threshold, int count, SonarPoint* out);
+    template <typename T>
+    size_t fillFirstPeakT(const SonarFrame& frame, int threshold, SonarPoint* out);
+    void point(int bin, int beam, float intensity, SonarPoint& out) const;
+};
+
+#endif // !defined(SONAR_POINT_CLOUD_HH)
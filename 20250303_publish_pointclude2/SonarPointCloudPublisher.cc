@@ -0,0 +1,173 @@
+#include "SonarPointCloudPublisher.hh"
+#include <rclcpp_components/register_node_macro.hpp>
+#include <sensor_msgs/point_cloud2_iterator.hpp>
+#include <memory>
+#include <stdexcept>
+
+namespace
+{
+// 停止要求を確認する間隔 [us]
+constexpr int64_t kWaitUs = 100000;
+} // namespace
+
+SonarPointCloudPublisher::SonarPointCloudPublisher(const rclcpp::NodeOptions& options)
+    : Node("sonar_pointcloud_publisher", options)
+{
+    source_uri_ = this->declare_parameter<std::string>("source", "udp://0.0.0.0:5700");
+    frame_id_ = this->declare_parameter<std::string>("frame_id", "sonar_frame");
+    const std::string mode = this->declare_parameter<std::string>("mode", "dense");
+    threshold_ = this->declare_parameter<int>("threshold", 0);
+    top_n_ = this->declare_parameter<int>("top_n", 1);
+    if (mode == "dense")
+        mode_ = kSonarCloudDense;
+    else if (mode == "threshold")
+        mode_ = kSonarCloudThreshold;
+    else if (mode == "strongest")
+        mode_ = kSonarCloudStrongest;
+    else if (mode == "first_peak")
+        mode_ = kSonarCloudFirstPeak;
+    else
+        throw std::invalid_argument("Unknown mode: " + mode);
+
+    publisher_ = this->create_publisher<sensor_msgs::msg::PointCloud2>("sonar/pointcloud", 10);
+    image_publisher_ = this->create_publisher<sensor_msgs::msg::Image>("sonar/image", 10);
+    info_publisher_ =
+        this->create_publisher<sonar_ros_bridge::msg::SonarPolarInfo>("sonar/polar_info", 10);
+    intra_process_ = options.use_intra_process_comms();
+    const char* transport = "a reused message";
+    if (publisher_->can_loan_messages())
+        transport = "loaned messages";
+    else if (intra_process_)
+        transport = "unique_ptr messages (intra-process)";
+    RCLCPP_INFO(this->get_logger(), "Publishing %s", transport);
+
+    if (!source_.open(source_uri_))
+        throw std::runtime_error("Cannot open " + source_uri_);
+    RCLCPP_INFO(this->get_logger(), "Receiving from %s", source_uri_.c_str());
+    worker_ = std::thread(&SonarPointCloudPublisher::run, this);
+}
+
+SonarPointCloudPublisher::~SonarPointCloudPublisher()
+{
+    stopping_ = true;
+    if (worker_.joinable())
+        worker_.join();
+    source_.close();
+}
+
+// フレームが届く毎に変換して publish する (executor とは別のスレッド)
+void
+SonarPointCloudPublisher::run()
+{
+    while (!stopping_ && rclcpp::ok())
+    {
+        SonarFramePtr frame = source_.waitFrame(kWaitUs);
+        if (frame)
+            publish_frame(*frame);
+    }
+}
+
+void
+SonarPointCloudPublisher::publish_frame(const SonarFrame& frame)
+{
+    const rclcpp::Time received = this->now();
+    if (table_.update(frame))
+    {
+        RCLCPP_INFO(this->get_logger(), "Geometry %dx%d %s, swath %d deg, range %d m",
+                    frame.width, frame.height, frame.is16bit ? "16bit" : "8bit", frame.swath,
+                    frame.range);
+    }
+    const uint64_t dropped = source_.droppedFrames();
+    if (dropped != reported_dropped_)
+    {
+        RCLCPP_WARN_THROTTLE(this->get_logger(), *this->get_clock(), 5000,
+                             "%lu frames skipped (publishing slower than the sonar)",
+                             static_cast<unsigned long>(dropped));
+        reported_dropped_ = dropped;
+    }
+
+    using sensor_msgs::msg::Image;
+    using sensor_msgs::msg::PointCloud2;
+    using sonar_ros_bridge::msg::SonarPolarInfo;
+    publish(*publisher_, msg_, [&](PointCloud2& msg) { fill_pointcloud(frame, msg); });
+    publish(*image_publisher_, image_msg_, [&](Image& msg) { fill_image(frame, msg); });
+    publish(*info_publisher_, info_msg_,
+            [&](SonarPolarInfo& msg) { fill_polar_info(frame, received, msg); });
+}
+
+void
+SonarPointCloudPublisher::fill_pointcloud(const SonarFrame& frame,
+                                          sensor_msgs::msg::PointCloud2& msg)
+{
+    msg.header.stamp = rclcpp::Time(static_cast<int64_t>(frame.timestampUs) * 1000);
+    msg.header.frame_id = frame_id_;
+    if (msg.fields.size() != 4)
+    {
+        sensor_msgs::PointCloud2Modifier modifier(msg);
+        modifier.setPointCloud2Fields(4,
+                                      "x", 1, sensor_msgs::msg::PointField::FLOAT32,
+                                      "y", 1, sensor_msgs::msg::PointField::FLOAT32,
+                                      "z", 1, sensor_msgs::msg::PointField::FLOAT32,
+                                      "intensity", 1, sensor_msgs::msg::PointField::FLOAT32);
+    }
+    msg.is_bigendian = false;
+    msg.is_dense = true;
+
+    if (mode_ == kSonarCloudDense)
+    {
+        // 画素と同じ並びの organized cloud (行 = レンジビン, 列 = ビーム)
+        // data は SonarPoint の配列そのもので、PointCloud2Iterator を使わずに一度に埋める
+        // (使い回すメッセージなら大きさが同じなので resize は何もしない)
+        msg.height = frame.height;
+        msg.width = frame.width;
+        msg.row_step = msg.width * msg.point_step;
+        msg.data.resize(static_cast<size_t>(msg.row_step) * msg.height);
+        table_.fill(frame, reinterpret_cast<SonarPoint*>(msg.data.data()));
+        return;
+    }
+
+    // 選んだ点だけを作業領域に書き、その分だけメッセージへコピーする
+    points_.resize(table_.pointCount());
+    size_t count = 0;
+    if (mode_ == kSonarCloudThreshold)
+        count = table_.fillAbove(frame, threshold_, points_.data());
+    else if (mode_ == kSonarCloudStrongest)
+        count = table_.fillStrongest(frame, threshold_, top_n_, points_.data());
+    else
+        count = table_.fillFirstPeak(frame, threshold_, points_.data());
+    msg.height = 1;
+    msg.width = static_cast<uint32_t>(count);
+    msg.row_step = msg.width * msg.point_step;
+    const uint8_t* bytes = reinterpret_cast<const uint8_t*>(points_.data());
+    msg.data.assign(bytes, bytes + msg.row_step);
+}
+
+// 画素をそのまま (ホストのバイトオーダで) コピーする
+void
+SonarPointCloudPublisher::fill_image(const SonarFrame& frame, sensor_msgs::msg::Image& msg)
+{
+    msg.header.stamp = rclcpp::Time(static_cast<int64_t>(frame.timestampUs) * 1000);
+    msg.header.frame_id = frame_id_;
+    msg.height = frame.height;
+    msg.width = frame.width;
+    msg.encoding = frame.is16bit ? "mono16" : "mono8";
+    msg.is_bigendian = __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__;
+    msg.step = msg.width * (frame.is16bit ? 2 : 1);
+    msg.data.assign(frame.pixels(), frame.pixels() + static_cast<size_t>(msg.step) * msg.height);
+}
+
+void
+SonarPointCloudPublisher::fill_polar_info(const SonarFrame& frame, const rclcpp::Time& received,
+                                          sonar_ros_bridge::msg::SonarPolarInfo& msg)
+{
+    msg.header.stamp = rclcpp::Time(static_cast<int64_t>(frame.timestampUs) * 1000);
+    msg.header.frame_id = frame_id_;
+    msg.received = received;
+    msg.stream_id = frame.streamId;
+    msg.frame_number = frame.frameId;
+    msg.beam_angles = table_.beamAngles();
+    msg.range_resolution = table_.binSize();
+    msg.max_range = static_cast<float>(frame.range);
+}
+
+RCLCPP_COMPONENTS_REGISTER_NODE(SonarPointCloudPublisher)
@@ -0,0 +1,92 @@
+#if !defined(SONAR_POINT_CLOUD_PUBLISHER_HH)
+#define SONAR_POINT_CLOUD_PUBLISHER_HH
+
+#include "SonarFrameSource.hh"
+#include "SonarPointCloud.hh"
+#include "sonar_ros_bridge/msg/sonar_polar_info.hpp"
+#include <rclcpp/rclcpp.hpp>
+#include <sensor_msgs/msg/image.hpp>
+#include <sensor_msgs/msg/point_cloud2.hpp>
+#include <atomic>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+// ソナーフレームを publish するノード (トピックとパラメータは test.cc 参照)
+//   sonar/pointcloud  PointCloud2 (ビン毎に x, y, z, intensity)
+//   sonar/image       極座標のままの画像 (mono8 / mono16, 列 = ビーム, 行 = レンジビン)
+//   sonar/polar_info  画像のジオメトリ (SonarPolarInfo: ビーム毎の方位角, ビン間隔, 時刻)
+// 画像は画素 1 つが 1 / 2 バイトなので dense な点群 (16 バイト) の 1/16 (1/8) の帯域で済む
+// 購読されていないトピックは変換も publish もしない
+//
+// publish の方法 (大きなメッセージを同じホストのノード間でシリアライズ・コピーしない)
+//   1. RMW がメッセージを貸し出せるなら (can_loan_messages) 借りたメッセージへ直接書く
+//      (今の RMW が貸し出すのは固定長の型だけなので、PointCloud2 では将来のため)
+//   2. プロセス内通信が有効なら (コンポーネントとして use_intra_process_comms で読み込んだ場合)
+//      毎回新しいメッセージを unique_ptr で渡す。同じプロセスの購読側へは所有権が移るだけ
+//   3. それ以外は 1 つのメッセージを使い回す。同じジオメトリなら data を確保し直さず、
+//      コピーは RMW のシリアライズの 1 回だけ
+class SonarPointCloudPublisher : public rclcpp::Node
+{
+public:
+    explicit SonarPointCloudPublisher(const rclcpp::NodeOptions& options = rclcpp::NodeOptions());
+    ~SonarPointCloudPublisher() override;
+
+private:
+    void run();
+    void publish_frame(const SonarFrame& frame);
+    // 各メッセージを msg へ書く (msg は前回の中身が残っていてよい)
+    void fill_pointcloud(const SonarFrame& frame, sensor_msgs::msg::PointCloud2& msg);
+    void fill_image(const SonarFrame& frame, sensor_msgs::msg::Image& msg);
+    void fill_polar_info(const SonarFrame& frame, const rclcpp::Time& received,
+                         sonar_ros_bridge::msg::SonarPolarInfo& msg);
+
+    // 購読されていれば、貸し出し / unique_ptr / 使い回し (上の説明) のいずれかで publish する
+    template <typename MessageT, typename Fill>
+    void publish(rclcpp::Publisher<MessageT>& publisher, MessageT& reused, Fill fill)
+    {
+        if (publisher.get_subscription_count() == 0)
+            return;
+        if (publisher.can_loan_messages())
+        {
+            auto loaned = publisher.borrow_loaned_message();
+            fill(loaned.get());
+            publisher.publish(std::move(loaned));
+        }
+        else if (intra_process_)
+        {
+            auto msg = std::make_unique<MessageT>();
+            fill(*msg);
+            publisher.publish(std::move(msg));
+        }
+        else
+        {
+            fill(reused);
+            publisher.publish(reused);
+        }
+    }
+
+    rclcpp::Publisher<sensor_msgs::msg::PointCloud2>::SharedPtr publisher_;
+    rclcpp::Publisher<sensor_msgs::msg::Image>::SharedPtr image_publisher_;
+    rclcpp::Publisher<sonar_ros_bridge::msg::SonarPolarInfo>::SharedPtr info_publisher_;
+    bool intra_process_{false};
+    sensor_msgs::msg::PointCloud2 msg_;
+    sensor_msgs::msg::Image image_msg_;
+    sonar_ros_bridge::msg::SonarPolarInfo info_msg_;
+
+    std::string source_uri_;
+    std::string frame_id_;
+    SonarFrameSource source_;
+    SonarPolarTable table_;
+    SonarCloudMode mode_{kSonarCloudDense};
+    int threshold_{0};
+    int top_n_{1};
+    std::vector<SonarPoint> points_;
+    uint64_t reported_dropped_{0};
+
+    std::thread worker_;
+    std::atomic<bool> stopping_{false};
+};
+
+#endif // !defined(SONAR_POINT_CLOUD_PUBLISHER_HH)
@@ -0,0 +1,150 @@
+#include "SonarPoseTrack.hh"
+#include <algorithm>
+#include <cctype>
+#include <cmath>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+
+namespace
+{
+// a の向きから b の向きへ t (0..1) の球面線形補間
+void
+slerp(const SonarPose& a, const SonarPose& b, double t, SonarPose& out)
+{
+    double bx = b.qx, by = b.qy, bz = b.qz, bw = b.qw;
+    double dot = a.qx * bx + a.qy * by + a.qz * bz + a.qw * bw;
+    // 短い方の弧を通る
+    if (dot < 0.0)
+    {
+        bx = -bx;
+        by = -by;
+        bz = -bz;
+        bw = -bw;
+        dot = -dot;
+    }
+    double wa = 1.0 - t;
+    double wb = t;
+    // ほぼ同じ向きなら線形補間 (sin の割り算を避ける)
+    if (dot < 0.9995)
+    {
+        const double theta = std::acos(dot);
+        const double s = std::sin(theta);
+        wa = std::sin((1.0 - t) * theta) / s;
+        wb = std::sin(t * theta) / s;
+    }
+    out.qx = wa * a.qx + wb * bx;
+    out.qy = wa * a.qy + wb * by;
+    out.qz = wa * a.qz + wb * bz;
+    out.qw = wa * a.qw + wb * bw;
+    const double n = std::sqrt(out.qx * out.qx + out.qy * out.qy + out.qz * out.qz +
+                               out.qw * out.qw);
+    out.qx /= n;
+    out.qy /= n;
+    out.qz /= n;
+    out.qw /= n;
+}
+} // namespace
+
+// explicit
+SonarPoseTrack::SonarPoseTrack(int64_t maxGapUs, size_t capacity)
+    : mMaxGapUs(maxGapUs), mCapacity(capacity)
+{
+}
+
+void
+SonarPoseTrack::add(const SonarPose& pose)
+{
+    if (!mPoses.empty() && pose.timeUs <= mPoses.back().timeUs)
+        return;
+    mPoses.push_back(pose);
+    if (mCapacity > 0 && mPoses.size() > mCapacity)
+        mPoses.pop_front();
+}
+
+bool
+SonarPoseTrack::loadCsv(const std::string& path)
+{
+    std::ifstream in(path);
+    if (!in)
+    {
+        std::cerr << "Error: Cannot open " << path << std::endl;
+        return false;
+    }
+    std::string line;
+    size_t lineNumber = 0;
+    while (std::getline(in, line))
+    {
+        ++lineNumber;
+        std::replace(line.begin(), line.end(), ',', ' ');
+        const size_t first = line.find_first_not_of(" \t\r");
+        if (first == std::string::npos || line[first] == '#')
+            continue;
+        if (!(std::isdigit(static_cast<unsigned char>(line[first])) || line[first] == '-' ||
+              line[first] == '.'))
+            continue;
+        double v[8];
+        const char* p = line.c_str();
+        int n = 0;
+        for (; n < 8; ++n)
+        {
+            char* end;
+            v[n] = strtod(p, &end);
+            if (end == p)
+                break;
+            p = end;
+        }
+        if (n < 8)
+        {
+            std::cerr << "Error: " << path << ":" << lineNumber
+                      << ": expected time x y z qx qy qz qw" << std::endl;
+            return false;
+        }
+        SonarPose pose;
+        pose.timeUs = int64_t(std::llround(v[0] * 1e6));
+        pose.x = v[1];
+        pose.y = v[2];
+        pose.z = v[3];
+        pose.qx = v[4];
+        pose.qy = v[5];
+        pose.qz = v[6];
+        pose.qw = v[7];
+        add(pose);
+    }
+    return true;
+}
+
+bool
+SonarPoseTrack::lookup(int64_t timeUs, SonarPose& pose) const
+{
+    const auto after = std::lower_bound(
+        mPoses.begin(), mPoses.end(), timeUs,
+        [](const SonarPose& p, int64_t t) { return p.timeUs < t; });
+    if (after == mPoses.end())
+        return false;
+    if (after->timeUs == timeUs)
+    {
+        pose = *after;
+        return true;
+    }
+    if (after == mPoses.begin())
+        return false;
+    const SonarPose& a = *(after - 1);
+    const SonarPose& b = *after;
+    if (b.timeUs - a.timeUs > mMaxGapUs)
+        return false;
+
+    const double t = double(timeUs - a.timeUs) / double(b.timeUs - a.timeUs);
+    pose.timeUs = timeUs;
+    pose.x = a.x + (b.x - a.x) * t;
+    pose.y = a.y + (b.y - a.y) * t;
+    pose.z = a.z + (b.z - a.z) * t;
+    slerp(a, b, t, pose);
+    return true;
+}
+
+bool
+SonarPoseTrack::isPending(int64_t timeUs) const
+{
+    return mPoses.empty() || mPoses.back().timeUs < timeUs;
+}
@@ -0,0 +1,50 @@
+#if !defined(SONAR_POSE_TRACK_HH)
+#define SONAR_POSE_TRACK_HH
+
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <string>
+
+// sonar_frame の world (map) での姿勢
+struct SonarPose
+{
+    int64_t timeUs{0}; // UNIX 時間 [us]
+    double x{0.0};
+    double y{0.0};
+    double z{0.0};
+    double qx{0.0};
+    double qy{0.0};
+    double qz{0.0};
+    double qw{1.0};
+};
+
+// 時刻順の姿勢の列。フレームの時刻の姿勢を前後の姿勢から補間する
+// (位置は線形、向きは slerp)
+class SonarPoseTrack
+{
+public:
+    // maxGapUs: 補間に使う前後の姿勢の最大の間隔 (これより離れていれば姿勢は不明とする)
+    // capacity: 保持する姿勢の数 (0: 無制限。CSV から読む場合)
+    explicit SonarPoseTrack(int64_t maxGapUs = 500000, size_t capacity = 0);
+
+    // 時刻が前の姿勢より古ければ捨てる
+    void add(const SonarPose& pose);
+    // TUM 形式 (1 行に "time x y z qx qy qz qw", time は UNIX 時間 [s]) を読む
+    // 区切りは空白かカンマ。'#' で始まる行と数値で始まらない行 (見出し) は読み飛ばす
+    bool loadCsv(const std::string& path);
+
+    // timeUs の姿勢 (前後の姿勢が無いか離れすぎていれば false)
+    bool lookup(int64_t timeUs, SonarPose& pose) const;
+    // timeUs より新しい姿勢がまだ届いていなければ true (フレームを待たせる)
+    bool isPending(int64_t timeUs) const;
+
+    size_t size() const { return mPoses.size(); }
+
+private:
+    int64_t mMaxGapUs;
+    size_t mCapacity;
+    std::deque<SonarPose> mPoses;
+};
+
+#endif // !defined(SONAR_POSE_TRACK_HH)
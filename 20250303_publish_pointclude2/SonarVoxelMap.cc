@@ -0,0 +1,362 @@
+#include "SonarVoxelMap.hh"
+#include <algorithm>
+#include <cmath>
+#include <condition_variable>
+#include <cstdio>
+#include <functional>
+#include <iostream>
+#include <limits>
+#include <mutex>
+#include <thread>
+
+namespace
+{
+// キー: ボクセルの整数座標 (各軸 21 ビット、±2^20 ボクセル) を 63 ビットに詰めたもの
+// 0.1 m のボクセルなら原点から ±100 km まで
+constexpr int kKeyBits = 21;
+constexpr int64_t kKeyOffset = int64_t(1) << (kKeyBits - 1);
+constexpr uint64_t kKeyMask = (uint64_t(1) << kKeyBits) - 1;
+
+inline uint64_t
+packKey(int64_t x, int64_t y, int64_t z)
+{
+    return (uint64_t(x + kKeyOffset) & kKeyMask) |
+           ((uint64_t(y + kKeyOffset) & kKeyMask) << kKeyBits) |
+           ((uint64_t(z + kKeyOffset) & kKeyMask) << (2 * kKeyBits));
+}
+
+inline int64_t
+keyAxis(uint64_t key, int axis)
+{
+    return int64_t((key >> (axis * kKeyBits)) & kKeyMask) - kKeyOffset;
+}
+
+// 64 シャード (キーを混ぜた上位 6 ビット)
+inline int
+shardOf(uint64_t key)
+{
+    return int((key * 0x9e3779b97f4a7c15ull) >> 58);
+}
+
+inline int64_t
+floorDiv(int64_t a, int64_t b)
+{
+    return a >= 0 ? a / b : -((-a + b - 1) / b);
+}
+
+inline float
+probability(float logOdds)
+{
+    return 1.0f - 1.0f / (1.0f + std::exp(logOdds));
+}
+} // namespace
+
+// 固定数のスレッドで同じ処理を 1 回ずつ実行する (ワーカー 0 は呼び出し元のスレッド)
+class SonarVoxelMap::Workers
+{
+public:
+    explicit Workers(int count) : mCount(std::max(1, count))
+    {
+        for (int i = 1; i < mCount; ++i)
+            mThreads.emplace_back(&Workers::loop, this, i);
+    }
+
+    ~Workers()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mMutex);
+            mStopping = true;
+        }
+        mStart.notify_all();
+        for (std::thread& thread : mThreads)
+            thread.join();
+    }
+
+    int count() const { return mCount; }
+
+    // task(worker) を全てのワーカーで実行し、終わるまで待つ
+    void run(const std::function<void(int)>& task)
+    {
+        {
+            std::lock_guard<std::mutex> lock(mMutex);
+            mTask = &task;
+            mRemaining = mCount - 1;
+            ++mGeneration;
+        }
+        mStart.notify_all();
+        task(0);
+        std::unique_lock<std::mutex> lock(mMutex);
+        mDone.wait(lock, [this] { return mRemaining == 0; });
+        mTask = nullptr;
+    }
+
+private:
+    void loop(int worker)
+    {
+        uint64_t seen = 0;
+        for (;;)
+        {
+            const std::function<void(int)>* task;
+            {
+                std::unique_lock<std::mutex> lock(mMutex);
+                mStart.wait(lock, [&] { return mStopping || mGeneration != seen; });
+                if (mStopping)
+                    return;
+                seen = mGeneration;
+                task = mTask;
+            }
+            (*task)(worker);
+            std::lock_guard<std::mutex> lock(mMutex);
+            if (--mRemaining == 0)
+                mDone.notify_one();
+        }
+    }
+
+    const int mCount;
+    std::vector<std::thread> mThreads;
+    std::mutex mMutex;
+    std::condition_variable mStart;
+    std::condition_variable mDone;
+    const std::function<void(int)>* mTask{nullptr};
+    uint64_t mGeneration{0};
+    int mRemaining{0};
+    bool mStopping{false};
+};
+
+// explicit
+SonarVoxelMap::SonarVoxelMap(const SonarVoxelMapConfig& config)
+    : mConfig(config),
+      mWorkers(new Workers(config.threads > 0 ? config.threads
+                                              : int(std::thread::hardware_concurrency()))),
+      mShards(kShardCount)
+{
+    const size_t workers = size_t(mWorkers->count());
+    mBuckets.resize(workers, std::vector<std::vector<uint64_t>>(kShardCount));
+    mSorted.resize(workers);
+    mSeen.resize(workers);
+    mWorkerUpdates.assign(workers, 0);
+}
+
+// virtual
+SonarVoxelMap::~SonarVoxelMap()
+{
+}
+
+void
+SonarVoxelMap::insertFrame(const SonarPolarScan& scan, const SonarPose& pose)
+{
+    if (!scan.pixels || !scan.beamAngles || scan.width <= 0 || scan.height <= 0 ||
+        scan.binSize <= 0.0f)
+        return;
+    mWorkers->run([&](int worker) {
+        if (scan.is16bit)
+            collect<uint16_t>(scan, pose, worker);
+        else
+            collect<uint8_t>(scan, pose, worker);
+    });
+    mWorkers->run([this](int worker) { apply(worker); });
+    ++mFrames;
+    mUpdates = 0;
+    for (uint64_t updates : mWorkerUpdates)
+        mUpdates += updates;
+}
+
+// 段階 1: worker が受け持つビームの各ビンを world のボクセルへ変換し、シャード毎に分ける
+template <typename T>
+void
+SonarVoxelMap::collect(const SonarPolarScan& scan, const SonarPose& pose, int worker)
+{
+    std::vector<std::vector<uint64_t>>& buckets = mBuckets[size_t(worker)];
+    for (std::vector<uint64_t>& bucket : buckets)
+        bucket.clear();
+    std::vector<uint64_t>& seen = mSeen[size_t(worker)];
+    seen.assign(size_t(1) << kSeenBits, ~uint64_t(0));
+    const int workers = mWorkers->count();
+    const int begin = scan.width * worker / workers;
+    const int end = scan.width * (worker + 1) / workers;
+
+    // 姿勢の回転行列の 1, 2 列 (sonar_frame の z 成分は常に 0)
+    const double qx = pose.qx, qy = pose.qy, qz = pose.qz, qw = pose.qw;
+    const double r00 = 1 - 2 * (qy * qy + qz * qz), r01 = 2 * (qx * qy - qz * qw);
+    const double r10 = 2 * (qx * qy + qz * qw), r11 = 1 - 2 * (qx * qx + qz * qz);
+    const double r20 = 2 * (qx * qz - qy * qw), r21 = 2 * (qy * qz + qx * qw);
+
+    // ボクセル単位の座標で計算する
+    const double scale = 1.0 / mConfig.voxelSize;
+    const double ox = pose.x * scale, oy = pose.y * scale, oz = pose.z * scale;
+    const double step = double(scan.binSize) * scale;
+    const int first = std::max(0, int(std::ceil(mConfig.minRange / scan.binSize)));
+    int last = scan.height - 1;
+    if (mConfig.maxRange > 0.0)
+        last = std::min(last, int(mConfig.maxRange / scan.binSize));
+    const T threshold = T(std::min<int>(std::max(mConfig.threshold, 0),
+                                        std::numeric_limits<T>::max()));
+    const T* pixels = reinterpret_cast<const T*>(scan.pixels);
+    const size_t width = size_t(scan.width);
+
+    for (int b = begin; b < end; ++b)
+    {
+        const double c = std::cos(double(scan.beamAngles[b]));
+        const double s = std::sin(double(scan.beamAngles[b]));
+        const double dx = (r00 * c + r01 * s) * step;
+        const double dy = (r10 * c + r11 * s) * step;
+        const double dz = (r20 * c + r21 * s) * step;
+        bool reflected = false;
+        for (int r = first; r <= last; ++r)
+        {
+            const bool hit = pixels[size_t(r) * width + size_t(b)] > threshold;
+            // 最初の反射より奥は影 (空きとは限らない)
+            if (!hit && (reflected || !mConfig.freeSpace))
+                continue;
+            reflected = reflected || hit;
+            const uint64_t key = packKey(int64_t(std::floor(ox + dx * r)),
+                                         int64_t(std::floor(oy + dy * r)),
+                                         int64_t(std::floor(oz + dz * r)));
+            // 同じビームの続くビンや隣のビームが直前に入れた更新は入れない
+            // (近距離では多くのビームが同じボクセルを通る。漏れた重複は apply() でまとめる)
+            const uint64_t update = (key << 1) | (hit ? 1 : 0);
+            uint64_t& recent = seen[(update * 0x9e3779b97f4a7c15ull) >> (64 - kSeenBits)];
+            if (recent == update)
+                continue;
+            recent = update;
+            buckets[size_t(shardOf(key))].push_back(update);
+        }
+    }
+}
+
+// 段階 2: worker が受け持つシャードへ全ワーカーの更新を適用する
+// 並べるとボクセル毎に空き → 占有の順になるので、最後の 1 つが占有なら占有として 1 回だけ更新する
+void
+SonarVoxelMap::apply(int worker)
+{
+    const int workers = mWorkers->count();
+    std::vector<uint64_t>& sorted = mSorted[size_t(worker)];
+    uint64_t updates = 0;
+    for (int shard = worker; shard < kShardCount; shard += workers)
+    {
+        sorted.clear();
+        for (const std::vector<std::vector<uint64_t>>& buckets : mBuckets)
+            sorted.insert(sorted.end(), buckets[size_t(shard)].begin(),
+                          buckets[size_t(shard)].end());
+        std::sort(sorted.begin(), sorted.end());
+
+        std::unordered_map<uint64_t, float>& voxels = mShards[size_t(shard)];
+        for (size_t i = 0; i < sorted.size();)
+        {
+            const uint64_t key = sorted[i] >> 1;
+            size_t j = i + 1;
+            while (j < sorted.size() && (sorted[j] >> 1) == key)
+                ++j;
+            const bool hit = (sorted[j - 1] & 1) != 0;
+            float& logOdds = voxels[key];
+            const float delta = hit ? mConfig.hitLogOdds : mConfig.missLogOdds;
+            logOdds = std::min(mConfig.maxLogOdds, std::max(mConfig.minLogOdds, logOdds + delta));
+            ++updates;
+            i = j;
+        }
+    }
+    mWorkerUpdates[size_t(worker)] += updates;
+}
+
+void
+SonarVoxelMap::exportOccupied(double minProbability, int downsample,
+                              std::vector<SonarMapVoxel>& out) const
+{
+    out.clear();
+    const double p = std::min(std::max(minProbability, 1e-6), 1.0 - 1e-6);
+    const float minLogOdds = float(std::log(p / (1.0 - p)));
+    const double size = mConfig.voxelSize;
+
+    if (downsample <= 1)
+    {
+        for (const std::unordered_map<uint64_t, float>& voxels : mShards)
+        {
+            for (const std::pair<const uint64_t, float>& voxel : voxels)
+            {
+                if (voxel.second < minLogOdds)
+                    continue;
+                SonarMapVoxel v;
+                v.x = float((keyAxis(voxel.first, 0) + 0.5) * size);
+                v.y = float((keyAxis(voxel.first, 1) + 0.5) * size);
+                v.z = float((keyAxis(voxel.first, 2) + 0.5) * size);
+                v.probability = probability(voxel.second);
+                out.push_back(v);
+            }
+        }
+        return;
+    }
+
+    // downsample^3 個ずつまとめ、最も占有らしいボクセルの log-odds を使う
+    const int64_t k = downsample;
+    std::unordered_map<uint64_t, float> coarse;
+    for (const std::unordered_map<uint64_t, float>& voxels : mShards)
+    {
+        for (const std::pair<const uint64_t, float>& voxel : voxels)
+        {
+            if (voxel.second < minLogOdds)
+                continue;
+            const uint64_t key = packKey(floorDiv(keyAxis(voxel.first, 0), k),
+                                         floorDiv(keyAxis(voxel.first, 1), k),
+                                         floorDiv(keyAxis(voxel.first, 2), k));
+            std::unordered_map<uint64_t, float>::iterator it = coarse.find(key);
+            if (it == coarse.end())
+                coarse.emplace(key, voxel.second);
+            else
+                it->second = std::max(it->second, voxel.second);
+        }
+    }
+    const double coarseSize = size * double(k);
+    out.reserve(coarse.size());
+    for (const std::pair<const uint64_t, float>& voxel : coarse)
+    {
+        SonarMapVoxel v;
+        v.x = float((keyAxis(voxel.first, 0) + 0.5) * coarseSize);
+        v.y = float((keyAxis(voxel.first, 1) + 0.5) * coarseSize);
+        v.z = float((keyAxis(voxel.first, 2) + 0.5) * coarseSize);
+        v.probability = probability(voxel.second);
+        out.push_back(v);
+    }
+}
+
+// static
+bool
+SonarVoxelMap::savePly(const std::string& path, const std::vector<SonarMapVoxel>& voxels)
+{
+    const std::string temporary = path + ".tmp";
+    FILE* fp = fopen(temporary.c_str(), "wb");
+    if (!fp)
+    {
+        std::cerr << "Error: Cannot write " << temporary << std::endl;
+        return false;
+    }
+    const bool bigEndian = __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__;
+    fprintf(fp,
+            "ply\n"
+            "format %s 1.0\n"
+            "element vertex %zu\n"
+            "property float x\n"
+            "property float y\n"
+            "property float z\n"
+            "property float probability\n"
+            "end_header\n",
+            bigEndian ? "binary_big_endian" : "binary_little_endian", voxels.size());
+    const bool written =
+        fwrite(voxels.data(), sizeof(SonarMapVoxel), voxels.size(), fp) == voxels.size();
+    const bool closed = fclose(fp) == 0;
+    if (!written || !closed || rename(temporary.c_str(), path.c_str()) != 0)
+    {
+        std::cerr << "Error: Cannot write " << path << std::endl;
+        remove(temporary.c_str());
+        return false;
+    }
+    return true;
+}
+
+size_t
+SonarVoxelMap::voxelCount() const
+{
+    size_t count = 0;
+    for (const std::unordered_map<uint64_t, float>& voxels : mShards)
+        count += voxels.size();
+    return count;
+}
@@ -0,0 +1,109 @@
+#if !defined(SONAR_VOXEL_MAP_HH)
+#define SONAR_VOXEL_MAP_HH
+
+#include "SonarPoseTrack.hh"
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// 極座標のソナー画像 1 フレーム (sonar/image + sonar/polar_info の中身)
+struct SonarPolarScan
+{
+    int width{0};                      // ビーム数 (列)
+    int height{0};                     // レンジビン数 (行)
+    bool is16bit{false};
+    const uint8_t* pixels{nullptr};    // 行 r, 列 b が [r * width + b] (ホストのバイトオーダ)
+    const float* beamAngles{nullptr};  // ビーム毎の方位角 [rad] (x から +y が正)
+    float binSize{0.0f};               // ビン間隔 [m] (行 r の距離 = r * binSize)
+};
+
+struct SonarVoxelMapConfig
+{
+    double voxelSize{0.1};      // [m]
+    int threads{0};             // 挿入に使うスレッド数 (0: CPU の数)
+    int threshold{0};           // これを超えるビンを反射 (占有) とする
+    double minRange{0.5};       // これより近いビンは使わない (送受波器の残響) [m]
+    double maxRange{0.0};       // これより遠いビンは使わない (0: 制限なし) [m]
+    bool freeSpace{true};       // 最初の反射より手前のビンを空きとして更新する
+    // log-odds (既定は占有 0.7 / 空き 0.4 / 下限 0.12 / 上限 0.97 の確率に相当)
+    float hitLogOdds{0.85f};
+    float missLogOdds{-0.4f};
+    float minLogOdds{-2.0f};
+    float maxLogOdds{3.5f};
+};
+
+// 地図の 1 ボクセル (PointCloud2 の x, y, z, probability: FLOAT32 と同じ並び)
+struct SonarMapVoxel
+{
+    float x;
+    float y;
+    float z;
+    float probability;
+};
+static_assert(sizeof(SonarMapVoxel) == 16, "SonarMapVoxel must match the PointCloud2 layout");
+
+// 疎なボクセルのハッシュマップによる 3 次元の占有地図 (log-odds)
+//
+// ソナーは各レンジビンを直接観測するので、光線を辿らずにビン毎に更新する
+//   threshold を超えるビン                    → 占有 (hitLogOdds)
+//   ビームで最初の反射より手前のビン          → 空き (missLogOdds, freeSpace の場合)
+//   最初の反射より奥の弱いビン                → 音響的な影なので更新しない
+// 1 フレームで同じボクセルに入る複数のビンは 1 回の更新にまとめる (占有が優先)
+//
+// ボクセルはキーのハッシュで kShardCount 個のシャードに分ける。挿入は 2 段階で並列に行う
+//   1. ビームをスレッドに分け、各ビンを world へ変換してシャード毎の更新の列に入れる
+//   2. シャードをスレッドに分け、各シャードの更新をまとめて適用する
+// どちらの段階でもスレッドが同じデータに書かないのでロックは要らない
+// insertFrame() / exportOccupied() は同じスレッドから呼ぶこと
+class SonarVoxelMap
+{
+public:
+    explicit SonarVoxelMap(const SonarVoxelMapConfig& config);
+    virtual ~SonarVoxelMap();
+
+    SonarVoxelMap(const SonarVoxelMap&) = delete;
+    SonarVoxelMap& operator=(const SonarVoxelMap&) = delete;
+
+    // pose は scan の時刻の sonar_frame の姿勢
+    void insertFrame(const SonarPolarScan& scan, const SonarPose& pose);
+
+    // 占有確率が minProbability 以上のボクセルを out へ書く (中心の座標)
+    // downsample > 1 なら downsample^3 個のボクセルを 1 つにまとめる (log-odds の最大)
+    void exportOccupied(double minProbability, int downsample,
+                        std::vector<SonarMapVoxel>& out) const;
+    // PLY (binary, x y z probability) で保存する (一時ファイルに書いてから置き換える)
+    static bool savePly(const std::string& path, const std::vector<SonarMapVoxel>& voxels);
+
+    size_t voxelCount() const;
+    uint64_t insertedFrames() const { return mFrames; }
+    // 適用した更新の数 (フレーム内でまとめた後)
+    uint64_t appliedUpdates() const { return mUpdates; }
+    double voxelSize() const { return mConfig.voxelSize; }
+
+private:
+    class Workers;
+    static constexpr int kShardCount = 64;
+    static constexpr int kSeenBits = 12;
+
+    template <typename T>
+    void collect(const SonarPolarScan& scan, const SonarPose& pose, int worker);
+    void apply(int worker);
+
+    SonarVoxelMapConfig mConfig;
+    std::unique_ptr<Workers> mWorkers;
+    std::vector<std::unordered_map<uint64_t, float>> mShards;
+    // [worker][shard]: (キー << 1) | 占有
+    std::vector<std::vector<std::vector<uint64_t>>> mBuckets;
+    // [worker]: 最近入れた更新 (キーのハッシュで引く直接マップのキャッシュ)
+    std::vector<std::vector<uint64_t>> mSeen;
+    // [worker]: apply() でシャードの更新を集めて並べる作業領域
+    std::vector<std::vector<uint64_t>> mSorted;
+    std::vector<uint64_t> mWorkerUpdates;
+    uint64_t mFrames{0};
+    uint64_t mUpdates{0};
+};
+
+#endif // !defined(SONAR_VOXEL_MAP_HH)
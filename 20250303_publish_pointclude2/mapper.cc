@@ -0,0 +1,39 @@
+// ソナーフレームを姿勢で world に置き、3 次元の占有地図を作る
+//
+// SonarPointCloudPublisher が出す極座標の画像 sonar/image とジオメトリ sonar/polar_info を
+// 購読し、フレームの時刻の姿勢 (前後の姿勢から補間) で各ビンを map_frame へ変換して
+// 疎なボクセルの地図 (log-odds) に積み上げる。ビーム毎に threshold を超えるビンを占有、
+// 最初の反射より手前を空き、その奥 (音響的な影) は未知のままとする
+// 挿入はビーム / シャード単位で threads 個のスレッドに分ける (SonarVoxelMap.hh 参照)
+//
+// パラメータ
+//   pose_topic       sonar_frame の姿勢 (geometry_msgs/PoseStamped, 既定 sonar/pose)
+//   pose_csv         姿勢を購読せずに CSV (TUM 形式: time x y z qx qy qz qw) から読む
+//   max_pose_gap     補間に使う前後の姿勢の最大の間隔 [s] (既定 0.5)
+//   map_frame        地図と姿勢の frame_id (既定 map)
+//   voxel_size       ボクセルの大きさ [m] (既定 0.1)
+//   threshold        これを超える画素を反射とする (既定 0)
+//   min_range        これより近いビンは使わない [m] (既定 0.5)
+//   max_range        これより遠いビンは使わない [m] (既定 0: 制限なし)
+//   free_space       反射より手前を空きとして更新する (既定 true)
+//   threads          挿入に使うスレッド数 (既定 0: CPU の数)
+//   publish_period   sonar/map を publish / 保存する間隔 [s] (既定 2.0)
+//   min_probability  sonar/map に出す占有確率の下限 (既定 0.7)
+//   downsample       sonar/map で downsample^3 個のボクセルを 1 つにまとめる (既定 1)
+//   save_path        地図を PLY で保存するパス (既定 "": 保存しない)
+//
+//   ros2 run sonar_ros_bridge sonar_occupancy_mapper --ros-args
+//     -p pose_csv:=poses.csv -p save_path:=map.ply
+//
+// コンポーネント (SonarOccupancyMapper) としても読み込める
+
+#include "SonarOccupancyMapper.hh"
+#include <rclcpp/rclcpp.hpp>
+
+int main(int argc, char *argv[])
+{
+    rclcpp::init(argc, argv);
+    rclcpp::spin(std::make_shared<SonarOccupancyMapper>());
+    rclcpp::shutdown();
+    return 0;
+}
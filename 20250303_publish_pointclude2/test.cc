@@ -1,93 +1,38 @@
+// ソナーフレームを PointCloud2 として publish するブリッジ
+//
+// UDP (チャンクプロトコル v2) か共有メモリのリングから最新のフレームを受け取り、
+// ビン (ビーム × レンジ) を点にして sonar/pointcloud へ出す
+// 同じフレームを極座標のままの画像 sonar/image (mono8 / mono16) とそのジオメトリ
+// sonar/polar_info (sonar_ros_bridge/msg/SonarPolarInfo) としても出す
+// (走査変換や閾値処理を購読側で行うなら点群の 1/16 の帯域で済む)
+// 受信が publish より速ければ古いフレームは捨てる (遅れを溜めない)
+//
+// パラメータ
+//   source    入力の URI (既定 udp://0.0.0.0:5700, SonarLiveReceiver.hh 参照)
+//   frame_id  ヘッダの frame_id (既定 sonar_frame, RViz で適切な TF を設定する必要あり)
+//   mode      点にするビン
+//               dense       全ビン (既定, width x height の organized cloud)
+//               threshold   threshold を超えるビン
+//               strongest   ビーム毎に threshold を超える強い方から top_n 個
+//               first_peak  ビーム毎に最初の反射 (threshold を超えた最初の区間の最大)
+//             dense 以外は height 1 の cloud で、水柱を含まないので桁違いに小さい
+//   threshold 画素値の閾値 (既定 0)
+//   top_n     strongest のビーム毎の点数 (既定 1)
+//
+//   ros2 run sonar_ros_bridge sonar_pointcloud_publisher --ros-args -p source:=shm://sonar
+//
+// コンポーネント (SonarPointCloudPublisher) としても読み込める。購読側と同じコンテナで
+// use_intra_process_comms を有効にするとメッセージはコピーされずに渡る
+//   ros2 component load /ComponentManager sonar_ros_bridge SonarPointCloudPublisher
+//     (-e use_intra_process_comms:=true を付ける)
+//
+// 姿勢で world に積み上げた 3 次元の占有地図は sonar_occupancy_mapper (mapper.cc) で作る
+//
+// ビルド: colcon build (CMakeLists.txt, 受信側は 20250401_sonar_udp_receiver/test のソースを使う)
+// liblz4 があれば送信側の LZ4 圧縮にも対応する
+
+#include "SonarPointCloudPublisher.hh"
 #include <rclcpp/rclcpp.hpp>
-#include <sensor_msgs/msg/point_cloud2.hpp>
-#include <sensor_msgs/point_cloud2_iterator.hpp>
-#include <vector>
-#include <cmath>
-
-class SonarPointCloudPublisher : public rclcpp::Node
-{
-public:
-    SonarPointCloudPublisher()
-        : Node("sonar_pointcloud_publisher"),
-          nRange(10.0), nBeam(512), nSwath(120.0)
-    {
-        publisher_ = this->create_publisher<sensor_msgs::msg::PointCloud2>("sonar/pointcloud", 10);
-        timer_ = this->create_wall_timer(std::chrono::milliseconds(100),
-                                         std::bind(&SonarPointCloudPublisher::publish_pointcloud, this));
-    }
-
-private:
-    void publish_pointcloud()
-    {
-        // 仮のセンサーデータを作成（本来はUDP受信等で取得）
-        std::vector<uint8_t> sonar_data(nBeam * static_cast<int>(nRange), 0);
-        for (size_t i = 0; i < sonar_data.size(); i++)
-        {
-            sonar_data[i] = static_cast<uint8_t>(std::rand() % 256); // 0~255のランダム強度
-        }
-
-        sensor_msgs::msg::PointCloud2 msg;
-        msg.header.stamp = this->get_clock()->now();
-        msg.header.frame_id = "sonar_frame"; // RVizで適切なTFを設定する必要あり
-
-        msg.height = 1;
-        msg.width = sonar_data.size();
-        msg.is_bigendian = false;
-        msg.is_dense = true;
-
-        sensor_msgs::PointCloud2Modifier modifier(msg);
-        modifier.setPointCloud2Fields(4,
-                                      "x", 1, sensor_msgs::msg::PointField::FLOAT32,
-                                      "y", 1, sensor_msgs::msg::PointField::FLOAT32,
-                                      "z", 1, sensor_msgs::msg::PointField::FLOAT32,
-                                      "intensity", 1, sensor_msgs::msg::PointField::FLOAT32);
-        modifier.resize(sonar_data.size());
-
-        sensor_msgs::PointCloud2Iterator<float> iter_x(msg, "x");
-        sensor_msgs::PointCloud2Iterator<float> iter_y(msg, "y");
-        sensor_msgs::PointCloud2Iterator<float> iter_z(msg, "z");
-        sensor_msgs::PointCloud2Iterator<float> iter_intensity(msg, "intensity");
-
-        // 角度分割
-        double angle_step = nSwath * (M_PI / 180.0) / nBeam;
-        double start_angle = -nSwath * (M_PI / 180.0) / 2.0;
-
-        for (int b = 0; b < nBeam; b++)
-        {
-            double angle = start_angle + b * angle_step;
-            double cos_angle = std::cos(angle);
-            double sin_angle = std::sin(angle);
-
-            for (int r = 0; r < static_cast<int>(nRange); r++)
-            {
-                double range = (r + 1) * (nRange / static_cast<double>(nRange));
-                int index = b * static_cast<int>(nRange) + r;
-
-                // 画像データの強度をIntensityとして指定
-                double intensity = static_cast<double>(sonar_data[index]);
-
-                *iter_x = range * cos_angle;
-                *iter_y = range * sin_angle;
-                *iter_z = 0.0; // Zを常に0に固定
-                *iter_intensity = intensity; // Intensityにソナーのピクセル値を格納
-
-                ++iter_x;
-                ++iter_y;
-                ++iter_z;
-                ++iter_intensity;
-            }
-        }
-
-        publisher_->publish(msg);
-    }
-
-    rclcpp::Publisher<sensor_msgs::msg::PointCloud2>::SharedPtr publisher_;
-    rclcpp::TimerBase::SharedPtr timer_;
-
-    double nRange;
-    int nBeam;
-    double nSwath;
-};
 
 int main(int argc, char *argv[])
 {
@@ -96,4 +41,3 @@ int main(int argc, char *argv[])
     rclcpp::shutdown();
     return 0;
 }
-
@@ -0,0 +1,342 @@
+#include "AsyncFileWriter.hh"
+#include <algorithm>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <iostream>
+#include <unistd.h>
+
+namespace {
+// O_DIRECT の境界 (論理ブロックサイズ)
+constexpr size_t kDirectAlign = 4096;
+// マルチプレクサ側 AVIOContext の内部バッファ
+constexpr int kAvioBufferSize = 64 * 1024;
+}
+
+// コンストラクタ
+AsyncFileWriter::AsyncFileWriter(const std::string& path, const AsyncFileWriterConfig& cfg)
+    : config(cfg) {
+    config.bufferSize = std::max(kDirectAlign, config.bufferSize / kDirectAlign * kDirectAlign);
+    config.bufferCount = std::max(2, config.bufferCount);
+
+    fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        std::cerr << "Error: Could not open output file " << path << " (" << strerror(errno) << ")"
+                  << std::endl;
+        return;
+    }
+    // O_DIRECT はアラインされた領域だけに使い、端数は通常の fd で書く
+    if (config.directIO) {
+        directFd = ::open(path.c_str(), O_WRONLY | O_DIRECT | O_CLOEXEC);
+        if (directFd < 0) {
+            std::cerr << "Warning: O_DIRECT is not supported, falling back to buffered I/O ("
+                      << strerror(errno) << ")" << std::endl;
+        }
+    }
+
+    buffers.resize(config.bufferCount);
+    for (Buffer& buffer : buffers) {
+        void* p = nullptr;
+        if (posix_memalign(&p, kDirectAlign, config.bufferSize) != 0) {
+            std::cerr << "Error: Failed to allocate write buffer" << std::endl;
+            close();
+            return;
+        }
+        buffer.data = static_cast<uint8_t*>(p);
+        freeBuffers.push_back(&buffer);
+    }
+    carry.resize(kDirectAlign);
+
+    unsigned char* avioBuffer = static_cast<unsigned char*>(av_malloc(kAvioBufferSize));
+    avioCtx = avio_alloc_context(avioBuffer, kAvioBufferSize, 1, this, nullptr, writeCallback,
+                                 seekCallback);
+    if (!avioCtx) {
+        std::cerr << "Error: Failed to allocate AVIOContext" << std::endl;
+        av_free(avioBuffer);
+        close();
+        return;
+    }
+
+    lastSync = std::chrono::steady_clock::now();
+    thread = std::thread(&AsyncFileWriter::writerLoop, this);
+}
+
+// デストラクタ
+AsyncFileWriter::~AsyncFileWriter() {
+    close();
+    for (Buffer& buffer : buffers) {
+        free(buffer.data);
+    }
+}
+
+bool AsyncFileWriter::isOpen() const {
+    return fd >= 0 && avioCtx != nullptr;
+}
+
+AVIOContext* AsyncFileWriter::avioContext() {
+    return avioCtx;
+}
+
+void AsyncFileWriter::close() {
+    if (avioCtx) {
+        avio_flush(avioCtx);
+    }
+    if (thread.joinable()) {
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            submitCurrent();
+            submitCarry(lock);
+            finished = true;
+        }
+        pendingCond.notify_one();
+        thread.join();
+    }
+    if (avioCtx) {
+        av_freep(&avioCtx->buffer);
+        avio_context_free(&avioCtx);
+    }
+    if (fd >= 0) {
+        if (config.fsyncBytes > 0 || config.fsyncIntervalMs > 0) {
+            fdatasync(fd);
+        }
+        ::close(fd);
+        fd = -1;
+    }
+    if (directFd >= 0) {
+        ::close(directFd);
+        directFd = -1;
+    }
+}
+
+uint64_t AsyncFileWriter::stallCount() const {
+    return stalls.load(std::memory_order_relaxed);
+}
+
+// static
+int AsyncFileWriter::writeCallback(void* opaque, AVIO_WRITE_BUF buf, int size) {
+    return static_cast<AsyncFileWriter*>(opaque)->write(buf, size);
+}
+
+// static
+int64_t AsyncFileWriter::seekCallback(void* opaque, int64_t offset, int whence) {
+    return static_cast<AsyncFileWriter*>(opaque)->seek(offset, whence);
+}
+
+// マルチプレクサのスレッドから呼ばれる: バッファへコピーするだけ
+int AsyncFileWriter::write(const uint8_t* data, size_t size) {
+    if (int err = error.load(std::memory_order_relaxed)) {
+        return AVERROR(err);
+    }
+    std::unique_lock<std::mutex> lock(mutex);
+    size_t remain = size;
+    while (remain > 0) {
+        if (!current && !acquireBuffer(lock)) {
+            return AVERROR(EIO);
+        }
+        size_t n = std::min(remain, config.bufferSize - current->length);
+        memcpy(current->data + current->length, data, n);
+        current->length += n;
+        data += n;
+        remain -= n;
+        position += n;
+        fileSize = std::max(fileSize, position);
+        if (current->length == config.bufferSize) {
+            submitCurrent();
+        }
+    }
+    return static_cast<int>(size);
+}
+
+// シーク (matroska は末尾でヘッダ領域へ戻って書き直す)
+int64_t AsyncFileWriter::seek(int64_t offset, int whence) {
+    whence &= ~AVSEEK_FORCE;
+    if (whence == AVSEEK_SIZE) {
+        return fileSize;
+    }
+    int64_t target;
+    if (whence == SEEK_SET) {
+        target = offset;
+    } else if (whence == SEEK_CUR) {
+        target = position + offset;
+    } else if (whence == SEEK_END) {
+        target = fileSize + offset;
+    } else {
+        return AVERROR(EINVAL);
+    }
+    if (target < 0) {
+        return AVERROR(EINVAL);
+    }
+    if (target != position) {
+        std::lock_guard<std::mutex> lock(mutex);
+        submitCurrent();
+        position = target;
+    }
+    return position;
+}
+
+// 全て書き込み待ちなら空くまで待つ (mutex 保持中に呼ぶ)
+bool AsyncFileWriter::waitFreeBuffer(std::unique_lock<std::mutex>& lock) {
+    if (freeBuffers.empty()) {
+        stalls.fetch_add(1, std::memory_order_relaxed);
+        freeCond.wait(lock, [this] { return !freeBuffers.empty() || error.load() != 0; });
+    }
+    return !freeBuffers.empty();
+}
+
+// 空きバッファを取得 (mutex 保持中に呼ぶ)
+// position が持ち越した端数の続きなら、端数をバッファの先頭に置いてアラインを保つ
+bool AsyncFileWriter::acquireBuffer(std::unique_lock<std::mutex>& lock) {
+    if (carryLength > 0 && carryOffset + int64_t(carryLength) != position &&
+        !submitCarry(lock)) {
+        return false;
+    }
+    if (!waitFreeBuffer(lock)) {
+        return false;
+    }
+    current = freeBuffers.back();
+    freeBuffers.pop_back();
+    current->length = carryLength;
+    current->offset = carryLength > 0 ? carryOffset : position;
+    memcpy(current->data, carry.data(), carryLength);
+    carryLength = 0;
+    return true;
+}
+
+// 書き込み中のバッファを書き込みスレッドへ渡す (mutex 保持中に呼ぶ)
+// O_DIRECT なら末尾の端数のブロックは渡さずに carry へ持ち越す
+void AsyncFileWriter::submitCurrent() {
+    if (!current) return;
+    if (directFd >= 0) {
+        const int64_t end = current->offset + int64_t(current->length);
+        const int64_t aligned = std::max(current->offset, end / int64_t(kDirectAlign) *
+                                                              int64_t(kDirectAlign));
+        carryLength = size_t(end - aligned);
+        carryOffset = aligned;
+        current->length -= carryLength;
+        memcpy(carry.data(), current->data + current->length, carryLength);
+    }
+    if (current->length > 0) {
+        pending.push_back(current);
+        pendingCond.notify_one();
+    } else {
+        freeBuffers.push_back(current);
+    }
+    current = nullptr;
+}
+
+// 持ち越した端数を単独のバッファで書き込みスレッドへ渡す (mutex 保持中に呼ぶ)
+bool AsyncFileWriter::submitCarry(std::unique_lock<std::mutex>& lock) {
+    if (carryLength == 0) {
+        return true;
+    }
+    if (!waitFreeBuffer(lock)) {
+        return false;
+    }
+    Buffer* buffer = freeBuffers.back();
+    freeBuffers.pop_back();
+    memcpy(buffer->data, carry.data(), carryLength);
+    buffer->length = carryLength;
+    buffer->offset = carryOffset;
+    carryLength = 0;
+    pending.push_back(buffer);
+    pendingCond.notify_one();
+    return true;
+}
+
+// 書き込みスレッド
+void AsyncFileWriter::writerLoop() {
+    const auto ready = [this] { return !pending.empty() || finished; };
+    while (true) {
+        Buffer* buffer = nullptr;
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            if (config.fsyncIntervalMs > 0) {
+                // 間隔が過ぎたら書きかけのバッファも書く (低ビットレートでもメモリに溜め込まない)
+                auto deadline = lastSync + std::chrono::milliseconds(config.fsyncIntervalMs);
+                if (!pendingCond.wait_until(lock, deadline, ready)) {
+                    submitCurrent();
+                }
+            } else {
+                pendingCond.wait(lock, ready);
+            }
+            if (pending.empty()) {
+                if (finished) {
+                    break;
+                }
+                // 書くものが無い: 前回の同期以降に書いた分だけ同期する
+                lock.unlock();
+                syncIfNeeded(0);
+                continue;
+            }
+            buffer = pending.front();
+            pending.pop_front();
+        }
+
+        if (error.load(std::memory_order_relaxed) == 0 && writeBuffer(*buffer)) {
+            syncIfNeeded(buffer->length);
+        }
+
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            freeBuffers.push_back(buffer);
+        }
+        freeCond.notify_one();
+    }
+}
+
+// バッファ 1 つを書き込む: アラインされた部分は O_DIRECT、端数は通常の fd
+bool AsyncFileWriter::writeBuffer(const Buffer& buffer) {
+    const uint8_t* data = buffer.data;
+    size_t length = buffer.length;
+    off_t offset = buffer.offset;
+
+    if (directFd >= 0 && offset % kDirectAlign == 0) {
+        size_t aligned = length / kDirectAlign * kDirectAlign;
+        while (aligned > 0) {
+            ssize_t n = pwrite(directFd, data, aligned, offset);
+            if (n < 0) {
+                if (errno == EINTR) continue;
+                break; // 通常の fd で書き直す
+            }
+            n = n / kDirectAlign * kDirectAlign;
+            if (n == 0) break;
+            data += n;
+            offset += n;
+            length -= n;
+            aligned -= n;
+        }
+    }
+
+    while (length > 0) {
+        ssize_t n = pwrite(fd, data, length, offset);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            std::cerr << "Error: Failed to write output file (" << strerror(errno) << ")"
+                      << std::endl;
+            error.store(errno);
+            freeCond.notify_all();
+            return false;
+        }
+        data += n;
+        offset += n;
+        length -= n;
+    }
+    return true;
+}
+
+// 設定されたバイト数・間隔毎に fdatasync し、ダーティページを溜め込まない
+void AsyncFileWriter::syncIfNeeded(size_t written) {
+    unsyncedBytes += written;
+    auto now = std::chrono::steady_clock::now();
+    bool byBytes = config.fsyncBytes > 0 && unsyncedBytes >= config.fsyncBytes;
+    bool byTime = config.fsyncIntervalMs > 0 &&
+                  now - lastSync >= std::chrono::milliseconds(config.fsyncIntervalMs);
+    if (byBytes || byTime) {
+        if (unsyncedBytes > 0) {
+            fdatasync(fd);
+        }
+        unsyncedBytes = 0;
+        lastSync = now;
+    }
+}
@@ -0,0 +1,100 @@
+#if !defined(ASYNC_FILE_WRITER_HH)
+#define ASYNC_FILE_WRITER_HH
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+extern "C" {
+    #include <libavformat/avformat.h>
+}
+
+// FFmpeg 7.0 (libavformat 61) 以降は write_packet の引数が const
+#if LIBAVFORMAT_VERSION_MAJOR >= 61
+#define AVIO_WRITE_BUF const uint8_t*
+#else
+#define AVIO_WRITE_BUF uint8_t*
+#endif
+
+// 書き込みスレッドの設定
+struct AsyncFileWriterConfig {
+    // 既定は 1 MiB x 8 (ストリーム毎に確保するので小さめ。1 Mbps なら 1 分強を溜められる)
+    size_t bufferSize = 1024 * 1024;     // 1 バッファのサイズ (4096 の倍数)
+    int bufferCount = 8;                 // バッファ数 (書き込み待ちで溜められる量)
+    bool directIO = false;               // O_DIRECT でページキャッシュを経由しない
+    size_t fsyncBytes = 0;               // この量を書く毎に fdatasync (0: 無効)
+    int fsyncIntervalMs = 1000;          // この間隔で書きかけのバッファも書いて fdatasync (0: 無効)
+};
+
+// 専用スレッドで大きなアラインされたバッファ単位に書き込む AVIOContext
+// マルチプレクサからの小さな書き込みはバッファへコピーするだけで戻る
+// O_DIRECT の場合、満杯でないバッファ (fsyncIntervalMs / シーク) はアラインされた部分だけを書き、
+// 端数のブロックは次のバッファの先頭へ持ち越す (以降のバッファもアラインされたまま)
+// 持ち越した端数を単独で書くのは、続きと違う位置へ書く時と close() の時だけ
+class AsyncFileWriter {
+public:
+    AsyncFileWriter(const std::string& path, const AsyncFileWriterConfig& config);
+    ~AsyncFileWriter();
+
+    bool isOpen() const;
+    AVIOContext* avioContext();
+    // 残りを書き出してスレッドを止め、ファイルを閉じる
+    void close();
+    // 空きバッファ待ちでマルチプレクサが止まった回数
+    uint64_t stallCount() const;
+
+private:
+    struct Buffer {
+        uint8_t* data = nullptr;
+        size_t length = 0;
+        int64_t offset = 0;
+    };
+
+    static int writeCallback(void* opaque, AVIO_WRITE_BUF buf, int size);
+    static int64_t seekCallback(void* opaque, int64_t offset, int whence);
+    int write(const uint8_t* data, size_t size);
+    int64_t seek(int64_t offset, int whence);
+    bool waitFreeBuffer(std::unique_lock<std::mutex>& lock);
+    bool acquireBuffer(std::unique_lock<std::mutex>& lock);
+    void submitCurrent();
+    bool submitCarry(std::unique_lock<std::mutex>& lock);
+    void writerLoop();
+    bool writeBuffer(const Buffer& buffer);
+    void syncIfNeeded(size_t written);
+
+    AsyncFileWriterConfig config;
+    int fd = -1;
+    int directFd = -1;
+    AVIOContext* avioCtx = nullptr;
+
+    std::vector<Buffer> buffers;
+    std::vector<Buffer*> freeBuffers;
+    std::deque<Buffer*> pending;
+    Buffer* current = nullptr;
+    // O_DIRECT で書かずに持ち越した端数のブロック (kDirectAlign 未満)
+    std::vector<uint8_t> carry;
+    size_t carryLength = 0;
+    int64_t carryOffset = 0;
+    int64_t position = 0;
+    int64_t fileSize = 0;
+
+    // current はマルチプレクサと書き込みスレッド (fsyncIntervalMs 毎) の両方が触るので mutex で守る
+    std::mutex mutex;
+    std::condition_variable pendingCond;
+    std::condition_variable freeCond;
+    std::thread thread;
+    bool finished = false;
+    std::atomic<int> error{0};
+    std::atomic<uint64_t> stalls{0};
+
+    size_t unsyncedBytes = 0;
+    std::chrono::steady_clock::time_point lastSync;
+};
+
+#endif // #if !defined(ASYNC_FILE_WRITER_HH)
@@ -0,0 +1,317 @@
+#include "MultiHeadRecorder.hh"
+#include "SonarRecorder.hh"
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <iostream>
+
+// コンストラクタ
+MultiHeadRecorder::MultiHeadRecorder(const std::vector<SonarHeadConfig>& configs,
+                                     const AsyncFileWriterConfig& writerConfig)
+    : filename(getTimestampedFilename()) {
+    avformat_network_init();
+
+    int ret = avformat_alloc_output_context2(&formatCtx, nullptr, "matroska", filename.c_str());
+    if (ret < 0 || !formatCtx) {
+        std::cerr << "Error: Failed to allocate output context (" << ret << ")" << std::endl;
+        exit(1);
+    }
+
+    for (size_t i = 0; i < configs.size(); ++i) {
+        std::unique_ptr<Head> head(new Head);
+        head->config = configs[i];
+        head->index = static_cast<int>(i);
+        if (head->config.name.empty()) {
+            head->config.name = "head" + std::to_string(i);
+        }
+        initHead(*head);
+        heads.push_back(std::move(head));
+    }
+
+    av_dump_format(formatCtx, 0, filename.c_str(), 1);
+
+    writer.reset(new AsyncFileWriter(filename, writerConfig));
+    if (!writer->isOpen()) {
+        exit(1);
+    }
+    formatCtx->pb = writer->avioContext();
+    formatCtx->flags |= AVFMT_FLAG_CUSTOM_IO;
+
+    for (auto& head : heads) {
+        Head* p = head.get();
+        head->thread = std::thread([this, p] { encodeLoop(*p); });
+    }
+}
+
+// デストラクタ
+MultiHeadRecorder::~MultiHeadRecorder() {
+    {
+        std::lock_guard<std::mutex> lock(originMutex);
+        if (originUs < 0 && earliestUs >= 0) {
+            setOrigin();
+        }
+    }
+    for (auto& head : heads) {
+        {
+            std::lock_guard<std::mutex> lock(head->mutex);
+            head->finished = true;
+        }
+        head->cond.notify_one();
+    }
+    for (auto& head : heads) {
+        if (head->thread.joinable()) {
+            head->thread.join();
+        }
+    }
+
+    if (headerWritten) {
+        av_write_trailer(formatCtx);
+    }
+    writer->close();
+    writer.reset();
+
+    for (auto& head : heads) {
+        avcodec_free_context(&head->codecCtx);
+        av_frame_free(&head->frame);
+        av_packet_free(&head->pkt);
+    }
+    avformat_free_context(formatCtx);
+}
+
+// ヘッド毎のエンコーダとストリームを作る
+void MultiHeadRecorder::initHead(Head& head) {
+    const SonarHeadConfig& config = head.config;
+    int ret;
+
+    const AVCodec* codec = avcodec_find_encoder(config.is16bit ? AV_CODEC_ID_FFV1
+                                                               : AV_CODEC_ID_H264);
+    if (!codec) {
+        std::cerr << "Error: Encoder for " << config.name << " not found" << std::endl;
+        exit(1);
+    }
+
+    head.stream = avformat_new_stream(formatCtx, nullptr);
+    if (!head.stream) {
+        std::cerr << "Error: Failed to create stream" << std::endl;
+        exit(1);
+    }
+
+    head.codecCtx = avcodec_alloc_context3(codec);
+    if (!head.codecCtx) {
+        std::cerr << "Error: Failed to allocate codec context" << std::endl;
+        exit(1);
+    }
+
+    AVCodecContext* ctx = head.codecCtx;
+    ctx->width = config.width;
+    ctx->height = config.height;
+    ctx->time_base = {1, 1000000};
+    ctx->framerate = {config.fps, 1};
+    ctx->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
+    if (config.is16bit) {
+        ctx->pix_fmt = AV_PIX_FMT_GRAY16LE;
+        ctx->level = 3;
+    } else {
+        ctx->pix_fmt = AV_PIX_FMT_YUV420P;
+        ctx->gop_size = 30;
+        ctx->max_b_frames = 1;
+        ctx->bit_rate = 1000000;
+    }
+
+    if ((ret = avcodec_open2(ctx, codec, nullptr)) < 0) {
+        std::cerr << "Error: Failed to open codec (" << ret << ")" << std::endl;
+        exit(1);
+    }
+
+    ret = avcodec_parameters_from_context(head.stream->codecpar, ctx);
+    if (ret < 0) {
+        std::cerr << "Error: Failed to copy codec parameters (" << ret << ")" << std::endl;
+        exit(1);
+    }
+    head.stream->time_base = ctx->time_base;
+    av_dict_set(&head.stream->metadata, "title", config.name.c_str(), 0);
+
+    head.frame = av_frame_alloc();
+    head.frame->format = ctx->pix_fmt;
+    head.frame->width = config.width;
+    head.frame->height = config.height;
+    if (av_frame_get_buffer(head.frame, 32) < 0) {
+        std::cerr << "Error: Failed to allocate AVFrame" << std::endl;
+        exit(1);
+    }
+    head.pkt = av_packet_alloc();
+}
+
+// フレームをヘッドのキューへ積む (エンコードは各ヘッドのスレッド)
+void MultiHeadRecorder::recordFrame(int headIndex, const uint8_t* pImage, int64_t timestampUs) {
+    if (!pImage || headIndex < 0 || headIndex >= headCount()) return;
+    Head& head = *heads[headIndex];
+
+    if (timestampUs < 0) {
+        timestampUs = std::chrono::duration_cast<std::chrono::microseconds>(
+                          std::chrono::system_clock::now().time_since_epoch())
+                          .count();
+    }
+    if (originUs < 0) {
+        std::lock_guard<std::mutex> lock(originMutex);
+        if (originUs < 0) {
+            if (!head.started) {
+                head.started = true;
+                ++startedHeads;
+            }
+            if (earliestUs < 0 || timestampUs < earliestUs) {
+                earliestUs = timestampUs;
+            }
+            bool full;
+            {
+                std::lock_guard<std::mutex> headLock(head.mutex);
+                full = head.queue.size() + 1 >= kMaxQueuedFrames;
+            }
+            if (startedHeads == headCount() || full) {
+                setOrigin();
+            }
+        }
+    }
+
+    size_t bytes = size_t(head.config.width) * head.config.height * (head.config.is16bit ? 2 : 1);
+    {
+        std::lock_guard<std::mutex> lock(head.mutex);
+        if (head.queue.size() >= kMaxQueuedFrames) {
+            head.spare.push_back(std::move(head.queue.front().image));
+            head.queue.pop_front();
+            head.dropped.fetch_add(1, std::memory_order_relaxed);
+        }
+        Job job;
+        if (!head.spare.empty()) {
+            job.image = std::move(head.spare.back());
+            head.spare.pop_back();
+        }
+        job.image.assign(pImage, pImage + bytes);
+        job.timestampUs = timestampUs;
+        head.queue.push_back(std::move(job));
+    }
+    head.cond.notify_one();
+}
+
+// 時刻原点を確定して待っているエンコードスレッドを起こす (originMutex 保持中に呼ぶ)
+void MultiHeadRecorder::setOrigin() {
+    originUs = earliestUs;
+    for (auto& head : heads) {
+        {
+            std::lock_guard<std::mutex> lock(head->mutex);
+        }
+        head->cond.notify_one();
+    }
+}
+
+int MultiHeadRecorder::headCount() const {
+    return static_cast<int>(heads.size());
+}
+
+uint64_t MultiHeadRecorder::droppedFrames(int headIndex) const {
+    return heads[headIndex]->dropped.load(std::memory_order_relaxed);
+}
+
+// ヘッド毎のエンコードスレッド
+void MultiHeadRecorder::encodeLoop(Head& head) {
+    while (true) {
+        Job job;
+        {
+            std::unique_lock<std::mutex> lock(head.mutex);
+            head.cond.wait(lock, [this, &head] {
+                return (!head.queue.empty() && originUs >= 0) || head.finished;
+            });
+            if (head.queue.empty() || originUs < 0) {
+                break;
+            }
+            job = std::move(head.queue.front());
+            head.queue.pop_front();
+        }
+
+        // 原点より前のフレーム (原点を決めた後に遅れて届いたもの) は時刻軸に置けないので捨てる
+        int64_t pts = job.timestampUs - originUs;
+        if (pts < 0) {
+            head.dropped.fetch_add(1, std::memory_order_relaxed);
+            std::lock_guard<std::mutex> lock(head.mutex);
+            head.spare.push_back(std::move(job.image));
+            continue;
+        }
+        if (pts <= head.lastPts) {
+            pts = head.lastPts + 1;
+        }
+        head.lastPts = pts;
+
+        if (av_frame_make_writable(head.frame) < 0) {
+            std::cerr << "Error: Failed to make frame writable" << std::endl;
+            continue;
+        }
+        fillFrame(head, job.image);
+        head.frame->pts = pts;
+        encodeFrame(head, head.frame);
+
+        std::lock_guard<std::mutex> lock(head.mutex);
+        head.spare.push_back(std::move(job.image));
+    }
+    encodeFrame(head, nullptr);
+}
+
+// ソナー画像をエンコーダの画素形式へ詰める
+void MultiHeadRecorder::fillFrame(Head& head, const std::vector<uint8_t>& image) {
+    const int width = head.config.width;
+    const int height = head.config.height;
+    AVFrame* frame = head.frame;
+
+    if (head.config.is16bit) {
+        for (int y = 0; y < height; ++y) {
+            memcpy(frame->data[0] + y * frame->linesize[0], image.data() + 2 * y * width,
+                   2 * width);
+        }
+        return;
+    }
+    for (int y = 0; y < height; ++y) {
+        memcpy(frame->data[0] + y * frame->linesize[0], image.data() + y * width, width);
+    }
+    memset(frame->data[1], 128, frame->linesize[1] * height / 2);
+    memset(frame->data[2], 128, frame->linesize[2] * height / 2);
+}
+
+// フレームをエンコード (frame == nullptr でエンコーダをフラッシュ)
+void MultiHeadRecorder::encodeFrame(Head& head, AVFrame* frame) {
+    int ret = avcodec_send_frame(head.codecCtx, frame);
+    if (ret < 0) {
+        std::cerr << "Error: Failed to send frame for encoding (" << ret << ")" << std::endl;
+        return;
+    }
+
+    while (avcodec_receive_packet(head.codecCtx, head.pkt) == 0) {
+        head.pkt->stream_index = head.stream->index;
+        writePacket(head.pkt);
+        av_packet_unref(head.pkt);
+    }
+}
+
+// パケットをマルチプレクサへ渡す (最初のパケットでヘッダを書く)
+void MultiHeadRecorder::writePacket(AVPacket* packet) {
+    std::lock_guard<std::mutex> lock(muxMutex);
+    if (headerFailed) {
+        return;
+    }
+    if (!headerWritten) {
+        int64_t origin = originUs;
+        av_dict_set(&formatCtx->metadata, "creation_time", formatUtcTimestamp(origin).c_str(), 0);
+        av_dict_set(&formatCtx->metadata, "SONAR_START_TIME_US", std::to_string(origin).c_str(),
+                    0);
+        int ret = avformat_write_header(formatCtx, nullptr);
+        if (ret < 0) {
+            std::cerr << "Error: Failed to write header (" << ret << ")" << std::endl;
+            headerFailed = true;
+            return;
+        }
+        headerWritten = true;
+    }
+
+    AVStream* stream = formatCtx->streams[packet->stream_index];
+    av_packet_rescale_ts(packet, heads[packet->stream_index]->codecCtx->time_base,
+                         stream->time_base);
+    av_interleaved_write_frame(formatCtx, packet);
+}
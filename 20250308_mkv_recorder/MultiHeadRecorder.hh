@@ -0,0 +1,96 @@
+#if !defined(MULTI_HEAD_RECORDER_HH)
+#define MULTI_HEAD_RECORDER_HH
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include "AsyncFileWriter.hh"
+extern "C" {
+    #include <libavcodec/avcodec.h>
+    #include <libavformat/avformat.h>
+}
+
+// ソナーヘッド 1 台分の設定
+// 8bit は H264 (YUV420P)、16bit は階調を落とさないよう FFV1 (GRAY16LE) でエンコードする
+struct SonarHeadConfig {
+    int width = 512;
+    int height = 256;
+    bool is16bit = false;
+    int fps = 15;     // 公称値 (レート制御用)
+    std::string name; // ストリーム名 (空なら head<N>)
+};
+
+// 複数ソナーヘッドを 1 つの MKV へ、共通の時刻軸で記録する
+// ヘッド毎にエンコードスレッドを持ち、パケットはマルチプレクサでインターリーブする
+class MultiHeadRecorder {
+public:
+    MultiHeadRecorder(const std::vector<SonarHeadConfig>& configs,
+                      const AsyncFileWriterConfig& writerConfig = AsyncFileWriterConfig());
+    ~MultiHeadRecorder();
+
+    // head 番号のフレームを記録する (複数スレッドから呼んでよい)
+    // timestampUs: 取得時刻 (UNIX 時刻 [us])。負なら現在時刻を使う
+    void recordFrame(int head, const uint8_t* pImage, int64_t timestampUs = -1);
+
+    int headCount() const;
+    // 捨てたフレーム数 (エンコードが追いつかない / 時刻原点より前)
+    uint64_t droppedFrames(int head) const;
+
+private:
+    struct Job {
+        std::vector<uint8_t> image;
+        int64_t timestampUs = 0;
+    };
+
+    struct Head {
+        SonarHeadConfig config;
+        int index = 0;
+        AVCodecContext* codecCtx = nullptr;
+        AVStream* stream = nullptr;
+        AVFrame* frame = nullptr;
+        AVPacket* pkt = nullptr;
+
+        std::thread thread;
+        std::mutex mutex;
+        std::condition_variable cond;
+        std::deque<Job> queue;
+        std::vector<std::vector<uint8_t>> spare;
+        bool finished = false;
+        bool started = false; // 時刻原点を決める前にフレームが届いた
+        int64_t lastPts = -1;
+        std::atomic<uint64_t> dropped{0};
+    };
+
+    void initHead(Head& head);
+    void encodeLoop(Head& head);
+    void encodeFrame(Head& head, AVFrame* frame);
+    void fillFrame(Head& head, const std::vector<uint8_t>& image);
+    void writePacket(AVPacket* packet);
+    void setOrigin();
+
+    std::string filename;
+    std::vector<std::unique_ptr<Head>> heads;
+    AVFormatContext* formatCtx = nullptr;
+    std::unique_ptr<AsyncFileWriter> writer;
+
+    // 全ヘッド共通の時刻原点 (全ヘッドの最初のフレームのうち最も早い取得時刻)
+    // 全ヘッドのフレームが揃うか、どれかのキューが一杯になるまでエンコードを待たせて決める
+    std::mutex originMutex;
+    std::atomic<int64_t> originUs{-1};
+    int64_t earliestUs = -1;
+    int startedHeads = 0;
+
+    std::mutex muxMutex;
+    bool headerWritten = false;
+    bool headerFailed = false;
+
+    static constexpr size_t kMaxQueuedFrames = 8;
+};
+
+#endif // #if !defined(MULTI_HEAD_RECORDER_HH)
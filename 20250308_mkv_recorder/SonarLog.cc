@@ -0,0 +1,371 @@
+#include "SonarLog.hh"
+#include <chrono>
+#include <cstring>
+#include <fcntl.h>
+#include <iostream>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#if defined(SONAR_HAVE_LZ4)
+#include <lz4.h>
+#endif
+
+namespace {
+size_t paddingFor(uint64_t position) {
+    return (kSonarLogAlign - position % kSonarLogAlign) % kSonarLogAlign;
+}
+}
+
+// ---------------------------------------------------------------------------
+// SonarLogWriter
+// ---------------------------------------------------------------------------
+
+// コンストラクタ
+SonarLogWriter::SonarLogWriter(const std::string& filename, int width, int height, int fps,
+                               bool is16bit, bool compress)
+    : filename(filename), width(width), height(height), is16bit(is16bit), compress(compress) {
+#if !defined(SONAR_HAVE_LZ4)
+    if (compress) {
+        std::cerr << "Warning: Built without LZ4, frames are stored uncompressed" << std::endl;
+        this->compress = false;
+    }
+#endif
+    file = fopen(filename.c_str(), "wb");
+    if (!file) {
+        std::cerr << "Error: Could not open output file " << filename << std::endl;
+        return;
+    }
+    setvbuf(file, nullptr, _IOFBF, 1 << 20);
+
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, kSonarLogMagic, sizeof(header.magic));
+    header.version = kSonarLogVersion;
+    header.headerSize = sizeof(header);
+    header.width = static_cast<uint16_t>(width);
+    header.height = static_cast<uint16_t>(height);
+    header.bytesPerPixel = is16bit ? 2 : 1;
+    header.fps = static_cast<uint16_t>(fps);
+    header.startTimeUs = -1;
+    if (writeAll(&header, sizeof(header))) {
+        goodPosition = position;
+    }
+}
+
+// デストラクタ
+SonarLogWriter::~SonarLogWriter() {
+    close();
+}
+
+bool SonarLogWriter::isOpen() const {
+    return file != nullptr;
+}
+
+void SonarLogWriter::setGeometry(float swath, float range) {
+    this->swath = swath;
+    this->range = range;
+}
+
+// フレーム記録処理
+void SonarLogWriter::recordFrame(const uint8_t* pImage, int64_t timestampUs) {
+    if (!pImage || !file) return;
+
+    SonarLogRecordHeader record;
+    bool compressed = encodeFrame(pImage, timestampUs, record, compressBuffer);
+    writeRecord(record, compressed ? static_cast<const void*>(compressBuffer.data()) : pImage);
+}
+
+// レコードヘッダを作り、必要なら圧縮する
+bool SonarLogWriter::encodeFrame(const uint8_t* pImage, int64_t timestampUs,
+                                 SonarLogRecordHeader& record,
+                                 std::vector<char>& compressed) const {
+    if (timestampUs < 0) {
+        timestampUs = std::chrono::duration_cast<std::chrono::microseconds>(
+                          std::chrono::system_clock::now().time_since_epoch())
+                          .count();
+    }
+
+    const uint32_t rawSize = uint32_t(width) * uint32_t(height) * (is16bit ? 2 : 1);
+    record.magic = kSonarLogRecordMagic;
+    record.flags = 0;
+    record.timestampUs = timestampUs;
+    record.storedSize = rawSize;
+    record.rawSize = rawSize;
+    record.swath = swath;
+    record.range = range;
+
+#if defined(SONAR_HAVE_LZ4)
+    // 縮まない場合は非圧縮で保存する (読み出し時にゼロコピーになる)
+    if (compress) {
+        compressed.resize(LZ4_compressBound(int(rawSize)));
+        int n = LZ4_compress_default(reinterpret_cast<const char*>(pImage), compressed.data(),
+                                     int(rawSize), int(compressed.size()));
+        if (n > 0 && uint32_t(n) < rawSize) {
+            record.flags |= kSonarLogFlagLz4;
+            record.storedSize = uint32_t(n);
+            return true;
+        }
+    }
+#else
+    (void)pImage;
+    (void)compressed;
+#endif
+    return false;
+}
+
+// encodeFrame() で作ったレコードを書く
+void SonarLogWriter::writeRecord(const SonarLogRecordHeader& record, const void* payload) {
+    if (!payload || !file || failed) return;
+
+    if (header.startTimeUs < 0) {
+        header.startTimeUs = record.timestampUs;
+    }
+
+    SonarLogIndexEntry entry;
+    entry.offset = position;
+    entry.timestampUs = record.timestampUs;
+
+    static const uint8_t zeros[kSonarLogAlign] = {};
+    if (!writeAll(&record, sizeof(record)) || !writeAll(payload, record.storedSize) ||
+        !writeAll(zeros, paddingFor(position))) {
+        return;
+    }
+    // stdio のバッファに残ったままだと失敗した位置が分からないので、レコード毎に書き出す
+    if (fflush(file) != 0) {
+        std::cerr << "Error: Failed to write " << filename << std::endl;
+        failed = true;
+        return;
+    }
+    goodPosition = position;
+    index.push_back(entry);
+}
+
+// 索引を書き、ヘッダの indexOffset/frameCount を更新して閉じる
+// 書き込みに失敗していたら最後に書き終えたレコードで切り詰め、索引なし (読み込み時に走査) にする
+void SonarLogWriter::close() {
+    if (!file) return;
+
+    if (!failed) {
+        SonarLogIndexHeader indexHeader;
+        indexHeader.magic = kSonarLogIndexMagic;
+        indexHeader.count = static_cast<uint32_t>(index.size());
+        uint64_t indexOffset = position;
+        if (writeAll(&indexHeader, sizeof(indexHeader)) &&
+            writeAll(index.data(), index.size() * sizeof(SonarLogIndexEntry))) {
+            header.indexOffset = indexOffset;
+            header.frameCount = index.size();
+            if (fseek(file, 0, SEEK_SET) == 0) {
+                fwrite(&header, sizeof(header), 1, file);
+            }
+        }
+    }
+    fclose(file);
+    file = nullptr;
+
+    // stdio のバッファを捨てた (fclose した) 後で切り詰める
+    if (failed && truncate(filename.c_str(), off_t(goodPosition)) == 0 &&
+        goodPosition >= sizeof(header)) {
+        header.indexOffset = 0;
+        header.frameCount = index.size();
+        if (FILE* f = fopen(filename.c_str(), "r+b")) {
+            fwrite(&header, sizeof(header), 1, f);
+            fclose(f);
+        }
+        std::cerr << "Warning: " << filename << " was cut after " << index.size() << " frames"
+                  << std::endl;
+    }
+}
+
+bool SonarLogWriter::writeAll(const void* data, size_t size) {
+    if (size == 0) return true;
+    if (fwrite(data, 1, size, file) != size) {
+        std::cerr << "Error: Failed to write " << filename << std::endl;
+        failed = true;
+        return false;
+    }
+    position += size;
+    return true;
+}
+
+// ---------------------------------------------------------------------------
+// SonarLogReader
+// ---------------------------------------------------------------------------
+
+// コンストラクタ
+SonarLogReader::SonarLogReader() {
+}
+
+// デストラクタ
+SonarLogReader::~SonarLogReader() {
+    close();
+}
+
+bool SonarLogReader::open(const std::string& filename) {
+    close();
+
+    fd = ::open(filename.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        std::cerr << "Error: Could not open " << filename << std::endl;
+        return false;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || size_t(st.st_size) < sizeof(SonarLogFileHeader)) {
+        std::cerr << "Error: " << filename << " is not a sonar log" << std::endl;
+        close();
+        return false;
+    }
+    mapSize = size_t(st.st_size);
+    void* p = mmap(nullptr, mapSize, PROT_READ, MAP_SHARED, fd, 0);
+    if (p == MAP_FAILED) {
+        std::cerr << "Error: Failed to mmap " << filename << std::endl;
+        map = nullptr;
+        close();
+        return false;
+    }
+    map = static_cast<const uint8_t*>(p);
+    // 再生は基本的に順方向なので先読みさせる
+    madvise(p, mapSize, MADV_SEQUENTIAL);
+
+    header = reinterpret_cast<const SonarLogFileHeader*>(map);
+    if (memcmp(header->magic, kSonarLogMagic, sizeof(header->magic)) != 0 ||
+        header->version != kSonarLogVersion || header->headerSize < sizeof(SonarLogFileHeader)) {
+        std::cerr << "Error: " << filename << " is not a sonar log" << std::endl;
+        close();
+        return false;
+    }
+    if (!buildIndex()) {
+        std::cerr << "Error: " << filename << " has a broken index" << std::endl;
+        close();
+        return false;
+    }
+    return true;
+}
+
+void SonarLogReader::close() {
+    if (map) {
+        munmap(const_cast<uint8_t*>(map), mapSize);
+        map = nullptr;
+    }
+    if (fd >= 0) {
+        ::close(fd);
+        fd = -1;
+    }
+    mapSize = 0;
+    header = nullptr;
+    offsets.clear();
+}
+
+bool SonarLogReader::isOpen() const {
+    return map != nullptr;
+}
+
+int SonarLogReader::width() const {
+    return header ? header->width : 0;
+}
+
+int SonarLogReader::height() const {
+    return header ? header->height : 0;
+}
+
+int SonarLogReader::bytesPerPixel() const {
+    return header ? header->bytesPerPixel : 0;
+}
+
+int SonarLogReader::fps() const {
+    return header ? header->fps : 0;
+}
+
+int64_t SonarLogReader::startTimeUs() const {
+    return header ? header->startTimeUs : 0;
+}
+
+int SonarLogReader::frameCount() const {
+    return static_cast<int>(offsets.size());
+}
+
+// 末尾の索引を読む。無ければ (書き込み途中で終了したファイル) レコードを走査して作る
+bool SonarLogReader::buildIndex() {
+    offsets.clear();
+    uint64_t indexOffset = header->indexOffset;
+    if (indexOffset != 0) {
+        if (indexOffset + sizeof(SonarLogIndexHeader) > mapSize) {
+            return false;
+        }
+        const SonarLogIndexHeader* ih =
+            reinterpret_cast<const SonarLogIndexHeader*>(map + indexOffset);
+        uint64_t end = indexOffset + sizeof(SonarLogIndexHeader) +
+                       uint64_t(ih->count) * sizeof(SonarLogIndexEntry);
+        if (ih->magic != kSonarLogIndexMagic || end > mapSize) {
+            return false;
+        }
+        const SonarLogIndexEntry* entries =
+            reinterpret_cast<const SonarLogIndexEntry*>(ih + 1);
+        offsets.resize(ih->count);
+        for (uint32_t i = 0; i < ih->count; ++i) {
+            offsets[i] = entries[i].offset;
+        }
+        return true;
+    }
+
+    uint64_t position = header->headerSize;
+    position += paddingFor(position);
+    while (position + sizeof(SonarLogRecordHeader) <= mapSize) {
+        const SonarLogRecordHeader* rec =
+            reinterpret_cast<const SonarLogRecordHeader*>(map + position);
+        uint64_t end = position + sizeof(SonarLogRecordHeader) + rec->storedSize;
+        if (rec->magic != kSonarLogRecordMagic || end > mapSize) {
+            break;
+        }
+        offsets.push_back(position);
+        position = end + paddingFor(end);
+    }
+    return true;
+}
+
+const SonarLogRecordHeader* SonarLogReader::record(int index) const {
+    if (index < 0 || index >= frameCount()) {
+        return nullptr;
+    }
+    uint64_t offset = offsets[index];
+    if (offset + sizeof(SonarLogRecordHeader) > mapSize) {
+        return nullptr;
+    }
+    const SonarLogRecordHeader* rec = reinterpret_cast<const SonarLogRecordHeader*>(map + offset);
+    if (rec->magic != kSonarLogRecordMagic ||
+        offset + sizeof(SonarLogRecordHeader) + rec->storedSize > mapSize) {
+        return nullptr;
+    }
+    return rec;
+}
+
+bool SonarLogReader::frame(int index, SonarLogFrame& out) {
+    const SonarLogRecordHeader* rec = record(index);
+    if (!rec) {
+        return false;
+    }
+    const uint8_t* payload = reinterpret_cast<const uint8_t*>(rec + 1);
+    out.timestampUs = rec->timestampUs;
+    out.swath = rec->swath;
+    out.range = rec->range;
+
+    if (!(rec->flags & kSonarLogFlagLz4)) {
+        out.data = payload;
+        out.size = rec->storedSize;
+        return true;
+    }
+#if defined(SONAR_HAVE_LZ4)
+    decompressBuffer.resize(rec->rawSize);
+    int n = LZ4_decompress_safe(reinterpret_cast<const char*>(payload),
+                                reinterpret_cast<char*>(decompressBuffer.data()),
+                                int(rec->storedSize), int(rec->rawSize));
+    if (n != int(rec->rawSize)) {
+        std::cerr << "Error: Failed to decompress frame " << index << std::endl;
+        return false;
+    }
+    out.data = decompressBuffer.data();
+    out.size = rec->rawSize;
+    return true;
+#else
+    std::cerr << "Error: Built without LZ4, cannot read compressed frame " << index << std::endl;
+    return false;
+#endif
+}
@@ -0,0 +1,152 @@
+#if !defined(SONAR_LOG_HH)
+#define SONAR_LOG_HH
+
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include <vector>
+
+// ソナー生データログ (.slog)
+//
+// コーデックを通さずに生フレームをそのまま保存する形式 (リトルエンディアン)
+//   [SonarLogFileHeader]
+//   [SonarLogRecordHeader][payload] ... (各レコードは kSonarLogAlign 境界から始まる)
+//   [SonarLogIndexHeader][SonarLogIndexEntry x frameCount]
+// indexOffset が 0 のファイル (書き込み中に落ちた等) は読み込み時にレコードを走査して索引を作る
+
+constexpr char kSonarLogMagic[8] = {'S', 'O', 'N', 'A', 'R', 'L', 'O', 'G'};
+constexpr uint32_t kSonarLogVersion = 1;
+constexpr uint32_t kSonarLogRecordMagic = 0x304d5246; // "FRM0"
+constexpr uint32_t kSonarLogIndexMagic = 0x30584449;  // "IDX0"
+constexpr size_t kSonarLogAlign = 64;
+
+// レコードのフラグ
+constexpr uint32_t kSonarLogFlagLz4 = 1u << 0;
+
+#pragma pack(push, 1)
+struct SonarLogFileHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t headerSize;
+    uint16_t width;
+    uint16_t height;
+    uint16_t bytesPerPixel;
+    uint16_t fps; // 公称値
+    int64_t startTimeUs;
+    uint64_t indexOffset;
+    uint64_t frameCount;
+    uint8_t reserved[16];
+};
+
+struct SonarLogRecordHeader {
+    uint32_t magic;
+    uint32_t flags;
+    int64_t timestampUs; // 取得時刻 (UNIX 時刻 [us])
+    uint32_t storedSize; // payload のバイト数 (圧縮後)
+    uint32_t rawSize;    // 展開後のバイト数
+    float swath;         // [deg]
+    float range;         // [m]
+};
+
+struct SonarLogIndexHeader {
+    uint32_t magic;
+    uint32_t count;
+};
+
+struct SonarLogIndexEntry {
+    uint64_t offset; // レコード先頭のファイル位置
+    int64_t timestampUs;
+};
+#pragma pack(pop)
+
+static_assert(sizeof(SonarLogFileHeader) == 64, "SonarLogFileHeader must be 64 bytes");
+static_assert(sizeof(SonarLogRecordHeader) == 32, "SonarLogRecordHeader must be 32 bytes");
+
+// 書き込み: SonarRecorder と同じ使い方で置き換えられる
+class SonarLogWriter {
+public:
+    SonarLogWriter(const std::string& filename, int width, int height, int fps, bool is16bit,
+                   bool compress = false);
+    ~SonarLogWriter();
+
+    bool isOpen() const;
+    // 以降のフレームに付けるスワス [deg]・レンジ [m]
+    void setGeometry(float swath, float range);
+    // timestampUs: 取得時刻 (UNIX 時刻 [us])。負なら現在時刻を使う
+    void recordFrame(const uint8_t* pImage, int64_t timestampUs = -1);
+
+    // recordFrame() を圧縮と書き込みに分けたもの (圧縮と書き込みを別スレッドで行う場合)
+    // encodeFrame() はレコードヘッダを作り、圧縮した場合は payload を compressed に入れて true を返す
+    // (false なら pImage をそのまま書く)。encodeFrame() と setGeometry() は同じスレッドから、
+    // writeRecord() と close() は別の 1 つのスレッドから呼んでよい
+    bool encodeFrame(const uint8_t* pImage, int64_t timestampUs, SonarLogRecordHeader& record,
+                     std::vector<char>& compressed) const;
+    void writeRecord(const SonarLogRecordHeader& record, const void* payload);
+
+    // 索引を書いてファイルを閉じる
+    void close();
+
+private:
+    bool writeAll(const void* data, size_t size);
+
+    std::string filename;
+    int width, height;
+    bool is16bit;
+    bool compress;
+    float swath = 120.0f;
+    float range = 30.0f;
+    FILE* file = nullptr;
+    uint64_t position = 0;
+    // 最後に書き終えたレコードの終端。書き込みに失敗したら以降は書かず、閉じるときここで切り詰める
+    uint64_t goodPosition = 0;
+    bool failed = false;
+    SonarLogFileHeader header;
+    std::vector<SonarLogIndexEntry> index;
+    std::vector<char> compressBuffer;
+};
+
+// 1 フレーム分の参照
+// 非圧縮フレームの data は mmap した領域を直接指す (コピーなし)
+struct SonarLogFrame {
+    const uint8_t* data = nullptr;
+    size_t size = 0;
+    int64_t timestampUs = 0;
+    float swath = 0.0f;
+    float range = 0.0f;
+};
+
+// 読み込み: ファイル全体を mmap し、索引で任意フレームへ O(1) でアクセスする
+class SonarLogReader {
+public:
+    SonarLogReader();
+    ~SonarLogReader();
+
+    bool open(const std::string& filename);
+    void close();
+    bool isOpen() const;
+
+    int width() const;
+    int height() const;
+    int bytesPerPixel() const;
+    int fps() const;
+    int64_t startTimeUs() const;
+    int frameCount() const;
+
+    // index 番目のフレームを取得する
+    // 圧縮フレームは内部バッファへ展開するため、次の呼び出しまで有効
+    bool frame(int index, SonarLogFrame& out);
+
+private:
+    bool buildIndex();
+    const SonarLogRecordHeader* record(int index) const;
+
+    int fd = -1;
+    const uint8_t* map = nullptr;
+    size_t mapSize = 0;
+    const SonarLogFileHeader* header = nullptr;
+    std::vector<uint64_t> offsets;
+    std::vector<uint8_t> decompressBuffer;
+};
+
+#endif // #if !defined(SONAR_LOG_HH)
@@ -0,0 +1,382 @@
+#include "SonarRecorder.hh"
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstring>
+#include <ctime>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+
+// 現在時刻を取得し、ファイル名を生成
+std::string getTimestampedFilename(const std::string& extension) {
+    auto now = std::chrono::system_clock::now();
+    auto now_ms = std::chrono::duration_cast<std::chrono::milliseconds>(now.time_since_epoch()) % 1000;
+    std::time_t now_time = std::chrono::system_clock::to_time_t(now);
+    std::tm tm = *std::localtime(&now_time);
+
+    std::ostringstream oss;
+    oss << "oculus_"
+        << std::put_time(&tm, "%Y-%m-%d_%H-%M-%S") << "."
+        << std::setw(3) << std::setfill('0') << now_ms.count()
+        << extension;
+    return oss.str();
+}
+
+// UNIX 時刻 [us] を creation_time 用の ISO 8601 (UTC) 文字列にする
+std::string formatUtcTimestamp(int64_t timestampUs) {
+    std::time_t sec = static_cast<std::time_t>(timestampUs / 1000000);
+    std::tm tm = *std::gmtime(&sec);
+    std::ostringstream oss;
+    oss << std::put_time(&tm, "%Y-%m-%dT%H:%M:%S") << "." << std::setw(6) << std::setfill('0')
+        << (timestampUs % 1000000) << "Z";
+    return oss.str();
+}
+
+// コンストラクタ
+SonarRecorder::SonarRecorder(int width, int height, int fps, bool is16bit,
+                             const AsyncFileWriterConfig& writerConfig,
+                             const std::string& filename)
+    : width(width), height(height), fps(fps), is16bit(is16bit), writerConfig(writerConfig),
+      requestedFilename(filename), tsOffset(AV_NOPTS_VALUE) {
+    avformat_network_init();
+    initFFmpeg();
+    if (!openOutput()) {
+        exit(1);
+    }
+}
+
+// コンストラクタ (プリトリガモード)
+SonarRecorder::SonarRecorder(int width, int height, int fps, bool is16bit,
+                             const PreTriggerConfig& config,
+                             const AsyncFileWriterConfig& writerConfig)
+    : width(width), height(height), fps(fps), is16bit(is16bit), preTrigger(true),
+      preTriggerConfig(config), writerConfig(writerConfig), tsOffset(AV_NOPTS_VALUE) {
+    avformat_network_init();
+    initFFmpeg();
+}
+
+// デストラクタ
+SonarRecorder::~SonarRecorder() {
+    cleanup();
+}
+
+// フレーム記録処理 (エラー原因の関数が欠落していたため修正)
+void SonarRecorder::recordFrame(const uint8_t* pImage, int64_t timestampUs) {
+    if (!pImage) return;
+
+    if (timestampUs < 0) {
+        timestampUs = std::chrono::duration_cast<std::chrono::microseconds>(
+                          std::chrono::system_clock::now().time_since_epoch())
+                          .count();
+    }
+    if (firstTimestampUs < 0) {
+        firstTimestampUs = timestampUs;
+    }
+    // 実際の取得間隔をそのまま pts にする (単調増加だけは保証する)
+    int64_t pts = timestampUs - firstTimestampUs;
+    if (pts <= lastPts) {
+        pts = lastPts + 1;
+    }
+    lastPts = pts;
+
+    AVFrame* frame = av_frame_alloc();
+    if (!frame) {
+        std::cerr << "Error: Failed to allocate AVFrame" << std::endl;
+        return;
+    }
+    frame->format = AV_PIX_FMT_YUV420P;
+    frame->width = width;
+    frame->height = height;
+    frame->pts = pts;
+    av_frame_get_buffer(frame, 32);
+
+    // 16bit は上位 8bit を使う
+    const uint16_t* pImage16 = reinterpret_cast<const uint16_t*>(pImage);
+    for (int y = 0; y < height; ++y) {
+        uint8_t* dst = frame->data[0] + y * frame->linesize[0];
+        if (is16bit) {
+            for (int x = 0; x < width; ++x) {
+                dst[x] = static_cast<uint8_t>(pImage16[y * width + x] >> 8);
+            }
+        } else {
+            memcpy(dst, pImage + y * width, width);
+        }
+    }
+
+    memset(frame->data[1], 128, frame->linesize[1] * height / 2);
+    memset(frame->data[2], 128, frame->linesize[2] * height / 2);
+
+    // トリガ時にバッファが空ならキーフレームから書き始める
+    if (forceKeyframe) {
+        frame->pict_type = AV_PICTURE_TYPE_I;
+        forceKeyframe = false;
+    }
+
+    encodeFrame(frame);
+    av_frame_free(&frame);
+
+    // ポストトリガ期間が過ぎたらファイルを閉じてバッファリングに戻る
+    if (preTrigger && formatCtx && lastPts > postTriggerEndPts) {
+        finishOutput();
+    }
+}
+
+// トリガ: リングバッファをファイルへ書き出し、ポストトリガ期間の録画を開始
+void SonarRecorder::trigger() {
+    if (!preTrigger) return;
+
+    int64_t postTicks = std::llround(preTriggerConfig.postSeconds / av_q2d(codecCtx->time_base));
+    if (!formatCtx) {
+        if (!openOutput()) {
+            return;
+        }
+        forceKeyframe = ring.empty();
+        for (AVPacket* packet : ring) {
+            writePacket(packet);
+        }
+        clearRing();
+    }
+    postTriggerEndPts = std::max<int64_t>(lastPts, 0) + postTicks;
+}
+
+bool SonarRecorder::isRecording() const {
+    return formatCtx != nullptr;
+}
+
+// FFmpeg 初期化処理 (エンコーダ)
+void SonarRecorder::initFFmpeg() {
+    int ret;
+    const AVCodec* codec = avcodec_find_encoder(AV_CODEC_ID_H264);
+    if (!codec) {
+        std::cerr << "Error: H264 encoder not found" << std::endl;
+        exit(1);
+    }
+
+    codecCtx = avcodec_alloc_context3(codec);
+    if (!codecCtx) {
+        std::cerr << "Error: Failed to allocate codec context" << std::endl;
+        exit(1);
+    }
+
+    codecCtx->width = width;
+    codecCtx->height = height;
+    codecCtx->pix_fmt = AV_PIX_FMT_YUV420P;
+    // 可変フレームレート: pts は取得時刻 [us]、framerate はレート制御用の公称値
+    codecCtx->time_base = {1, 1000000};
+    codecCtx->framerate = {fps, 1};
+    codecCtx->gop_size = 30;
+    codecCtx->max_b_frames = 1;
+    codecCtx->bit_rate = 1000000;
+    codecCtx->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
+
+    if ((ret = avcodec_open2(codecCtx, codec, nullptr)) < 0) {
+        std::cerr << "Error: Failed to open codec (" << ret << ")" << std::endl;
+        exit(1);
+    }
+
+    pkt = av_packet_alloc();
+}
+
+// 出力ファイルを開く (連続録画では生成時、プリトリガではトリガ毎)
+bool SonarRecorder::openOutput() {
+    filename = requestedFilename.empty() ? getTimestampedFilename() : requestedFilename;
+    int ret = avformat_alloc_output_context2(&formatCtx, nullptr, "matroska", filename.c_str());
+    if (ret < 0 || !formatCtx) {
+        std::cerr << "Error: Failed to allocate output context (" << ret << ")" << std::endl;
+        formatCtx = nullptr;
+        return false;
+    }
+
+    stream = avformat_new_stream(formatCtx, nullptr);
+    if (!stream) {
+        std::cerr << "Error: Failed to create stream" << std::endl;
+        avformat_free_context(formatCtx);
+        formatCtx = nullptr;
+        return false;
+    }
+
+    ret = avcodec_parameters_from_context(stream->codecpar, codecCtx);
+    if (ret < 0) {
+        std::cerr << "Error: Failed to copy codec parameters (" << ret << ")" << std::endl;
+        avformat_free_context(formatCtx);
+        formatCtx = nullptr;
+        return false;
+    }
+    stream->time_base = codecCtx->time_base;
+
+    av_dump_format(formatCtx, 0, filename.c_str(), 1);
+
+    // 書き込みは専用スレッドへ任せ、エンコードスレッドをストレージの遅延から切り離す
+    writer.reset(new AsyncFileWriter(filename, writerConfig));
+    if (!writer->isOpen()) {
+        writer.reset();
+        avformat_free_context(formatCtx);
+        formatCtx = nullptr;
+        return false;
+    }
+    formatCtx->pb = writer->avioContext();
+    formatCtx->flags |= AVFMT_FLAG_CUSTOM_IO;
+
+    // ヘッダは先頭パケットの時刻が決まってから書く (writeHeader)
+    headerWritten = false;
+    tsOffset = AV_NOPTS_VALUE;
+    return true;
+}
+
+// ファイル時刻 0 の UNIX 時刻をメタデータに入れてヘッダを書く
+// (航法ログ等と時刻を突き合わせるため)
+bool SonarRecorder::writeHeader() {
+    int64_t startUs = firstTimestampUs + tsOffset;
+    av_dict_set(&formatCtx->metadata, "creation_time", formatUtcTimestamp(startUs).c_str(), 0);
+    av_dict_set(&formatCtx->metadata, "SONAR_START_TIME_US", std::to_string(startUs).c_str(), 0);
+
+    int ret = avformat_write_header(formatCtx, nullptr);
+    if (ret < 0) {
+        std::cerr << "Error: Failed to write header (" << ret << ")" << std::endl;
+        return false;
+    }
+    headerWritten = true;
+    return true;
+}
+
+// 出力ファイルを閉じる
+void SonarRecorder::closeOutput() {
+    if (!formatCtx) return;
+    if (headerWritten) {
+        av_write_trailer(formatCtx);
+    }
+    writer->close();
+    if (writer->stallCount() > 0) {
+        std::cerr << "Warning: Writer stalled " << writer->stallCount() << " times" << std::endl;
+    }
+    writer.reset();
+    avformat_free_context(formatCtx);
+    formatCtx = nullptr;
+    stream = nullptr;
+    headerWritten = false;
+    tsOffset = AV_NOPTS_VALUE;
+}
+
+// エンコーダに残っているパケット (B フレームで遅れて出る最後の GOP) を書いてから閉じる
+// フラッシュしたエンコーダは再び使えないので作り直す (次のフレームはキーフレームになる)
+void SonarRecorder::finishOutput() {
+    encodeFrame(nullptr);
+    closeOutput();
+    avcodec_free_context(&codecCtx);
+    av_packet_free(&pkt);
+    initFFmpeg();
+}
+
+// フレームをエンコード (frame == nullptr でエンコーダをフラッシュ)
+void SonarRecorder::encodeFrame(AVFrame* frame) {
+    int ret = avcodec_send_frame(codecCtx, frame);
+    if (ret < 0) {
+        std::cerr << "Error: Failed to send frame for encoding (" << ret << ")" << std::endl;
+        return;
+    }
+
+    while (avcodec_receive_packet(codecCtx, pkt) == 0) {
+        if (formatCtx) {
+            writePacket(pkt);
+        } else if (preTrigger) {
+            bufferPacket(pkt);
+        }
+        av_packet_unref(pkt);
+    }
+}
+
+// パケットをファイルへ書き出す (ファイル先頭がキーフレーム・時刻 0 になるよう補正)
+void SonarRecorder::writePacket(AVPacket* packet) {
+    if (!formatCtx) return;
+    if (tsOffset == AV_NOPTS_VALUE) {
+        if (!(packet->flags & AV_PKT_FLAG_KEY)) {
+            return;
+        }
+        tsOffset = (packet->dts != AV_NOPTS_VALUE) ? packet->dts : packet->pts;
+        if (!writeHeader()) {
+            closeOutput();
+            return;
+        }
+    }
+    if (packet->pts != AV_NOPTS_VALUE) packet->pts -= tsOffset;
+    if (packet->dts != AV_NOPTS_VALUE) packet->dts -= tsOffset;
+    av_packet_rescale_ts(packet, codecCtx->time_base, stream->time_base);
+    packet->stream_index = stream->index;
+    av_interleaved_write_frame(formatCtx, packet);
+}
+
+// トリガ待ちの間、エンコード済みパケットをリングバッファへ保持
+void SonarRecorder::bufferPacket(AVPacket* packet) {
+    // バッファ先頭は常にキーフレーム
+    if (ring.empty() && !(packet->flags & AV_PKT_FLAG_KEY)) {
+        return;
+    }
+    AVPacket* copy = av_packet_clone(packet);
+    if (!copy) {
+        std::cerr << "Error: Failed to clone packet" << std::endl;
+        return;
+    }
+    ring.push_back(copy);
+    ringBytes += copy->size;
+    trimRing();
+}
+
+// GOP 単位で古いパケットを捨てる
+// 先頭 GOP を捨てても preSeconds 分残る場合、またはバイト上限を超えた場合に捨てる
+// 最新の (書き込み中の) GOP はバイト上限を超えても捨てない (プリトリガ映像が無くなるため)
+void SonarRecorder::trimRing() {
+    const double tb = av_q2d(codecCtx->time_base);
+    while (!ring.empty()) {
+        size_t next = 1;
+        while (next < ring.size() && !(ring[next]->flags & AV_PKT_FLAG_KEY)) {
+            ++next;
+        }
+
+        bool overBytes = ringBytes > preTriggerConfig.maxBufferBytes;
+        if (next == ring.size()) {
+            if (overBytes && !warnedSmallBuffer) {
+                std::cerr << "Warning: maxBufferBytes (" << preTriggerConfig.maxBufferBytes
+                          << ") is smaller than one GOP; keeping the GOP in progress"
+                          << std::endl;
+                warnedSmallBuffer = true;
+            }
+            break;
+        }
+        double remain = (ring.back()->dts - ring[next]->dts) * tb;
+        bool overTime = remain >= preTriggerConfig.preSeconds;
+        if (!overBytes && !overTime) {
+            break;
+        }
+
+        for (size_t i = 0; i < next; ++i) {
+            AVPacket* packet = ring.front();
+            ringBytes -= packet->size;
+            av_packet_free(&packet);
+            ring.pop_front();
+        }
+    }
+}
+
+void SonarRecorder::clearRing() {
+    for (AVPacket* packet : ring) {
+        av_packet_free(&packet);
+    }
+    ring.clear();
+    ringBytes = 0;
+}
+
+// リソース解放
+void SonarRecorder::cleanup() {
+    if (codecCtx) {
+        encodeFrame(nullptr);
+    }
+    closeOutput();
+    clearRing();
+    if (codecCtx) {
+        avcodec_free_context(&codecCtx);
+    }
+    if (pkt) {
+        av_packet_free(&pkt);
+    }
+}
@@ -0,0 +1,86 @@
+#if !defined(SONAR_RECORDER_HH)
+#define SONAR_RECORDER_HH
+
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <string>
+#include "AsyncFileWriter.hh"
+extern "C" {
+    #include <libavcodec/avcodec.h>
+    #include <libavformat/avformat.h>
+}
+
+// 現在時刻を取得し、ファイル名を生成
+std::string getTimestampedFilename(const std::string& extension = ".mkv");
+// UNIX 時刻 [us] を creation_time 用の ISO 8601 (UTC) 文字列にする
+std::string formatUtcTimestamp(int64_t timestampUs);
+
+// プリトリガ録画の設定
+// preSeconds 秒分のエンコード済みパケットを maxBufferBytes 以内でメモリに保持し、
+// trigger() 後は postSeconds 秒間録画を継続する
+struct PreTriggerConfig {
+    double preSeconds = 10.0;
+    size_t maxBufferBytes = 64 * 1024 * 1024;
+    double postSeconds = 10.0;
+};
+
+class SonarRecorder {
+public:
+    // 生成時から連続録画する (filename が空ならカレントディレクトリに日時の名前で作る)
+    SonarRecorder(int width, int height, int fps, bool is16bit,
+                  const AsyncFileWriterConfig& writerConfig = AsyncFileWriterConfig(),
+                  const std::string& filename = std::string());
+    // プリトリガモード: trigger() が呼ばれるまでファイルを開かない
+    SonarRecorder(int width, int height, int fps, bool is16bit, const PreTriggerConfig& config,
+                  const AsyncFileWriterConfig& writerConfig = AsyncFileWriterConfig());
+    ~SonarRecorder();
+    // timestampUs: 取得時刻 (UNIX 時刻 [us])。負なら現在時刻を使う
+    void recordFrame(const uint8_t* pImage, int64_t timestampUs = -1);
+
+    // バッファ内の直近のキーフレームから書き出しを開始する (録画中なら録画期間を延長)
+    void trigger();
+    bool isRecording() const;
+
+private:
+    int width, height, fps;
+    bool is16bit;
+    bool preTrigger = false;
+    PreTriggerConfig preTriggerConfig;
+    AsyncFileWriterConfig writerConfig;
+    std::string requestedFilename;
+    std::string filename;
+    std::unique_ptr<AsyncFileWriter> writer;
+    AVFormatContext* formatCtx = nullptr;
+    AVCodecContext* codecCtx = nullptr;
+    AVStream* stream = nullptr;
+    AVPacket* pkt = nullptr;
+    bool headerWritten = false;
+
+    // 取得時刻 [us] を time_base = 1/1000000 の pts にする
+    int64_t firstTimestampUs = -1;
+    int64_t lastPts = -1;
+
+    // プリトリガ用リングバッファ (codecCtx->time_base のパケット)
+    std::deque<AVPacket*> ring;
+    size_t ringBytes = 0;
+    bool warnedSmallBuffer = false;
+    int64_t tsOffset = 0;
+    int64_t postTriggerEndPts = 0;
+    bool forceKeyframe = false;
+
+    void initFFmpeg();
+    bool openOutput();
+    bool writeHeader();
+    void closeOutput();
+    void finishOutput();
+    void encodeFrame(AVFrame* frame);
+    void writePacket(AVPacket* packet);
+    void bufferPacket(AVPacket* packet);
+    void trimRing();
+    void clearRing();
+    void cleanup();
+};
+
+#endif // #if !defined(SONAR_RECORDER_HH)
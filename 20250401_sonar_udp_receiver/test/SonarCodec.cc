@@ -0,0 +1,302 @@
+#include "SonarCodec.hh"
+#include <algorithm>
+#include <cstring>
+
+#if defined(__x86_64__)
+#include <emmintrin.h>
+#endif
+#if defined(SONAR_HAVE_LZ4)
+#include <lz4.h>
+#endif
+
+namespace
+{
+// これより短い 0 の連続はリテラルに含めたほうが小さい
+constexpr size_t kMinRun = 16;
+
+uint64_t
+load64(const uint8_t* p)
+{
+    uint64_t v;
+    memcpy(&v, p, 8);
+    return v;
+}
+
+// i の 8 バイトが基準 (reference が無ければ 0) と同じか
+bool
+sameWord(const uint8_t* src, const uint8_t* ref, size_t i)
+{
+    return ref ? load64(src + i) == load64(ref + i) : load64(src + i) == 0;
+}
+
+bool
+sameByte(const uint8_t* src, const uint8_t* ref, size_t i)
+{
+    return src[i] == (ref ? ref[i] : 0);
+}
+
+// i から基準と同じバイトが続く間を読み飛ばす
+size_t
+skipRun(const uint8_t* src, const uint8_t* ref, size_t i, size_t n)
+{
+    while (i + 8 <= n && sameWord(src, ref, i))
+        i += 8;
+    while (i < n && sameByte(src, ref, i))
+        ++i;
+    return i;
+}
+
+// i からのリテラルの終わり (kMinRun 以上基準と同じバイトが続く位置) を探す
+size_t
+literalEnd(const uint8_t* src, const uint8_t* ref, size_t i, size_t n)
+{
+    while (i + kMinRun <= n)
+    {
+        if (sameWord(src, ref, i) && sameWord(src, ref, i + 8))
+        {
+            // 直前の同じバイトもランへ含める
+            while (sameByte(src, ref, i - 1))
+                --i;
+            return i;
+        }
+        i += 8;
+    }
+    return n;
+}
+
+uint8_t*
+putVarint(uint8_t* p, size_t v)
+{
+    while (v >= 0x80)
+    {
+        *p++ = uint8_t(v | 0x80);
+        v >>= 7;
+    }
+    *p++ = uint8_t(v);
+    return p;
+}
+
+bool
+getVarint(const uint8_t*& p, const uint8_t* end, size_t& v)
+{
+    v = 0;
+    for (int shift = 0; shift < 64 && p < end; shift += 7)
+    {
+        uint8_t b = *p++;
+        v |= size_t(b & 0x7f) << shift;
+        if (!(b & 0x80))
+            return true;
+    }
+    return false;
+}
+
+size_t
+zeroRleEncode(const uint8_t* src, size_t n, const uint8_t* ref, uint8_t* dst, size_t capacity)
+{
+    uint8_t* out = dst;
+    uint8_t* const end = dst + capacity;
+    size_t i = 0;
+    while (i < n)
+    {
+        size_t runStart = i;
+        i = skipRun(src, ref, i, n);
+        size_t run = i - runStart;
+        size_t literalStart = i;
+        i = i < n ? literalEnd(src, ref, i, n) : n;
+        size_t literals = i - literalStart;
+
+        // varint 2 つは最大 20 バイト
+        if (size_t(end - out) < 20 + literals)
+            return 0;
+        out = putVarint(out, run);
+        out = putVarint(out, literals);
+        if (ref)
+        {
+            for (size_t k = 0; k < literals; ++k)
+                out[k] = uint8_t(src[literalStart + k] - ref[literalStart + k]);
+        }
+        else
+        {
+            memcpy(out, src + literalStart, literals);
+        }
+        out += literals;
+    }
+    return size_t(out - dst);
+}
+
+bool
+zeroRleDecode(const uint8_t* src, size_t size, const uint8_t* ref, uint8_t* dst, size_t rawSize)
+{
+    const uint8_t* p = src;
+    const uint8_t* const end = src + size;
+    size_t o = 0;
+    while (o < rawSize)
+    {
+        size_t run, literals;
+        if (!getVarint(p, end, run) || !getVarint(p, end, literals) || run > rawSize - o ||
+            literals > rawSize - o - run || literals > size_t(end - p))
+            return false;
+        if (ref)
+            memcpy(dst + o, ref + o, run);
+        else
+            memset(dst + o, 0, run);
+        o += run;
+        if (ref)
+        {
+            for (size_t k = 0; k < literals; ++k)
+                dst[o + k] = uint8_t(p[k] + ref[o + k]);
+        }
+        else
+        {
+            memcpy(dst + o, p, literals);
+        }
+        o += literals;
+        p += literals;
+    }
+    return p == end;
+}
+} // namespace
+
+bool
+sonarCodecAvailable(SonarCodec codec)
+{
+    switch (codec)
+    {
+    case kSonarCodecRaw:
+    case kSonarCodecZeroRle:
+    case kSonarCodecDeltaRle:
+        return true;
+    case kSonarCodecLz4:
+#if defined(SONAR_HAVE_LZ4)
+        return true;
+#else
+        return false;
+#endif
+    }
+    return false;
+}
+
+const char*
+sonarCodecName(SonarCodec codec)
+{
+    switch (codec)
+    {
+    case kSonarCodecRaw:
+        return "raw";
+    case kSonarCodecLz4:
+        return "lz4";
+    case kSonarCodecZeroRle:
+        return "rle";
+    case kSonarCodecDeltaRle:
+        return "delta";
+    }
+    return "unknown";
+}
+
+size_t
+sonarEncodePixels(SonarCodec codec, const uint8_t* src, size_t size, const uint8_t* reference,
+                  uint8_t* dst, size_t dstCapacity)
+{
+    switch (codec)
+    {
+    case kSonarCodecRaw:
+        if (size > dstCapacity)
+            return 0;
+        memcpy(dst, src, size);
+        return size;
+    case kSonarCodecZeroRle:
+        return zeroRleEncode(src, size, nullptr, dst, dstCapacity);
+    case kSonarCodecDeltaRle:
+        return reference ? zeroRleEncode(src, size, reference, dst, dstCapacity) : 0;
+    case kSonarCodecLz4:
+#if defined(SONAR_HAVE_LZ4)
+        if (size > size_t(LZ4_MAX_INPUT_SIZE))
+            return 0;
+        return size_t(std::max(0, LZ4_compress_default(reinterpret_cast<const char*>(src),
+                                                       reinterpret_cast<char*>(dst), int(size),
+                                                       int(std::min<size_t>(dstCapacity,
+                                                                            0x7fffffff)))));
+#else
+        return 0;
+#endif
+    }
+    return 0;
+}
+
+bool
+sonarDecodePixels(SonarCodec codec, const uint8_t* src, size_t size, const uint8_t* reference,
+                  uint8_t* dst, size_t rawSize)
+{
+    switch (codec)
+    {
+    case kSonarCodecRaw:
+        if (size != rawSize)
+            return false;
+        memcpy(dst, src, size);
+        return true;
+    case kSonarCodecZeroRle:
+        return zeroRleDecode(src, size, nullptr, dst, rawSize);
+    case kSonarCodecDeltaRle:
+        return reference && zeroRleDecode(src, size, reference, dst, rawSize);
+    case kSonarCodecLz4:
+#if defined(SONAR_HAVE_LZ4)
+        if (size > 0x7fffffff || rawSize > 0x7fffffff)
+            return false;
+        return LZ4_decompress_safe(reinterpret_cast<const char*>(src),
+                                   reinterpret_cast<char*>(dst), int(size),
+                                   int(rawSize)) == int(rawSize);
+#else
+        return false;
+#endif
+    }
+    return false;
+}
+
+void
+sonarNoiseFloor(const uint8_t* src, uint8_t* dst, size_t size, bool is16bit, int floor)
+{
+    if (floor <= 0)
+    {
+        if (dst != src)
+            memmove(dst, src, size);
+        return;
+    }
+    size_t i = 0;
+#if defined(__x86_64__)
+    // floor - x (飽和減算) が 0 なら x >= floor
+    const __m128i zero = _mm_setzero_si128();
+    if (is16bit)
+    {
+        const __m128i f = _mm_set1_epi16(short(std::min(floor, 0xffff)));
+        for (; i + 16 <= size; i += 16)
+        {
+            __m128i x = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + i));
+            __m128i keep = _mm_cmpeq_epi16(_mm_subs_epu16(f, x), zero);
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + i), _mm_and_si128(x, keep));
+        }
+    }
+    else
+    {
+        const __m128i f = _mm_set1_epi8(char(std::min(floor, 0xff)));
+        for (; i + 16 <= size; i += 16)
+        {
+            __m128i x = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + i));
+            __m128i keep = _mm_cmpeq_epi8(_mm_subs_epu8(f, x), zero);
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + i), _mm_and_si128(x, keep));
+        }
+    }
+#endif
+    if (is16bit)
+    {
+        for (; i + 2 <= size; i += 2)
+        {
+            uint16_t x;
+            memcpy(&x, src + i, 2);
+            if (x < floor)
+                x = 0;
+            memcpy(dst + i, &x, 2);
+        }
+    }
+    for (; i < size; ++i)
+        dst[i] = src[i] < floor ? 0 : src[i];
+}
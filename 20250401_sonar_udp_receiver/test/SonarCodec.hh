@@ -0,0 +1,32 @@
+#if !defined(SONAR_CODEC_HH)
+#define SONAR_CODEC_HH
+
+#include "SonarProtocol.hh"
+#include <cstddef>
+#include <cstdint>
+
+// 画素の圧縮・展開 (送信側・受信側で共用, 方式は SonarProtocol.hh の SonarCodec)
+//
+// ZeroRle: [varint 0 の数][varint リテラル数][リテラル] の繰り返し
+//   ソナー画像の大半を占める水柱の 0 を 8 バイト単位で読み飛ばす
+// DeltaRle: 基準フレームと同じ画素を「0」として ZeroRle で表し、リテラルは差分 (mod 256)
+//   展開は基準フレームからのコピーと加算だけで済む
+
+// このビルドで使える方式か (LZ4 は SONAR_HAVE_LZ4 の場合のみ)
+bool sonarCodecAvailable(SonarCodec codec);
+const char* sonarCodecName(SonarCodec codec);
+
+// src (size バイト) を dst に圧縮して長さを返す。dstCapacity に収まらなければ 0
+// DeltaRle では reference (同じ大きさの基準フレームの画素) が必要
+size_t sonarEncodePixels(SonarCodec codec, const uint8_t* src, size_t size,
+                         const uint8_t* reference, uint8_t* dst, size_t dstCapacity);
+
+// src (size バイト) を dst へちょうど rawSize バイトに展開する。壊れていれば false
+bool sonarDecodePixels(SonarCodec codec, const uint8_t* src, size_t size,
+                       const uint8_t* reference, uint8_t* dst, size_t rawSize);
+
+// floor 未満の画素を 0 にして dst へ書く (非可逆, 水柱の雑音を 0 の連続にする)
+// is16bit なら 2 バイト (ホストのバイトオーダ) 単位で比べる。src == dst でもよい
+void sonarNoiseFloor(const uint8_t* src, uint8_t* dst, size_t size, bool is16bit, int floor);
+
+#endif // !defined(SONAR_CODEC_HH)
@@ -0,0 +1,83 @@
+#include "SonarFrame.hh"
+#include <cstdlib>
+
+namespace
+{
+uint16_t
+readBe16(const uint8_t* p)
+{
+    return uint16_t((p[0] << 8) | p[1]);
+}
+
+uint32_t
+readBe32(const uint8_t* p)
+{
+    return (uint32_t(p[0]) << 24) | (uint32_t(p[1]) << 16) | (uint32_t(p[2]) << 8) | p[3];
+}
+} // namespace
+
+bool
+SonarFrame::parseImageHeader()
+{
+    if (size < kSonarImageHeaderSize)
+        return false;
+    width = readBe16(mData);
+    height = readBe16(mData + 2);
+    swath = readBe16(mData + 4);
+    range = readBe16(mData + 6);
+    is16bit = readBe32(mData + 8) == 1;
+    return size >= kSonarImageHeaderSize + size_t(width) * height * (is16bit ? 2 : 1);
+}
+
+// explicit
+SonarFramePool::SonarFramePool(size_t frameCapacity, int frameCount)
+    : mStorage(std::make_shared<Storage>()), mFrameCapacity(frameCapacity)
+{
+    mStorage->frames.resize(frameCount);
+    for (SonarFrame& frame : mStorage->frames)
+    {
+        void* p = nullptr;
+        if (posix_memalign(&p, 64, frameCapacity) != 0)
+            break;
+        frame.mData = static_cast<uint8_t*>(p);
+        frame.mCapacity = frameCapacity;
+        mStorage->buffers.push_back(frame.mData);
+        mStorage->free.push_back(&frame);
+    }
+}
+
+// virtual
+SonarFramePool::~SonarFramePool()
+{
+}
+
+SonarFramePool::Storage::~Storage()
+{
+    for (uint8_t* p : buffers)
+        ::free(p);
+}
+
+SonarFramePtr
+SonarFramePool::acquire()
+{
+    SonarFrame* frame = nullptr;
+    {
+        std::lock_guard<std::mutex> lock(mStorage->mutex);
+        if (mStorage->free.empty())
+            return nullptr;
+        frame = mStorage->free.back();
+        mStorage->free.pop_back();
+    }
+    frame->size = 0;
+    std::shared_ptr<Storage> storage = mStorage;
+    return SonarFramePtr(frame, [storage](SonarFrame* f) {
+        std::lock_guard<std::mutex> lock(storage->mutex);
+        storage->free.push_back(f);
+    });
+}
+
+size_t
+SonarFramePool::frameCapacity() const
+{
+    return mFrameCapacity;
+}
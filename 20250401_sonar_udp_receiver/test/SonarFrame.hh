@@ -0,0 +1,79 @@
+#if !defined(SONAR_FRAME_HH)
+#define SONAR_FRAME_HH
+
+#include "SonarProtocol.hh"
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+// 再構築済みのソナーフレーム
+// data() は送信されたペイロード全体 (画像ヘッダ + 画素) を保持する
+class SonarFrame
+{
+public:
+    uint8_t* data() { return mData; }
+    const uint8_t* data() const { return mData; }
+    size_t capacity() const { return mCapacity; }
+
+    // 画素 (画像ヘッダの直後)
+    const uint8_t* pixels() const { return mData + kSonarImageHeaderSize; }
+    size_t pixelBytes() const { return size - kSonarImageHeaderSize; }
+
+    // ペイロード先頭の画像ヘッダを解析して width 等を設定する
+    bool parseImageHeader();
+
+    size_t size{0};
+    int width{0};
+    int height{0};
+    int swath{0};
+    int range{0};
+    bool is16bit{false};
+
+    // 送信元 (IPv4 アドレスとポート, ネットワークバイトオーダ。共有メモリ経由なら 0)
+    uint32_t sourceAddress{0};
+    uint16_t sourcePort{0};
+
+    // チャンクヘッダから
+    uint16_t streamId{0};
+    uint32_t frameId{0};
+    uint64_t timestampUs{0};
+
+private:
+    friend class SonarFramePool;
+    uint8_t* mData{nullptr};
+    size_t mCapacity{0};
+};
+
+using SonarFramePtr = std::shared_ptr<SonarFrame>;
+
+// 固定サイズのフレームバッファを使い回すプール
+// 取得したフレームは参照が無くなるとプールへ戻る (プールより長生きしてもよい)
+class SonarFramePool
+{
+public:
+    SonarFramePool(size_t frameCapacity, int frameCount);
+    virtual ~SonarFramePool();
+
+    SonarFramePool(const SonarFramePool&) = delete;
+    SonarFramePool& operator=(const SonarFramePool&) = delete;
+
+    // 空きが無ければ nullptr
+    SonarFramePtr acquire();
+    size_t frameCapacity() const;
+
+private:
+    struct Storage
+    {
+        std::mutex mutex;
+        std::vector<SonarFrame*> free;
+        std::vector<SonarFrame> frames;
+        std::vector<uint8_t*> buffers;
+        ~Storage();
+    };
+    std::shared_ptr<Storage> mStorage;
+    size_t mFrameCapacity;
+};
+
+#endif // !defined(SONAR_FRAME_HH)
@@ -0,0 +1,39 @@
+#include "SonarFrameMailbox.hh"
+
+bool
+SonarFrameMailbox::put(const SonarFramePtr& frame)
+{
+    SonarFramePtr replaced;
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        replaced = std::move(mPending);
+        mPending = frame;
+        if (replaced)
+            ++mDropped;
+    }
+    // 上書きしたフレームはロックの外でプールへ戻す
+    return !replaced;
+}
+
+SonarFramePtr
+SonarFrameMailbox::take()
+{
+    std::lock_guard<std::mutex> lock(mMutex);
+    if (mPending)
+        ++mDelivered;
+    return std::move(mPending);
+}
+
+uint64_t
+SonarFrameMailbox::deliveredFrames() const
+{
+    std::lock_guard<std::mutex> lock(mMutex);
+    return mDelivered;
+}
+
+uint64_t
+SonarFrameMailbox::droppedFrames() const
+{
+    std::lock_guard<std::mutex> lock(mMutex);
+    return mDropped;
+}
@@ -0,0 +1,33 @@
+#if !defined(SONAR_FRAME_MAILBOX_HH)
+#define SONAR_FRAME_MAILBOX_HH
+
+#include "SonarFrame.hh"
+#include <cstdint>
+#include <mutex>
+
+// 最新のフレームだけを受け渡すメールボックス (受信スレッド → 表示スレッド)
+//
+// 書き込み側は未取得のフレームを上書きし、読み出し側は次の描画で最新の 1 つだけを取る
+// 上書きされたフレームはすぐにプールへ戻り、捨てた数として数える
+// 保持するのは高々 1 フレームなので、表示が受信より遅くても遅延とメモリは増えない
+// (受信側が組み立て中 / メールボックス / 表示中 の 3 つのバッファで回る triple buffer)
+class SonarFrameMailbox
+{
+public:
+    // 任意のスレッドから呼べる。空だったら true (読み出し側へ知らせる必要がある)
+    bool put(const SonarFramePtr& frame);
+    // 未取得のフレームを取り出す (無ければ nullptr)
+    SonarFramePtr take();
+
+    uint64_t deliveredFrames() const;
+    // 取り出される前に上書きされたフレーム数
+    uint64_t droppedFrames() const;
+
+private:
+    mutable std::mutex mMutex;
+    SonarFramePtr mPending;
+    uint64_t mDelivered{0};
+    uint64_t mDropped{0};
+};
+
+#endif // !defined(SONAR_FRAME_MAILBOX_HH)
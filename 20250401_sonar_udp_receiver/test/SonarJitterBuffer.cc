@@ -0,0 +1,144 @@
+#include "SonarJitterBuffer.hh"
+#include <algorithm>
+#include <cmath>
+#include <ctime>
+
+// explicit
+SonarJitterBuffer::SonarJitterBuffer(const SonarJitterBufferConfig& config)
+    : mConfig(config),
+      mLatencyUs(double(std::min(config.targetLatencyUs, config.maxLatencyUs)))
+{
+    mFrames.reserve(mConfig.maxFrames + 1);
+}
+
+// virtual
+SonarJitterBuffer::~SonarJitterBuffer()
+{
+}
+
+// static
+int64_t
+SonarJitterBuffer::nowUs()
+{
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return int64_t(ts.tv_sec) * 1000000 + ts.tv_nsec / 1000;
+}
+
+void
+SonarJitterBuffer::push(const SonarFramePtr& frame, int64_t arrivalUs)
+{
+    if (mHaveReleased && frame->timestampUs <= mLastReleasedTimestampUs)
+    {
+        // 送信側の時計が大きく戻った場合は作り直す
+        if (int64_t(mLastReleasedTimestampUs - frame->timestampUs) > mConfig.maxLatencyUs)
+        {
+            mHaveReleased = false;
+            mHaveTransit = false;
+        }
+        else
+        {
+            ++mStats.lateFrames;
+            return;
+        }
+    }
+
+    updateJitter(arrivalUs - int64_t(frame->timestampUs));
+
+    auto it = std::upper_bound(mFrames.begin(), mFrames.end(), frame,
+                               [](const SonarFramePtr& a, const SonarFramePtr& b) {
+                                   return a->timestampUs < b->timestampUs;
+                               });
+    mFrames.insert(it, frame);
+    if (mFrames.size() > mConfig.maxFrames)
+    {
+        mFrames.erase(mFrames.begin());
+        ++mStats.overflowFrames;
+    }
+}
+
+SonarFramePtr
+SonarJitterBuffer::pop(int64_t nowUs)
+{
+    if (mFrames.empty() || releaseTimeUs(mFrames.front()) > nowUs)
+        return nullptr;
+    SonarFramePtr frame = std::move(mFrames.front());
+    mFrames.erase(mFrames.begin());
+    mHaveReleased = true;
+    mLastReleasedTimestampUs = frame->timestampUs;
+    ++mStats.releasedFrames;
+    return frame;
+}
+
+int64_t
+SonarJitterBuffer::nextReleaseUs() const
+{
+    return mFrames.empty() ? -1 : releaseTimeUs(mFrames.front());
+}
+
+bool
+SonarJitterBuffer::empty() const
+{
+    return mFrames.empty();
+}
+
+int64_t
+SonarJitterBuffer::latencyUs() const
+{
+    return int64_t(mLatencyUs);
+}
+
+int64_t
+SonarJitterBuffer::jitterUs() const
+{
+    return int64_t(mJitterUs);
+}
+
+const SonarJitterBufferStats&
+SonarJitterBuffer::stats() const
+{
+    return mStats;
+}
+
+// 最小伝送時間 <= 伝送時間 なので、到着から maxLatencyUs より長く留まることはない
+int64_t
+SonarJitterBuffer::releaseTimeUs(const SonarFramePtr& frame) const
+{
+    return int64_t(frame->timestampUs) + mMinTransitUs + int64_t(mLatencyUs);
+}
+
+void
+SonarJitterBuffer::updateJitter(int64_t transitUs)
+{
+    if (!mHaveTransit)
+    {
+        mHaveTransit = true;
+        mLastTransitUs = transitUs;
+        mMinTransitUs = transitUs;
+        mWindowMinTransitUs = transitUs;
+        mWindowFrames = 0;
+        return;
+    }
+
+    // RFC 3550 の到着間ジッタ
+    double d = std::fabs(double(transitUs - mLastTransitUs));
+    mLastTransitUs = transitUs;
+    mJitterUs += (d - mJitterUs) / 16.0;
+
+    mMinTransitUs = std::min(mMinTransitUs, transitUs);
+    mWindowMinTransitUs = std::min(mWindowMinTransitUs, transitUs);
+    if (++mWindowFrames >= kTransitWindowFrames)
+    {
+        mMinTransitUs = mWindowMinTransitUs;
+        mWindowMinTransitUs = transitUs;
+        mWindowFrames = 0;
+    }
+
+    if (mConfig.adaptive)
+    {
+        double desired = std::min(std::max(mJitterUs * mConfig.jitterMultiplier,
+                                           double(mConfig.targetLatencyUs)),
+                                  double(mConfig.maxLatencyUs));
+        mLatencyUs += (desired - mLatencyUs) / 16.0;
+    }
+}
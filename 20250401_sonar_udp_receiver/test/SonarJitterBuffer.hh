@@ -0,0 +1,72 @@
+#if !defined(SONAR_JITTER_BUFFER_HH)
+#define SONAR_JITTER_BUFFER_HH
+
+#include "SonarFrame.hh"
+#include <cstdint>
+#include <vector>
+
+// ジッタバッファの設定
+struct SonarJitterBufferConfig
+{
+    int64_t targetLatencyUs{0};     // 目標遅延 (adaptive でなければ固定)。0 で無効
+    int64_t maxLatencyUs{500000};
+    bool adaptive{true};            // ジッタが大きければ遅延を maxLatencyUs まで延ばす
+    double jitterMultiplier{4.0};   // 遅延 = ジッタ推定値 * jitterMultiplier
+    size_t maxFrames{8};            // 保持する最大フレーム数 (超えたら古いものを捨てる)
+};
+
+// ジッタバッファの集計
+struct SonarJitterBufferStats
+{
+    uint64_t releasedFrames{0};
+    uint64_t lateFrames{0};       // 後のフレームを既に出した後に届いたフレーム
+    uint64_t overflowFrames{0};   // maxFrames を超えて捨てたフレーム
+};
+
+// 再構築したフレームを送信時刻の順に、一定の遅延で取り出すバッファ
+//
+// 再生時刻 = 送信時刻 + 最小伝送時間 (時計の差を含む) + 遅延
+// 遅延は RFC 3550 と同じジッタ推定値から決め、急に変わらないよう平滑化する
+// 時刻は全て CLOCK_MONOTONIC [us] (送信時刻だけは送信側の時計)
+class SonarJitterBuffer
+{
+public:
+    explicit SonarJitterBuffer(const SonarJitterBufferConfig& config);
+    virtual ~SonarJitterBuffer();
+
+    static int64_t nowUs();
+
+    void push(const SonarFramePtr& frame, int64_t arrivalUs);
+    // 再生時刻を過ぎた最も古いフレーム (無ければ nullptr)
+    SonarFramePtr pop(int64_t nowUs);
+    // 次のフレームの再生時刻 (空なら -1)
+    int64_t nextReleaseUs() const;
+
+    bool empty() const;
+    int64_t latencyUs() const;
+    int64_t jitterUs() const;
+    const SonarJitterBufferStats& stats() const;
+
+private:
+    int64_t releaseTimeUs(const SonarFramePtr& frame) const;
+    void updateJitter(int64_t transitUs);
+
+    SonarJitterBufferConfig mConfig;
+    std::vector<SonarFramePtr> mFrames; // timestampUs の昇順
+    double mLatencyUs;
+    double mJitterUs{0.0};
+
+    // 最小伝送時間は一定数毎に区切った窓で取り、時計のずれに追従する
+    static constexpr int kTransitWindowFrames = 256;
+    bool mHaveTransit{false};
+    int64_t mLastTransitUs{0};
+    int64_t mMinTransitUs{0};
+    int64_t mWindowMinTransitUs{0};
+    int mWindowFrames{0};
+
+    bool mHaveReleased{false};
+    uint64_t mLastReleasedTimestampUs{0};
+    SonarJitterBufferStats mStats;
+};
+
+#endif // !defined(SONAR_JITTER_BUFFER_HH)
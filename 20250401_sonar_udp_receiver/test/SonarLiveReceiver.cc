@@ -0,0 +1,259 @@
+#include "SonarLiveReceiver.hh"
+#include "SonarShmRing.hh"
+#include <arpa/inet.h>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <poll.h>
+
+namespace
+{
+// 1024x1024 16bit まで
+constexpr size_t kMaxFrameBytes = kSonarImageHeaderSize + 1024 * 1024 * 2;
+constexpr uint16_t kDefaultPort = 5700;
+// 停止要求を確認する間隔 (この間に届かなければ不完全なフレームを捨てる)
+constexpr int kPollMs = 100;
+
+bool
+isMulticast(const std::string& address)
+{
+    in_addr in;
+    return inet_pton(AF_INET, address.c_str(), &in) == 1 && IN_MULTICAST(ntohl(in.s_addr));
+}
+} // namespace
+
+SonarLiveReceiver::SonarLiveReceiver(int heldFrames, FrameCallback onFrame)
+    : mHeldFrames(heldFrames), mOnFrame(std::move(onFrame))
+{
+}
+
+// virtual
+SonarLiveReceiver::~SonarLiveReceiver()
+{
+    close();
+}
+
+// static
+bool
+SonarLiveReceiver::isLiveUri(const std::string& uri)
+{
+    return uri.compare(0, 6, "udp://") == 0 || uri.compare(0, 6, "shm://") == 0;
+}
+
+bool
+SonarLiveReceiver::open(const std::string& uri)
+{
+    close();
+    if (!parse(uri))
+    {
+        std::cerr << "Error: Invalid source " << uri << std::endl;
+        return false;
+    }
+    mStopping = false;
+    mReceived = 0;
+    mLocked = false;
+
+    if (mIsShm)
+    {
+        // 書き込み側がまだ無くても開始する (SonarShmReader が開き直す)
+        mThread = std::thread(&SonarLiveReceiver::runShm, this);
+        return true;
+    }
+
+    mReceiver.reset(new SonarUdpReceiver(mUdpConfig));
+    if (!mReceiver->isOpen())
+    {
+        mReceiver.reset();
+        return false;
+    }
+    SonarReassemblerConfig config;
+    // 組み立て中のフレームと差分圧縮の基準フレーム、予備と展開先の 2 つに加えて利用側が持つ分
+    mPool.reset(new SonarFramePool((kMaxFrameBytes + config.maxPayload - 1) / config.maxPayload *
+                                       config.maxPayload,
+                                   config.maxStreams * (config.maxFramesInFlight + 1) + 2 +
+                                       mHeldFrames));
+    mReassembler.reset(new SonarReassembler(*mPool, config,
+                                            [this](const SonarFramePtr& frame) { accept(frame); }));
+    mThread = std::thread(&SonarLiveReceiver::runUdp, this);
+    return true;
+}
+
+void
+SonarLiveReceiver::close()
+{
+    mStopping = true;
+    if (mThread.joinable())
+        mThread.join();
+    mReassembler.reset();
+    mPool.reset();
+    mReceiver.reset();
+}
+
+bool
+SonarLiveReceiver::isOpen() const
+{
+    return mThread.joinable();
+}
+
+uint64_t
+SonarLiveReceiver::receivedFrames() const
+{
+    return mReceived;
+}
+
+bool
+SonarLiveReceiver::parse(const std::string& uri)
+{
+    if (!isLiveUri(uri))
+        return false;
+    mIsShm = uri.compare(0, 6, "shm://") == 0;
+    std::string location = uri.substr(6);
+    std::string query;
+    size_t q = location.find('?');
+    if (q != std::string::npos)
+    {
+        query = location.substr(q + 1);
+        location.erase(q);
+    }
+
+    mUdpConfig = SonarUdpReceiverConfig();
+    mStreamId = -1;
+    size_t begin = 0;
+    while (begin < query.size())
+    {
+        size_t end = query.find('&', begin);
+        if (end == std::string::npos)
+            end = query.size();
+        const std::string item = query.substr(begin, end - begin);
+        begin = end + 1;
+        const size_t eq = item.find('=');
+        const std::string key = item.substr(0, eq);
+        const std::string value = eq == std::string::npos ? std::string() : item.substr(eq + 1);
+        if (key == "stream")
+            mStreamId = atoi(value.c_str());
+        else if (key == "iface" && !mIsShm)
+            mUdpConfig.multicastInterface = value;
+        else if (key == "source" && !mIsShm)
+            mUdpConfig.multicastSource = value;
+        else
+        {
+            std::cerr << "Error: Unknown option '" << key << "' in " << uri << std::endl;
+            return false;
+        }
+    }
+
+    if (mIsShm)
+    {
+        mShmName = location;
+        return !mShmName.empty();
+    }
+
+    // [ADDRESS][:PORT]
+    std::string address = location;
+    uint16_t port = kDefaultPort;
+    size_t colon = location.rfind(':');
+    if (colon != std::string::npos)
+    {
+        address = location.substr(0, colon);
+        port = uint16_t(atoi(location.c_str() + colon + 1));
+    }
+    if (address.empty())
+        address = "0.0.0.0";
+    if (isMulticast(address))
+    {
+        mUdpConfig.multicastGroup = address;
+        mUdpConfig.bindAddress = "0.0.0.0";
+    }
+    else
+    {
+        mUdpConfig.bindAddress = address;
+    }
+    mUdpConfig.port = port;
+    return port != 0;
+}
+
+void
+SonarLiveReceiver::runUdp()
+{
+    pollfd p;
+    p.fd = mReceiver->fd();
+    p.events = POLLIN;
+    while (!mStopping)
+    {
+        p.revents = 0;
+        if (poll(&p, 1, kPollMs) <= 0)
+        {
+            mReassembler->expire();
+            continue;
+        }
+        int n;
+        do
+        {
+            mReassembler->prepare(*mReceiver);
+            n = mReceiver->receiveBatch();
+            if (n > 0)
+                mReassembler->process(*mReceiver, n);
+        } while (n == mReceiver->batchSize());
+    }
+}
+
+void
+SonarLiveReceiver::runShm()
+{
+    // 届いた順に全て読む (最新だけを残すかどうかは利用側が決める)
+    SonarShmReader reader(mShmName);
+    // 書き込み中と利用側が持つ分
+    SonarFramePool pool(kMaxFrameBytes, 1 + mHeldFrames);
+    uint64_t reportedDropped = 0;
+    while (!mStopping)
+    {
+        if (!reader.wait(int64_t(kPollMs) * 1000))
+            continue;
+        SonarShmFrame shm;
+        while (!mStopping && reader.tryRead(shm))
+        {
+            // 上書きされる前にコピーする
+            SonarFramePtr frame = pool.acquire();
+            if (!frame || shm.size > frame->capacity())
+                continue;
+            memcpy(frame->data(), shm.data, shm.size);
+            if (!reader.isValid(shm))
+                continue;
+            frame->size = shm.size;
+            frame->streamId = shm.streamId;
+            frame->frameId = shm.frameId;
+            frame->timestampUs = shm.timestampUs;
+            if (frame->parseImageHeader())
+                accept(frame);
+        }
+        if (reader.droppedFrames() != reportedDropped)
+        {
+            reportedDropped = reader.droppedFrames();
+            std::cerr << "Warning: shm: " << reportedDropped
+                      << " frames overwritten before being read" << std::endl;
+        }
+    }
+}
+
+// 扱うストリームのフレームだけを通知する (受信スレッド)
+void
+SonarLiveReceiver::accept(const SonarFramePtr& frame)
+{
+    const SonarStreamKey key = SonarStreamKey::of(*frame);
+    if (mStreamId >= 0)
+    {
+        if (frame->streamId != mStreamId)
+            return;
+    }
+    else if (!mLocked)
+    {
+        mKey = key;
+        mLocked = true;
+    }
+    else if (!(key == mKey))
+    {
+        return;
+    }
+    ++mReceived;
+    mOnFrame(frame);
+}
@@ -0,0 +1,72 @@
+#if !defined(SONAR_LIVE_RECEIVER_HH)
+#define SONAR_LIVE_RECEIVER_HH
+
+#include "SonarFrame.hh"
+#include "SonarReassembler.hh"
+#include "SonarUdpReceiver.hh"
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <string>
+#include <thread>
+
+// ライブ入力 (UDP / 共有メモリ) を専用のスレッドで受信し、1 ストリームのフレームを通知する
+// (プレイヤーの SonarLiveSource と ROS ブリッジの SonarFrameSource が共有する)
+//
+// URI
+//   udp://[ADDRESS][:PORT][?stream=N&iface=IFACE&source=ADDRESS]
+//     ADDRESS がマルチキャストのアドレスならそのグループに参加する (省略時は 0.0.0.0:5700)
+//   shm://NAME[?stream=N]
+//     同一ホストの送信側が書く共有メモリのリング (SonarShmRing)
+// 扱うのは 1 ストリームだけ。stream を省略すると最初に届いたストリームにする
+//
+// フレームは届いた順に受信スレッドから通知する
+// 通知されたフレームはプールのバッファなので、利用側が持ち続ける数を heldFrames で指定する
+class SonarLiveReceiver
+{
+public:
+    using FrameCallback = std::function<void(const SonarFramePtr&)>;
+
+    SonarLiveReceiver(int heldFrames, FrameCallback onFrame);
+    virtual ~SonarLiveReceiver();
+
+    SonarLiveReceiver(const SonarLiveReceiver&) = delete;
+    SonarLiveReceiver& operator=(const SonarLiveReceiver&) = delete;
+
+    static bool isLiveUri(const std::string& uri);
+
+    // 受信スレッドを開始する (URI が不正か UDP ソケットを開けなければ false)
+    bool open(const std::string& uri);
+    void close();
+    bool isOpen() const;
+
+    // 通知したフレーム数
+    uint64_t receivedFrames() const;
+
+private:
+    bool parse(const std::string& uri);
+    void runUdp();
+    void runShm();
+    void accept(const SonarFramePtr& frame);
+
+    const int mHeldFrames;
+    const FrameCallback mOnFrame;
+    std::thread mThread;
+    std::atomic<bool> mStopping{false};
+    std::atomic<uint64_t> mReceived{0};
+
+    bool mIsShm{false};
+    std::string mShmName;
+    SonarUdpReceiverConfig mUdpConfig;
+    // 扱うストリーム (-1: 最初に届いたもの)
+    int mStreamId{-1};
+    bool mLocked{false};
+    SonarStreamKey mKey;
+
+    std::unique_ptr<SonarUdpReceiver> mReceiver;
+    std::unique_ptr<SonarFramePool> mPool;
+    std::unique_ptr<SonarReassembler> mReassembler;
+};
+
+#endif // !defined(SONAR_LIVE_RECEIVER_HH)
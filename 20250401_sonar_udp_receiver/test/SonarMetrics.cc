@@ -0,0 +1,201 @@
+#include "SonarMetrics.hh"
+#include <algorithm>
+#include <arpa/inet.h>
+#include <cstdio>
+#include <ctime>
+#include <sstream>
+
+namespace
+{
+int
+bucketOf(uint64_t value)
+{
+    if (value == 0)
+        return 0;
+    int bucket = 64 - __builtin_clzll(value);
+    return std::min(bucket, SonarHistogram::kBuckets - 1);
+}
+
+void
+writeHistogram(std::ostream& out, const char* name, const SonarHistogram& histogram)
+{
+    const SonarHistogram::Snapshot s = histogram.snapshot();
+    out << "\"" << name << "\": {\"count\": " << s.count << ", \"mean\": " << s.mean()
+        << ", \"p50\": " << s.percentile(0.5) << ", \"p90\": " << s.percentile(0.9)
+        << ", \"p99\": " << s.percentile(0.99) << ", \"max\": " << s.max << ", \"buckets\": [";
+    // 末尾の空のバケットは省く
+    int last = SonarHistogram::kBuckets;
+    while (last > 0 && s.buckets[last - 1] == 0)
+        --last;
+    for (int i = 0; i < last; ++i)
+        out << (i ? ", " : "") << s.buckets[i];
+    out << "]}";
+}
+} // namespace
+
+void
+SonarHistogram::record(uint64_t value)
+{
+    ++mBuckets[bucketOf(value)];
+    ++mCount;
+    mSum += value;
+    mMax.raise(value);
+}
+
+SonarHistogram::Snapshot
+SonarHistogram::snapshot() const
+{
+    Snapshot s;
+    for (int i = 0; i < kBuckets; ++i)
+        s.buckets[i] = mBuckets[i].value();
+    s.count = mCount.value();
+    s.sum = mSum.value();
+    s.max = mMax.value();
+    return s;
+}
+
+double
+SonarHistogram::Snapshot::mean() const
+{
+    return count ? double(sum) / double(count) : 0.0;
+}
+
+uint64_t
+SonarHistogram::Snapshot::percentile(double q) const
+{
+    uint64_t total = 0;
+    for (int i = 0; i < kBuckets; ++i)
+        total += buckets[i];
+    if (total == 0)
+        return 0;
+    const uint64_t rank = std::max<uint64_t>(1, uint64_t(q * double(total) + 0.5));
+    uint64_t seen = 0;
+    for (int i = 0; i < kBuckets; ++i)
+    {
+        seen += buckets[i];
+        if (seen >= rank)
+        {
+            uint64_t upper = i == 0 ? 0 : (uint64_t(1) << i) - 1;
+            return std::min(upper, max);
+        }
+    }
+    return max;
+}
+
+std::shared_ptr<SonarStreamMetrics>
+SonarMetricsRegistry::addStream(uint32_t address, uint16_t port, uint16_t streamId)
+{
+    std::shared_ptr<SonarStreamMetrics> metrics = std::make_shared<SonarStreamMetrics>();
+    metrics->address = address;
+    metrics->port = port;
+    metrics->streamId = streamId;
+    std::lock_guard<std::mutex> lock(mMutex);
+    mStreams.push_back(metrics);
+    return metrics;
+}
+
+void
+SonarMetricsRegistry::removeStream(const std::shared_ptr<SonarStreamMetrics>& metrics)
+{
+    std::lock_guard<std::mutex> lock(mMutex);
+    mStreams.erase(std::remove(mStreams.begin(), mStreams.end(), metrics), mStreams.end());
+}
+
+std::shared_ptr<SonarSocketMetrics>
+SonarMetricsRegistry::addSocket(int shard)
+{
+    std::shared_ptr<SonarSocketMetrics> metrics = std::make_shared<SonarSocketMetrics>();
+    metrics->shard = shard;
+    std::lock_guard<std::mutex> lock(mMutex);
+    mSockets.push_back(metrics);
+    return metrics;
+}
+
+std::vector<std::shared_ptr<const SonarStreamMetrics>>
+SonarMetricsRegistry::streams() const
+{
+    std::lock_guard<std::mutex> lock(mMutex);
+    return std::vector<std::shared_ptr<const SonarStreamMetrics>>(mStreams.begin(),
+                                                                  mStreams.end());
+}
+
+std::vector<std::shared_ptr<const SonarSocketMetrics>>
+SonarMetricsRegistry::sockets() const
+{
+    std::lock_guard<std::mutex> lock(mMutex);
+    return std::vector<std::shared_ptr<const SonarSocketMetrics>>(mSockets.begin(),
+                                                                  mSockets.end());
+}
+
+std::string
+SonarMetricsRegistry::toJson() const
+{
+    // 値を読む間は登録を止めない (shared_ptr を持っているので削除されても読める)
+    const std::vector<std::shared_ptr<const SonarSocketMetrics>> socketList = sockets();
+    const std::vector<std::shared_ptr<const SonarStreamMetrics>> streamList = streams();
+
+    timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    std::ostringstream out;
+    out << "{\n  \"timeUs\": " << (uint64_t(ts.tv_sec) * 1000000 + ts.tv_nsec / 1000)
+        << ",\n  \"sockets\": [";
+    for (size_t i = 0; i < socketList.size(); ++i)
+    {
+        const SonarSocketMetrics& m = *socketList[i];
+        out << (i ? ",\n" : "\n") << "    {\"shard\": " << m.shard
+            << ", \"datagrams\": " << m.datagrams.value() << ", \"batches\": " << m.batches.value()
+            << ", \"kernelDrops\": " << m.kernelDrops.value() << "}";
+    }
+    out << (socketList.empty() ? "" : "\n  ") << "],\n  \"streams\": [";
+    for (size_t i = 0; i < streamList.size(); ++i)
+    {
+        const SonarStreamMetrics& m = *streamList[i];
+        char source[INET_ADDRSTRLEN] = "";
+        in_addr address;
+        address.s_addr = m.address;
+        inet_ntop(AF_INET, &address, source, sizeof(source));
+        out << (i ? ",\n" : "\n") << "    {\"source\": \"" << source << ":" << ntohs(m.port)
+            << "\", \"streamId\": " << m.streamId
+            << ",\n     \"datagrams\": " << m.datagrams.value()
+            << ", \"bytes\": " << m.bytes.value()
+            << ", \"completedFrames\": " << m.completedFrames.value()
+            << ", \"expiredFrames\": " << m.expiredFrames.value()
+            << ", \"missingFrames\": " << m.missingFrames.value()
+            << ", \"missingChunks\": " << m.missingChunks.value()
+            << ",\n     \"crcErrors\": " << m.crcErrors.value()
+            << ", \"duplicateChunks\": " << m.duplicateChunks.value()
+            << ", \"lateChunks\": " << m.lateChunks.value()
+            << ", \"malformedDatagrams\": " << m.malformedDatagrams.value()
+            << ", \"poolExhausted\": " << m.poolExhausted.value()
+            << ", \"recoveredChunks\": " << m.recoveredChunks.value()
+            << ", \"codecErrors\": " << m.codecErrors.value()
+            << ",\n     \"reorderedChunks\": " << m.reorderedChunks.value()
+            << ", \"reorderedFrames\": " << m.reorderedFrames.value() << ",\n     ";
+        writeHistogram(out, "reorderDepth", m.reorderDepth);
+        out << ",\n     ";
+        writeHistogram(out, "reassemblyUs", m.reassemblyUs);
+        out << ",\n     ";
+        writeHistogram(out, "latencyUs", m.latencyUs);
+        out << "}";
+    }
+    out << (streamList.empty() ? "" : "\n  ") << "]\n}\n";
+    return out.str();
+}
+
+bool
+SonarMetricsRegistry::writeJson(const std::string& path) const
+{
+    const std::string json = toJson();
+    const std::string temporary = path + ".tmp";
+    FILE* file = fopen(temporary.c_str(), "w");
+    if (!file)
+        return false;
+    bool ok = fwrite(json.data(), 1, json.size(), file) == json.size();
+    ok = fclose(file) == 0 && ok;
+    if (!ok || rename(temporary.c_str(), path.c_str()) != 0)
+    {
+        remove(temporary.c_str());
+        return false;
+    }
+    return true;
+}
@@ -0,0 +1,140 @@
+#if !defined(SONAR_METRICS_HH)
+#define SONAR_METRICS_HH
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+// 受信の計測値 (ストリーム毎のカウンタとヒストグラム)
+//
+// 書き込みは受信スレッドだけが行い、読み出しは任意のスレッドから行う
+// 書き込み側は relaxed の load + store だけなので、通常の整数の加算と同じコストで済む
+// (lock 付きの命令もロックも使わない)
+// 読み出した値は各値ごとには正しいが、複数の値の間で同じ時点のものとは限らない
+
+// 単一の書き込みスレッドから更新するカウンタ
+class SonarCounter
+{
+public:
+    void operator++() { add(1); }
+    void operator--() { add(~uint64_t(0)); }
+    void operator+=(uint64_t n) { add(n); }
+    void
+    add(uint64_t n)
+    {
+        mValue.store(mValue.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+    }
+    void set(uint64_t value) { mValue.store(value, std::memory_order_relaxed); }
+    // 最大値を残す
+    void
+    raise(uint64_t value)
+    {
+        if (value > mValue.load(std::memory_order_relaxed))
+            mValue.store(value, std::memory_order_relaxed);
+    }
+    uint64_t value() const { return mValue.load(std::memory_order_relaxed); }
+
+private:
+    std::atomic<uint64_t> mValue{0};
+};
+
+// 2 のべき乗の区間で数えるヒストグラム (単一の書き込みスレッド)
+// バケット 0 は 0、バケット k (>= 1) は [2^(k-1), 2^k)
+class SonarHistogram
+{
+public:
+    static constexpr int kBuckets = 32;
+
+    struct Snapshot
+    {
+        uint64_t buckets[kBuckets];
+        uint64_t count;
+        uint64_t sum;
+        uint64_t max;
+
+        double mean() const;
+        // 分位点 q (0..1) を含むバケットの上限 (max を超えない)
+        uint64_t percentile(double q) const;
+    };
+
+    void record(uint64_t value);
+    Snapshot snapshot() const;
+
+private:
+    SonarCounter mBuckets[kBuckets];
+    SonarCounter mCount;
+    SonarCounter mSum;
+    SonarCounter mMax;
+};
+
+// 1 つのストリームの計測値
+// 名前は SonarReassemblerStats と揃えてある (expiredFrames: 中断したフレーム, missingFrames: 欠番)
+struct SonarStreamMetrics
+{
+    // ストリームの識別子 (登録前に設定し、以後は変えない。ネットワークバイトオーダ)
+    uint32_t address{0};
+    uint16_t port{0};
+    uint16_t streamId{0};
+
+    SonarCounter datagrams;
+    SonarCounter bytes;
+    SonarCounter completedFrames;
+    SonarCounter expiredFrames;
+    SonarCounter missingFrames;
+    SonarCounter missingChunks;
+    SonarCounter crcErrors;
+    SonarCounter duplicateChunks;
+    SonarCounter lateChunks;
+    SonarCounter malformedDatagrams;
+    SonarCounter poolExhausted;
+    SonarCounter recoveredChunks;
+    SonarCounter codecErrors;
+    SonarCounter reorderedChunks;   // フレーム内で先のチャンクより後に届いたチャンク
+    SonarCounter reorderedFrames;   // 後のフレームより後に最初のチャンクが届いたフレーム
+    SonarCounter lastUs;            // 最後にデータグラムが届いた時刻 (CLOCK_MONOTONIC)
+
+    SonarHistogram reorderDepth;    // 入れ替わったチャンクの深さ (何チャンク追い越されたか)
+    SonarHistogram reassemblyUs;    // 最初のチャンクから完成までの時間
+    // 送信側の取得時刻 (UNIX 時間) から通知までの時間。送受信の時計が合っている場合のみ意味がある
+    // (受信側の時計が遅れていて負になる場合は 0 として数える)
+    SonarHistogram latencyUs;
+};
+
+// 1 つの受信ソケットの計測値
+struct SonarSocketMetrics
+{
+    int shard{0};
+    SonarCounter datagrams;
+    SonarCounter batches;           // データグラムを受け取った recvmmsg の回数
+    SonarCounter kernelDrops;       // 受信バッファが溢れてカーネルが捨てた数 (SO_RXQ_OVFL, 累計)
+};
+
+// 計測値の登録先 (受信スレッドが登録し、任意のスレッドから読む)
+// 登録の追加・削除だけロックを取る。値の更新はロックを取らない
+class SonarMetricsRegistry
+{
+public:
+    std::shared_ptr<SonarStreamMetrics> addStream(uint32_t address, uint16_t port,
+                                                  uint16_t streamId);
+    void removeStream(const std::shared_ptr<SonarStreamMetrics>& metrics);
+    std::shared_ptr<SonarSocketMetrics> addSocket(int shard);
+
+    std::vector<std::shared_ptr<const SonarStreamMetrics>> streams() const;
+    std::vector<std::shared_ptr<const SonarSocketMetrics>> sockets() const;
+
+    // 全ての計測値を JSON で返す
+    std::string toJson() const;
+    // JSON を path へ書く (一時ファイルから rename するので、読む側は書きかけを見ない)
+    bool writeJson(const std::string& path) const;
+
+private:
+    mutable std::mutex mMutex;
+    std::vector<std::shared_ptr<SonarStreamMetrics>> mStreams;
+    std::vector<std::shared_ptr<SonarSocketMetrics>> mSockets;
+};
+
+#endif // !defined(SONAR_METRICS_HH)
@@ -0,0 +1,124 @@
+#include "SonarMulticast.hh"
+#include <arpa/inet.h>
+#include <cerrno>
+#include <cstring>
+#include <ifaddrs.h>
+#include <iostream>
+#include <net/if.h>
+#include <sys/socket.h>
+
+#if !defined(IP_MULTICAST_ALL)
+#define IP_MULTICAST_ALL 49
+#endif
+
+bool
+sonarIsMulticast(const in_addr& address)
+{
+    return IN_MULTICAST(ntohl(address.s_addr));
+}
+
+// 名前でもアドレスでも指定できるよう、getifaddrs で index とアドレスの両方を埋める
+// (IP_ADD_SOURCE_MEMBERSHIP はアドレスしか受け付けないため)
+bool
+sonarResolveInterface(const std::string& nameOrAddress, ip_mreqn& mreq)
+{
+    memset(&mreq, 0, sizeof(mreq));
+    mreq.imr_address.s_addr = htonl(INADDR_ANY);
+    if (nameOrAddress.empty())
+        return true;
+
+    in_addr address;
+    bool isAddress = inet_pton(AF_INET, nameOrAddress.c_str(), &address) == 1;
+
+    ifaddrs* list = nullptr;
+    if (getifaddrs(&list) != 0)
+        return false;
+    bool found = false;
+    for (ifaddrs* it = list; it && !found; it = it->ifa_next)
+    {
+        if (!it->ifa_addr || it->ifa_addr->sa_family != AF_INET)
+            continue;
+        const in_addr& ifAddress = reinterpret_cast<const sockaddr_in*>(it->ifa_addr)->sin_addr;
+        if (isAddress ? ifAddress.s_addr == address.s_addr : nameOrAddress == it->ifa_name)
+        {
+            mreq.imr_address = ifAddress;
+            mreq.imr_ifindex = int(if_nametoindex(it->ifa_name));
+            found = true;
+        }
+    }
+    freeifaddrs(list);
+    if (!found)
+        std::cerr << "Error: Unknown interface " << nameOrAddress << std::endl;
+    return found;
+}
+
+bool
+sonarJoinGroup(int fd, const std::string& group, const std::string& interface,
+               const std::string& source)
+{
+    ip_mreqn mreq;
+    if (!sonarResolveInterface(interface, mreq))
+        return false;
+    if (inet_pton(AF_INET, group.c_str(), &mreq.imr_multiaddr) != 1 ||
+        !sonarIsMulticast(mreq.imr_multiaddr))
+    {
+        std::cerr << "Error: Invalid multicast group " << group << std::endl;
+        return false;
+    }
+
+    // 同じポートで別グループに参加している他のソケット宛てを受け取らない
+    int all = 0;
+    setsockopt(fd, IPPROTO_IP, IP_MULTICAST_ALL, &all, sizeof(all));
+
+    if (source.empty())
+    {
+        if (setsockopt(fd, IPPROTO_IP, IP_ADD_MEMBERSHIP, &mreq, sizeof(mreq)) != 0)
+        {
+            std::cerr << "Error: IP_ADD_MEMBERSHIP " << group << " failed (" << strerror(errno)
+                      << ")" << std::endl;
+            return false;
+        }
+        return true;
+    }
+
+    ip_mreq_source smreq;
+    memset(&smreq, 0, sizeof(smreq));
+    smreq.imr_multiaddr = mreq.imr_multiaddr;
+    smreq.imr_interface = mreq.imr_address;
+    if (inet_pton(AF_INET, source.c_str(), &smreq.imr_sourceaddr) != 1)
+    {
+        std::cerr << "Error: Invalid source address " << source << std::endl;
+        return false;
+    }
+    if (setsockopt(fd, IPPROTO_IP, IP_ADD_SOURCE_MEMBERSHIP, &smreq, sizeof(smreq)) != 0)
+    {
+        std::cerr << "Error: IP_ADD_SOURCE_MEMBERSHIP " << source << "@" << group << " failed ("
+                  << strerror(errno) << ")" << std::endl;
+        return false;
+    }
+    return true;
+}
+
+bool
+sonarSetMulticastSender(int fd, int ttl, const std::string& interface, bool loopback)
+{
+    if (setsockopt(fd, IPPROTO_IP, IP_MULTICAST_TTL, &ttl, sizeof(ttl)) != 0)
+    {
+        std::cerr << "Error: IP_MULTICAST_TTL failed (" << strerror(errno) << ")" << std::endl;
+        return false;
+    }
+    int loop = loopback ? 1 : 0;
+    setsockopt(fd, IPPROTO_IP, IP_MULTICAST_LOOP, &loop, sizeof(loop));
+    if (interface.empty())
+        return true;
+    ip_mreqn mreq;
+    if (!sonarResolveInterface(interface, mreq))
+        return false;
+    if (setsockopt(fd, IPPROTO_IP, IP_MULTICAST_IF, &mreq, sizeof(mreq)) != 0)
+    {
+        std::cerr << "Error: IP_MULTICAST_IF " << interface << " failed (" << strerror(errno)
+                  << ")" << std::endl;
+        return false;
+    }
+    return true;
+}
@@ -0,0 +1,22 @@
+#if !defined(SONAR_MULTICAST_HH)
+#define SONAR_MULTICAST_HH
+
+#include <netinet/in.h>
+#include <string>
+
+// マルチキャスト用の補助関数 (送信側・受信側で共用)
+
+bool sonarIsMulticast(const in_addr& address);
+
+// インタフェース名 (eth0) またはそのアドレス (192.168.1.10) を ip_mreqn に設定する
+// 空なら既定のインタフェース。解決できなければ false
+bool sonarResolveInterface(const std::string& nameOrAddress, ip_mreqn& mreq);
+
+// fd でマルチキャストグループに参加する (source が空でなければその送信元だけ受ける)
+bool sonarJoinGroup(int fd, const std::string& group, const std::string& interface,
+                    const std::string& source);
+
+// 送信側のマルチキャスト設定 (TTL, 送出インタフェース, 自ホストへのループバック)
+bool sonarSetMulticastSender(int fd, int ttl, const std::string& interface, bool loopback);
+
+#endif // !defined(SONAR_MULTICAST_HH)
@@ -0,0 +1,205 @@
+#include "SonarProtocol.hh"
+#include <cstring>
+
+#if defined(__x86_64__)
+#include <emmintrin.h>
+#include <nmmintrin.h>
+#elif defined(__ARM_FEATURE_CRC32)
+#include <arm_acle.h>
+#endif
+
+namespace
+{
+void
+writeBe16(uint8_t* p, uint16_t v)
+{
+    p[0] = uint8_t(v >> 8);
+    p[1] = uint8_t(v);
+}
+
+void
+writeBe32(uint8_t* p, uint32_t v)
+{
+    writeBe16(p, uint16_t(v >> 16));
+    writeBe16(p + 2, uint16_t(v));
+}
+
+void
+writeBe64(uint8_t* p, uint64_t v)
+{
+    writeBe32(p, uint32_t(v >> 32));
+    writeBe32(p + 4, uint32_t(v));
+}
+
+uint16_t
+readBe16(const uint8_t* p)
+{
+    return uint16_t((p[0] << 8) | p[1]);
+}
+
+uint32_t
+readBe32(const uint8_t* p)
+{
+    return (uint32_t(p[0]) << 24) | (uint32_t(p[1]) << 16) | (uint32_t(p[2]) << 8) | p[3];
+}
+
+uint64_t
+readBe64(const uint8_t* p)
+{
+    return (uint64_t(readBe32(p)) << 32) | readBe32(p + 4);
+}
+
+// 反転多項式 0x82f63b78 のテーブル (命令が無い環境用)
+struct Crc32cTable
+{
+    uint32_t t[256];
+    Crc32cTable()
+    {
+        for (uint32_t i = 0; i < 256; ++i)
+        {
+            uint32_t c = i;
+            for (int k = 0; k < 8; ++k)
+                c = (c & 1) ? (c >> 1) ^ 0x82f63b78u : c >> 1;
+            t[i] = c;
+        }
+    }
+};
+
+uint32_t
+crc32cTable(const uint8_t* p, size_t n, uint32_t c)
+{
+    static const Crc32cTable table;
+    while (n--)
+        c = table.t[(c ^ *p++) & 0xff] ^ (c >> 8);
+    return c;
+}
+
+#if defined(__x86_64__)
+__attribute__((target("sse4.2"))) uint32_t
+crc32cSse42(const uint8_t* p, size_t n, uint32_t c)
+{
+    uint64_t c64 = c;
+    for (; n >= 8; n -= 8, p += 8)
+    {
+        uint64_t v;
+        memcpy(&v, p, 8);
+        c64 = _mm_crc32_u64(c64, v);
+    }
+    c = uint32_t(c64);
+    while (n--)
+        c = _mm_crc32_u8(c, *p++);
+    return c;
+}
+#endif
+} // namespace
+
+void
+encodeSonarChunkHeader(const SonarChunkHeader& header, uint8_t* dst)
+{
+    writeBe16(dst, kSonarMagic);
+    dst[2] = kSonarProtocolVersion;
+    dst[3] = header.flags;
+    writeBe16(dst + 4, header.streamId);
+    writeBe16(dst + 6, uint16_t(kSonarChunkHeaderSize));
+    writeBe32(dst + 8, header.frameId);
+    writeBe16(dst + 12, header.chunkIndex);
+    writeBe16(dst + 14, header.chunkCount);
+    writeBe32(dst + 16, header.totalSize);
+    writeBe32(dst + 20, header.chunkOffset);
+    writeBe64(dst + 24, header.timestampUs);
+    writeBe32(dst + 32, header.crc32c);
+    writeBe16(dst + 36, header.fecGroups);
+    writeBe16(dst + 38, 0);
+}
+
+bool
+decodeSonarChunkHeader(const uint8_t* src, size_t size, SonarChunkHeader& header)
+{
+    if (size < kSonarChunkHeaderSize || readBe16(src) != kSonarMagic ||
+        src[2] != kSonarProtocolVersion || readBe16(src + 6) != kSonarChunkHeaderSize)
+        return false;
+    header.flags = src[3];
+    header.streamId = readBe16(src + 4);
+    header.frameId = readBe32(src + 8);
+    header.chunkIndex = readBe16(src + 12);
+    header.chunkCount = readBe16(src + 14);
+    header.totalSize = readBe32(src + 16);
+    header.chunkOffset = readBe32(src + 20);
+    header.timestampUs = readBe64(src + 24);
+    header.crc32c = readBe32(src + 32);
+    header.fecGroups = readBe16(src + 36);
+    return true;
+}
+
+void
+encodeSonarImageHeader(int width, int height, int swath, int range, bool is16bit, uint8_t* dst)
+{
+    writeBe16(dst, uint16_t(width));
+    writeBe16(dst + 2, uint16_t(height));
+    writeBe16(dst + 4, uint16_t(swath));
+    writeBe16(dst + 6, uint16_t(range));
+    writeBe32(dst + 8, is16bit ? 1 : 0);
+}
+
+uint32_t
+sonarCrc32c(const void* data, size_t size, uint32_t crc)
+{
+    const uint8_t* p = static_cast<const uint8_t*>(data);
+    uint32_t c = ~crc;
+#if defined(__x86_64__)
+    static const bool hasSse42 = __builtin_cpu_supports("sse4.2");
+    if (hasSse42)
+        return ~crc32cSse42(p, size, c);
+#elif defined(__ARM_FEATURE_CRC32)
+    for (; size >= 8; size -= 8, p += 8)
+    {
+        uint64_t v;
+        memcpy(&v, p, 8);
+        c = __crc32cd(c, v);
+    }
+    while (size--)
+        c = __crc32cb(c, *p++);
+    return ~c;
+#endif
+    return ~crc32cTable(p, size, c);
+}
+
+uint16_t
+sonarFecGroups(size_t chunkCount, size_t groupSize)
+{
+    if (groupSize == 0 || chunkCount == 0)
+        return 0;
+    return uint16_t((chunkCount + groupSize - 1) / groupSize);
+}
+
+size_t
+sonarFecGroupChunks(size_t chunkCount, size_t fecGroups, size_t group)
+{
+    return chunkCount / fecGroups + (group < chunkCount % fecGroups ? 1 : 0);
+}
+
+void
+sonarXor(uint8_t* dst, const uint8_t* src, size_t size)
+{
+#if defined(__x86_64__)
+    for (; size >= 64; size -= 64, dst += 64, src += 64)
+    {
+        for (int k = 0; k < 64; k += 16)
+        {
+            __m128i a = _mm_loadu_si128(reinterpret_cast<const __m128i*>(dst + k));
+            __m128i b = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + k));
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + k), _mm_xor_si128(a, b));
+        }
+    }
+#endif
+    for (; size >= 8; size -= 8, dst += 8, src += 8)
+    {
+        uint64_t a, b;
+        memcpy(&a, dst, 8);
+        memcpy(&b, src, 8);
+        a ^= b;
+        memcpy(dst, &a, 8);
+    }
+    while (size--)
+        *dst++ ^= *src++;
+}
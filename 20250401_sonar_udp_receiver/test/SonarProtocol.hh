@@ -0,0 +1,101 @@
+#if !defined(SONAR_PROTOCOL_HH)
+#define SONAR_PROTOCOL_HH
+
+#include <cstddef>
+#include <cstdint>
+
+// CHUNKED UDP プロトコル v2
+//
+// 各データグラムは固定長のチャンクヘッダ (ビッグエンディアン) + フレームの一部
+//
+//   0  u16 magic        'SO' (0x534f)
+//   2  u8  version      2
+//   3  u8  flags        kSonarFlag*
+//   4  u16 streamId     ソナーヘッド等の識別子
+//   6  u16 headerSize   チャンクヘッダ長 (40)
+//   8  u32 frameId      フレーム毎に +1 (ラップアラウンドあり)
+//  12  u16 chunkIndex
+//  14  u16 chunkCount
+//  16  u32 totalSize    フレーム全体 (画像ヘッダ + 画素) のバイト数
+//  20  u32 chunkOffset  このチャンクのフレーム内オフセット
+//  24  u64 timestampUs  取得時刻 (UNIX 時間 [us])
+//  32  u32 crc32c       このチャンク本体の CRC32C (kSonarFlagCrc の場合のみ有効)
+//  36  u16 fecGroups    パリティチャンク数 (0: FEC なし)
+//  38  u16 reserved
+//
+// フレーム本体は v1 と同じく画像ヘッダ (kSonarImageHeaderSize) + 画素
+//
+// FEC (XOR パリティ)
+//   データチャンク i はグループ i % fecGroups に属する (インタリーブ)
+//   各グループのパリティチャンクはグループ内のデータチャンクの XOR
+//   (短い最後のチャンクは 0 で埋めて計算する)
+//   パリティチャンクは kSonarFlagParity を立て、chunkIndex にグループ番号、chunkOffset に 0 を入れる
+//   長さはデータチャンクの長さ (stride) で、データチャンクの後に送る
+//   グループ毎に 1 チャンクまでの損失を再送なしで復元できる。連続した損失も fecGroups 個までなら
+//   別々のグループに散るので復元できる
+//
+// 圧縮 (flags の kSonarFlagCodecMask, フレーム毎に送信側が選ぶ)
+//   圧縮したフレームの本体 (totalSize バイト) は
+//     u32 rawSize            展開後の大きさ (画像ヘッダ + 画素)
+//     u32 referenceFrameId   差分の基準フレーム (kSonarCodecDeltaRle のみ)
+//     画像ヘッダ (非圧縮)
+//     圧縮した画素
+//   受信側が対応していない方式のフレームは捨てる (送信側は --compress で方式を選ぶ)
+//   圧縮しても小さくならないフレームは非圧縮で送る
+
+constexpr uint16_t kSonarMagic = 0x534f;
+constexpr uint8_t kSonarProtocolVersion = 2;
+constexpr size_t kSonarChunkHeaderSize = 40;
+
+constexpr uint8_t kSonarFlagCrc = 0x01;
+constexpr uint8_t kSonarFlagParity = 0x02;
+constexpr uint8_t kSonarFlagCodecMask = 0x0c;
+constexpr int kSonarFlagCodecShift = 2;
+
+// 画素の圧縮方式
+enum SonarCodec : uint8_t
+{
+    kSonarCodecRaw = 0,
+    kSonarCodecLz4 = 1,      // LZ4 (SONAR_HAVE_LZ4 でビルドした場合のみ)
+    kSonarCodecZeroRle = 2,  // 0 の連続をまとめる (水柱部分)
+    kSonarCodecDeltaRle = 3, // 基準フレームとの差分を ZeroRle で (変化しない画素をまとめる)
+};
+constexpr size_t kSonarCodecHeaderSize = 8;
+
+// フレーム先頭の画像ヘッダ (width, height, swath, range: u16, is16bit: u32, ビッグエンディアン)
+constexpr size_t kSonarImageHeaderSize = 12;
+
+struct SonarChunkHeader
+{
+    uint8_t flags{0};
+    uint16_t streamId{0};
+    uint32_t frameId{0};
+    uint16_t chunkIndex{0};
+    uint16_t chunkCount{0};
+    uint32_t totalSize{0};
+    uint32_t chunkOffset{0};
+    uint64_t timestampUs{0};
+    uint32_t crc32c{0};
+    uint16_t fecGroups{0};
+};
+
+// dst には kSonarChunkHeaderSize バイト書き込む
+void encodeSonarChunkHeader(const SonarChunkHeader& header, uint8_t* dst);
+// magic / version / headerSize が一致しなければ false
+bool decodeSonarChunkHeader(const uint8_t* src, size_t size, SonarChunkHeader& header);
+
+// dst には kSonarImageHeaderSize バイト書き込む
+void encodeSonarImageHeader(int width, int height, int swath, int range, bool is16bit,
+                            uint8_t* dst);
+
+// CRC32C (Castagnoli)。SSE4.2 / ARMv8 CRC 命令があれば使う
+uint32_t sonarCrc32c(const void* data, size_t size, uint32_t crc = 0);
+
+// FEC のグループ数 (groupSize 個のデータチャンク毎に 1 つのパリティ, groupSize 0 なら FEC なし)
+uint16_t sonarFecGroups(size_t chunkCount, size_t groupSize);
+// グループ group に属するデータチャンク数
+size_t sonarFecGroupChunks(size_t chunkCount, size_t fecGroups, size_t group);
+// dst ^= src (size バイト)
+void sonarXor(uint8_t* dst, const uint8_t* src, size_t size);
+
+#endif // !defined(SONAR_PROTOCOL_HH)
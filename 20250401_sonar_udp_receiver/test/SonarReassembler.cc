@@ -0,0 +1,739 @@
+#include "SonarReassembler.hh"
+#include "SonarCodec.hh"
+#include <algorithm>
+#include <cstring>
+#include <ctime>
+
+namespace
+{
+// 欠番がこれより大きければ送信側の再起動とみなして数えない
+constexpr int32_t kMaxFrameGap = 1024;
+
+uint32_t
+readBe32(const uint8_t* p)
+{
+    return (uint32_t(p[0]) << 24) | (uint32_t(p[1]) << 16) | (uint32_t(p[2]) << 8) | p[3];
+}
+
+bool
+overlaps(const uint8_t* a, size_t aSize, const uint8_t* b, size_t bSize)
+{
+    return a < b + bSize && b < a + aSize;
+}
+
+// [dst, dst + size) に書き込む前に、そこへ着地している未処理のデータグラム (next 以降) を退避する
+void
+protect(SonarUdpReceiver& receiver, int next, int count, const uint8_t* dst, size_t size)
+{
+    for (int j = next; j < count; ++j)
+    {
+        long m = receiver.payloadSize(j);
+        if (m > 0 && overlaps(receiver.payload(j), size_t(m), dst, size))
+            receiver.relocateToScratch(j);
+    }
+}
+} // namespace
+
+SonarReassemblerStats&
+SonarReassemblerStats::operator+=(const SonarReassemblerStats& other)
+{
+    completedFrames += other.completedFrames;
+    expiredFrames += other.expiredFrames;
+    missingFrames += other.missingFrames;
+    missingChunks += other.missingChunks;
+    crcErrors += other.crcErrors;
+    duplicateChunks += other.duplicateChunks;
+    lateChunks += other.lateChunks;
+    malformedDatagrams += other.malformedDatagrams;
+    poolExhausted += other.poolExhausted;
+    recoveredChunks += other.recoveredChunks;
+    codecErrors += other.codecErrors;
+    return *this;
+}
+
+// static
+SonarStreamKey
+SonarStreamKey::of(const SonarFrame& frame)
+{
+    SonarStreamKey key;
+    key.address = frame.sourceAddress;
+    key.port = frame.sourcePort;
+    key.streamId = frame.streamId;
+    return key;
+}
+
+bool
+SonarStreamKey::operator==(const SonarStreamKey& other) const
+{
+    return address == other.address && port == other.port && streamId == other.streamId;
+}
+
+bool
+SonarStreamKey::operator<(const SonarStreamKey& other) const
+{
+    if (address != other.address)
+        return address < other.address;
+    if (port != other.port)
+        return port < other.port;
+    return streamId < other.streamId;
+}
+
+// explicit
+SonarReassembler::SonarReassembler(SonarFramePool& pool, const SonarReassemblerConfig& config,
+                                   FrameCallback onFrame,
+                                   std::shared_ptr<SonarMetricsRegistry> registry)
+    : mPool(pool), mConfig(config), mOnFrame(std::move(onFrame)), mRegistry(std::move(registry))
+{
+    mConfig.maxFramesInFlight = std::max(1, mConfig.maxFramesInFlight);
+    mConfig.maxStreams = std::max(1, mConfig.maxStreams);
+}
+
+// virtual
+SonarReassembler::~SonarReassembler()
+{
+    if (mRegistry)
+    {
+        for (const std::unique_ptr<Stream>& stream : mStreams)
+            mRegistry->removeStream(stream->metrics);
+    }
+}
+
+SonarReassemblerStats
+SonarReassembler::stats() const
+{
+    SonarReassemblerStats total = mStats;
+    for (const std::unique_ptr<Stream>& stream : mStreams)
+        total += counters(*stream->metrics);
+    return total;
+}
+
+std::vector<SonarStreamStats>
+SonarReassembler::streamStats() const
+{
+    std::vector<SonarStreamStats> result;
+    result.reserve(mStreams.size());
+    for (const std::unique_ptr<Stream>& stream : mStreams)
+        result.push_back({stream->key, counters(*stream->metrics)});
+    return result;
+}
+
+// static
+int64_t
+SonarReassembler::nowUs()
+{
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return int64_t(ts.tv_sec) * 1000000 + ts.tv_nsec / 1000;
+}
+
+// static
+SonarReassemblerStats
+SonarReassembler::counters(const SonarStreamMetrics& metrics)
+{
+    SonarReassemblerStats stats;
+    stats.completedFrames = metrics.completedFrames.value();
+    stats.expiredFrames = metrics.expiredFrames.value();
+    stats.missingFrames = metrics.missingFrames.value();
+    stats.missingChunks = metrics.missingChunks.value();
+    stats.crcErrors = metrics.crcErrors.value();
+    stats.duplicateChunks = metrics.duplicateChunks.value();
+    stats.lateChunks = metrics.lateChunks.value();
+    stats.malformedDatagrams = metrics.malformedDatagrams.value();
+    stats.poolExhausted = metrics.poolExhausted.value();
+    stats.recoveredChunks = metrics.recoveredChunks.value();
+    stats.codecErrors = metrics.codecErrors.value();
+    return stats;
+}
+
+// 次に届くチャンクの格納先を予測して受信器に設定する
+// 直前のチャンクと同じフレームの未受信チャンク、その後は次のフレーム (先取りバッファ) の先頭から
+// 受信済みのチャンク位置は指定しない (外れた場合に上書きしてしまうため)
+// 複数のストリームが交互に届く場合は外れるが、コピーし直すだけで結果は変わらない
+// FEC のパリティチャンクはデータチャンクの後に届くので、その分はスクラッチで受ける
+void
+SonarReassembler::prepare(SonarUdpReceiver& receiver)
+{
+    receiver.resetPayloadTargets();
+    if (!mSpare)
+        mSpare = mPool.acquire();
+
+    Assembly* assembly = mLastStream ? find(*mLastStream, mLastFrameId) : nullptr;
+    if (assembly && (!assembly->predictable || assembly->stride == 0))
+        assembly = nullptr;
+    uint32_t index = assembly ? mLastChunkIndex + 1u : 0u;
+    const size_t spareStride = mLastStream ? mLastStream->stride : mConfig.maxPayload;
+    uint32_t parity = mLastStream ? mLastParityPending : 0;
+
+    for (int i = 0; i < receiver.batchSize(); ++i)
+    {
+        if (assembly)
+        {
+            while (index < assembly->chunkCount && assembly->received[index])
+                ++index;
+            if (index >= assembly->chunkCount)
+            {
+                assembly = nullptr;
+                index = 0;
+            }
+        }
+        if (!assembly && parity > 0)
+        {
+            --parity;
+            continue;
+        }
+        SonarFrame* slot = assembly ? assembly->frame.get() : mSpare.get();
+        size_t stride = assembly ? assembly->stride : spareStride;
+        if (!slot || stride == 0)
+            break;
+        size_t offset = size_t(index) * stride;
+        if (offset + stride > slot->capacity())
+            break;
+        receiver.setPayloadTarget(i, slot->data() + offset, stride);
+        ++index;
+    }
+}
+
+void
+SonarReassembler::process(SonarUdpReceiver& receiver, int count)
+{
+    const int64_t now = nowUs();
+    for (int i = 0; i < count; ++i)
+    {
+        long n = receiver.payloadSize(i);
+        SonarChunkHeader header;
+        if (n < 0 || receiver.truncated(i) ||
+            !decodeSonarChunkHeader(receiver.header(i), receiver.headerBytes(), header) ||
+            header.chunkIndex >= header.chunkCount || header.totalSize > mPool.frameCapacity() ||
+            size_t(header.chunkOffset) + size_t(n) > header.totalSize ||
+            header.fecGroups > header.chunkCount ||
+            ((header.flags & kSonarFlagParity) && header.chunkIndex >= header.fecGroups))
+        {
+            ++mStats.malformedDatagrams;
+            continue;
+        }
+
+        SonarStreamKey key;
+        key.address = receiver.source(i).sin_addr.s_addr;
+        key.port = receiver.source(i).sin_port;
+        key.streamId = header.streamId;
+        Stream& stream = *this->stream(key, now);
+        ++stream.metrics->datagrams;
+        stream.metrics->bytes += uint64_t(n) + receiver.headerBytes();
+
+        // CRC はソケットから受け取った直後 (キャッシュにある間) に確認する
+        const uint8_t* src = receiver.payload(i);
+        if ((header.flags & kSonarFlagCrc) && mConfig.verifyCrc &&
+            sonarCrc32c(src, size_t(n)) != header.crc32c)
+        {
+            ++stream.metrics->crcErrors;
+            continue;
+        }
+
+        Assembly* assembly = find(stream, header.frameId);
+        if (assembly)
+        {
+            if (assembly->chunkCount != header.chunkCount ||
+                assembly->totalSize != header.totalSize ||
+                assembly->fecGroups != header.fecGroups ||
+                assembly->codec != (header.flags & kSonarFlagCodecMask) >> kSonarFlagCodecShift)
+            {
+                ++stream.metrics->malformedDatagrams;
+                continue;
+            }
+        }
+        else
+        {
+            if (isRetired(stream, header.frameId, header.timestampUs))
+            {
+                // 完成済みのフレームのパリティは使われずに捨てるのが普通なので数えない
+                if (header.flags & kSonarFlagParity)
+                {
+                    if (&stream == mLastStream && header.frameId == mLastFrameId &&
+                        mLastParityPending > 0)
+                        --mLastParityPending;
+                }
+                else
+                {
+                    ++stream.metrics->lateChunks;
+                }
+                continue;
+            }
+            assembly = open(stream, header, now);
+            if (!assembly)
+                continue;
+        }
+
+        if (header.flags & kSonarFlagParity)
+        {
+            bool accepted =
+                acceptParity(stream, *assembly, header, src, size_t(n), receiver, i + 1, count);
+            if (accepted && assembly->receivedChunks == assembly->chunkCount)
+                complete(stream, *assembly, receiver, i + 1, count);
+            continue;
+        }
+
+        if (assembly->received[header.chunkIndex])
+        {
+            ++stream.metrics->duplicateChunks;
+            continue;
+        }
+
+        uint8_t* dst = assembly->frame->data() + header.chunkOffset;
+        if (src != dst)
+        {
+            // 予測が外れた: 正しい位置に後続データグラムが着地していれば先に退避してからコピー
+            protect(receiver, i + 1, count, dst, size_t(n));
+            memmove(dst, src, size_t(n));
+        }
+
+        assembly->received[header.chunkIndex] = 1;
+        assembly->ranges[header.chunkIndex] = {header.chunkOffset, uint32_t(n)};
+        if (header.chunkIndex < assembly->highestChunk)
+        {
+            ++stream.metrics->reorderedChunks;
+            stream.metrics->reorderDepth.record(assembly->highestChunk - header.chunkIndex);
+        }
+        else
+        {
+            assembly->highestChunk = header.chunkIndex;
+        }
+        ++assembly->receivedChunks;
+        learnStride(stream, *assembly, header, size_t(n));
+        mLastStream = &stream;
+        mLastFrameId = header.frameId;
+        mLastChunkIndex = header.chunkIndex;
+        mLastParityPending = assembly->fecGroups - assembly->parityCount;
+        if (assembly->fecGroups > 0)
+        {
+            uint32_t group = header.chunkIndex % assembly->fecGroups;
+            --assembly->groupMissing[group];
+            recover(stream, *assembly, group, receiver, i + 1, count);
+        }
+
+        if (assembly->receivedChunks == assembly->chunkCount)
+            complete(stream, *assembly, receiver, i + 1, count);
+    }
+    expire();
+}
+
+void
+SonarReassembler::expire()
+{
+    const int64_t now = nowUs();
+    for (size_t i = mStreams.size(); i-- > 0;)
+    {
+        Stream& stream = *mStreams[i];
+        for (Assembly& assembly : stream.assemblies)
+        {
+            if (assembly.active && now - assembly.firstUs > mConfig.timeoutUs)
+                abandon(stream, assembly);
+        }
+        if (now - stream.lastUs > mConfig.streamIdleUs)
+            remove(i);
+    }
+}
+
+// key のストリームを返す (無ければ作る)
+// 直前と同じストリームが続くことが多いので先に確認する
+SonarReassembler::Stream*
+SonarReassembler::stream(const SonarStreamKey& key, int64_t now)
+{
+    Stream* found = nullptr;
+    if (mLastStream && mLastStream->key == key)
+    {
+        found = mLastStream;
+    }
+    else
+    {
+        for (const std::unique_ptr<Stream>& stream : mStreams)
+        {
+            if (stream->key == key)
+            {
+                found = stream.get();
+                break;
+            }
+        }
+    }
+
+    if (!found)
+    {
+        if (mStreams.size() >= size_t(mConfig.maxStreams))
+        {
+            size_t oldest = 0;
+            for (size_t i = 1; i < mStreams.size(); ++i)
+            {
+                if (mStreams[i]->lastUs < mStreams[oldest]->lastUs)
+                    oldest = i;
+            }
+            remove(oldest);
+        }
+        found = new Stream;
+        found->key = key;
+        found->assemblies.resize(mConfig.maxFramesInFlight);
+        found->retired.resize(kRetiredHistory);
+        found->stride = mConfig.maxPayload;
+        found->metrics = mRegistry ? mRegistry->addStream(key.address, key.port, key.streamId)
+                                   : std::make_shared<SonarStreamMetrics>();
+        mStreams.emplace_back(found);
+    }
+    found->lastUs = now;
+    found->metrics->lastUs.set(uint64_t(now));
+    return found;
+}
+
+// ストリームを捨てる (組み立て中のフレームは破棄、集計は合計に残す)
+void
+SonarReassembler::remove(size_t index)
+{
+    Stream& stream = *mStreams[index];
+    for (Assembly& assembly : stream.assemblies)
+    {
+        if (assembly.active)
+            abandon(stream, assembly);
+    }
+    mStats += counters(*stream.metrics);
+    if (mRegistry)
+        mRegistry->removeStream(stream.metrics);
+    if (mLastStream == &stream)
+        mLastStream = nullptr;
+    mStreams.erase(mStreams.begin() + index);
+}
+
+SonarReassembler::Assembly*
+SonarReassembler::find(Stream& stream, uint32_t frameId)
+{
+    for (Assembly& assembly : stream.assemblies)
+    {
+        if (assembly.active && assembly.frameId == frameId)
+            return &assembly;
+    }
+    return nullptr;
+}
+
+// 新しいフレームの組み立てを始める
+// 空きが無ければそのストリームで最も古いフレームを不完全のまま捨てる
+SonarReassembler::Assembly*
+SonarReassembler::open(Stream& stream, const SonarChunkHeader& header, int64_t now)
+{
+    SonarStreamMetrics& metrics = *stream.metrics;
+    if (!stream.haveNewest)
+    {
+        stream.haveNewest = true;
+        stream.newestFrameId = header.frameId;
+    }
+    else
+    {
+        int32_t gap = int32_t(header.frameId - stream.newestFrameId);
+        if (gap > 0 && gap <= kMaxFrameGap)
+        {
+            metrics.missingFrames += uint64_t(gap - 1);
+            stream.newestFrameId = header.frameId;
+        }
+        else if (gap <= 0 && gap > -int32_t(kRetiredHistory))
+        {
+            // 欠番として数えたフレームが遅れて届いた
+            ++metrics.reorderedFrames;
+            if (metrics.missingFrames.value() > 0)
+                --metrics.missingFrames;
+        }
+        else
+        {
+            stream.newestFrameId = header.frameId;
+        }
+    }
+
+    Assembly* assembly = nullptr;
+    for (Assembly& candidate : stream.assemblies)
+    {
+        if (!candidate.active)
+        {
+            assembly = &candidate;
+            break;
+        }
+        if (!assembly || candidate.firstUs < assembly->firstUs)
+            assembly = &candidate;
+    }
+    if (assembly->active)
+        abandon(stream, *assembly);
+
+    SonarFramePtr frame = mSpare ? std::move(mSpare) : mPool.acquire();
+    if (!frame)
+    {
+        // プールが空 (表示側が参照を持ち続けている)
+        ++metrics.poolExhausted;
+        stream.retired[header.frameId % kRetiredHistory] = {header.frameId, header.timestampUs,
+                                                             true};
+        return nullptr;
+    }
+
+    assembly->active = true;
+    assembly->frame = std::move(frame);
+    assembly->frameId = header.frameId;
+    assembly->chunkCount = header.chunkCount;
+    assembly->totalSize = header.totalSize;
+    assembly->timestampUs = header.timestampUs;
+    assembly->received.assign(header.chunkCount, 0);
+    assembly->ranges.resize(header.chunkCount);
+    assembly->receivedChunks = 0;
+    assembly->highestChunk = 0;
+    assembly->stride = 0;
+    assembly->predictable = true;
+    assembly->firstUs = now;
+    assembly->codec = uint8_t((header.flags & kSonarFlagCodecMask) >> kSonarFlagCodecShift);
+    assembly->fecGroups = header.fecGroups;
+    assembly->groupMissing.resize(header.fecGroups);
+    for (uint32_t group = 0; group < header.fecGroups; ++group)
+        assembly->groupMissing[group] =
+            uint32_t(sonarFecGroupChunks(header.chunkCount, header.fecGroups, group));
+    assembly->parityReceived.assign(header.fecGroups, 0);
+    assembly->parityCount = 0;
+    assembly->parityStride = 0;
+    return assembly;
+}
+
+// next 以降のデータグラムは未処理 (展開先のバッファに着地していることがある)
+void
+SonarReassembler::complete(Stream& stream, Assembly& assembly, SonarUdpReceiver& receiver,
+                           int next, int count)
+{
+    // チャンク数が揃っても、オフセットが重なっていれば隙間にプールの前のフレームの中身が残る
+    if (!covered(assembly))
+    {
+        ++stream.metrics->malformedDatagrams;
+        assembly.frame.reset();
+        retire(stream, assembly);
+        return;
+    }
+
+    SonarFramePtr frame = std::move(assembly.frame);
+    frame->size = assembly.totalSize;
+    frame->sourceAddress = stream.key.address;
+    frame->sourcePort = stream.key.port;
+    frame->streamId = stream.key.streamId;
+    frame->frameId = assembly.frameId;
+    frame->timestampUs = assembly.timestampUs;
+    const SonarCodec codec = SonarCodec(assembly.codec);
+    const int64_t firstUs = assembly.firstUs;
+    retire(stream, assembly);
+
+    if (codec != kSonarCodecRaw)
+    {
+        // 展開したら圧縮されたほうのバッファはすぐプールへ戻る
+        frame = decode(stream, *frame, codec, receiver, next, count);
+        if (!frame)
+            return;
+    }
+
+    // 画像ヘッダと totalSize が食い違うフレームは表示できない
+    if (!frame->parseImageHeader())
+    {
+        ++stream.metrics->malformedDatagrams;
+        return;
+    }
+    SonarStreamMetrics& metrics = *stream.metrics;
+    ++metrics.completedFrames;
+    metrics.reassemblyUs.record(uint64_t(std::max<int64_t>(0, nowUs() - firstUs)));
+    timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    const int64_t unixUs = int64_t(ts.tv_sec) * 1000000 + ts.tv_nsec / 1000;
+    metrics.latencyUs.record(uint64_t(std::max<int64_t>(0, unixUs - int64_t(frame->timestampUs))));
+    stream.reference = frame;
+    mOnFrame(frame);
+}
+
+// チャンクの範囲が隙間も重なりも無くフレーム全体 (totalSize) を覆っているか
+// 普通はチャンク番号の順にオフセットが並ぶので、並べ替えるのは順序が違う場合だけ
+// static
+bool
+SonarReassembler::covered(const Assembly& assembly)
+{
+    uint32_t end = 0;
+    size_t i = 0;
+    for (; i < assembly.ranges.size() && assembly.ranges[i].offset == end; ++i)
+        end += assembly.ranges[i].size;
+    if (i == assembly.ranges.size())
+        return end == assembly.totalSize;
+
+    std::vector<ChunkRange> sorted(assembly.ranges);
+    std::sort(sorted.begin(), sorted.end(),
+              [](const ChunkRange& a, const ChunkRange& b) { return a.offset < b.offset; });
+    end = 0;
+    for (const ChunkRange& range : sorted)
+    {
+        if (range.offset != end)
+            return false;
+        end += range.size;
+    }
+    return end == assembly.totalSize;
+}
+
+// 圧縮されたフレームをプールの新しいフレームへ展開する (失敗したら nullptr)
+SonarFramePtr
+SonarReassembler::decode(Stream& stream, const SonarFrame& packed, SonarCodec codec,
+                         SonarUdpReceiver& receiver, int next, int count)
+{
+    const size_t prefix = kSonarCodecHeaderSize + kSonarImageHeaderSize;
+    const uint8_t* src = packed.data();
+    size_t rawSize = packed.size >= prefix ? readBe32(src) : 0;
+    if (!sonarCodecAvailable(codec) || rawSize < kSonarImageHeaderSize ||
+        rawSize > mPool.frameCapacity())
+    {
+        ++stream.metrics->codecErrors;
+        return nullptr;
+    }
+
+    // 差分の基準フレームが届いていなければ次のキーフレームまで展開できない
+    const uint8_t* reference = nullptr;
+    if (codec == kSonarCodecDeltaRle)
+    {
+        const SonarFramePtr& ref = stream.reference;
+        if (!ref || ref->frameId != readBe32(src + 4) || ref->size != rawSize)
+        {
+            ++stream.metrics->codecErrors;
+            return nullptr;
+        }
+        reference = ref->pixels();
+    }
+
+    SonarFramePtr frame = mPool.acquire();
+    if (!frame)
+    {
+        ++stream.metrics->poolExhausted;
+        return nullptr;
+    }
+    // このバッチの途中で abandon() がプールへ戻したバッファなら、prepare() の予測で
+    // 後続のデータグラムが着地しているので先に退避する
+    protect(receiver, next, count, frame->data(), rawSize);
+    memcpy(frame->data(), src + kSonarCodecHeaderSize, kSonarImageHeaderSize);
+    if (!sonarDecodePixels(codec, src + prefix, packed.size - prefix, reference,
+                           frame->data() + kSonarImageHeaderSize,
+                           rawSize - kSonarImageHeaderSize))
+    {
+        ++stream.metrics->codecErrors;
+        return nullptr;
+    }
+    frame->size = rawSize;
+    frame->sourceAddress = packed.sourceAddress;
+    frame->sourcePort = packed.sourcePort;
+    frame->streamId = packed.streamId;
+    frame->frameId = packed.frameId;
+    frame->timestampUs = packed.timestampUs;
+    return frame;
+}
+
+void
+SonarReassembler::abandon(Stream& stream, Assembly& assembly)
+{
+    ++stream.metrics->expiredFrames;
+    stream.metrics->missingChunks += assembly.chunkCount - assembly.receivedChunks;
+    assembly.frame.reset();
+    retire(stream, assembly);
+}
+
+void
+SonarReassembler::retire(Stream& stream, Assembly& assembly)
+{
+    stream.retired[assembly.frameId % kRetiredHistory] = {assembly.frameId, assembly.timestampUs,
+                                                          true};
+    assembly.active = false;
+}
+
+// 送信側が再起動して frameId が巻き戻っても誤判定しないよう、時刻も比べる
+bool
+SonarReassembler::isRetired(const Stream& stream, uint32_t frameId, uint64_t timestampUs) const
+{
+    const Retired& retired = stream.retired[frameId % kRetiredHistory];
+    return retired.valid && retired.frameId == frameId && retired.timestampUs == timestampUs;
+}
+
+// 送信側のチャンク長を学習する
+// chunkOffset が chunkIndex * stride に従わないフレームは予測に使わない
+void
+SonarReassembler::learnStride(Stream& stream, Assembly& assembly, const SonarChunkHeader& header,
+                              size_t payloadSize)
+{
+    if (header.chunkIndex + 1u < header.chunkCount)
+    {
+        if (assembly.stride == 0)
+            assembly.stride = payloadSize;
+        else if (assembly.stride != payloadSize)
+            assembly.predictable = false;
+        stream.stride = payloadSize;
+    }
+    if (assembly.stride != 0 && header.chunkOffset != header.chunkIndex * assembly.stride)
+        assembly.predictable = false;
+}
+
+// パリティチャンクを保存し、そのグループが復元できれば復元する
+bool
+SonarReassembler::acceptParity(Stream& stream, Assembly& assembly, const SonarChunkHeader& header,
+                               const uint8_t* src, size_t size, SonarUdpReceiver& receiver,
+                               int next, int count)
+{
+    uint32_t group = header.chunkIndex;
+    if (assembly.parityReceived[group])
+    {
+        ++stream.metrics->duplicateChunks;
+        return false;
+    }
+    if (assembly.parityStride == 0)
+    {
+        assembly.parityStride = size;
+        if (assembly.parity.size() < assembly.fecGroups * size)
+            assembly.parity.resize(assembly.fecGroups * size);
+    }
+    else if (assembly.parityStride != size)
+    {
+        ++stream.metrics->malformedDatagrams;
+        return false;
+    }
+    // 予測が外れてフレームバッファ上に着地していることがあるが、パリティ用の領域とは重ならない
+    memcpy(&assembly.parity[group * size], src, size);
+    assembly.parityReceived[group] = 1;
+    ++assembly.parityCount;
+    if (&stream == mLastStream && header.frameId == mLastFrameId && mLastParityPending > 0)
+        --mLastParityPending;
+    recover(stream, assembly, group, receiver, next, count);
+    return true;
+}
+
+// グループ group でデータチャンクが 1 つだけ欠けていて、パリティが届いていれば復元する
+// 欠けたチャンク = パリティ ^ グループ内の他のチャンク (0 埋め分は XOR しても変わらない)
+// next 以降のデータグラムは未処理なので、復元先に着地していれば先に退避する
+void
+SonarReassembler::recover(Stream& stream, Assembly& assembly, uint32_t group,
+                          SonarUdpReceiver& receiver, int next, int count)
+{
+    if (assembly.groupMissing[group] != 1 || !assembly.parityReceived[group])
+        return;
+    const size_t stride = assembly.parityStride;
+    const uint32_t groups = assembly.fecGroups;
+    if (stride == 0 || (assembly.totalSize + stride - 1) / stride != assembly.chunkCount)
+        return;
+
+    uint32_t missing = group;
+    while (missing < assembly.chunkCount && assembly.received[missing])
+        missing += groups;
+    if (missing >= assembly.chunkCount)
+        return;
+
+    uint8_t* frame = assembly.frame->data();
+    const size_t offset = size_t(missing) * stride;
+    const size_t length = std::min(stride, size_t(assembly.totalSize) - offset);
+    protect(receiver, next, count, frame + offset, length);
+    memcpy(frame + offset, &assembly.parity[group * stride], length);
+    for (uint32_t i = group; i < assembly.chunkCount; i += groups)
+    {
+        if (i == missing)
+            continue;
+        const size_t chunkOffset = size_t(i) * stride;
+        sonarXor(frame + offset, frame + chunkOffset,
+                 std::min(length, size_t(assembly.totalSize) - chunkOffset));
+    }
+
+    assembly.received[missing] = 1;
+    assembly.ranges[missing] = {uint32_t(offset), uint32_t(length)};
+    ++assembly.receivedChunks;
+    assembly.groupMissing[group] = 0;
+    ++stream.metrics->recoveredChunks;
+}
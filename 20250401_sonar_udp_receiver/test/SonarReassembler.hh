@@ -0,0 +1,207 @@
+#if !defined(SONAR_REASSEMBLER_HH)
+#define SONAR_REASSEMBLER_HH
+
+#include "SonarFrame.hh"
+#include "SonarMetrics.hh"
+#include "SonarProtocol.hh"
+#include "SonarUdpReceiver.hh"
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <vector>
+
+// 再構築の設定
+struct SonarReassemblerConfig
+{
+    size_t maxPayload{60000};      // 送信側のチャンク長 (受信したチャンクから学習し直す)
+    int maxFramesInFlight{4};      // ストリーム毎に同時に組み立てるフレーム数
+    int64_t timeoutUs{200000};     // 最初のチャンクからこの時間で揃わなければ破棄
+    bool verifyCrc{true};
+    int maxStreams{8};             // 同時に扱うストリーム数 (超えたら最も古いものを捨てる)
+    int64_t streamIdleUs{5000000}; // この時間届かなかったストリームの状態を捨てる
+};
+
+// 損失の集計
+struct SonarReassemblerStats
+{
+    uint64_t completedFrames{0};
+    uint64_t expiredFrames{0};      // タイムアウト / 追い出しで捨てた不完全フレーム
+    uint64_t missingFrames{0};      // チャンクが 1 つも届かなかったフレーム (frameId の欠番)
+    uint64_t missingChunks{0};      // 捨てたフレームで欠けていたチャンク
+    uint64_t crcErrors{0};
+    uint64_t duplicateChunks{0};
+    uint64_t lateChunks{0};         // 完了 / 破棄済みフレームのチャンク
+    uint64_t malformedDatagrams{0};
+    uint64_t poolExhausted{0};      // バッファが無く受け付けられなかったフレーム
+    uint64_t recoveredChunks{0};    // パリティから復元したチャンク
+    uint64_t codecErrors{0};        // 展開できなかったフレーム (未対応の方式, 基準フレームの欠落等)
+
+    SonarReassemblerStats& operator+=(const SonarReassemblerStats& other);
+};
+
+// ストリームの識別子 (送信元のアドレス・ポートとストリーム ID の組)
+// 送信元が違えば同じストリーム ID でも別のストリームとして組み立てる
+struct SonarStreamKey
+{
+    uint32_t address{0}; // ネットワークバイトオーダ
+    uint16_t port{0};    // ネットワークバイトオーダ
+    uint16_t streamId{0};
+
+    static SonarStreamKey of(const SonarFrame& frame);
+    bool operator==(const SonarStreamKey& other) const;
+    bool operator<(const SonarStreamKey& other) const;
+};
+
+// ストリーム毎の集計
+struct SonarStreamStats
+{
+    SonarStreamKey key;
+    SonarReassemblerStats stats;
+};
+
+// CHUNKED UDP (プロトコル v2) をフレームへ再構築する
+//
+// 各チャンクはプールから取ったフレームバッファの chunkOffset の位置へ置く
+// prepare() で次に届くチャンクの位置を予測して recvmmsg の格納先に指定するため、
+// 順序通りに届いたチャンクはソケットからの 1 回のコピーだけで済む
+// 予測が外れたチャンクだけ正しい位置へコピーし直す
+//
+// 送信元とストリーム ID (SonarStreamKey) 毎に独立した組み立て状態を持つため、
+// 同じポートへ複数の送信側が送っても互いのフレームを壊さない
+// ストリーム毎に frameId で最大 maxFramesInFlight 個のフレームを並行して組み立てるため、
+// 前後のフレームのチャンクが入れ替わって届いても壊れない
+// 完成したフレームは完成順に通知する (frameId 順とは限らない)
+//
+// FEC (fecGroups > 0) のフレームは、グループで 1 つだけ欠けたデータチャンクを
+// パリティチャンクとの XOR で復元する (損失が無ければ XOR は行わない)
+//
+// 圧縮されたフレームは揃った時点でプールの別のフレームへ直接展開して通知する
+// 差分圧縮の基準にするため、ストリーム毎に最後に通知したフレームを 1 つ保持する
+//
+// ストリーム毎の計測値 (SonarStreamMetrics) は registry へ登録され、他のスレッドから読める
+// stats() / streamStats() は process() と同じスレッドから呼ぶ
+//
+// フレームバッファのプールは全ストリームで共有する
+class SonarReassembler
+{
+public:
+    using FrameCallback = std::function<void(const SonarFramePtr&)>;
+
+    SonarReassembler(SonarFramePool& pool, const SonarReassemblerConfig& config,
+                     FrameCallback onFrame,
+                     std::shared_ptr<SonarMetricsRegistry> registry = nullptr);
+    virtual ~SonarReassembler();
+
+    // receiveBatch() の前に呼ぶ
+    void prepare(SonarUdpReceiver& receiver);
+    // receiveBatch() の後に呼ぶ
+    void process(SonarUdpReceiver& receiver, int count);
+    // タイムアウトしたフレームと途絶えたストリームを捨てる (process() からも呼ばれる)
+    void expire();
+
+    // 全ストリームの合計 (捨てたストリームの分も含む)
+    SonarReassemblerStats stats() const;
+    // 現在のストリーム毎の集計
+    std::vector<SonarStreamStats> streamStats() const;
+
+private:
+    struct ChunkRange
+    {
+        uint32_t offset;
+        uint32_t size;
+    };
+
+    struct Assembly
+    {
+        bool active{false};
+        SonarFramePtr frame;
+        uint32_t frameId{0};
+        uint16_t chunkCount{0};
+        uint32_t totalSize{0};
+        uint64_t timestampUs{0};
+        std::vector<uint8_t> received; // チャンク毎の受信済みフラグ
+        std::vector<ChunkRange> ranges; // チャンク毎に書いた範囲 (完成時に隙間が無いか確認する)
+        uint32_t receivedChunks{0};
+        uint16_t highestChunk{0};      // 受信した最大の chunkIndex (入れ替わりの深さの計測用)
+        size_t stride{0};              // chunkOffset == chunkIndex * stride なら予測に使える
+        bool predictable{true};
+        int64_t firstUs{0};
+        uint8_t codec{kSonarCodecRaw};
+
+        // FEC
+        uint16_t fecGroups{0};
+        std::vector<uint32_t> groupMissing; // グループ毎の未受信データチャンク数
+        std::vector<uint8_t> parityReceived;
+        uint16_t parityCount{0};
+        size_t parityStride{0};
+        std::vector<uint8_t> parity;        // fecGroups * parityStride (フレーム間で使い回す)
+    };
+
+    // 最近完了 / 破棄したフレーム (遅れて届いたチャンクを捨てるため)
+    struct Retired
+    {
+        uint32_t frameId;
+        uint64_t timestampUs;
+        bool valid;
+    };
+    static constexpr size_t kRetiredHistory = 256;
+
+    // 1 つのストリームの組み立て状態
+    struct Stream
+    {
+        SonarStreamKey key;
+        std::vector<Assembly> assemblies;
+        std::vector<Retired> retired;
+        size_t stride{0};
+        int64_t lastUs{0}; // 最後にチャンクが届いた時刻
+
+        // 欠番の検出
+        bool haveNewest{false};
+        uint32_t newestFrameId{0};
+
+        SonarFramePtr reference; // 最後に通知したフレーム (差分圧縮の基準)
+
+        std::shared_ptr<SonarStreamMetrics> metrics;
+    };
+
+    static int64_t nowUs();
+    static SonarReassemblerStats counters(const SonarStreamMetrics& metrics);
+
+    Stream* stream(const SonarStreamKey& key, int64_t now);
+    void remove(size_t index);
+    Assembly* find(Stream& stream, uint32_t frameId);
+    Assembly* open(Stream& stream, const SonarChunkHeader& header, int64_t now);
+    void complete(Stream& stream, Assembly& assembly, SonarUdpReceiver& receiver, int next,
+                  int count);
+    static bool covered(const Assembly& assembly);
+    SonarFramePtr decode(Stream& stream, const SonarFrame& packed, SonarCodec codec,
+                         SonarUdpReceiver& receiver, int next, int count);
+    void abandon(Stream& stream, Assembly& assembly);
+    void retire(Stream& stream, Assembly& assembly);
+    bool isRetired(const Stream& stream, uint32_t frameId, uint64_t timestampUs) const;
+    void learnStride(Stream& stream, Assembly& assembly, const SonarChunkHeader& header,
+                     size_t payloadSize);
+    bool acceptParity(Stream& stream, Assembly& assembly, const SonarChunkHeader& header,
+                      const uint8_t* src, size_t size, SonarUdpReceiver& receiver, int next,
+                      int count);
+    void recover(Stream& stream, Assembly& assembly, uint32_t group, SonarUdpReceiver& receiver,
+                 int next, int count);
+
+    SonarFramePool& mPool;
+    SonarReassemblerConfig mConfig;
+    FrameCallback mOnFrame;
+    std::shared_ptr<SonarMetricsRegistry> mRegistry;
+    std::vector<std::unique_ptr<Stream>> mStreams;
+    SonarFramePtr mSpare; // 次のフレーム用に先取りしたバッファ
+
+    // 予測の起点 (最後に処理したチャンク)
+    Stream* mLastStream{nullptr};
+    uint32_t mLastFrameId{0};
+    uint16_t mLastChunkIndex{0};
+    uint32_t mLastParityPending{0}; // 最後のフレームでまだ届いていないパリティチャンク数
+
+    // ストリームを特定できなかったデータグラムと、捨てたストリームの集計
+    SonarReassemblerStats mStats;
+};
+
+#endif // !defined(SONAR_REASSEMBLER_HH)
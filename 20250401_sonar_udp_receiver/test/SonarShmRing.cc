@@ -0,0 +1,399 @@
+#include "SonarShmRing.hh"
+#include <algorithm>
+#include <cerrno>
+#include <climits>
+#include <cstring>
+#include <ctime>
+#include <fcntl.h>
+#include <iostream>
+#include <linux/futex.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
+namespace
+{
+constexpr size_t kHeaderBytes = 4096;
+constexpr size_t kPageBytes = 4096;
+
+static_assert(sizeof(SonarShmHeader) <= kHeaderBytes, "SonarShmHeader must fit in one page");
+static_assert(sizeof(SonarShmSlot) == 64, "SonarShmSlot must be one cache line");
+
+std::string
+shmName(const std::string& name)
+{
+    return (name.empty() || name[0] != '/') ? "/" + name : name;
+}
+
+int64_t
+monotonicUs()
+{
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return int64_t(ts.tv_sec) * 1000000 + ts.tv_nsec / 1000;
+}
+
+void
+cpuRelax()
+{
+#if defined(__x86_64__) || defined(__i386__)
+    _mm_pause();
+#elif defined(__aarch64__)
+    asm volatile("yield");
+#endif
+}
+
+// プロセス間で共有するため FUTEX_PRIVATE_FLAG は付けない
+void
+futexWake(std::atomic<uint32_t>* word)
+{
+    syscall(SYS_futex, reinterpret_cast<uint32_t*>(word), FUTEX_WAKE, INT_MAX, nullptr, nullptr,
+            0);
+}
+
+void
+futexWait(std::atomic<uint32_t>* word, uint32_t expected, int64_t timeoutUs)
+{
+    timespec ts;
+    ts.tv_sec = timeoutUs / 1000000;
+    ts.tv_nsec = (timeoutUs % 1000000) * 1000;
+    syscall(SYS_futex, reinterpret_cast<uint32_t*>(word), FUTEX_WAIT, expected, &ts, nullptr, 0);
+}
+
+// 作り直す前に古いセグメントの読み出し側へ閉じたことを知らせる
+void
+closeStaleSegment(const std::string& name)
+{
+    int fd = shm_open(name.c_str(), O_RDWR, 0);
+    if (fd < 0)
+        return;
+    void* p = mmap(nullptr, kHeaderBytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    ::close(fd);
+    if (p != MAP_FAILED)
+    {
+        SonarShmHeader* header = static_cast<SonarShmHeader*>(p);
+        if (memcmp(header->magic, kSonarShmMagic, sizeof(kSonarShmMagic)) == 0)
+        {
+            header->closed.store(1, std::memory_order_release);
+            header->futexWord.fetch_add(1);
+            futexWake(&header->futexWord);
+        }
+        munmap(p, kHeaderBytes);
+    }
+    shm_unlink(name.c_str());
+}
+} // namespace
+
+// explicit
+SonarShmWriter::SonarShmWriter(const std::string& name, size_t slotCapacity, uint32_t slotCount)
+    : mName(shmName(name))
+{
+    if (slotCount < 2 || slotCapacity == 0)
+    {
+        std::cerr << "Error: shared memory ring needs at least 2 slots" << std::endl;
+        return;
+    }
+    closeStaleSegment(mName);
+
+    int fd = shm_open(mName.c_str(), O_CREAT | O_EXCL | O_RDWR | O_CLOEXEC, 0666);
+    if (fd < 0)
+    {
+        std::cerr << "Error: shm_open(" << mName << ") failed (" << strerror(errno) << ")"
+                  << std::endl;
+        return;
+    }
+    // umask に関係なく別ユーザーの読み出し側も開けるようにする
+    fchmod(fd, 0666);
+
+    const size_t stride =
+        (sizeof(SonarShmSlot) + slotCapacity + kPageBytes - 1) / kPageBytes * kPageBytes;
+    mMapSize = kHeaderBytes + stride * slotCount;
+    if (ftruncate(fd, off_t(mMapSize)) != 0)
+    {
+        std::cerr << "Error: ftruncate(" << mName << ") failed (" << strerror(errno) << ")"
+                  << std::endl;
+        ::close(fd);
+        shm_unlink(mName.c_str());
+        return;
+    }
+    void* p = mmap(nullptr, mMapSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, 0);
+    ::close(fd);
+    if (p == MAP_FAILED)
+    {
+        std::cerr << "Error: mmap(" << mName << ") failed (" << strerror(errno) << ")"
+                  << std::endl;
+        shm_unlink(mName.c_str());
+        return;
+    }
+    mMap = static_cast<uint8_t*>(p);
+
+    // ftruncate で 0 埋めされている (スロットの seq = 0 は「未書き込み」)
+    mHeader = reinterpret_cast<SonarShmHeader*>(mMap);
+    mHeader->version = kSonarShmVersion;
+    mHeader->slotCount = slotCount;
+    mHeader->slotCapacity = slotCapacity;
+    mHeader->slotStride = stride;
+    // magic は最後に書き、読み出し側が書きかけのヘッダを見ないようにする
+    std::atomic_thread_fence(std::memory_order_release);
+    memcpy(mHeader->magic, kSonarShmMagic, sizeof(kSonarShmMagic));
+}
+
+// virtual
+SonarShmWriter::~SonarShmWriter()
+{
+    if (!mMap)
+        return;
+    mHeader->closed.store(1, std::memory_order_release);
+    mHeader->futexWord.fetch_add(1);
+    futexWake(&mHeader->futexWord);
+    munmap(mMap, mMapSize);
+    // 開いている読み出し側はマップが残るので、最後のフレームまで読める
+    shm_unlink(mName.c_str());
+}
+
+bool
+SonarShmWriter::isOpen() const
+{
+    return mMap != nullptr;
+}
+
+size_t
+SonarShmWriter::slotCapacity() const
+{
+    return mHeader ? mHeader->slotCapacity : 0;
+}
+
+uint8_t*
+SonarShmWriter::begin()
+{
+    if (!mMap)
+        return nullptr;
+    SonarShmSlot* slot = reinterpret_cast<SonarShmSlot*>(
+        mMap + kHeaderBytes + (mSeq % mHeader->slotCount) * mHeader->slotStride);
+    // seqlock: 奇数にしてからデータを書き換える
+    slot->seq.store(2 * mSeq + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    mWriting = true;
+    return reinterpret_cast<uint8_t*>(slot + 1);
+}
+
+void
+SonarShmWriter::commit(size_t size, uint16_t streamId, uint32_t frameId, uint64_t timestampUs)
+{
+    if (!mWriting)
+        return;
+    SonarShmSlot* slot = reinterpret_cast<SonarShmSlot*>(
+        mMap + kHeaderBytes + (mSeq % mHeader->slotCount) * mHeader->slotStride);
+    slot->size = uint32_t(size);
+    slot->streamId = streamId;
+    slot->frameId = frameId;
+    slot->timestampUs = timestampUs;
+    slot->seq.store(2 * mSeq + 2, std::memory_order_release);
+    ++mSeq;
+    mWriting = false;
+
+    mHeader->writeSeq.store(mSeq, std::memory_order_release);
+    mHeader->futexWord.fetch_add(1);
+    // 待っている読み出し側がいなければシステムコールを省く
+    if (mHeader->waiters.load() > 0)
+        futexWake(&mHeader->futexWord);
+}
+
+bool
+SonarShmWriter::publish(const uint8_t* data, size_t size, uint16_t streamId, uint32_t frameId,
+                        uint64_t timestampUs)
+{
+    if (!mMap || size > mHeader->slotCapacity)
+        return false;
+    memcpy(begin(), data, size);
+    commit(size, streamId, frameId, timestampUs);
+    return true;
+}
+
+// explicit
+SonarShmReader::SonarShmReader(const std::string& name, bool fromOldest, int spinUs)
+    : mName(shmName(name)), mFromOldest(fromOldest), mSpinUs(spinUs)
+{
+    open();
+}
+
+// virtual
+SonarShmReader::~SonarShmReader()
+{
+    close();
+}
+
+bool
+SonarShmReader::open()
+{
+    if (mReopen)
+        close();
+    if (mMap)
+        return true;
+    int fd = shm_open(mName.c_str(), O_RDWR | O_CLOEXEC, 0);
+    if (fd < 0)
+        return false;
+    struct stat st;
+    if (fstat(fd, &st) != 0 || size_t(st.st_size) < kHeaderBytes)
+    {
+        ::close(fd);
+        return false;
+    }
+    void* p = mmap(nullptr, size_t(st.st_size), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    ::close(fd);
+    if (p == MAP_FAILED)
+        return false;
+
+    SonarShmHeader* header = static_cast<SonarShmHeader*>(p);
+    bool valid = memcmp(header->magic, kSonarShmMagic, sizeof(kSonarShmMagic)) == 0;
+    std::atomic_thread_fence(std::memory_order_acquire);
+    valid = valid && header->version == kSonarShmVersion && header->slotCount >= 2 &&
+            kHeaderBytes + header->slotStride * header->slotCount <= size_t(st.st_size);
+    if (!valid)
+    {
+        munmap(p, size_t(st.st_size));
+        return false;
+    }
+
+    mMap = static_cast<uint8_t*>(p);
+    mMapSize = size_t(st.st_size);
+    mHeader = header;
+    uint64_t written = mHeader->writeSeq.load(std::memory_order_acquire);
+    uint64_t keep = mHeader->slotCount - 1;
+    mCursor = (mFromOldest && written > keep) ? written - keep : (mFromOldest ? 0 : written);
+    return true;
+}
+
+void
+SonarShmReader::close()
+{
+    if (mMap)
+        munmap(mMap, mMapSize);
+    mMap = nullptr;
+    mHeader = nullptr;
+    mReopen = false;
+}
+
+bool
+SonarShmReader::isOpen() const
+{
+    return mMap != nullptr;
+}
+
+uint64_t
+SonarShmReader::droppedFrames() const
+{
+    return mDroppedFrames;
+}
+
+SonarShmSlot*
+SonarShmReader::slot(uint64_t seq) const
+{
+    return reinterpret_cast<SonarShmSlot*>(mMap + kHeaderBytes +
+                                           (seq % mHeader->slotCount) * mHeader->slotStride);
+}
+
+bool
+SonarShmReader::tryRead(SonarShmFrame& out)
+{
+    if (mHeader && mHeader->closed.load(std::memory_order_acquire) &&
+        mCursor >= mHeader->writeSeq.load(std::memory_order_acquire))
+    {
+        // 書き込み側が終了した (作り直された)。直前に返したフレームがまだ使われているかも
+        // しれないのでここでは unmap せず、次の wait() / open() で開き直す
+        mReopen = true;
+        return false;
+    }
+    if (!mHeader && !open())
+        return false;
+
+    const uint64_t keep = mHeader->slotCount - 1;
+    while (true)
+    {
+        uint64_t written = mHeader->writeSeq.load(std::memory_order_acquire);
+        if (mCursor >= written)
+            return false;
+        // 書き込み中のスロットまで追い越されていれば読める範囲まで飛ばす
+        if (written - mCursor > keep)
+        {
+            mDroppedFrames += written - mCursor - keep;
+            mCursor = written - keep;
+        }
+
+        SonarShmSlot* s = slot(mCursor);
+        const uint64_t expected = 2 * mCursor + 2;
+        if (s->seq.load(std::memory_order_acquire) != expected)
+        {
+            ++mDroppedFrames;
+            ++mCursor;
+            continue;
+        }
+        out.data = reinterpret_cast<const uint8_t*>(s + 1);
+        out.size = s->size;
+        out.streamId = s->streamId;
+        out.frameId = s->frameId;
+        out.timestampUs = s->timestampUs;
+        out.seq = mCursor;
+        // メタデータを読む間に上書きされていないか
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if (s->seq.load(std::memory_order_relaxed) != expected ||
+            out.size > mHeader->slotCapacity)
+        {
+            ++mDroppedFrames;
+            ++mCursor;
+            continue;
+        }
+        ++mCursor;
+        return true;
+    }
+}
+
+bool
+SonarShmReader::wait(int64_t timeoutUs)
+{
+    if ((!mHeader || mReopen) && !open())
+    {
+        // 書き込み側がまだいない
+        usleep(useconds_t(std::min<int64_t>(timeoutUs, 10000)));
+        return false;
+    }
+    auto ready = [this]() {
+        return mHeader->writeSeq.load(std::memory_order_acquire) > mCursor ||
+               mHeader->closed.load(std::memory_order_acquire);
+    };
+    if (ready())
+        return true;
+
+    if (mSpinUs > 0)
+    {
+        const int64_t end = monotonicUs() + std::min<int64_t>(mSpinUs, timeoutUs);
+        while (monotonicUs() < end)
+        {
+            if (ready())
+                return true;
+            cpuRelax();
+        }
+    }
+
+    // futexWord を読んでから新しいフレームを確認するので、その間の公開は取りこぼさない
+    mHeader->waiters.fetch_add(1);
+    uint32_t word = mHeader->futexWord.load();
+    if (!ready())
+        futexWait(&mHeader->futexWord, word, timeoutUs);
+    mHeader->waiters.fetch_sub(1);
+    return ready();
+}
+
+bool
+SonarShmReader::isValid(const SonarShmFrame& frame) const
+{
+    if (!mHeader)
+        return false;
+    std::atomic_thread_fence(std::memory_order_acquire);
+    return slot(frame.seq)->seq.load(std::memory_order_relaxed) == 2 * frame.seq + 2;
+}
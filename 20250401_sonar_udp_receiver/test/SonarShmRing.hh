@@ -0,0 +1,136 @@
+#if !defined(SONAR_SHM_RING_HH)
+#define SONAR_SHM_RING_HH
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+// 共有メモリのリングバッファによる同一ホスト内のフレーム転送
+//
+// UDP プロトコルと同じ単位 (画像ヘッダ + 画素 のフレームに streamId / frameId / 時刻) を
+// POSIX 共有メモリ上の固定数のスロットで受け渡す
+//   - 書き込み側は 1 つ。読み出し側は何個でもよく、それぞれ独立したカーソルを持つ
+//   - 各スロットは seqlock (書き込み中は奇数) で守り、ロックは使わない
+//   - 読み出し側はスロット上のデータをコピーせずにそのまま読む
+//     書き込み側は読み出し側を待たないため、読み終えたら isValid() で上書きされていないか確認する
+//     (slotCount - 1 フレーム分の時間は上書きされない)
+//   - 新しいフレームは futex で待つ (spinUs の間は busy wait)
+//
+// 共有メモリの配置
+//   [SonarShmHeader (4 KiB)][スロット 0][スロット 1]...
+//   スロット = [SonarShmSlot (64 B)][データ (slotCapacity)] を 4 KiB 境界に揃えたもの
+
+constexpr char kSonarShmMagic[8] = {'S', 'O', 'N', 'A', 'R', 'S', 'H', 'M'};
+constexpr uint32_t kSonarShmVersion = 1;
+
+static_assert(ATOMIC_LLONG_LOCK_FREE == 2 && ATOMIC_INT_LOCK_FREE == 2,
+              "shared memory atomics must be lock-free");
+
+struct SonarShmHeader
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t slotCount;
+    uint64_t slotCapacity; // スロット 1 つのデータ部の大きさ
+    uint64_t slotStride;   // スロットの間隔
+    std::atomic<uint32_t> closed;
+
+    alignas(64) std::atomic<uint64_t> writeSeq; // 公開済みのフレーム数
+    alignas(64) std::atomic<uint32_t> futexWord;  // 公開毎に +1 (読み出し側はこれを待つ)
+    std::atomic<uint32_t> waiters;               // futex で待っている読み出し側の数
+};
+
+struct alignas(64) SonarShmSlot
+{
+    std::atomic<uint64_t> seq; // 2n+1: n 番目のフレームを書き込み中, 2n+2: n 番目のフレーム
+    uint64_t timestampUs;
+    uint32_t size;
+    uint32_t frameId;
+    uint16_t streamId;
+};
+
+// 読み出したフレームの参照 (データは共有メモリを直接指す)
+struct SonarShmFrame
+{
+    const uint8_t* data{nullptr}; // 画像ヘッダ + 画素
+    size_t size{0};
+    uint16_t streamId{0};
+    uint32_t frameId{0};
+    uint64_t timestampUs{0};
+    uint64_t seq{0};
+};
+
+// 書き込み側 (1 プロセスに 1 つ)
+// 同名の既存のセグメントは作り直す (古いセグメントを開いている読み出し側は closed を見て開き直す)
+class SonarShmWriter
+{
+public:
+    SonarShmWriter(const std::string& name, size_t slotCapacity, uint32_t slotCount);
+    virtual ~SonarShmWriter();
+
+    SonarShmWriter(const SonarShmWriter&) = delete;
+    SonarShmWriter& operator=(const SonarShmWriter&) = delete;
+
+    bool isOpen() const;
+    size_t slotCapacity() const;
+
+    // 次のスロットのデータ部を返す。ここへ直接書いて commit() する
+    uint8_t* begin();
+    void commit(size_t size, uint16_t streamId, uint32_t frameId, uint64_t timestampUs);
+
+    // begin() + memcpy + commit()
+    bool publish(const uint8_t* data, size_t size, uint16_t streamId, uint32_t frameId,
+                 uint64_t timestampUs);
+
+private:
+    std::string mName;
+    uint8_t* mMap{nullptr};
+    size_t mMapSize{0};
+    SonarShmHeader* mHeader{nullptr};
+    uint64_t mSeq{0};
+    bool mWriting{false};
+};
+
+// 読み出し側
+class SonarShmReader
+{
+public:
+    // fromOldest: 残っている最も古いフレームから読む (false なら次に公開されるフレームから)
+    SonarShmReader(const std::string& name, bool fromOldest = false, int spinUs = 0);
+    virtual ~SonarShmReader();
+
+    SonarShmReader(const SonarShmReader&) = delete;
+    SonarShmReader& operator=(const SonarShmReader&) = delete;
+
+    // 書き込み側が作るまで失敗する。tryRead() / wait() は開いていなければ開き直す
+    bool open();
+    bool isOpen() const;
+
+    // 次のフレームがあれば out に設定する (ブロックしない)
+    // out.data は次の wait() / open() まで有効 (書き込み側が終了しても tryRead() は unmap しない)
+    bool tryRead(SonarShmFrame& out);
+    // 次のフレームが公開されるまで最大 timeoutUs 待つ
+    bool wait(int64_t timeoutUs);
+    // out のスロットがまだ上書きされていなければ true (読み終えた後に呼ぶ)
+    bool isValid(const SonarShmFrame& frame) const;
+
+    // 追い越されて読めなかったフレーム数
+    uint64_t droppedFrames() const;
+
+private:
+    void close();
+    SonarShmSlot* slot(uint64_t seq) const;
+
+    std::string mName;
+    bool mFromOldest;
+    int mSpinUs;
+    uint8_t* mMap{nullptr};
+    size_t mMapSize{0};
+    SonarShmHeader* mHeader{nullptr};
+    uint64_t mCursor{0};
+    uint64_t mDroppedFrames{0};
+    bool mReopen{false}; // 書き込み側が終了したので次の wait() / open() で開き直す
+};
+
+#endif // !defined(SONAR_SHM_RING_HH)
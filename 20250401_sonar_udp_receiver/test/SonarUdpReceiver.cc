@@ -0,0 +1,238 @@
+#include "SonarUdpReceiver.hh"
+#include "SonarMulticast.hh"
+#include <arpa/inet.h>
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <iostream>
+#include <unistd.h>
+
+#if !defined(SO_BUSY_POLL)
+#define SO_BUSY_POLL 46
+#endif
+
+namespace
+{
+constexpr size_t kControlBytes = CMSG_SPACE(sizeof(uint32_t));
+} // namespace
+
+// explicit
+SonarUdpReceiver::SonarUdpReceiver(const SonarUdpReceiverConfig& config) : mConfig(config)
+{
+    if (mConfig.batchSize < 1)
+        mConfig.batchSize = 1;
+
+    mFd = ::socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (mFd < 0)
+    {
+        std::cerr << "Error: socket() failed (" << strerror(errno) << ")" << std::endl;
+        return;
+    }
+
+    int one = 1;
+    setsockopt(mFd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    if (mConfig.reusePort && setsockopt(mFd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one)) != 0)
+        std::cerr << "Warning: SO_REUSEPORT failed (" << strerror(errno) << ")" << std::endl;
+
+    // 高フレームレート時にカーネル側で溢れないよう受信バッファを広げる
+    // (SO_RCVBUFFORCE は rmem_max を超えられるが CAP_NET_ADMIN が必要)
+    if (mConfig.receiveBufferBytes > 0)
+    {
+        int bytes = mConfig.receiveBufferBytes;
+        if (setsockopt(mFd, SOL_SOCKET, SO_RCVBUFFORCE, &bytes, sizeof(bytes)) != 0)
+            setsockopt(mFd, SOL_SOCKET, SO_RCVBUF, &bytes, sizeof(bytes));
+    }
+    // 溢れて捨てられた数を受け取る (損失がカーネルか経路かを区別するため)
+    setsockopt(mFd, SOL_SOCKET, SO_RXQ_OVFL, &one, sizeof(one));
+    socklen_t len = sizeof(mReceiveBufferBytes);
+    getsockopt(mFd, SOL_SOCKET, SO_RCVBUF, &mReceiveBufferBytes, &len);
+
+    if (mConfig.busyPollUs > 0)
+    {
+        int us = mConfig.busyPollUs;
+        if (setsockopt(mFd, SOL_SOCKET, SO_BUSY_POLL, &us, sizeof(us)) != 0)
+            std::cerr << "Warning: SO_BUSY_POLL failed (" << strerror(errno) << ")" << std::endl;
+    }
+
+    sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(mConfig.port);
+    const std::string& bindAddress =
+        mConfig.multicastGroup.empty() ? mConfig.bindAddress : mConfig.multicastGroup;
+    if (inet_pton(AF_INET, bindAddress.c_str(), &addr.sin_addr) != 1)
+    {
+        std::cerr << "Error: Invalid bind address " << bindAddress << std::endl;
+        ::close(mFd);
+        mFd = -1;
+        return;
+    }
+    if (::bind(mFd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0)
+    {
+        std::cerr << "Error: bind() failed (" << strerror(errno) << ")" << std::endl;
+        ::close(mFd);
+        mFd = -1;
+        return;
+    }
+    if (!mConfig.multicastGroup.empty() &&
+        !sonarJoinGroup(mFd, mConfig.multicastGroup, mConfig.multicastInterface,
+                        mConfig.multicastSource))
+    {
+        ::close(mFd);
+        mFd = -1;
+        return;
+    }
+
+    const int n = mConfig.batchSize;
+    mHeaders.resize(size_t(n) * mConfig.headerBytes);
+    mScratch.resize(size_t(n) * mConfig.datagramCapacity);
+    mIov.resize(2 * n);
+    mMsgs.resize(n);
+    mSources.resize(n);
+    mControl.resize(size_t(n) * kControlBytes);
+    for (int i = 0; i < n; ++i)
+    {
+        mIov[2 * i].iov_base = mHeaders.data() + size_t(i) * mConfig.headerBytes;
+        mIov[2 * i].iov_len = mConfig.headerBytes;
+        memset(&mMsgs[i], 0, sizeof(mMsgs[i]));
+        mMsgs[i].msg_hdr.msg_iov = &mIov[2 * i];
+        mMsgs[i].msg_hdr.msg_iovlen = 2;
+        mMsgs[i].msg_hdr.msg_name = &mSources[i];
+        mMsgs[i].msg_hdr.msg_namelen = sizeof(sockaddr_in);
+        mMsgs[i].msg_hdr.msg_control = mControl.data() + size_t(i) * kControlBytes;
+    }
+    resetPayloadTargets();
+}
+
+// virtual
+SonarUdpReceiver::~SonarUdpReceiver()
+{
+    if (mFd >= 0)
+        ::close(mFd);
+}
+
+bool
+SonarUdpReceiver::isOpen() const
+{
+    return mFd >= 0;
+}
+
+int
+SonarUdpReceiver::fd() const
+{
+    return mFd;
+}
+
+int
+SonarUdpReceiver::receiveBufferBytes() const
+{
+    return mReceiveBufferBytes;
+}
+
+int
+SonarUdpReceiver::batchSize() const
+{
+    return mConfig.batchSize;
+}
+
+size_t
+SonarUdpReceiver::headerBytes() const
+{
+    return mConfig.headerBytes;
+}
+
+void
+SonarUdpReceiver::setPayloadTarget(int i, uint8_t* dst, size_t capacity)
+{
+    mIov[2 * i + 1].iov_base = dst;
+    mIov[2 * i + 1].iov_len = capacity;
+}
+
+void
+SonarUdpReceiver::resetPayloadTargets()
+{
+    for (int i = 0; i < mConfig.batchSize; ++i)
+        setPayloadTarget(i, mScratch.data() + size_t(i) * mConfig.datagramCapacity,
+                         mConfig.datagramCapacity);
+}
+
+int
+SonarUdpReceiver::receiveBatch()
+{
+    if (mFd < 0)
+        return -1;
+    for (int i = 0; i < mConfig.batchSize; ++i)
+    {
+        mMsgs[i].msg_hdr.msg_namelen = sizeof(sockaddr_in);
+        mMsgs[i].msg_hdr.msg_controllen = kControlBytes;
+    }
+
+    int n;
+    do
+    {
+        n = recvmmsg(mFd, mMsgs.data(), mConfig.batchSize, MSG_DONTWAIT, nullptr);
+    } while (n < 0 && errno == EINTR);
+
+    if (n < 0)
+        return (errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : -1;
+
+    // 累計値なので最後のデータグラムの分だけ見ればよい (損失が無ければ付かない)
+    if (n > 0)
+    {
+        msghdr& last = mMsgs[n - 1].msg_hdr;
+        for (cmsghdr* c = CMSG_FIRSTHDR(&last); c; c = CMSG_NXTHDR(&last, c))
+        {
+            if (c->cmsg_level == SOL_SOCKET && c->cmsg_type == SO_RXQ_OVFL)
+                memcpy(&mKernelDrops, CMSG_DATA(c), sizeof(mKernelDrops));
+        }
+    }
+    return n;
+}
+
+uint32_t
+SonarUdpReceiver::kernelDrops() const
+{
+    return mKernelDrops;
+}
+
+const uint8_t*
+SonarUdpReceiver::header(int i) const
+{
+    return static_cast<const uint8_t*>(mIov[2 * i].iov_base);
+}
+
+const uint8_t*
+SonarUdpReceiver::payload(int i) const
+{
+    return static_cast<const uint8_t*>(mIov[2 * i + 1].iov_base);
+}
+
+long
+SonarUdpReceiver::payloadSize(int i) const
+{
+    return long(mMsgs[i].msg_len) - long(mConfig.headerBytes);
+}
+
+bool
+SonarUdpReceiver::truncated(int i) const
+{
+    return (mMsgs[i].msg_hdr.msg_flags & MSG_TRUNC) != 0;
+}
+
+const sockaddr_in&
+SonarUdpReceiver::source(int i) const
+{
+    return mSources[i];
+}
+
+void
+SonarUdpReceiver::relocateToScratch(int i)
+{
+    uint8_t* scratch = mScratch.data() + size_t(i) * mConfig.datagramCapacity;
+    if (mIov[2 * i + 1].iov_base == scratch)
+        return;
+    long n = payloadSize(i);
+    if (n > 0)
+        memcpy(scratch, mIov[2 * i + 1].iov_base, size_t(n));
+    setPayloadTarget(i, scratch, mConfig.datagramCapacity);
+}
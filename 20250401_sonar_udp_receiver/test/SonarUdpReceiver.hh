@@ -0,0 +1,95 @@
+#if !defined(SONAR_UDP_RECEIVER_HH)
+#define SONAR_UDP_RECEIVER_HH
+
+#include "SonarProtocol.hh"
+#include <cstddef>
+#include <cstdint>
+#include <netinet/in.h>
+#include <string>
+#include <sys/socket.h>
+#include <vector>
+
+// UDP 受信ソケットの設定
+struct SonarUdpReceiverConfig
+{
+    std::string bindAddress{"127.0.0.1"};
+    uint16_t port{5700};
+    int batchSize{64};                         // recvmmsg 1 回で受け取る最大データグラム数
+    size_t headerBytes{kSonarChunkHeaderSize}; // 本体と分けて受け取るプロトコルヘッダ長
+    size_t datagramCapacity{65536};            // データグラム本体 1 つ分のバッファ
+    int receiveBufferBytes{8 * 1024 * 1024};   // SO_RCVBUF (0: OS 既定値)
+    int busyPollUs{0};                         // SO_BUSY_POLL [us] (0: 無効)
+    // SO_REUSEPORT: 同じアドレス・ポートに bind した複数のソケットへカーネルが振り分ける
+    // 振り分けは送信元アドレス・ポートのハッシュなので、1 つの送信元は常に同じソケットに届く
+    bool reusePort{false};
+
+    // マルチキャスト (multicastGroup が空でなければ bindAddress の代わりにグループへ bind して参加)
+    // 同じホストの複数の受信側が同じグループ・ポートを共有できる
+    std::string multicastGroup;
+    std::string multicastInterface;            // インタフェース名またはアドレス (空: 既定)
+    std::string multicastSource;               // 送信元を限定する (SSM, 空: 全て)
+};
+
+// recvmmsg でデータグラムをまとめて受信するネイティブソケット
+// バッファは生成時に確保し、受信毎の確保は行わない
+//
+// 各データグラムはヘッダ (headerBytes) と本体に分けて scatter 受信する
+// setPayloadTarget() で本体の格納先を指定すると、カーネルから直接そこへコピーされる
+// (指定しなければ内部のスクラッチバッファ)
+class SonarUdpReceiver
+{
+public:
+    explicit SonarUdpReceiver(const SonarUdpReceiverConfig& config);
+    virtual ~SonarUdpReceiver();
+
+    SonarUdpReceiver(const SonarUdpReceiver&) = delete;
+    SonarUdpReceiver& operator=(const SonarUdpReceiver&) = delete;
+
+    bool isOpen() const;
+    int fd() const;
+    // 実際に設定された SO_RCVBUF
+    int receiveBufferBytes() const;
+
+    int batchSize() const;
+    size_t headerBytes() const;
+
+    // 次の receiveBatch() で i 番目のデータグラム本体を dst へ受信する
+    // capacity は送信側の最大ペイロード以上にすること (足りなければ切り詰められる)
+    void setPayloadTarget(int i, uint8_t* dst, size_t capacity);
+    // 全ての格納先をスクラッチバッファへ戻す
+    void resetPayloadTargets();
+
+    // ノンブロッキングで受信できるだけ受信する (最大 batchSize)
+    // 受信数を返す。無ければ 0、エラーなら -1
+    int receiveBatch();
+
+    // receiveBatch() で受信した i 番目のデータグラム (次の receiveBatch() まで有効)
+    // ヘッダより短いデータグラムは payloadSize() < 0
+    const uint8_t* header(int i) const;
+    const uint8_t* payload(int i) const;
+    long payloadSize(int i) const;
+    bool truncated(int i) const;
+    const sockaddr_in& source(int i) const;
+
+    // 受信バッファが溢れてカーネルが捨てたデータグラム数 (累計)
+    // SO_RXQ_OVFL で各データグラムに付く値を receiveBatch() 毎に読む (最初の損失までは 0)
+    uint32_t kernelDrops() const;
+
+    // 格納先が別用途に必要になった場合、本体をスクラッチバッファへ退避する
+    void relocateToScratch(int i);
+
+private:
+    SonarUdpReceiverConfig mConfig;
+    int mFd{-1};
+    int mReceiveBufferBytes{0};
+
+    std::vector<uint8_t> mHeaders;
+    std::vector<uint8_t> mScratch;
+    std::vector<iovec> mIov; // データグラム毎に [ヘッダ, 本体]
+    std::vector<mmsghdr> mMsgs;
+    std::vector<sockaddr_in> mSources;
+    std::vector<uint8_t> mControl; // データグラム毎の補助データ (SO_RXQ_OVFL)
+    uint32_t mKernelDrops{0};
+};
+
+#endif // !defined(SONAR_UDP_RECEIVER_HH)
@@ -1,143 +1,411 @@
 #include "Widget.hh"
-#include <QtCore/QDataStream>
+#include "SonarJitterBuffer.hh"
+#include "SonarReassembler.hh"
+#include "SonarShmRing.hh"
+#include "SonarUdpReceiver.hh"
 #include <QtCore/QMetaObject>
+#include <QtCore/QSocketNotifier>
 #include <QtCore/QThread>
+#include <QtCore/QTimer>
+#include <QtCore/QtDebug>
 #include <QtGui/QPaintEvent>
 #include <QtGui/QPainter>
-#include <QtNetwork/QHostAddress>
-#include <QtNetwork/QUdpSocket>
+#include <algorithm>
 #include <cmath>
+#include <cstring>
+#include <map>
+#include <memory>
 
 // UdpWorker: CHUNKED UDP を受信し、再構築して Widget に通知する
+// recvmmsg でまとめて受信し、チャンクはプールのフレームバッファへ直接置く
+// 送信元とストリーム ID 毎に独立して再構築する
+// ジッタバッファが有効なら、ストリーム毎に送信時刻の順に一定の遅延で通知する
+//
+// 計測値は Widget の SonarMetricsRegistry へ登録する (表示スレッドから読んで統計ファイルへ書く)
+//
+// 受信スレッドを複数にする場合は、各スレッドの UdpWorker が SO_REUSEPORT で同じポートに bind し、
+// カーネルが送信元毎にいずれか 1 つのソケットへ振り分ける
 class UdpWorker : public QObject
 {
 public:
-    UdpWorker(quint16 port, int maxPayload, Widget* target)
-        : m_port(port), m_maxPayload(maxPayload), m_target(target)
+    UdpWorker(int shard, const SonarUdpReceiverConfig& config,
+              const SonarReassemblerConfig& reassemblerConfig,
+              const SonarJitterBufferConfig& jitterConfig,
+              const std::shared_ptr<SonarMetricsRegistry>& metrics, Widget* target)
+        : m_shard(shard),
+          m_target(target),
+          m_receiver(config),
+          m_pool((kMaxFrameBytes + reassemblerConfig.maxPayload - 1) /
+                     reassemblerConfig.maxPayload * reassemblerConfig.maxPayload,
+                 std::max(1, reassemblerConfig.maxStreams) *
+                         (reassemblerConfig.maxFramesInFlight + 1 +
+                          (jitterConfig.targetLatencyUs > 0 ? int(jitterConfig.maxFrames) : 0)) +
+                     kPoolFrames),
+          m_reassembler(m_pool, reassemblerConfig,
+                        [this](const SonarFramePtr& frame) { onFrameComplete(frame); },
+                        metrics),
+          m_jitterConfig(jitterConfig),
+          m_socketMetrics(metrics->addSocket(shard))
     {
-        sock.bind(QHostAddress::LocalHost, m_port, QUdpSocket::ShareAddress);
-        connect(&sock, &QUdpSocket::readyRead, this, &UdpWorker::processDatagrams,
+        if (jitterConfig.targetLatencyUs > 0)
+        {
+            m_playoutTimer = new QTimer(this);
+            m_playoutTimer->setSingleShot(true);
+            m_playoutTimer->setTimerType(Qt::PreciseTimer);
+            connect(m_playoutTimer, &QTimer::timeout, this, &UdpWorker::releaseFrames);
+        }
+
+        if (!m_receiver.isOpen())
+            return;
+        m_notifier = new QSocketNotifier(m_receiver.fd(), QSocketNotifier::Read, this);
+        connect(m_notifier, &QSocketNotifier::activated, this, &UdpWorker::processDatagrams,
                 Qt::DirectConnection);
+
+        // 受信が途絶えても不完全なフレームをタイムアウトさせ、損失を報告する
+        m_timer = new QTimer(this);
+        connect(m_timer, &QTimer::timeout, this, &UdpWorker::checkLoss);
+        m_timer->start(kLossReportIntervalMs);
     }
 
 private:
     void
     processDatagrams()
     {
-        while (sock.hasPendingDatagrams())
+        int n;
+        do
         {
-            QByteArray datagram;
-            datagram.resize(int(sock.pendingDatagramSize()));
-            sock.readDatagram(datagram.data(), datagram.size());
-            if (datagram.size() < 4)
-                continue;
-
-            QDataStream seqStream(datagram);
-            seqStream.setByteOrder(QDataStream::BigEndian);
-            quint32 seq;
-            seqStream >> seq;
-            QByteArray chunk = datagram.mid(4);
-
-            if (seq == 0)
+            m_reassembler.prepare(m_receiver);
+            n = m_receiver.receiveBatch();
+            if (n > 0)
             {
-                buffer.clear();
-                headerParsed = false;
-                expectedSize = 0;
+                ++m_socketMetrics->batches;
+                m_socketMetrics->datagrams += uint64_t(n);
+                m_reassembler.process(m_receiver, n);
             }
-            int offset = int(seq) * m_maxPayload;
-            int need = offset + chunk.size();
-            if (buffer.size() < need)
-                buffer.resize(need);
-            memcpy(buffer.data() + offset, chunk.constData(), chunk.size());
+        } while (n == m_receiver.batchSize());
+        m_socketMetrics->kernelDrops.set(m_receiver.kernelDrops());
+    }
+
+    void
+    onFrameComplete(const SonarFramePtr& frame)
+    {
+        if (!m_playoutTimer)
+        {
+            post(frame);
+            return;
+        }
+        // 送信側毎に時計と経路が違うため、遅延はストリーム毎に推定する
+        std::unique_ptr<SonarJitterBuffer>& jitter = m_jitter[SonarStreamKey::of(*frame)];
+        if (!jitter)
+            jitter.reset(new SonarJitterBuffer(m_jitterConfig));
+        jitter->push(frame, SonarJitterBuffer::nowUs());
+        releaseFrames();
+    }
+
+    // 再生時刻を過ぎたフレームを通知し、最も早い次のフレームの時刻にタイマーを掛け直す
+    void
+    releaseFrames()
+    {
+        int64_t now = SonarJitterBuffer::nowUs();
+        int64_t next = -1;
+        for (auto& entry : m_jitter)
+        {
+            while (SonarFramePtr frame = entry.second->pop(now))
+                post(frame);
+            int64_t release = entry.second->nextReleaseUs();
+            if (release >= 0 && (next < 0 || release < next))
+                next = release;
+        }
+        if (next >= 0)
+            m_playoutTimer->start(int(std::max<int64_t>(0, (next - now + 999) / 1000)));
+    }
+
+    void
+    post(const SonarFramePtr& frame)
+    {
+        // UI スレッドへ渡す (フレームは参照で渡す)
+        m_target->deliver(frame);
+    }
+
+    void
+    checkLoss()
+    {
+        m_reassembler.expire();
+        const std::vector<SonarStreamStats> streams = m_reassembler.streamStats();
+        dropIdleJitterBuffers(streams);
+        const SonarReassemblerStats stats = m_reassembler.stats();
+        const uint64_t kernelDrops = m_socketMetrics->kernelDrops.value();
+        uint64_t lost =
+            stats.expiredFrames + stats.missingFrames + stats.poolExhausted + kernelDrops;
+        uint64_t errors = stats.crcErrors + stats.malformedDatagrams + stats.recoveredChunks +
+                          stats.codecErrors;
+        if (lost == m_reportedLost && errors == m_reportedErrors)
+            return;
+        qWarning("[shard %d, %d streams] frames: %llu completed, %llu expired "
+                 "(%llu chunks missing), %llu missing, %llu no buffer; chunks: %llu crc errors, "
+                 "%llu malformed, %llu late, %llu duplicate, %llu recovered by FEC; "
+                 "%llu undecodable; %llu datagrams dropped by the kernel",
+                 m_shard, int(streams.size()), (unsigned long long)stats.completedFrames,
+                 (unsigned long long)stats.expiredFrames,
+                 (unsigned long long)stats.missingChunks,
+                 (unsigned long long)stats.missingFrames,
+                 (unsigned long long)stats.poolExhausted, (unsigned long long)stats.crcErrors,
+                 (unsigned long long)stats.malformedDatagrams,
+                 (unsigned long long)stats.lateChunks,
+                 (unsigned long long)stats.duplicateChunks,
+                 (unsigned long long)stats.recoveredChunks,
+                 (unsigned long long)stats.codecErrors, (unsigned long long)kernelDrops);
+        m_reportedLost = lost;
+        m_reportedErrors = errors;
+        for (const auto& entry : m_jitter)
+        {
+            const SonarJitterBufferStats& jitterStats = entry.second->stats();
+            qWarning("jitter buffer (stream %u): latency %lld us, jitter %lld us, %llu late, "
+                     "%llu overflow",
+                     unsigned(entry.first.streamId), (long long)entry.second->latencyUs(),
+                     (long long)entry.second->jitterUs(),
+                     (unsigned long long)jitterStats.lateFrames,
+                     (unsigned long long)jitterStats.overflowFrames);
+        }
+    }
 
-            if (!headerParsed && buffer.size() >= 12)
+    // 再構築側が捨てたストリームのジッタバッファを捨てる
+    void
+    dropIdleJitterBuffers(const std::vector<SonarStreamStats>& streams)
+    {
+        for (auto it = m_jitter.begin(); it != m_jitter.end();)
+        {
+            bool alive = it->second->nextReleaseUs() >= 0;
+            for (size_t i = 0; i < streams.size() && !alive; ++i)
+                alive = streams[i].key == it->first;
+            it = alive ? std::next(it) : m_jitter.erase(it);
+        }
+    }
+
+    // 1024x1024 16bit まで
+    static constexpr size_t kMaxFrameBytes = kSonarImageHeaderSize + 1024 * 1024 * 2;
+    // ストリーム毎の組み立て中のフレームと差分圧縮の基準フレームに加えて表示側が保持できる数
+    static constexpr int kPoolFrames = 4;
+    static constexpr int kLossReportIntervalMs = 1000;
+
+    int m_shard;
+    Widget* m_target;
+    SonarUdpReceiver m_receiver;
+    SonarFramePool m_pool;
+    SonarReassembler m_reassembler;
+    SonarJitterBufferConfig m_jitterConfig;
+    std::shared_ptr<SonarSocketMetrics> m_socketMetrics;
+    std::map<SonarStreamKey, std::unique_ptr<SonarJitterBuffer>> m_jitter;
+    QTimer* m_playoutTimer{nullptr};
+    QSocketNotifier* m_notifier{nullptr};
+    QTimer* m_timer{nullptr};
+    uint64_t m_reportedLost{0};
+    uint64_t m_reportedErrors{0};
+};
+
+// ShmWorker: 同一ホストの送信側が共有メモリのリングに書いたフレームを Widget に通知する
+// 表示は最新のフレームだけでよいので、溜まっていれば最新の 1 つだけをプールへコピーする
+// (共有メモリを参照したまま描画すると書き込み側に上書きされるため)
+class ShmWorker : public QObject
+{
+public:
+    ShmWorker(const std::string& name, Widget* target)
+        : m_target(target),
+          m_reader(name),
+          m_pool(kMaxFrameBytes, kPoolFrames)
+    {
+    }
+
+    // スレッドの開始時に呼ばれ、interruption が要求されるまで戻らない
+    void
+    run()
+    {
+        QThread* thread = QThread::currentThread();
+        while (!thread->isInterruptionRequested())
+        {
+            if (!m_reader.wait(kWaitUs))
+                continue;
+            SonarShmFrame latest, next;
+            bool found = false;
+            while (m_reader.tryRead(next))
             {
-                QDataStream hdr(buffer);
-                hdr.setByteOrder(QDataStream::BigEndian);
-                quint16 w, h, sw, rg;
-                quint32 is16;
-                hdr >> w >> h >> sw >> rg >> is16;
-                int pixelBytes = int(w) * int(h) * (is16 ? 2 : 1);
-                expectedSize = 12 + pixelBytes;
-                headerParsed = true;
-                curW = w;
-                curH = h;
-                curSw = sw;
-                curRg = rg;
-                curIs16 = (is16 == 1);
+                latest = next;
+                found = true;
             }
-            if (headerParsed && buffer.size() >= expectedSize)
+            if (found)
+                copyAndPost(latest);
+            if (m_reader.droppedFrames() != m_reportedDropped)
             {
-                QByteArray full = buffer.left(expectedSize);
-                QByteArray raw = full.mid(12);
-                // UI スレッドに通知
-                QMetaObject::invokeMethod(m_target, "onFrameDecoded", Qt::QueuedConnection,
-                                          Q_ARG(int, curW), Q_ARG(int, curH), Q_ARG(int, curSw),
-                                          Q_ARG(int, curRg), Q_ARG(bool, curIs16),
-                                          Q_ARG(QByteArray, raw));
-                headerParsed = false;
+                m_reportedDropped = m_reader.droppedFrames();
+                qWarning("shm: %llu frames overwritten before being read",
+                         (unsigned long long)m_reportedDropped);
             }
         }
     }
 
-    quint16 m_port;
-    int m_maxPayload;
+private:
+    void
+    copyAndPost(const SonarShmFrame& shm)
+    {
+        SonarFramePtr frame = m_pool.acquire();
+        if (!frame || shm.size > frame->capacity())
+            return;
+        memcpy(frame->data(), shm.data, shm.size);
+        if (!m_reader.isValid(shm))
+            return;
+        frame->size = shm.size;
+        frame->streamId = shm.streamId;
+        frame->frameId = shm.frameId;
+        frame->timestampUs = shm.timestampUs;
+        if (!frame->parseImageHeader())
+            return;
+        m_target->deliver(frame);
+    }
+
+    static constexpr size_t kMaxFrameBytes = kSonarImageHeaderSize + 1024 * 1024 * 2;
+    static constexpr int kPoolFrames = 4;
+    // 終了要求を確認する間隔
+    static constexpr int64_t kWaitUs = 100000;
+
     Widget* m_target;
-    QUdpSocket sock;
-    QByteArray buffer;
-    int expectedSize{0};
-    bool headerParsed{false};
-    int curW{0}, curH{0}, curSw{0}, curRg{0};
-    bool curIs16{false};
+    SonarShmReader m_reader;
+    SonarFramePool m_pool;
+    uint64_t m_reportedDropped{0};
 };
 
 // explicit
-Widget::Widget(QWidget* pParent) : QWidget(pParent)
+Widget::Widget(const SonarUdpReceiverConfig& config,
+               const SonarReassemblerConfig& reassemblerConfig,
+               const SonarJitterBufferConfig& jitterConfig, int receiveThreads, QWidget* pParent)
+    : QWidget(pParent)
 {
-    m_worker = new UdpWorker(5700, 60000, this);
-    m_thread = new QThread(this);
-    m_worker->moveToThread(m_thread);
-    connect(m_thread, &QThread::finished, m_worker, &QObject::deleteLater);
-    m_thread->start();
+
+    // マルチキャストは SO_REUSEPORT の全ソケットに複製されて届くため分担できない
+    if (receiveThreads > 1 && !config.multicastGroup.empty())
+    {
+        qWarning("multicast reception uses a single receive thread");
+        receiveThreads = 1;
+    }
+    SonarUdpReceiverConfig shardConfig = config;
+    shardConfig.reusePort = receiveThreads > 1;
+    for (int i = 0; i < std::max(1, receiveThreads); ++i)
+    {
+        QThread* thread =
+            createThread(new UdpWorker(i, shardConfig, reassemblerConfig, jitterConfig, m_metrics,
+                                       this));
+        thread->setObjectName(QString("udp-rx-%1").arg(i));
+        thread->start();
+    }
+    startStatsTimer();
     setMinimumSize(600, 600);
 }
 
-Widget::~Widget()
+Widget::Widget(const std::string& shmName, QWidget* pParent)
+    : QWidget(pParent)
 {
-    m_thread->quit();
-    m_thread->wait();
+    ShmWorker* worker = new ShmWorker(shmName, this);
+    QThread* thread = createThread(worker);
+    connect(thread, &QThread::started, worker, &ShmWorker::run);
+    thread->start();
+    startStatsTimer();
+    setMinimumSize(600, 600);
 }
 
-void
-Widget::onFrameDecoded(int w, int h, int sw, int rg, bool is16, QByteArray raw)
+Widget::~Widget()
 {
-    m_width = w;
-    m_height = h;
-    m_swath = sw;
-    m_range = rg;
-    m_is16bit = is16;
-    int count = w * h;
-    if (is16)
-    {
-        m_frame16.resize(count);
-        memcpy(m_frame16.data(), raw.constData(), count * sizeof(quint16));
-    }
-    else
+    for (QThread* thread : m_threads)
     {
-        m_frame8.resize(count);
-        memcpy(m_frame8.data(), raw.constData(), count * sizeof(quint8));
+        thread->requestInterruption();
+        thread->quit();
     }
-    update();
+    for (QThread* thread : m_threads)
+        thread->wait();
+}
+
+void
+Widget::setDisplayStream(int streamId)
+{
+    m_displayStream = streamId;
+}
+
+void
+Widget::setStatsFile(const std::string& path)
+{
+    m_statsFile = path;
+}
+
+const SonarMetricsRegistry&
+Widget::metrics() const
+{
+    return *m_metrics;
+}
+
+// worker を専用のスレッドへ移す (スレッドの終了時に worker を破棄する)
+QThread*
+Widget::createThread(QObject* worker)
+{
+    QThread* thread = new QThread(this);
+    worker->moveToThread(thread);
+    connect(thread, &QThread::finished, worker, &QObject::deleteLater);
+    m_threads.push_back(thread);
+    return thread;
+}
+
+void
+Widget::deliver(const SonarFramePtr& frame)
+{
+    // 複数のソナーヘッドから受信している場合は指定したストリームだけを表示する
+    int displayStream = m_displayStream.load(std::memory_order_relaxed);
+    if (displayStream >= 0 && frame->streamId != displayStream)
+        return;
+    // 描画待ちのフレームがあれば上書きするだけ (再描画の要求はその時に出したもの 1 回)
+    if (m_mailbox.put(frame))
+        QMetaObject::invokeMethod(this, "update", Qt::QueuedConnection);
+}
+
+void
+Widget::startStatsTimer()
+{
+    QTimer* timer = new QTimer(this);
+    connect(timer, &QTimer::timeout, this, &Widget::reportStats);
+    timer->start(kStatsIntervalMs);
+}
+
+void
+Widget::reportStats()
+{
+    if (!m_statsFile.empty() && !m_metrics->writeJson(m_statsFile))
+        qWarning("failed to write %s", m_statsFile.c_str());
+
+    uint64_t dropped = m_mailbox.droppedFrames();
+    if (dropped == m_reportedDropped)
+        return;
+    qWarning("display: %llu frames drawn, %llu superseded before repaint",
+             (unsigned long long)m_mailbox.deliveredFrames(), (unsigned long long)dropped);
+    m_reportedDropped = dropped;
 }
 
 void
 Widget::paintEvent(QPaintEvent*)
 {
+    // 最新のフレームだけを取る。画素はコピーせず、フレームバッファを参照したまま描画する
+    if (SonarFramePtr frame = m_mailbox.take())
+    {
+        m_frame = std::move(frame);
+        m_width = m_frame->width;
+        m_height = m_frame->height;
+        m_swath = m_frame->swath;
+        m_range = m_frame->range;
+        m_is16bit = m_frame->is16bit;
+    }
+
     QPainter painter(this);
     painter.setRenderHint(QPainter::Antialiasing);
     painter.fillRect(rect(), mBackgroundColor);
-    if ((m_is16bit && m_frame16.isEmpty()) || (!m_is16bit && m_frame8.isEmpty()))
+    if (!m_frame)
         return;
+    const quint8* frame8 = m_frame->pixels();
+    const quint16* frame16 = reinterpret_cast<const quint16*>(m_frame->pixels());
 
     QPointF center(width() / 2.0, height());
     double scale = (height() * 0.9) / m_range;
@@ -164,7 +432,7 @@ Widget::paintEvent(QPaintEvent*)
         for (int r = 0; r < m_height; ++r)
         {
             int idx = r * m_width + i;
-            int v = m_is16bit ? m_frame16[idx] : m_frame8[idx];
+            int v = m_is16bit ? frame16[idx] : frame8[idx];
             if (v < mMinIntensity)
                 v = mMinIntensity;
             if (v > mMaxIntensity)
@@ -1,36 +1,62 @@
 #if !defined(WIDGET_HH)
 #define WIDGET_HH
 
-#include <QtCore/QByteArray>
-#include <QtCore/QVector>
+#include "SonarFrame.hh"
+#include "SonarFrameMailbox.hh"
+#include "SonarJitterBuffer.hh"
+#include "SonarMetrics.hh"
+#include "SonarReassembler.hh"
+#include "SonarUdpReceiver.hh"
 #include <QtGui/QColor>
 #include <QtWidgets/QWidget>
+#include <atomic>
+#include <memory>
+#include <string>
+#include <vector>
 
 class QPaintEvent;
-class UdpWorker;
 class QThread;
 
 class Widget : public QWidget
 {
     Q_OBJECT
 public:
-    explicit Widget(QWidget* pParent = nullptr);
+    explicit Widget(const SonarUdpReceiverConfig& config = SonarUdpReceiverConfig(),
+                    const SonarReassemblerConfig& reassemblerConfig = SonarReassemblerConfig(),
+                    const SonarJitterBufferConfig& jitterConfig = SonarJitterBufferConfig(),
+                    int receiveThreads = 1, QWidget* pParent = nullptr);
+    // 共有メモリのリング (SonarShmRing) から受け取る
+    explicit Widget(const std::string& shmName, QWidget* pParent = nullptr);
     virtual ~Widget();
 
+    // 表示するストリーム ID (負なら全て)
+    void setDisplayStream(int streamId);
+    // 受信の計測値 (SonarMetricsRegistry::toJson) を 1 秒毎に path へ書く (空なら書かない)
+    void setStatsFile(const std::string& path);
+    // ストリーム毎・受信ソケット毎の計測値 (任意のスレッドから読める)
+    const SonarMetricsRegistry& metrics() const;
+
+    // 受信したフレームを渡す (受信スレッドから呼ぶ)
+    // 次の描画までに届いたフレームは最新の 1 つだけが描画される
+    void deliver(const SonarFramePtr& frame);
+
 protected:
     void paintEvent(QPaintEvent* event) override;
 
 private slots:
-    void onFrameDecoded(int w, int h, int sw, int rg, bool is16, QByteArray raw);
+    void reportStats();
 
 private:
     int calculateTickStep(int range) const;
+    QThread* createThread(QObject* worker);
+    void startStatsTimer();
+
+    static constexpr int kStatsIntervalMs = 1000;
 
     // Sonar parameters
     int m_width{0}, m_height{0}, m_swath{0}, m_range{0};
     bool m_is16bit{false};
-    QVector<quint8> m_frame8;
-    QVector<quint16> m_frame16;
+    SonarFramePtr m_frame;
 
     // Rendering parameters
     int mMinIntensity{0};
@@ -40,9 +66,16 @@ private:
     QColor mMinIntensityColor{Qt::yellow};
     QColor mMaxIntensityColor{Qt::black};
 
-    // Worker thread
-    QThread* m_thread{nullptr};
-    UdpWorker* m_worker{nullptr};
+    std::atomic<int> m_displayStream{-1};
+    SonarFrameMailbox m_mailbox;
+    uint64_t m_reportedDropped{0};
+
+    // 受信スレッドより長生きする場合があるため共有する
+    std::shared_ptr<SonarMetricsRegistry> m_metrics{std::make_shared<SonarMetricsRegistry>()};
+    std::string m_statsFile;
+
+    // Worker threads (受信シャード毎に 1 つ)
+    std::vector<QThread*> m_threads;
 };
 
 #endif // !defined(WIDGET_HH)
@@ -1,11 +1,98 @@
 #include "Widget.hh"
 #include <QApplication>
+#include <QCommandLineParser>
 
 int
 main(int argc, char* argv[])
 {
     QApplication a(argc, argv);
-    Widget w;
+
+    QCommandLineParser parser;
+    parser.setApplicationDescription("Receive and display chunked sonar frames over UDP");
+    parser.addHelpOption();
+
+    QCommandLineOption bindOpt(QStringList{"b", "bind"}, "Bind address", "ADDRESS", "127.0.0.1");
+    parser.addOption(bindOpt);
+    QCommandLineOption portOpt(QStringList{"p", "port"}, "UDP port", "PORT", "5700");
+    parser.addOption(portOpt);
+    QCommandLineOption groupOpt(QStringList{"g", "group"}, "Multicast group to join", "GROUP");
+    parser.addOption(groupOpt);
+    QCommandLineOption ifaceOpt("iface", "Multicast interface (name or address)", "IFACE");
+    parser.addOption(ifaceOpt);
+    QCommandLineOption sourceOpt("source", "Accept multicast only from this sender (SSM)",
+                                 "ADDRESS");
+    parser.addOption(sourceOpt);
+    QCommandLineOption rcvbufOpt("rcvbuf", "Socket receive buffer size [bytes]", "BYTES",
+                                 QString::number(8 * 1024 * 1024));
+    parser.addOption(rcvbufOpt);
+    QCommandLineOption busyPollOpt("busy-poll", "SO_BUSY_POLL duration [us] (0: disabled)", "US",
+                                   "0");
+    parser.addOption(busyPollOpt);
+    QCommandLineOption batchOpt("batch", "Datagrams per recvmmsg call", "N", "64");
+    parser.addOption(batchOpt);
+    QCommandLineOption threadsOpt(QStringList{"t", "threads"},
+                                  "Receive threads sharing the port via SO_REUSEPORT", "N", "1");
+    parser.addOption(threadsOpt);
+    QCommandLineOption maxStreamsOpt("max-streams",
+                                     "Streams (source address + stream ID) per receive thread",
+                                     "N", "8");
+    parser.addOption(maxStreamsOpt);
+    QCommandLineOption displayStreamOpt("display-stream", "Only display this stream ID", "ID");
+    parser.addOption(displayStreamOpt);
+    QCommandLineOption timeoutOpt("timeout", "Incomplete frame timeout [ms]", "MS", "200");
+    parser.addOption(timeoutOpt);
+    QCommandLineOption noCrcOpt("no-crc", "Skip CRC32C verification of chunks");
+    parser.addOption(noCrcOpt);
+    QCommandLineOption jitterOpt("jitter-buffer",
+                                 "Jitter buffer target latency [ms] (0: display frames on arrival)",
+                                 "MS", "0");
+    parser.addOption(jitterOpt);
+    QCommandLineOption jitterMaxOpt("jitter-max", "Maximum jitter buffer latency [ms]", "MS",
+                                    "500");
+    parser.addOption(jitterMaxOpt);
+    QCommandLineOption fixedJitterOpt("fixed-jitter", "Do not adapt the jitter buffer latency");
+    parser.addOption(fixedJitterOpt);
+    QCommandLineOption statsFileOpt("stats-file",
+                                    "Write per-stream counters and histograms to PATH (JSON, 1 s)",
+                                    "PATH");
+    parser.addOption(statsFileOpt);
+    QCommandLineOption shmOpt("shm", "Read frames from a same-host shared memory ring instead of UDP",
+                              "NAME");
+    parser.addOption(shmOpt);
+    parser.process(a);
+
+    if (parser.isSet(shmOpt))
+    {
+        Widget w(parser.value(shmOpt).toStdString());
+        w.setWindowTitle("SonarPanel (shm)");
+        w.show();
+        return a.exec();
+    }
+
+    SonarUdpReceiverConfig config;
+    config.bindAddress = parser.value(bindOpt).toStdString();
+    config.port = parser.value(portOpt).toUShort();
+    config.multicastGroup = parser.value(groupOpt).toStdString();
+    config.multicastInterface = parser.value(ifaceOpt).toStdString();
+    config.multicastSource = parser.value(sourceOpt).toStdString();
+    config.receiveBufferBytes = parser.value(rcvbufOpt).toInt();
+    config.busyPollUs = parser.value(busyPollOpt).toInt();
+    config.batchSize = parser.value(batchOpt).toInt();
+
+    SonarReassemblerConfig reassemblerConfig;
+    reassemblerConfig.timeoutUs = int64_t(parser.value(timeoutOpt).toInt()) * 1000;
+    reassemblerConfig.verifyCrc = !parser.isSet(noCrcOpt);
+    reassemblerConfig.maxStreams = parser.value(maxStreamsOpt).toInt();
+
+    SonarJitterBufferConfig jitterConfig;
+    jitterConfig.targetLatencyUs = int64_t(parser.value(jitterOpt).toInt()) * 1000;
+    jitterConfig.maxLatencyUs = int64_t(parser.value(jitterMaxOpt).toInt()) * 1000;
+    jitterConfig.adaptive = !parser.isSet(fixedJitterOpt);
+
+    Widget w(config, reassemblerConfig, jitterConfig, parser.value(threadsOpt).toInt());
+    w.setStatsFile(parser.value(statsFileOpt).toStdString());
+    if (parser.isSet(displayStreamOpt))
+        w.setDisplayStream(parser.value(displayStreamOpt).toInt());
     w.setWindowTitle("SonarPanel");
     w.show();
     return a.exec();
@@ -18,8 +18,19 @@ DEFINES += QT_DEPRECATED_WARNINGS
 #DEFINES += QT_DISABLE_DEPRECATED_BEFORE=0x060000    # disables all the APIs deprecated before Qt 6.0.0
 
 # Input
-HEADERS += Widget.hh
-SOURCES += Widget.cc test.cc
+HEADERS += Widget.hh SonarUdpReceiver.hh SonarFrame.hh SonarReassembler.hh SonarProtocol.hh \
+           SonarJitterBuffer.hh SonarMulticast.hh SonarShmRing.hh \
+           SonarFrameMailbox.hh SonarCodec.hh SonarMetrics.hh
+SOURCES += Widget.cc test.cc SonarUdpReceiver.cc SonarFrame.cc SonarReassembler.cc \
+           SonarProtocol.cc SonarJitterBuffer.cc SonarMulticast.cc SonarShmRing.cc \
+           SonarFrameMailbox.cc SonarCodec.cc SonarMetrics.cc
+
+# LZ4 圧縮されたフレームの展開 (liblz4 があれば)
+CONFIG += link_pkgconfig
+packagesExist(liblz4) {
+    DEFINES += SONAR_HAVE_LZ4
+    PKGCONFIG += liblz4
+}
 
 QT += widgets
 QT += network
@@ -0,0 +1,206 @@
+#include "SonarFrameSource.hh"
+#include "SonarLog.hh"
+#include <algorithm>
+#include <cctype>
+#include <fcntl.h>
+#include <iostream>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#if defined(SONAR_HAVE_OPENCV)
+#include <opencv2/imgproc.hpp>
+#include <opencv2/videoio.hpp>
+#endif
+
+namespace {
+
+std::string lowerExtension(const std::string& path) {
+    size_t dot = path.find_last_of('.');
+    if (dot == std::string::npos)
+        return "";
+    std::string ext = path.substr(dot);
+    std::transform(ext.begin(), ext.end(), ext.begin(),
+                   [](unsigned char c) { return char(std::tolower(c)); });
+    return ext;
+}
+
+// Headerless frames, mapped so that frames are sent straight from the page cache
+class RawSource : public SonarFrameSource {
+public:
+    explicit RawSource(const SonarRawFormat& format) : format(format) {}
+
+    ~RawSource() override {
+        if (map)
+            munmap(const_cast<uint8_t*>(map), mapSize);
+    }
+
+    bool open(const std::string& path) {
+        int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0)
+            return false;
+        struct stat st;
+        if (fstat(fd, &st) != 0 || st.st_size == 0) {
+            ::close(fd);
+            return false;
+        }
+        mapSize = size_t(st.st_size);
+        void* p = mmap(nullptr, mapSize, PROT_READ, MAP_PRIVATE, fd, 0);
+        ::close(fd);
+        if (p == MAP_FAILED) {
+            map = nullptr;
+            return false;
+        }
+        map = static_cast<const uint8_t*>(p);
+        madvise(p, mapSize, MADV_SEQUENTIAL);
+        frameBytes = size_t(format.width) * format.height * (format.is16bit ? 2 : 1);
+        if (frameBytes == 0 || mapSize < frameBytes) {
+            std::cerr << "Error: " << path << " is smaller than one " << format.width << "x"
+                      << format.height << " frame" << std::endl;
+            return false;
+        }
+        return true;
+    }
+
+    bool next(SonarSourceFrame& frame) override {
+        if ((index + 1) * frameBytes > mapSize)
+            return false;
+        frame.pixels = map + index * frameBytes;
+        frame.info.width = format.width;
+        frame.info.height = format.height;
+        frame.info.is16bit = format.is16bit;
+        frame.info.swath = format.swath;
+        frame.info.range = format.range;
+        frame.timestampUs = -1;
+        ++index;
+        return true;
+    }
+
+    bool rewind() override {
+        index = 0;
+        return true;
+    }
+
+    double fps() const override { return format.fps; }
+
+private:
+    SonarRawFormat format;
+    const uint8_t* map = nullptr;
+    size_t mapSize = 0;
+    size_t frameBytes = 0;
+    size_t index = 0;
+};
+
+// Raw sonar log written by SonarLogWriter (geometry and timestamps per frame)
+class LogSource : public SonarFrameSource {
+public:
+    bool open(const std::string& path) { return reader.open(path); }
+
+    bool next(SonarSourceFrame& frame) override {
+        SonarLogFrame logFrame;
+        if (index >= reader.frameCount() || !reader.frame(index, logFrame))
+            return false;
+        frame.pixels = logFrame.data;
+        frame.info.width = reader.width();
+        frame.info.height = reader.height();
+        frame.info.is16bit = reader.bytesPerPixel() == 2;
+        frame.info.swath = int(logFrame.swath + 0.5f);
+        frame.info.range = int(logFrame.range + 0.5f);
+        frame.timestampUs = logFrame.timestampUs;
+        ++index;
+        return true;
+    }
+
+    bool rewind() override {
+        index = 0;
+        return true;
+    }
+
+    double fps() const override { return reader.fps() > 0 ? reader.fps() : 30.0; }
+
+private:
+    SonarLogReader reader;
+    int index = 0;
+};
+
+#if defined(SONAR_HAVE_OPENCV)
+// Encoded recording; frames are converted to grayscale like the Python sender
+class VideoSource : public SonarFrameSource {
+public:
+    explicit VideoSource(const SonarRawFormat& format) : format(format) {}
+
+    bool open(const std::string& path) {
+        return capture.open(path, cv::CAP_FFMPEG) || capture.open(path);
+    }
+
+    bool next(SonarSourceFrame& frame) override {
+        if (!capture.read(decoded))
+            return false;
+        // POS_MSEC follows the container timestamps, so VFR recordings keep their timing
+        double msec = capture.get(cv::CAP_PROP_POS_MSEC);
+        if (decoded.channels() == 3)
+            cv::cvtColor(decoded, gray, cv::COLOR_BGR2GRAY);
+        else
+            gray = decoded;
+        if (format.is16bit)
+            gray.convertTo(pixels, CV_16UC1);
+        else if (gray.depth() != CV_8U)
+            gray.convertTo(pixels, CV_8UC1, 1.0 / 256.0);
+        else
+            pixels = gray;
+        if (!pixels.isContinuous())
+            pixels = pixels.clone();
+
+        frame.pixels = pixels.data;
+        frame.info.width = pixels.cols;
+        frame.info.height = pixels.rows;
+        frame.info.is16bit = pixels.depth() == CV_16U;
+        frame.info.swath = format.swath;
+        frame.info.range = format.range;
+        frame.timestampUs = msec >= 0 ? int64_t(msec * 1000.0) : -1;
+        return true;
+    }
+
+    bool rewind() override { return capture.set(cv::CAP_PROP_POS_FRAMES, 0); }
+
+    double fps() const override {
+        double fps = capture.get(cv::CAP_PROP_FPS);
+        return fps > 0 ? fps : 30.0;
+    }
+
+private:
+    SonarRawFormat format;
+    mutable cv::VideoCapture capture;
+    cv::Mat decoded, gray, pixels;
+};
+#endif
+
+} // namespace
+
+// static
+std::unique_ptr<SonarFrameSource> SonarFrameSource::open(const std::string& path,
+                                                         const SonarRawFormat& rawFormat) {
+    std::unique_ptr<SonarFrameSource> source;
+    bool opened = false;
+    std::string ext = lowerExtension(path);
+    if (ext == ".slog") {
+        LogSource* log = new LogSource();
+        source.reset(log);
+        opened = log->open(path);
+    } else if (ext == ".mkv" || ext == ".mp4" || ext == ".avi") {
+#if defined(SONAR_HAVE_OPENCV)
+        VideoSource* video = new VideoSource(rawFormat);
+        source.reset(video);
+        opened = video->open(path);
+#else
+        std::cerr << "Error: Built without OpenCV; cannot read " << path << std::endl;
+#endif
+    } else {
+        RawSource* raw = new RawSource(rawFormat);
+        source.reset(raw);
+        opened = raw->open(path);
+    }
+    if (!opened)
+        source.reset();
+    return source;
+}
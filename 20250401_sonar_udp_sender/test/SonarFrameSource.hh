@@ -0,0 +1,42 @@
+#if !defined(SONAR_FRAME_SOURCE_HH)
+#define SONAR_FRAME_SOURCE_HH
+
+#include "SonarSender.hh"
+#include <cstdint>
+#include <memory>
+#include <string>
+
+// One frame of a recording
+// pixels stays valid until the next call to next() or rewind()
+struct SonarSourceFrame {
+    const uint8_t* pixels = nullptr;
+    SonarImageInfo info;
+    int64_t timestampUs = -1; // recorded capture time [us] (-1: not recorded)
+};
+
+// Format of headerless raw recordings (consecutive width*height frames)
+struct SonarRawFormat {
+    int width = 256;
+    int height = 100;
+    bool is16bit = false;
+    int swath = 120;
+    int range = 30;
+    double fps = 10.0;
+};
+
+// Reads frames from a recording: .slog raw log, .mkv/.mp4/.avi (with OpenCV) or raw bytes
+class SonarFrameSource {
+public:
+    virtual ~SonarFrameSource() {}
+
+    // Picks the reader by file extension; nullptr if the file cannot be opened
+    static std::unique_ptr<SonarFrameSource> open(const std::string& path,
+                                                  const SonarRawFormat& rawFormat);
+
+    virtual bool next(SonarSourceFrame& frame) = 0;
+    virtual bool rewind() = 0;
+    // Nominal rate, used when the recording has no timestamps
+    virtual double fps() const = 0;
+};
+
+#endif // !defined(SONAR_FRAME_SOURCE_HH)
@@ -0,0 +1,405 @@
+#include "SonarSender.hh"
+#include "SonarCodec.hh"
+#include "SonarMulticast.hh"
+#include <algorithm>
+#include <arpa/inet.h>
+#include <cerrno>
+#include <cstring>
+#include <ctime>
+#include <iostream>
+#include <netinet/in.h>
+#include <unistd.h>
+
+#if !defined(SOL_UDP)
+#define SOL_UDP 17
+#endif
+#if !defined(UDP_SEGMENT)
+#define UDP_SEGMENT 103
+#endif
+
+namespace {
+// Largest UDP payload of one (GSO) send over IPv4
+constexpr size_t kMaxUdpPayload = 65507;
+// The kernel refuses GSO sends with more segments than this
+constexpr int kMaxGsoSegments = 64;
+// Spin instead of sleeping for the last part of a wait
+constexpr int64_t kSpinNs = 50000;
+} // namespace
+
+int64_t sonarNowNs() {
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return int64_t(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+}
+
+void sonarSleepUntilNs(int64_t deadlineNs) {
+    int64_t now = sonarNowNs();
+    if (deadlineNs - now > kSpinNs) {
+        int64_t wake = deadlineNs - kSpinNs;
+        timespec ts;
+        ts.tv_sec = wake / 1000000000;
+        ts.tv_nsec = wake % 1000000000;
+        while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, nullptr) == EINTR) {
+        }
+    }
+    while (sonarNowNs() < deadlineNs) {
+    }
+}
+
+SonarTokenBucket::SonarTokenBucket(double rateBytesPerSec, size_t burstBytes)
+    : rate(rateBytesPerSec), burst(double(burstBytes)), tokens(double(burstBytes)),
+      lastNs(sonarNowNs()) {}
+
+void SonarTokenBucket::consume(size_t bytes) {
+    if (rate <= 0)
+        return;
+    int64_t now = sonarNowNs();
+    tokens += double(now - lastNs) * rate / 1e9;
+    if (tokens > burst)
+        tokens = burst;
+    lastNs = now;
+
+    tokens -= double(bytes);
+    if (tokens < 0)
+        sonarSleepUntilNs(now + int64_t(-tokens * 1e9 / rate));
+}
+
+SonarSender::SonarSender(const SonarSenderConfig& config)
+    : config(config), bucket(config.rateBytesPerSec, config.burstBytes) {
+    if (this->config.batchSize < 1)
+        this->config.batchSize = 1;
+    if (!sonarCodecAvailable(config.codec)) {
+        std::cerr << "Warning: " << sonarCodecName(config.codec)
+                  << " compression is not built in; sending raw frames" << std::endl;
+        this->config.codec = kSonarCodecRaw;
+    }
+    if (config.chunkSize == 0 || config.chunkSize + kSonarChunkHeaderSize > kMaxUdpPayload) {
+        std::cerr << "Error: chunk size must be 1.." << kMaxUdpPayload - kSonarChunkHeaderSize
+                  << std::endl;
+        return;
+    }
+
+    fd = ::socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        std::cerr << "Error: socket() failed (" << strerror(errno) << ")" << std::endl;
+        return;
+    }
+    if (config.sendBufferBytes > 0) {
+        int size = config.sendBufferBytes;
+        if (setsockopt(fd, SOL_SOCKET, SO_SNDBUFFORCE, &size, sizeof(size)) != 0)
+            setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &size, sizeof(size));
+    }
+
+    memset(&dest, 0, sizeof(dest));
+    sockaddr_in* addr = reinterpret_cast<sockaddr_in*>(&dest);
+    addr->sin_family = AF_INET;
+    addr->sin_port = htons(config.port);
+    if (inet_pton(AF_INET, config.destAddress.c_str(), &addr->sin_addr) != 1) {
+        std::cerr << "Error: Invalid destination address " << config.destAddress << std::endl;
+        ::close(fd);
+        fd = -1;
+        return;
+    }
+    destLength = sizeof(sockaddr_in);
+
+    // One send reaches every receiver that joined the group
+    if (sonarIsMulticast(addr->sin_addr) &&
+        !sonarSetMulticastSender(fd, config.multicastTtl, config.multicastInterface,
+                                 config.multicastLoopback)) {
+        ::close(fd);
+        fd = -1;
+        return;
+    }
+
+    // With a socket-level segment size, any send longer than one segment is split
+    // by the kernel; shorter sends go out unchanged.
+    size_t segment = kSonarChunkHeaderSize + config.chunkSize;
+    int segments = int(std::min<size_t>(kMaxUdpPayload / segment, kMaxGsoSegments));
+    if (config.gso && segments >= 2) {
+        int size = int(segment);
+        if (setsockopt(fd, SOL_UDP, UDP_SEGMENT, &size, sizeof(size)) == 0) {
+            gso = true;
+            chunksPerMessage = segments;
+        } else {
+            std::cerr << "Warning: UDP GSO not available (" << strerror(errno) << ")"
+                      << std::endl;
+        }
+    }
+}
+
+SonarSender::~SonarSender() {
+    if (fd >= 0)
+        ::close(fd);
+}
+
+bool SonarSender::isOpen() const {
+    return fd >= 0;
+}
+
+bool SonarSender::gsoActive() const {
+    return gso;
+}
+
+uint64_t SonarSender::framesSent() const {
+    return frames;
+}
+
+uint64_t SonarSender::datagramsSent() const {
+    return datagrams;
+}
+
+uint64_t SonarSender::parityDatagramsSent() const {
+    return parityDatagrams;
+}
+
+uint64_t SonarSender::rawBytesSent() const {
+    return rawBytes;
+}
+
+uint64_t SonarSender::bytesSent() const {
+    return bytes;
+}
+
+uint64_t SonarSender::sendErrors() const {
+    return errors;
+}
+
+bool SonarSender::sendFrame(const SonarImageInfo& info, const uint8_t* pixels,
+                            uint64_t timestampUs) {
+    if (fd < 0)
+        return false;
+
+    const size_t pixelBytes = size_t(info.width) * info.height * (info.is16bit ? 2 : 1);
+    if (kSonarCodecHeaderSize + kSonarImageHeaderSize + pixelBytes > 0xffffffffu) {
+        std::cerr << "Error: Frame too large (" << pixelBytes << " bytes)" << std::endl;
+        return false;
+    }
+    const uint32_t id = frameId++;
+    const uint8_t* head;
+    const uint8_t* body;
+    size_t headSize, bodySize;
+    const SonarCodec codec = encodeBody(info, pixels, pixelBytes, id, head, headSize, body,
+                                        bodySize);
+
+    const size_t totalSize = headSize + bodySize;
+    const size_t chunkSize = config.chunkSize;
+    const size_t chunkCount = (totalSize + chunkSize - 1) / chunkSize;
+    if (chunkCount > 0xffff) {
+        std::cerr << "Error: Frame too large (" << totalSize << " bytes)" << std::endl;
+        havePrevious = false;
+        return false;
+    }
+    const uint8_t flags = uint8_t((config.crc ? kSonarFlagCrc : 0) |
+                                  (codec << kSonarFlagCodecShift));
+    const uint16_t groups = sonarFecGroups(chunkCount, config.fecGroupSize);
+    const size_t stride = std::min(chunkSize, totalSize);
+
+    // Buffers only grow, so steady-state sending does not allocate
+    const size_t messageCount = (chunkCount + chunksPerMessage - 1) / chunksPerMessage +
+                                (groups + chunksPerMessage - 1) / chunksPerMessage;
+    const size_t datagramCount = chunkCount + groups;
+    if (headers.size() < datagramCount * kSonarChunkHeaderSize)
+        headers.resize(datagramCount * kSonarChunkHeaderSize);
+    if (iov.size() < chunkCount * 3 + groups * 2)
+        iov.resize(chunkCount * 3 + groups * 2);
+    if (msgs.size() < messageCount)
+        msgs.resize(messageCount);
+    if (groups > 0) {
+        if (parity.size() < groups * stride)
+            parity.resize(groups * stride);
+        memset(parity.data(), 0, groups * stride);
+    }
+
+    SonarChunkHeader header;
+    header.flags = flags;
+    header.streamId = config.streamId;
+    header.frameId = id;
+    header.chunkCount = uint16_t(chunkCount);
+    header.totalSize = uint32_t(totalSize);
+    header.timestampUs = timestampUs;
+    header.fecGroups = groups;
+
+    size_t iovCount = 0;
+    size_t message = 0;
+    for (size_t i = 0; i < datagramCount; ++i) {
+        const bool isParity = i >= chunkCount;
+        const size_t slot = isParity ? i - chunkCount : i;
+        if (slot % chunksPerMessage == 0) {
+            memset(&msgs[message], 0, sizeof(mmsghdr));
+            msgs[message].msg_hdr.msg_name = &dest;
+            msgs[message].msg_hdr.msg_namelen = destLength;
+            msgs[message].msg_hdr.msg_iov = &iov[iovCount];
+            ++message;
+        }
+        msghdr& hdr = msgs[message - 1].msg_hdr;
+        const size_t iovStart = iovCount;
+        uint8_t* chunkHeader = &headers[i * kSonarChunkHeaderSize];
+
+        if (isParity) {
+            // Computed below from every data chunk of its group
+            uint8_t* data = &parity[slot * stride];
+            iov[iovCount++] = {chunkHeader, kSonarChunkHeaderSize};
+            iov[iovCount++] = {data, stride};
+            header.flags = uint8_t(flags | kSonarFlagParity);
+            header.chunkIndex = uint16_t(slot);
+            header.chunkOffset = 0;
+            header.crc32c = config.crc ? sonarCrc32c(data, stride) : 0;
+            encodeSonarChunkHeader(header, chunkHeader);
+            hdr.msg_iovlen += iovCount - iovStart;
+            continue;
+        }
+
+        // The chunk covers [offset, end) of head + body
+        const size_t offset = i * chunkSize;
+        const size_t end = std::min(offset + chunkSize, totalSize);
+        uint8_t* groupParity = groups > 0 ? &parity[(i % groups) * stride] : nullptr;
+        iov[iovCount++] = {chunkHeader, kSonarChunkHeaderSize};
+        uint32_t crc = 0;
+        if (offset < headSize) {
+            size_t len = std::min(end, headSize) - offset;
+            iov[iovCount++] = {const_cast<uint8_t*>(head + offset), len};
+            if (config.crc)
+                crc = sonarCrc32c(head + offset, len);
+            if (groupParity)
+                sonarXor(groupParity, head + offset, len);
+        }
+        if (end > headSize) {
+            size_t from = std::max(offset, headSize) - headSize;
+            size_t len = end - headSize - from;
+            iov[iovCount++] = {const_cast<uint8_t*>(body + from), len};
+            if (config.crc)
+                crc = sonarCrc32c(body + from, len, crc);
+            if (groupParity)
+                sonarXor(groupParity + (std::max(offset, headSize) - offset), body + from, len);
+        }
+
+        header.chunkIndex = uint16_t(i);
+        header.chunkOffset = uint32_t(offset);
+        header.crc32c = crc;
+        encodeSonarChunkHeader(header, chunkHeader);
+        hdr.msg_iovlen += iovCount - iovStart;
+    }
+
+    if (!sendMessages(int(message))) {
+        // The receiver may not hold this frame, so the next one must not reference it
+        havePrevious = false;
+        return false;
+    }
+    ++frames;
+    rawBytes += kSonarImageHeaderSize + pixelBytes;
+    datagrams += datagramCount;
+    parityDatagrams += groups;
+    return true;
+}
+
+// Picks what goes on the wire for this frame: head (the image header, preceded by the
+// codec header when compressed) and body (the pixels or their compressed form).
+// Frames that do not shrink are sent raw.
+SonarCodec SonarSender::encodeBody(const SonarImageInfo& info, const uint8_t* pixels,
+                                   size_t pixelBytes, uint32_t id, const uint8_t*& head,
+                                   size_t& headSize, const uint8_t*& body, size_t& bodySize) {
+    uint8_t* imageHeader = frameHead + kSonarCodecHeaderSize;
+    encodeSonarImageHeader(info.width, info.height, info.swath, info.range, info.is16bit,
+                           imageHeader);
+    head = imageHeader;
+    headSize = kSonarImageHeaderSize;
+
+    if (config.noiseFloor > 0) {
+        // Zero the near-zero water column so the run-length coders can skip it
+        if (filtered.size() < pixelBytes)
+            filtered.resize(pixelBytes);
+        sonarNoiseFloor(pixels, filtered.data(), pixelBytes, info.is16bit, config.noiseFloor);
+        pixels = filtered.data();
+    }
+    body = pixels;
+    bodySize = pixelBytes;
+
+    SonarCodec codec = config.codec;
+    if (codec == kSonarCodecDeltaRle) {
+        const bool sameGeometry = havePrevious && previousInfo.width == info.width &&
+                                  previousInfo.height == info.height &&
+                                  previousInfo.is16bit == info.is16bit;
+        if (!sameGeometry || framesSinceKeyframe + 1 >= config.keyframeInterval) {
+            codec = kSonarCodecZeroRle;
+            framesSinceKeyframe = 0;
+        } else {
+            ++framesSinceKeyframe;
+        }
+    }
+
+    size_t encodedSize = 0;
+    if (codec != kSonarCodecRaw) {
+        if (encoded.size() < pixelBytes)
+            encoded.resize(pixelBytes);
+        encodedSize = sonarEncodePixels(codec, pixels, pixelBytes, previous.data(),
+                                        encoded.data(), pixelBytes > 0 ? pixelBytes - 1 : 0);
+    }
+    if (encodedSize > 0) {
+        uint32_t rawSize = uint32_t(kSonarImageHeaderSize + pixelBytes);
+        uint32_t reference = codec == kSonarCodecDeltaRle ? previousFrameId : 0;
+        for (int k = 0; k < 4; ++k) {
+            frameHead[k] = uint8_t(rawSize >> (24 - 8 * k));
+            frameHead[4 + k] = uint8_t(reference >> (24 - 8 * k));
+        }
+        head = frameHead;
+        headSize = kSonarCodecHeaderSize + kSonarImageHeaderSize;
+        body = encoded.data();
+        bodySize = encodedSize;
+    } else {
+        codec = kSonarCodecRaw;
+    }
+
+    // Whatever was sent is what the receiver will hold as the next delta reference
+    // (sendFrame() clears havePrevious again if the frame does not go out)
+    if (config.codec == kSonarCodecDeltaRle) {
+        if (previous.size() < pixelBytes)
+            previous.resize(pixelBytes);
+        memcpy(previous.data(), pixels, pixelBytes);
+        previousInfo = info;
+        previousFrameId = id;
+        havePrevious = true;
+    }
+    return codec;
+}
+
+// Sends msgs[0, count) in sendmmsg batches no larger than the burst size
+bool SonarSender::sendMessages(int count) {
+    int sent = 0;
+    while (sent < count) {
+        int batch = 0;
+        size_t batchBytes = 0;
+        while (sent + batch < count && batch < config.batchSize) {
+            const msghdr& hdr = msgs[sent + batch].msg_hdr;
+            size_t size = 0;
+            for (size_t k = 0; k < hdr.msg_iovlen; ++k)
+                size += hdr.msg_iov[k].iov_len;
+            if (batch > 0 && config.rateBytesPerSec > 0 && batchBytes + size > config.burstBytes)
+                break;
+            batchBytes += size;
+            ++batch;
+        }
+        bucket.consume(batchBytes);
+
+        int done = 0;
+        while (done < batch) {
+            int n = sendmmsg(fd, &msgs[sent + done], unsigned(batch - done), 0);
+            if (n < 0) {
+                if (errno == EINTR)
+                    continue;
+                if (errno == ENOBUFS || errno == EAGAIN) {
+                    // The qdisc or socket buffer is full; back off briefly
+                    sonarSleepUntilNs(sonarNowNs() + 20000);
+                    continue;
+                }
+                ++errors;
+                std::cerr << "Error: sendmmsg() failed (" << strerror(errno) << ")" << std::endl;
+                return false;
+            }
+            for (int k = 0; k < n; ++k)
+                bytes += msgs[sent + done + k].msg_len;
+            done += n;
+        }
+        sent += batch;
+    }
+    return true;
+}
@@ -0,0 +1,139 @@
+#if !defined(SONAR_SENDER_HH)
+#define SONAR_SENDER_HH
+
+#include "SonarProtocol.hh"
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <sys/socket.h>
+#include <vector>
+
+// Monotonic clock [ns] and a precise absolute sleep
+// (clock_nanosleep for the bulk, then spin for the last few tens of microseconds)
+int64_t sonarNowNs();
+void sonarSleepUntilNs(int64_t deadlineNs);
+
+// Token bucket limiting the average send rate
+// The bucket may go into debt by one message so that messages larger than the
+// burst size are still sent; the next consume() waits until the debt is repaid.
+class SonarTokenBucket {
+public:
+    SonarTokenBucket(double rateBytesPerSec, size_t burstBytes);
+
+    // Blocks until `bytes` may be sent (returns immediately when the rate is 0)
+    void consume(size_t bytes);
+
+private:
+    double rate;   // bytes per second (0: unlimited)
+    double burst;  // bytes
+    double tokens;
+    int64_t lastNs;
+};
+
+struct SonarSenderConfig {
+    std::string destAddress = "127.0.0.1";
+    uint16_t port = 5700;
+    uint16_t streamId = 0;
+    size_t chunkSize = 60000;            // frame bytes per datagram (excluding the chunk header)
+    bool crc = true;                     // fill the CRC32C of every chunk
+    bool gso = true;                     // UDP_SEGMENT when several chunks fit in one send
+    int batchSize = 64;                  // messages per sendmmsg call
+    int sendBufferBytes = 8 * 1024 * 1024;
+    double rateBytesPerSec = 0;          // token bucket rate (0: unlimited)
+    size_t burstBytes = 256 * 1024;
+    // XOR parity FEC: one parity chunk per this many data chunks (0: off).
+    // Overhead is 1/fecGroupSize; any single loss per group is recovered.
+    size_t fecGroupSize = 0;
+    // Per-frame compression (SonarCodec). Delta frames reference the previous frame and
+    // every keyframeInterval-th frame (and the frame after a failed send) is a
+    // self-contained zero-run frame instead.
+    SonarCodec codec = kSonarCodecRaw;
+    int keyframeInterval = 30;
+    int noiseFloor = 0;                  // pixels below this are sent as 0 (lossy; 0: off)
+    // Used when destAddress is a multicast group
+    int multicastTtl = 1;                // 1: stay on the local network
+    std::string multicastInterface;      // interface name or address (empty: routing table)
+    bool multicastLoopback = true;       // deliver to receivers on this host as well
+};
+
+// Geometry carried in the image header at the start of every frame
+struct SonarImageInfo {
+    int width = 0;
+    int height = 0;
+    int swath = 120;
+    int range = 30;
+    bool is16bit = false;
+};
+
+// Sends frames with protocol v2 (SonarProtocol.hh)
+//
+// Datagrams are gathered with iovecs straight from the caller's pixels (no copy):
+// [chunk header][image header (chunk 0 only)][pixel slice]
+// All chunks of a frame go out in as few sendmmsg calls as the pacing allows.
+// With GSO the kernel splits one message into up to 64 datagrams, which makes
+// small (MTU-sized) chunks almost as cheap as 60 KB ones.
+// With FEC the interleaved parity chunks follow the data chunks in their own messages
+// (GSO only allows the last segment of a message to be short).
+// With a codec the frame is compressed on the calling thread first and the chunks
+// gather [codec header + image header][compressed pixels] instead.
+class SonarSender {
+public:
+    explicit SonarSender(const SonarSenderConfig& config);
+    ~SonarSender();
+
+    SonarSender(const SonarSender&) = delete;
+    SonarSender& operator=(const SonarSender&) = delete;
+
+    bool isOpen() const;
+    bool gsoActive() const;
+
+    // timestampUs: capture time (UNIX time [us])
+    bool sendFrame(const SonarImageInfo& info, const uint8_t* pixels, uint64_t timestampUs);
+
+    uint64_t framesSent() const;
+    uint64_t datagramsSent() const;
+    uint64_t parityDatagramsSent() const;
+    uint64_t bytesSent() const;
+    uint64_t rawBytesSent() const;       // frame bytes before compression
+    uint64_t sendErrors() const;
+
+private:
+    bool sendMessages(int count);
+    SonarCodec encodeBody(const SonarImageInfo& info, const uint8_t* pixels, size_t pixelBytes,
+                          uint32_t id, const uint8_t*& head, size_t& headSize,
+                          const uint8_t*& body, size_t& bodySize);
+
+    SonarSenderConfig config;
+    int fd = -1;
+    sockaddr_storage dest;
+    socklen_t destLength = 0;
+    bool gso = false;
+    int chunksPerMessage = 1;
+    SonarTokenBucket bucket;
+
+    uint32_t frameId = 0;
+    uint8_t frameHead[kSonarCodecHeaderSize + kSonarImageHeaderSize];
+    std::vector<uint8_t> headers; // kSonarChunkHeaderSize per chunk
+    std::vector<uint8_t> parity;  // stride bytes per FEC group
+
+    std::vector<iovec> iov;
+    std::vector<mmsghdr> msgs;
+
+    // Compression
+    std::vector<uint8_t> filtered; // pixels after the noise floor
+    std::vector<uint8_t> encoded;
+    std::vector<uint8_t> previous; // last frame sent (delta reference)
+    SonarImageInfo previousInfo;
+    uint32_t previousFrameId = 0;
+    bool havePrevious = false;
+    int framesSinceKeyframe = 0;
+
+    uint64_t frames = 0;
+    uint64_t datagrams = 0;
+    uint64_t parityDatagrams = 0;
+    uint64_t bytes = 0;
+    uint64_t rawBytes = 0;
+    uint64_t errors = 0;
+};
+
+#endif // !defined(SONAR_SENDER_HH)
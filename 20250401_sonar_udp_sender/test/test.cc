@@ -1,67 +1,235 @@
 // sonar_sender.cc
-// Compile with:
-// g++ sonar_sender.cc -o sonar_sender `pkg-config --cflags --libs Qt5Network` -std=c++11
+// Streams a sonar recording (.slog, .mkv or raw frames) over UDP with protocol v2,
+// or into a same-host shared memory ring (--shm).
+// Compile with: make   (make OPENCV=1 to read .mkv)
 
+#include "SonarCodec.hh"
+#include "SonarFrameSource.hh"
+#include "SonarSender.hh"
+#include "SonarShmRing.hh"
+#include <QtCore/QCommandLineParser>
 #include <QtCore/QCoreApplication>
-#include <QtNetwork/QUdpSocket>
-#include <QtCore/QFile>
-#include <QtCore/QByteArray>
-#include <QtCore/QDataStream>
-#include <QtCore/QTimer>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
 #include <iostream>
-#include <QThread>
+#include <memory>
 
-constexpr quint16 DEST_PORT = 5700;
-const QString DEST_IP = "127.0.0.1";
-const int MAX_PAYLOAD = 60000;
+static uint64_t unixTimeUs() {
+    return std::chrono::duration_cast<std::chrono::microseconds>(
+               std::chrono::system_clock::now().time_since_epoch())
+        .count();
+}
+
+// Largest frame a shared memory slot holds (1024x1024 16-bit, as on the receiver)
+static const size_t kShmSlotCapacity = kSonarImageHeaderSize + 1024 * 1024 * 2;
+
+// Writes the image header and pixels straight into the next ring slot
+static bool publishShm(SonarShmWriter &writer, const SonarSourceFrame &frame, uint16_t streamId,
+                       uint32_t frameId, uint64_t timestampUs) {
+    const SonarImageInfo &info = frame.info;
+    size_t pixelBytes = size_t(info.width) * info.height * (info.is16bit ? 2 : 1);
+    if (kSonarImageHeaderSize + pixelBytes > writer.slotCapacity()) {
+        std::cerr << "Frame too large for the shared memory ring" << std::endl;
+        return false;
+    }
+    uint8_t *slot = writer.begin();
+    encodeSonarImageHeader(info.width, info.height, info.swath, info.range, info.is16bit, slot);
+    memcpy(slot + kSonarImageHeaderSize, frame.pixels, pixelBytes);
+    writer.commit(kSonarImageHeaderSize + pixelBytes, streamId, frameId, timestampUs);
+    return true;
+}
 
 int main(int argc, char *argv[]) {
     QCoreApplication app(argc, argv);
 
-    if (argc < 2) {
-        std::cerr << "Usage: sonar_sender <mkv_or_raw_file>\n";
+    QCommandLineParser parser;
+    parser.setApplicationDescription("Stream sonar frames over UDP (chunked, protocol v2)");
+    parser.addHelpOption();
+    parser.addPositionalArgument("file", "Recording to send (.slog, .mkv or raw frames)");
+
+    QCommandLineOption ipOpt("ip", "Destination IP or multicast group", "ADDRESS", "127.0.0.1");
+    QCommandLineOption portOpt("port", "Destination UDP port", "PORT", "5700");
+    QCommandLineOption streamOpt("stream", "Stream ID", "ID", "0");
+    QCommandLineOption chunkOpt("chunk", "Frame bytes per datagram", "BYTES", "60000");
+    QCommandLineOption fpsOpt("fps", "Override the frame rate (0: as fast as possible)", "FPS");
+    QCommandLineOption speedOpt("speed", "Playback speed for recorded timestamps", "X", "1.0");
+    QCommandLineOption rateOpt("rate", "Bandwidth limit [MB/s] (0: unlimited)", "MBPS", "0");
+    QCommandLineOption burstOpt("burst", "Token bucket burst size [bytes]", "BYTES", "262144");
+    QCommandLineOption batchOpt("batch", "Messages per sendmmsg call", "N", "64");
+    QCommandLineOption loopOpt("loop", "Restart the recording at the end");
+    QCommandLineOption noCrcOpt("no-crc", "Do not compute CRC32C per chunk");
+    QCommandLineOption fecOpt("fec", "Add one XOR parity chunk per N data chunks (0: no FEC)", "N",
+                              "0");
+    QCommandLineOption compressOpt("compress", "Frame compression: raw, rle, delta or lz4",
+                                   "CODEC", "raw");
+    QCommandLineOption keyframeOpt("keyframe", "Self-contained frame every N frames (delta)", "N",
+                                   "30");
+    QCommandLineOption noiseOpt("noise-floor", "Send pixels below V as 0 (lossy)", "V", "0");
+    QCommandLineOption noGsoOpt("no-gso", "Disable UDP generic segmentation offload");
+    QCommandLineOption ttlOpt("ttl", "Multicast TTL", "HOPS", "1");
+    QCommandLineOption ifaceOpt("iface", "Multicast interface (name or address)", "IFACE");
+    QCommandLineOption shmOpt("shm", "Publish into a shared memory ring instead of UDP", "NAME");
+    QCommandLineOption shmSlotsOpt("shm-slots", "Frames kept in the shared memory ring", "N", "16");
+    QCommandLineOption noLoopOpt("no-multicast-loop", "Do not deliver multicast to this host");
+    QCommandLineOption widthOpt("width", "Raw frame width", "PIXELS", "256");
+    QCommandLineOption heightOpt("height", "Raw frame height", "PIXELS", "100");
+    QCommandLineOption bitsOpt("16bit", "Raw frames (or converted video) are 16-bit");
+    QCommandLineOption swathOpt("swath", "Swath angle [deg] for raw/video", "DEG", "120");
+    QCommandLineOption rangeOpt("range", "Range [m] for raw/video", "M", "30");
+    QCommandLineOption rawFpsOpt("raw-fps", "Frame rate of raw recordings", "FPS", "10");
+    for (const QCommandLineOption& opt :
+         {ipOpt, portOpt, streamOpt, chunkOpt, fpsOpt, speedOpt, rateOpt, burstOpt, batchOpt,
+          loopOpt, noCrcOpt, fecOpt, compressOpt, keyframeOpt, noiseOpt, noGsoOpt, ttlOpt, ifaceOpt, noLoopOpt, shmOpt, shmSlotsOpt,
+          widthOpt, heightOpt, bitsOpt, swathOpt, rangeOpt, rawFpsOpt})
+        parser.addOption(opt);
+    parser.process(app);
+
+    if (parser.positionalArguments().size() != 1)
+        parser.showHelp(1);
+
+    SonarRawFormat rawFormat;
+    rawFormat.width = parser.value(widthOpt).toInt();
+    rawFormat.height = parser.value(heightOpt).toInt();
+    rawFormat.is16bit = parser.isSet(bitsOpt);
+    rawFormat.swath = parser.value(swathOpt).toInt();
+    rawFormat.range = parser.value(rangeOpt).toInt();
+    rawFormat.fps = parser.value(rawFpsOpt).toDouble();
+
+    const std::string path = parser.positionalArguments().first().toStdString();
+    std::unique_ptr<SonarFrameSource> source = SonarFrameSource::open(path, rawFormat);
+    if (!source) {
+        std::cerr << "Failed to open " << path << std::endl;
         return 1;
     }
 
-    QFile file(argv[1]);
-    if (!file.open(QIODevice::ReadOnly)) {
-        std::cerr << "Failed to open file." << std::endl;
+    SonarSenderConfig config;
+    config.destAddress = parser.value(ipOpt).toStdString();
+    config.port = parser.value(portOpt).toUShort();
+    config.streamId = parser.value(streamOpt).toUShort();
+    config.chunkSize = parser.value(chunkOpt).toULong();
+    config.rateBytesPerSec = parser.value(rateOpt).toDouble() * 1e6;
+    config.burstBytes = parser.value(burstOpt).toULong();
+    config.batchSize = parser.value(batchOpt).toInt();
+    config.crc = !parser.isSet(noCrcOpt);
+    config.gso = !parser.isSet(noGsoOpt);
+    config.fecGroupSize = parser.value(fecOpt).toULong();
+    config.keyframeInterval = parser.value(keyframeOpt).toInt();
+    config.noiseFloor = parser.value(noiseOpt).toInt();
+    const std::string codec = parser.value(compressOpt).toStdString();
+    if (codec == "raw") {
+        config.codec = kSonarCodecRaw;
+    } else if (codec == "rle") {
+        config.codec = kSonarCodecZeroRle;
+    } else if (codec == "delta") {
+        config.codec = kSonarCodecDeltaRle;
+    } else if (codec == "lz4") {
+        config.codec = kSonarCodecLz4;
+    } else {
+        std::cerr << "Unknown codec: " << codec << std::endl;
         return 1;
     }
+    config.multicastTtl = parser.value(ttlOpt).toInt();
+    config.multicastInterface = parser.value(ifaceOpt).toStdString();
+    config.multicastLoopback = !parser.isSet(noLoopOpt);
+    std::unique_ptr<SonarSender> sender;
+    std::unique_ptr<SonarShmWriter> shm;
+    if (parser.isSet(shmOpt)) {
+        shm.reset(new SonarShmWriter(parser.value(shmOpt).toStdString(), kShmSlotCapacity,
+                                     parser.value(shmSlotsOpt).toUInt()));
+        if (!shm->isOpen())
+            return 1;
+    } else {
+        sender.reset(new SonarSender(config));
+        if (!sender->isOpen())
+            return 1;
+    }
+
+    // Frame schedule: a fixed rate when overridden (or nothing is recorded),
+    // otherwise the recorded timestamps scaled by --speed
+    const bool fixedRate = parser.isSet(fpsOpt);
+    const double fps = fixedRate ? parser.value(fpsOpt).toDouble() : source->fps();
+    const double speed = parser.value(speedOpt).toDouble();
+
+    int64_t startNs = sonarNowNs();
+    int64_t firstTimestampUs = -1;
+    int64_t loopOffsetNs = 0;
+    int64_t lastDueNs = 0;
+    uint64_t index = 0;
+
+    int64_t reportNs = startNs + 1000000000;
+    uint64_t reportBytes = 0, reportFrames = 0;
+    uint64_t shmFrames = 0, shmBytes = 0;
+
+    SonarSourceFrame frame;
+    while (true) {
+        if (!source->next(frame)) {
+            if (!parser.isSet(loopOpt) || !source->rewind() || !source->next(frame))
+                break;
+            // Continue the schedule one frame interval after the last frame
+            loopOffsetNs = lastDueNs - startNs + (fps > 0 ? int64_t(1e9 / fps) : 0);
+            firstTimestampUs = -1;
+        }
 
-    QUdpSocket socket;
-    QHostAddress dest(DEST_IP);
-
-    // Example settings
-    const quint16 width = 256;
-    const quint16 height = 100;
-    const quint16 swath = 120;
-    const quint16 range = 30;
-    const quint32 is16bit = 0;  // 0 = 8bit, 1 = 16bit
-
-    QByteArray frameData = file.read(width * height);  // Read 1 frame
-
-    QByteArray header;
-    QDataStream headerStream(&header, QIODevice::WriteOnly);
-    headerStream.setByteOrder(QDataStream::BigEndian);
-    headerStream << width << height << swath << range << is16bit;
-
-    QByteArray fullPayload = header + frameData;
-    int totalSize = fullPayload.size();
-    int chunkSize = MAX_PAYLOAD;
-    int numChunks = (totalSize + chunkSize - 1) / chunkSize;
-
-    for (int i = 0; i < numChunks; ++i) {
-        QByteArray chunk;
-        QDataStream ds(&chunk, QIODevice::WriteOnly);
-        ds.setByteOrder(QDataStream::BigEndian);
-        ds << static_cast<quint32>(i);  // Sequence number
-        chunk.append(fullPayload.mid(i * chunkSize, chunkSize));
-        socket.writeDatagram(chunk, dest, DEST_PORT);
-        QThread::msleep(1);  // Optional pacing
+        int64_t dueNs;
+        if (!fixedRate && frame.timestampUs >= 0 && speed > 0) {
+            if (firstTimestampUs < 0)
+                firstTimestampUs = frame.timestampUs;
+            dueNs = startNs + loopOffsetNs +
+                    int64_t(double(frame.timestampUs - firstTimestampUs) * 1000.0 / speed);
+        } else if (fps > 0) {
+            dueNs = startNs + int64_t(double(index) * 1e9 / fps);
+        } else {
+            dueNs = 0;
+        }
+        if (dueNs > 0)
+            sonarSleepUntilNs(dueNs);
+        lastDueNs = std::max(dueNs, sonarNowNs());
+
+        if (shm) {
+            if (!publishShm(*shm, frame, config.streamId, uint32_t(index), unixTimeUs()))
+                return 1;
+            ++shmFrames;
+            shmBytes += kSonarImageHeaderSize + size_t(frame.info.width) * frame.info.height *
+                                                    (frame.info.is16bit ? 2 : 1);
+        } else if (!sender->sendFrame(frame.info, frame.pixels, unixTimeUs())) {
+            return 1;
+        }
+        ++index;
+        uint64_t framesOut = shm ? shmFrames : sender->framesSent();
+        uint64_t bytesOut = shm ? shmBytes : sender->bytesSent();
+
+        int64_t now = sonarNowNs();
+        if (now >= reportNs) {
+            double seconds = (now - reportNs + 1000000000) / 1e9;
+            if (shm)
+                printf("%.1f fps, %.1f MB/s (shm)\n", (framesOut - reportFrames) / seconds,
+                       (bytesOut - reportBytes) / seconds / 1e6);
+            else
+                printf("%.1f fps, %.1f MB/s (%llu datagrams, %llu parity, gso %s)\n",
+                       (framesOut - reportFrames) / seconds,
+                       (bytesOut - reportBytes) / seconds / 1e6,
+                       (unsigned long long)sender->datagramsSent(),
+                       (unsigned long long)sender->parityDatagramsSent(),
+                       sender->gsoActive() ? "on" : "off");
+            fflush(stdout);
+            reportFrames = framesOut;
+            reportBytes = bytesOut;
+            reportNs = now + 1000000000;
+        }
     }
 
-    std::cout << "Sent " << numChunks << " UDP packets." << std::endl;
+    double seconds = (sonarNowNs() - startNs) / 1e9;
+    if (shm) {
+        std::cout << "Published " << shmFrames << " frames, " << shmBytes / 1e6 << " MB in "
+                  << seconds << " s (" << shmBytes / seconds / 1e6 << " MB/s)" << std::endl;
+        return 0;
+    }
+    std::cout << "Sent " << sender->framesSent() << " frames, " << sender->datagramsSent()
+              << " UDP packets, " << sender->bytesSent() / 1e6 << " MB in " << seconds << " s ("
+              << sender->bytesSent() / seconds / 1e6 << " MB/s)" << std::endl;
+    if (config.codec != kSonarCodecRaw && sender->bytesSent() > 0)
+        std::cout << "Compression " << sonarCodecName(config.codec) << ": "
+                  << double(sender->rawBytesSent()) / sender->bytesSent() << "x" << std::endl;
     return 0;
 }
-
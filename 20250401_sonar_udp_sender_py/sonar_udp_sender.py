@@ -4,21 +4,38 @@ import cv2
 import socket
 import struct
 import argparse
+import ipaddress
 import sys
 
-def send_chunked(sock, addr, data, max_dgram=60000):
+try:
+    # pip install crc32c (無ければ CRC 無しで送る)
+    from crc32c import crc32c
+except ImportError:
+    crc32c = None
+
+# チャンクヘッダ v2 (20250401_sonar_udp_receiver/test/SonarProtocol.hh と同じ並び)
+# magic, version, flags, streamId, headerSize, frameId, chunkIndex, chunkCount,
+# totalSize, chunkOffset, timestampUs, crc32c, fecGroups, reserved
+# (FEC のパリティは送らないので fecGroups は常に 0)
+CHUNK_HEADER = struct.Struct('!HBBHHIHHIIQIHH')
+SONAR_MAGIC = 0x534f
+SONAR_PROTOCOL_VERSION = 2
+SONAR_FLAG_CRC = 0x01
+
+def send_chunked(sock, addr, data, frame_id, timestamp_us, stream_id=0, max_dgram=60000):
     """データを max_dgram バイトずつに分割して UDP 送信"""
     total = len(data)
-    offset = 0
-    # オプションでシーケンス番号を先頭に付ける例（バイト長 4）
-    seq = 0
-    while offset < total:
+    count = (total + max_dgram - 1) // max_dgram
+    flags = SONAR_FLAG_CRC if crc32c else 0
+    for index in range(count):
+        offset = index * max_dgram
         chunk = data[offset:offset+max_dgram]
-        # シーケンス番号パック例（!I: network-order uint32）
-        header = struct.pack('!I', seq)
+        crc = crc32c(chunk) if crc32c else 0
+        header = CHUNK_HEADER.pack(SONAR_MAGIC, SONAR_PROTOCOL_VERSION, flags,
+                                   stream_id, CHUNK_HEADER.size,
+                                   frame_id & 0xffffffff, index, count,
+                                   total, offset, timestamp_us, crc, 0, 0)
         sock.sendto(header + chunk, addr)
-        offset += max_dgram
-        seq += 1
 
 def main():
     parser = argparse.ArgumentParser(description="Send sonar frames over UDP (chunked).")
@@ -27,10 +44,17 @@ def main():
     parser.add_argument("--range", type=int, default=30, help="Sonar range [m]")
     parser.add_argument("--is_16bit", type=int, choices=[0,1], default=0,
                         help="Frame pixel depth flag (1:16bit, 0:8bit)")
-    parser.add_argument("--ip", default="127.0.0.1", help="Destination IP")
+    parser.add_argument("--ip", default="127.0.0.1",
+                        help="Destination IP or multicast group")
     parser.add_argument("--port", type=int, default=5700, help="Destination UDP port")
     parser.add_argument("--max", type=int, default=60000,
                         help="Max UDP payload per packet")
+    parser.add_argument("--stream", type=int, default=0, help="Stream ID")
+    parser.add_argument("--ttl", type=int, default=1, help="Multicast TTL")
+    parser.add_argument("--iface", default="",
+                        help="Multicast interface address (default: routing table)")
+    parser.add_argument("--no-multicast-loop", action="store_true",
+                        help="Do not deliver multicast to this host")
     args = parser.parse_args()
 
     cap = cv2.VideoCapture(args.input_file)
@@ -41,7 +65,16 @@ def main():
 
     addr = (args.ip, args.port)
     sock = socket.socket(socket.AF_INET, socket.SOCK_DGRAM)
+    if ipaddress.ip_address(args.ip).is_multicast:
+        # 1 回の送信でグループに参加した全ての受信側へ届く
+        sock.setsockopt(socket.IPPROTO_IP, socket.IP_MULTICAST_TTL, args.ttl)
+        sock.setsockopt(socket.IPPROTO_IP, socket.IP_MULTICAST_LOOP,
+                        0 if args.no_multicast_loop else 1)
+        if args.iface:
+            sock.setsockopt(socket.IPPROTO_IP, socket.IP_MULTICAST_IF,
+                            socket.inet_aton(args.iface))
 
+    frame_id = 0
     try:
         while True:
             ret, frame = cap.read()
@@ -68,7 +101,9 @@ def main():
 
             payload = hdr + frame.tobytes()
             # チャンク化送信
-            send_chunked(sock, addr, payload, max_dgram=args.max)
+            send_chunked(sock, addr, payload, frame_id, int(time.time() * 1e6),
+                         stream_id=args.stream, max_dgram=args.max)
+            frame_id += 1
             time.sleep(1/fps)
 
     finally:
@@ -0,0 +1,162 @@
+#include "SonarDvrBuffer.hh"
+#include "SonarCodec.hh"
+#include <chrono>
+#include <cstring>
+
+// explicit
+SonarDvrBuffer::SonarDvrBuffer(size_t maxBytes) : mMaxBytes(maxBytes)
+{
+    mCodec = sonarCodecAvailable(kSonarCodecLz4) ? kSonarCodecLz4 : kSonarCodecZeroRle;
+}
+
+// virtual
+SonarDvrBuffer::~SonarDvrBuffer()
+{
+}
+
+void
+SonarDvrBuffer::setMaxBytes(size_t maxBytes)
+{
+    std::lock_guard<std::mutex> lock(mMutex);
+    mMaxBytes = maxBytes;
+    evict(0);
+}
+
+void
+SonarDvrBuffer::clear()
+{
+    std::lock_guard<std::mutex> lock(mMutex);
+    mEntries.clear();
+    mFirstIndex = 0;
+    mBytes = 0;
+    mEvicted = 0;
+}
+
+void
+SonarDvrBuffer::push(const SonarFrame& frame)
+{
+    const size_t rawSize = frame.pixelBytes();
+    if (mScratch.size() < rawSize)
+        mScratch.resize(rawSize);
+    // 小さくならなければ非圧縮で持つ
+    size_t size = sonarEncodePixels(mCodec, frame.pixels(), rawSize, nullptr, mScratch.data(),
+                                    rawSize > 0 ? rawSize - 1 : 0);
+    const SonarCodec codec = size > 0 ? mCodec : kSonarCodecRaw;
+    const uint8_t* src = size > 0 ? mScratch.data() : frame.pixels();
+    if (size == 0)
+        size = rawSize;
+
+    Entry entry;
+    entry.info.width = frame.width;
+    entry.info.height = frame.height;
+    entry.info.swath = frame.swath;
+    entry.info.range = frame.range;
+    entry.info.is16bit = frame.is16bit;
+    entry.info.timestampUs = frame.timestampUs;
+    entry.codec = codec;
+    entry.rawSize = rawSize;
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        entry.data.swap(mSpare);
+    }
+    entry.data.assign(src, src + size);
+
+    const size_t entryBytes = entry.data.capacity() + sizeof(Entry);
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        evict(entryBytes);
+        mEntries.push_back(std::move(entry));
+        mBytes += entryBytes;
+    }
+    mArrived.notify_all();
+}
+
+// mMutex を持って呼ぶ
+void
+SonarDvrBuffer::evict(size_t incoming)
+{
+    while (!mEntries.empty() && mBytes + incoming > mMaxBytes)
+    {
+        Entry& oldest = mEntries.front();
+        mBytes -= oldest.data.capacity() + sizeof(Entry);
+        if (oldest.data.capacity() > mSpare.capacity())
+            mSpare.swap(oldest.data);
+        mEntries.pop_front();
+        ++mFirstIndex;
+        ++mEvicted;
+    }
+}
+
+int64_t
+SonarDvrBuffer::firstIndex() const
+{
+    std::lock_guard<std::mutex> lock(mMutex);
+    return mFirstIndex;
+}
+
+int64_t
+SonarDvrBuffer::endIndex() const
+{
+    std::lock_guard<std::mutex> lock(mMutex);
+    return mFirstIndex + int64_t(mEntries.size());
+}
+
+bool
+SonarDvrBuffer::frame(int64_t index, SonarDvrFrameInfo& info, std::vector<uint8_t>& pixels) const
+{
+    // 展開 (1 フレーム 1 ms 未満) の間は push() を待たせる (捨てられないように)
+    std::lock_guard<std::mutex> lock(mMutex);
+    if (index < mFirstIndex || index >= mFirstIndex + int64_t(mEntries.size()))
+        return false;
+    const Entry& entry = mEntries[size_t(index - mFirstIndex)];
+    info = entry.info;
+    pixels.resize(entry.rawSize);
+    if (entry.codec == kSonarCodecRaw)
+    {
+        memcpy(pixels.data(), entry.data.data(), entry.rawSize);
+        return true;
+    }
+    return sonarDecodePixels(entry.codec, entry.data.data(), entry.data.size(), nullptr,
+                             pixels.data(), entry.rawSize);
+}
+
+uint64_t
+SonarDvrBuffer::timestampUs(int64_t index) const
+{
+    std::lock_guard<std::mutex> lock(mMutex);
+    if (index < mFirstIndex || index >= mFirstIndex + int64_t(mEntries.size()))
+        return 0;
+    return mEntries[size_t(index - mFirstIndex)].info.timestampUs;
+}
+
+bool
+SonarDvrBuffer::waitFor(int64_t index, int timeoutMs) const
+{
+    std::unique_lock<std::mutex> lock(mMutex);
+    return mArrived.wait_for(lock, std::chrono::milliseconds(timeoutMs), [&] {
+        return index < mFirstIndex + int64_t(mEntries.size());
+    });
+}
+
+int64_t
+SonarDvrBuffer::durationUs() const
+{
+    std::lock_guard<std::mutex> lock(mMutex);
+    if (mEntries.empty())
+        return 0;
+    return int64_t(mEntries.back().info.timestampUs - mEntries.front().info.timestampUs);
+}
+
+size_t
+SonarDvrBuffer::bytes() const
+{
+    std::lock_guard<std::mutex> lock(mMutex);
+    return mBytes;
+}
+
+uint64_t
+SonarDvrBuffer::evictedFrames() const
+{
+    std::lock_guard<std::mutex> lock(mMutex);
+    return mEvicted;
+}
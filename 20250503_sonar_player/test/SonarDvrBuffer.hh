@@ -0,0 +1,84 @@
+#if !defined(SONAR_DVR_BUFFER_HH)
+#define SONAR_DVR_BUFFER_HH
+
+#include "SonarFrame.hh"
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <mutex>
+#include <vector>
+
+// DVR バッファに保持したフレームの画像ヘッダと取得時刻
+struct SonarDvrFrameInfo
+{
+    int width{0};
+    int height{0};
+    int swath{0};
+    int range{0};
+    bool is16bit{false};
+    uint64_t timestampUs{0};
+};
+
+// ライブ表示の一時停止・巻き戻し用に直近のフレームを保持するバッファ
+//
+// 受信スレッドが push() し、再生スレッドが通し番号で読む
+// フレームは圧縮して (LZ4 が使えれば LZ4, 無ければ ZeroRle) 保持し、合計が maxBytes を
+// 超えたら古い順に捨てる。差分圧縮は使わない (どのフレームからでも単独で展開できるように)
+// 通し番号は受信順で、捨てても変わらない。firstIndex() から endIndex() - 1 までが読める
+class SonarDvrBuffer
+{
+public:
+    explicit SonarDvrBuffer(size_t maxBytes);
+    virtual ~SonarDvrBuffer();
+
+    SonarDvrBuffer(const SonarDvrBuffer&) = delete;
+    SonarDvrBuffer& operator=(const SonarDvrBuffer&) = delete;
+
+    void setMaxBytes(size_t maxBytes);
+    void clear();
+
+    // 受信スレッドから呼ぶ。圧縮はロックの外で行う
+    void push(const SonarFrame& frame);
+
+    int64_t firstIndex() const;
+    int64_t endIndex() const;
+    // index 番目のフレームを pixels へ展開する (捨てられていれば false)
+    bool frame(int64_t index, SonarDvrFrameInfo& info, std::vector<uint8_t>& pixels) const;
+    // index 番目の取得時刻 (捨てられていれば 0)
+    uint64_t timestampUs(int64_t index) const;
+    // index 番目が届くまで最大 timeoutMs 待つ
+    bool waitFor(int64_t index, int timeoutMs) const;
+
+    // 保持しているフレームの時間幅とメモリ量
+    int64_t durationUs() const;
+    size_t bytes() const;
+    // 容量を超えて捨てたフレーム数
+    uint64_t evictedFrames() const;
+
+private:
+    struct Entry
+    {
+        SonarDvrFrameInfo info;
+        SonarCodec codec{kSonarCodecRaw};
+        size_t rawSize{0};
+        std::vector<uint8_t> data;
+    };
+
+    void evict(size_t incoming);
+
+    mutable std::mutex mMutex;
+    mutable std::condition_variable mArrived;
+    std::deque<Entry> mEntries;
+    int64_t mFirstIndex{0};
+    size_t mBytes{0};
+    size_t mMaxBytes;
+    uint64_t mEvicted{0};
+    // 捨てたフレームのバッファは次の push() で使い回す
+    std::vector<uint8_t> mSpare;
+    // push() は受信スレッドからだけ呼ばれる
+    std::vector<uint8_t> mScratch;
+    SonarCodec mCodec;
+};
+
+#endif // !defined(SONAR_DVR_BUFFER_HH)
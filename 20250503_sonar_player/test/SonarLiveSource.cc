@@ -0,0 +1,46 @@
+#include "SonarLiveSource.hh"
+
+// explicit
+SonarLiveSource::SonarLiveSource(SonarDvrBuffer& buffer)
+    : mBuffer(buffer),
+      // DVR へは push() の中でコピーするため、フレームを持ち続けない
+      mReceiver(0, [this](const SonarFramePtr& frame) { mBuffer.push(*frame); })
+{
+}
+
+// virtual
+SonarLiveSource::~SonarLiveSource()
+{
+    close();
+}
+
+// static
+bool
+SonarLiveSource::isLiveUri(const std::string& uri)
+{
+    return SonarLiveReceiver::isLiveUri(uri);
+}
+
+bool
+SonarLiveSource::open(const std::string& uri)
+{
+    return mReceiver.open(uri);
+}
+
+void
+SonarLiveSource::close()
+{
+    mReceiver.close();
+}
+
+bool
+SonarLiveSource::isOpen() const
+{
+    return mReceiver.isOpen();
+}
+
+uint64_t
+SonarLiveSource::receivedFrames() const
+{
+    return mReceiver.receivedFrames();
+}
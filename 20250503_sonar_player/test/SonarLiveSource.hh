@@ -0,0 +1,38 @@
+#if !defined(SONAR_LIVE_SOURCE_HH)
+#define SONAR_LIVE_SOURCE_HH
+
+#include "SonarDvrBuffer.hh"
+#include "SonarLiveReceiver.hh"
+#include <cstdint>
+#include <string>
+
+// ライブ入力 (UDP / 共有メモリ) を受信して DVR バッファへ入れる
+// (URI は SonarLiveReceiver 参照。表示するのは 1 ストリームだけ)
+//
+// 受信・再構築・圧縮は SonarLiveReceiver のスレッドで行い、再生スレッドは DVR バッファから読むだけ
+// (一時停止・巻き戻し中も受信は止まらない)
+class SonarLiveSource
+{
+public:
+    explicit SonarLiveSource(SonarDvrBuffer& buffer);
+    virtual ~SonarLiveSource();
+
+    SonarLiveSource(const SonarLiveSource&) = delete;
+    SonarLiveSource& operator=(const SonarLiveSource&) = delete;
+
+    static bool isLiveUri(const std::string& uri);
+
+    // 受信スレッドを開始する (URI が不正か UDP ソケットを開けなければ false)
+    bool open(const std::string& uri);
+    void close();
+    bool isOpen() const;
+
+    // DVR バッファへ入れたフレーム数
+    uint64_t receivedFrames() const;
+
+private:
+    SonarDvrBuffer& mBuffer;
+    SonarLiveReceiver mReceiver;
+};
+
+#endif // !defined(SONAR_LIVE_SOURCE_HH)
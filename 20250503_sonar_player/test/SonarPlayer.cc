@@ -20,6 +20,9 @@ SonarPlayer::SonarPlayer(const QString& mkvPath, double swath, double range, int
     mpPushButtonStop = new QPushButton;
     mpPushButtonFastForward = new QPushButton;
     mpPushButtonRewind = new QPushButton;
+    // ライブ入力で最新のフレームへ戻る (ファイル再生中は隠す)
+    mpPushButtonLive = new QPushButton("Live");
+    mpPushButtonLive->setVisible(false);
 
     auto* st = this->style();
 
@@ -42,6 +45,7 @@ SonarPlayer::SonarPlayer(const QString& mkvPath, double swath, double range, int
     connect(mpPushButtonStop, &QPushButton::clicked, this, &SonarPlayer::stop);
     connect(mpPushButtonFastForward, &QPushButton::clicked, this, &SonarPlayer::fastForward);
     connect(mpPushButtonRewind, &QPushButton::clicked, this, &SonarPlayer::rewind);
+    connect(mpPushButtonLive, &QPushButton::clicked, this, &SonarPlayer::goLive);
 
     // スワス／レンジ／強度用 SpinBox／Labels
     auto* lblSwath = new QLabel("Swath[deg]", this);
@@ -132,6 +136,7 @@ SonarPlayer::SonarPlayer(const QString& mkvPath, double swath, double range, int
     h1->addWidget(mpPushButtonStop);
     h1->addWidget(mpPushButtonFastForward);
     h1->addWidget(mpPushButtonRewind);
+    h1->addWidget(mpPushButtonLive);
     h1->addSpacing(20);
     h1->addWidget(lblSwath);
     h1->addWidget(mpDoubleSpinBoxSwath);
@@ -176,6 +181,11 @@ SonarPlayer::SonarPlayer(const QString& mkvPath, double swath, double range, int
     connect(mpSonarThread, &SonarThread::playbackStopped, this,
             &SonarPlayer::handlePlaybackStopped);
 
+    // ライブ入力では一時停止中も DVR バッファが伸びる (縮む) ので、位置と状態を定期的に更新する
+    mpTimerLiveStatus = new QTimer(this);
+    connect(mpTimerLiveStatus, &QTimer::timeout, this, &SonarPlayer::updateLiveStatus);
+    mpTimerLiveStatus->start(500);
+
     mpSonarThread->start(); // 初期ファイルを自動再生
 }
 
@@ -210,12 +220,28 @@ SonarPlayer::rewind()
     mpSonarThread->rewind();
 }
 
+void
+SonarPlayer::goLive()
+{
+    mMaintainedMode = Mode::Play;
+    mpSonarThread->goLive();
+}
+
+void
+SonarPlayer::setDvrBufferBytes(size_t bytes)
+{
+    mpSonarThread->setDvrBufferBytes(bytes);
+}
+
 void
 SonarPlayer::updateFrame(const QImage& frame)
 {
     mpSonarWidget->setFrame(frame);
-    int current = mpSonarThread->currentFrameIndex();
-    mpSliderFramePosition->setValue(current);
+    if (mpSonarThread->isLive())
+        mpSliderFramePosition->setMaximum(mpSonarThread->totalFrameCount());
+    // スライダー操作中は位置を動かさない
+    if (!mpSliderFramePosition->isSliderDown())
+        mpSliderFramePosition->setValue(mpSonarThread->currentFrameIndex());
 }
 
 void
@@ -230,6 +256,30 @@ SonarPlayer::handleFileChanged(const QString& newPath)
     mpLineEditMkvPath->setText(newPath);
     mpSliderFramePosition->setValue(0);
     mpSliderFramePosition->setMaximum(mpSonarThread->totalFrameCount());
+    mpPushButtonLive->setVisible(mpSonarThread->isLive());
+    updateLiveStatus();
+}
+
+// ライブ入力: 最新からの遅れと DVR バッファの長さを表示する
+void
+SonarPlayer::updateLiveStatus()
+{
+    if (!mpSonarThread->isLive())
+        return;
+    mpSliderFramePosition->setMaximum(mpSonarThread->totalFrameCount());
+    if (!mpSliderFramePosition->isSliderDown())
+        mpSliderFramePosition->setValue(mpSonarThread->currentFrameIndex());
+
+    QString position = mpSonarThread->isFollowingLive()
+                           ? QString("LIVE")
+                           : QString("-%1 s").arg(mpSonarThread->behindLive().count() / 1000.0,
+                                                  0, 'f', 1);
+    mpLineEditMkvPath->setText(QString("%1    [%2]    DVR %3 s, %4 MiB")
+                                   .arg(mpSonarThread->currentFilePath())
+                                   .arg(position)
+                                   .arg(mpSonarThread->bufferedDuration().count() / 1000.0, 0,
+                                        'f', 1)
+                                   .arg(mpSonarThread->bufferedBytes() >> 20));
 }
 
 void
@@ -285,6 +335,9 @@ SonarPlayer::keyPressEvent(QKeyEvent* event)
     case Qt::Key_Left:
         mpSonarThread->rewind();
         break;
+    case Qt::Key_End:
+        goLive();
+        break;
     default:
         QWidget::keyPressEvent(event);
     }
@@ -13,6 +13,9 @@ public:
                          int minIntensity = 0, int maxIntensity = 255, QWidget* pParent = nullptr);
     virtual ~SonarPlayer();
 
+    // ライブ入力の DVR バッファの上限
+    void setDvrBufferBytes(size_t bytes);
+
 protected:
     void dragEnterEvent(QDragEnterEvent* event) override;
     void dropEvent(QDropEvent* event) override;
@@ -28,10 +31,12 @@ private slots:
     void stop();
     void fastForward();
     void rewind();
+    void goLive();
     void updateFrame(const QImage& frame);
     void setFramePosition(int pos);
     void handleFileChanged(const QString& newPath);
     void handlePlaybackStopped(int frameIndex);
+    void updateLiveStatus();
 
 private:
     SonarThread* mpSonarThread;
@@ -43,6 +48,7 @@ private:
     QPushButton* mpPushButtonStop;
     QPushButton* mpPushButtonFastForward;
     QPushButton* mpPushButtonRewind;
+    QPushButton* mpPushButtonLive;
     QDoubleSpinBox* mpDoubleSpinBoxSwath;
     QDoubleSpinBox* mpDoubleSpinBoxRange;
     QSpinBox* mpSpinBoxMinIntensity;
@@ -53,6 +59,7 @@ private:
     QPushButton* mpPushButtonBackgroundColor;
     QSlider* mpSliderFramePosition;
     QLineEdit* mpLineEditMkvPath;
+    QTimer* mpTimerLiveStatus;
 
 private:
     double mSwath;
@@ -1,16 +1,34 @@
 #include "SonarThread.hh"
+#include <algorithm>
+
+namespace
+{
+// ライブ入力の DVR バッファの既定の上限 (8bit 512x1000 15fps なら圧縮して数分〜十数分)
+constexpr size_t kDefaultDvrBytes = size_t(512) << 20;
+// ライブ入力で一時停止中に状態を確認する間隔 / 次のフレームを待つ上限
+constexpr unsigned long kLivePollMs = 50;
+} // namespace
 
 // explicit
-SonarThread::SonarThread(QObject* pParent) : QThread(pParent)
+SonarThread::SonarThread(QObject* pParent)
+    : QThread(pParent), mDvrBuffer(kDefaultDvrBytes), mLiveSource(mDvrBuffer)
 {
     mMinIntensity;
     mMaxIntensity;
     mFrameIndex = 0;
     mTotalFrames = 0;
     mFps = 30.0;
+    mPositionMsec = -1.0;
+    mSeekPending = false;
+    mIsLog = false;
+    mLogStartUs = 0;
     mState = PlaybackState::Stop;
     mIsRunning = true;
     mIsPending = false;
+    mIsLive = false;
+    mFollowLive = true;
+    mLiveIndex = -1;
+    mLiveStartUs = 0;
 }
 
 // virtual
@@ -25,17 +43,28 @@ SonarThread::run()
     unsigned long sleep_msec = 1000;
     while (mIsRunning && !isInterruptionRequested())
     {
+        QString pendingPath;
+        {
+            QMutexLocker locker(&mMutex);
+            if (mIsPending)
+                pendingPath = mPendingFilePath;
+        }
+        // 動画のフレーム時刻の表は全フレームを読むので mMutex を持たずに作る
+        std::vector<double> frameMsec;
+        if (!pendingPath.isEmpty() && !SonarLiveSource::isLiveUri(pendingPath.toStdString()) &&
+            !pendingPath.endsWith(".slog", Qt::CaseInsensitive))
+        {
+            scanFrameTimes(pendingPath, frameMsec);
+        }
         {
             QMutexLocker locker(&mMutex);
-            if (mIsPending && !mPendingFilePath.isEmpty())
+            if (mIsPending && !pendingPath.isEmpty() && mPendingFilePath == pendingPath)
             {
-                mCapture.release();
-                mCapture.open(mPendingFilePath.toStdString());
-                if (mCapture.isOpened())
+                mFrameMsec.swap(frameMsec);
+                if (openSource(mPendingFilePath))
                 {
-                    mFps = mCapture.get(cv::CAP_PROP_FPS);
-                    mTotalFrames = static_cast<int>(mCapture.get(cv::CAP_PROP_FRAME_COUNT));
                     mFrameIndex = 0;
+                    mPositionMsec = -1.0;
                     mFilePath = mPendingFilePath;
                     mIsPending = false;
                     mState = PlaybackState::Play;
@@ -44,10 +73,18 @@ SonarThread::run()
             }
         }
 
+        bool waitLive = false;
+        int64_t waitIndex = 0;
         {
             QMutexLocker locker(&mMutex);
-            if (mState == PlaybackState::Play || mState == PlaybackState::FastForward ||
-                mState == PlaybackState::Rewind)
+            if (mIsLive)
+            {
+                sleep_msec = stepLive();
+                waitLive = sleep_msec == 0;
+                waitIndex = mLiveIndex + 1;
+            }
+            else if (mState == PlaybackState::Play || mState == PlaybackState::FastForward ||
+                     mState == PlaybackState::Rewind)
             {
                 if ((mState == PlaybackState::Rewind && mFrameIndex <= 0) ||
                     ((mState == PlaybackState::Play || mState == PlaybackState::FastForward) &&
@@ -67,36 +104,260 @@ SonarThread::run()
                     else if (mState == PlaybackState::Rewind)
                         offset = -30;
 
-                    int next = mFrameIndex + offset;
+                    // シーク要求 (スライダー・停止からの再生) は要求されたフレームから表示する
+                    int next = mSeekPending ? mFrameIndex : mFrameIndex + offset;
 
                     if (next < 0)
                         next = 0;
                     if (next >= mTotalFrames)
                         next = mTotalFrames - 1;
 
-                    mCapture.set(cv::CAP_PROP_POS_FRAMES, next);
                     mFrameIndex = next;
 
+                    // 記録されたピング間隔で再生する
+                    double prevMsec = mPositionMsec;
                     cv::Mat frame;
-                    if (mCapture.read(frame))
+                    if (readFrame(next, offset == 1 && !mSeekPending, frame))
                     {
-                        if (frame.channels() == 1)
-                            cv::cvtColor(frame, frame, cv::COLOR_GRAY2RGB);
-
-                        frame.setTo(mMinIntensity, frame < mMinIntensity);
-                        frame.setTo(mMaxIntensity, frame > mMaxIntensity);
-
-                        QImage image(frame.data, frame.cols, frame.rows, frame.step,
-                                     QImage::Format_RGB888);
-                        emit frameReady(image.copy());
-                        sleep_msec = static_cast<unsigned long>(1000.0 / mFps);
+                        double deltaMsec = mPositionMsec - prevMsec;
+                        emitFrame(frame);
+                        if (offset == 1 && prevMsec >= 0.0 && deltaMsec > 0.0 && deltaMsec < 10000.0)
+                            sleep_msec = static_cast<unsigned long>(deltaMsec);
+                        else
+                            sleep_msec = static_cast<unsigned long>(1000.0 / mFps);
                     }
                 }
             }
         }
-        msleep(sleep_msec);
+        // ライブ表示中は次のフレームが届いたらすぐ表示する
+        if (waitLive)
+            mDvrBuffer.waitFor(waitIndex, kLivePollMs);
+        else
+            msleep(sleep_msec);
+    }
+    mLiveSource.close();
+    mCapture.release();
+    mLogReader.close();
+}
+
+// 表示用に RGB へ変換して強度を制限し、frameReady で渡す
+void
+SonarThread::emitFrame(cv::Mat& frame)
+{
+    if (frame.channels() == 1)
+        cv::cvtColor(frame, frame, cv::COLOR_GRAY2RGB);
+
+    frame.setTo(mMinIntensity, frame < mMinIntensity);
+    frame.setTo(mMaxIntensity, frame > mMaxIntensity);
+
+    QImage image(frame.data, frame.cols, frame.rows, frame.step, QImage::Format_RGB888);
+    emit frameReady(image.copy());
+}
+
+// ライブ入力の 1 ステップ (mMutex を持って呼ぶ)
+// 戻り値は次のステップまでの待ち時間 [ms]。0 なら次のフレームが届くまで待つ
+//   再生: 最新を表示し続ける。巻き戻し / 一時停止の後は記録された間隔で進め、最新に追い付いたら戻る
+//   一時停止 / 停止: 表示を止める (受信と DVR バッファへの追加は続く)
+//   早送り / 巻き戻し: 30 フレームずつ。DVR バッファの範囲で止まる
+unsigned long
+SonarThread::stepLive()
+{
+    const int64_t first = mDvrBuffer.firstIndex();
+    const int64_t end = mDvrBuffer.endIndex();
+    if (end == first)
+        return 0;
+    if (mLiveStartUs == 0)
+        mLiveStartUs = int64_t(mDvrBuffer.timestampUs(first));
+    // 止めている間に捨てられたら、残っている最も古いフレームから
+    if (mLiveIndex >= 0 && mLiveIndex < first)
+        mLiveIndex = first;
+    if (mState == PlaybackState::Stop || mState == PlaybackState::Pause)
+        return kLivePollMs;
+
+    int64_t next;
+    if (mState == PlaybackState::FastForward)
+        next = mLiveIndex + 30;
+    else if (mState == PlaybackState::Rewind)
+        next = mLiveIndex < 0 ? end - 1 - 30 : mLiveIndex - 30;
+    else
+        next = mFollowLive ? end - 1 : mLiveIndex + 1;
+    if (next < first)
+        next = first;
+    if (next >= end - 1)
+    {
+        next = end - 1;
+        mFollowLive = true;
+    }
+    if (mState == PlaybackState::Rewind)
+        mFollowLive = false;
+    if (next == mLiveIndex)
+        return mFollowLive ? 0 : kLivePollMs;
+
+    const uint64_t prevUs = mLiveIndex >= 0 ? mDvrBuffer.timestampUs(mLiveIndex) : 0;
+    SonarDvrFrameInfo info;
+    mLiveIndex = next;
+    if (!mDvrBuffer.frame(next, info, mLivePixels))
+        return kLivePollMs;
+    cv::Mat frame;
+    if (info.is16bit)
+    {
+        cv::Mat raw(info.height, info.width, CV_16UC1, mLivePixels.data());
+        raw.convertTo(frame, CV_8UC1, 1.0 / 256.0);
+    }
+    else
+    {
+        frame = cv::Mat(info.height, info.width, CV_8UC1, mLivePixels.data());
     }
+    mPositionMsec = (int64_t(info.timestampUs) - mLiveStartUs) / 1000.0;
+    emitFrame(frame);
+
+    if (mFollowLive)
+        return 0;
+    // 記録されたピング間隔で再生する
+    const double deltaMsec = (double(info.timestampUs) - double(prevUs)) / 1000.0;
+    if (mState == PlaybackState::Play && prevUs > 0 && deltaMsec > 0.0 && deltaMsec < 10000.0)
+        return static_cast<unsigned long>(deltaMsec);
+    return static_cast<unsigned long>(1000.0 / mFps);
+}
+
+// ファイルを開く (.slog は SonarLogReader、ライブ入力は SonarLiveSource、それ以外は OpenCV)
+bool
+SonarThread::openSource(const QString& path)
+{
+    mLiveSource.close();
     mCapture.release();
+    mLogReader.close();
+    mIsLive = SonarLiveSource::isLiveUri(path.toStdString());
+    if (mIsLive)
+    {
+        mIsLog = false;
+        mDvrBuffer.clear();
+        mFollowLive = true;
+        mLiveIndex = -1;
+        mLiveStartUs = 0;
+        mFps = 30.0;
+        mTotalFrames = 0;
+        mIsLive = mLiveSource.open(path.toStdString());
+        return mIsLive;
+    }
+
+    mIsLog = path.endsWith(".slog", Qt::CaseInsensitive);
+    if (mIsLog)
+    {
+        if (!mLogReader.open(path.toStdString()))
+            return false;
+        SonarLogFrame first;
+        mLogStartUs = mLogReader.frame(0, first) ? first.timestampUs : 0;
+        mFps = mLogReader.fps() > 0 ? mLogReader.fps() : 30.0;
+        mTotalFrames = mLogReader.frameCount();
+        return true;
+    }
+
+    mCapture.open(path.toStdString());
+    if (!mCapture.isOpened())
+        return false;
+    mFps = mCapture.get(cv::CAP_PROP_FPS);
+    // CAP_PROP_FRAME_COUNT は長さと公称 fps からの推定なので、表があれば表の数を使う
+    mTotalFrames = mFrameMsec.empty() ? static_cast<int>(mCapture.get(cv::CAP_PROP_FRAME_COUNT))
+                                      : static_cast<int>(mFrameMsec.size());
+    mSeekPending = false;
+    return true;
+}
+
+// 動画の全フレームを (デコードだけして) 読み、各フレームの表示時刻 [ms] を frameMsec に入れる
+// 時刻が単調増加でなければ空にする (フレーム番号でシークする)
+bool
+SonarThread::scanFrameTimes(const QString& path, std::vector<double>& frameMsec)
+{
+    frameMsec.clear();
+    cv::VideoCapture capture(path.toStdString());
+    if (!capture.isOpened())
+        return false;
+    while (capture.grab())
+    {
+        if (!mIsRunning || isInterruptionRequested())
+        {
+            frameMsec.clear();
+            return false;
+        }
+        const double msec = capture.get(cv::CAP_PROP_POS_MSEC);
+        if (!frameMsec.empty() && msec <= frameMsec.back())
+        {
+            frameMsec.clear();
+            return false;
+        }
+        frameMsec.push_back(msec);
+    }
+    return !frameMsec.empty();
+}
+
+// 表示時刻 msec のフレームの番号 (mFrameMsec が空でないこと)
+int
+SonarThread::frameIndexAt(double msec) const
+{
+    // 表とデコード時の時刻は同じ計算で求めるので一致する (丸めの分だけ 1 us の誤差を許す)
+    auto it = std::lower_bound(mFrameMsec.begin(), mFrameMsec.end(), msec - 0.001);
+    if (it == mFrameMsec.end())
+        --it;
+    return static_cast<int>(it - mFrameMsec.begin());
+}
+
+// index 番目のフレームを読み、mFrameIndex と mPositionMsec を更新する
+// sequential: 直前のフレームの次を読む (シーク不要)
+bool
+SonarThread::readFrame(int index, bool sequential, cv::Mat& frame)
+{
+    mSeekPending = false;
+    if (mIsLog)
+    {
+        // 非圧縮フレームはページキャッシュ上のデータをそのまま参照する
+        SonarLogFrame logFrame;
+        if (!mLogReader.frame(index, logFrame))
+            return false;
+        if (mLogReader.bytesPerPixel() == 2)
+        {
+            cv::Mat raw(mLogReader.height(), mLogReader.width(), CV_16UC1,
+                        const_cast<uint8_t*>(logFrame.data));
+            raw.convertTo(frame, CV_8UC1, 1.0 / 256.0);
+        }
+        else
+        {
+            frame = cv::Mat(mLogReader.height(), mLogReader.width(), CV_8UC1,
+                            const_cast<uint8_t*>(logFrame.data));
+        }
+        mFrameIndex = index;
+        mPositionMsec = (logFrame.timestampUs - mLogStartUs) / 1000.0;
+        return true;
+    }
+
+    // 通常再生は順に読む。フレーム番号のシークは公称 fps 換算で VFR ではずれるため、
+    // 表があれば表示時刻でシークし、手前のフレームに着いたら要求したフレームまで読み進める
+    const bool useTimes = index >= 0 && index < static_cast<int>(mFrameMsec.size());
+    if (!sequential)
+    {
+        if (useTimes)
+            mCapture.set(cv::CAP_PROP_POS_MSEC, mFrameMsec[index]);
+        else
+            mCapture.set(cv::CAP_PROP_POS_FRAMES, index);
+    }
+    if (!mCapture.read(frame))
+        return false;
+    mPositionMsec = mCapture.get(cv::CAP_PROP_POS_MSEC);
+    if (!mFrameMsec.empty())
+    {
+        while (!sequential && useTimes && frameIndexAt(mPositionMsec) < index &&
+               mCapture.read(frame))
+        {
+            mPositionMsec = mCapture.get(cv::CAP_PROP_POS_MSEC);
+        }
+        // 実際に返ったフレームの位置にする
+        mFrameIndex = frameIndexAt(mPositionMsec);
+    }
+    else
+    {
+        mFrameIndex = index;
+    }
+    return true;
 }
 
 void
@@ -122,21 +383,41 @@ SonarThread::setFilePath(const QString& path)
     mIsPending = true;
 }
 
+void
+SonarThread::setDvrBufferBytes(size_t bytes)
+{
+    mDvrBuffer.setMaxBytes(bytes);
+}
+
 void
 SonarThread::setFramePosition(int index)
 {
     QMutexLocker locker(&mMutex);
-    mCapture.set(cv::CAP_PROP_POS_FRAMES, index);
+    if (mIsLive)
+    {
+        mLiveIndex = mDvrBuffer.firstIndex() + index;
+        mFollowLive = false;
+        return;
+    }
+    // 次の readFrame() でシークする (位置はデコードしたフレームから決まる)
+    mFrameIndex = std::max(0, std::min(index, mTotalFrames - 1));
+    mSeekPending = true;
+    mPositionMsec = -1.0;
 }
 
 void
 SonarThread::play()
 {
     QMutexLocker locker(&mMutex);
-    if (mState == PlaybackState::Stop)
+    if (mState == PlaybackState::Stop && mIsLive)
+    {
+        mFollowLive = true;
+    }
+    else if (mState == PlaybackState::Stop)
     {
         mFrameIndex = 0;
-        mCapture.set(cv::CAP_PROP_POS_FRAMES, 0);
+        mPositionMsec = -1.0;
+        mSeekPending = true;
     }
     mState = PlaybackState::Play;
 }
@@ -145,6 +426,9 @@ void
 SonarThread::pause()
 {
     QMutexLocker locker(&mMutex);
+    // ライブ入力では止めた位置から再生を再開する (最新に追い付くか goLive() まで最新へ飛ばない)
+    if (mIsLive)
+        mFollowLive = false;
     mState = PlaybackState::Pause;
 }
 
@@ -169,17 +453,31 @@ SonarThread::rewind()
     mState = PlaybackState::Rewind;
 }
 
+void
+SonarThread::goLive()
+{
+    QMutexLocker locker(&mMutex);
+    mFollowLive = true;
+    mState = PlaybackState::Play;
+}
+
+// ライブ入力では DVR バッファに残っているフレーム数
 int
 SonarThread::totalFrameCount() const
 {
     QMutexLocker locker(&mMutex);
+    if (mIsLive)
+        return int(mDvrBuffer.endIndex() - mDvrBuffer.firstIndex());
     return mTotalFrames;
 }
 
+// ライブ入力では DVR バッファの最も古いフレームからの位置
 int
 SonarThread::currentFrameIndex() const
 {
     QMutexLocker locker(&mMutex);
+    if (mIsLive)
+        return int(std::max<int64_t>(0, mLiveIndex - mDvrBuffer.firstIndex()));
     return mFrameIndex;
 }
 
@@ -194,6 +492,48 @@ std::chrono::milliseconds
 SonarThread::elapsedDuration() const
 {
     QMutexLocker locker(&mMutex);
+    if (mPositionMsec >= 0.0)
+        return std::chrono::milliseconds(static_cast<int64_t>(mPositionMsec));
     double seconds = mFrameIndex / mFps;
     return std::chrono::milliseconds(static_cast<int64_t>(seconds * 1000));
 }
+
+bool
+SonarThread::isLive() const
+{
+    QMutexLocker locker(&mMutex);
+    return mIsLive;
+}
+
+bool
+SonarThread::isFollowingLive() const
+{
+    QMutexLocker locker(&mMutex);
+    return mIsLive && mFollowLive;
+}
+
+// 表示中のフレームが最新のフレームからどれだけ遅れているか
+std::chrono::milliseconds
+SonarThread::behindLive() const
+{
+    QMutexLocker locker(&mMutex);
+    if (!mIsLive || mLiveIndex < 0)
+        return std::chrono::milliseconds(0);
+    const uint64_t latestUs = mDvrBuffer.timestampUs(mDvrBuffer.endIndex() - 1);
+    const uint64_t currentUs = mDvrBuffer.timestampUs(mLiveIndex);
+    if (latestUs <= currentUs || currentUs == 0)
+        return std::chrono::milliseconds(0);
+    return std::chrono::milliseconds(int64_t(latestUs - currentUs) / 1000);
+}
+
+std::chrono::milliseconds
+SonarThread::bufferedDuration() const
+{
+    return std::chrono::milliseconds(mDvrBuffer.durationUs() / 1000);
+}
+
+size_t
+SonarThread::bufferedBytes() const
+{
+    return mDvrBuffer.bytes();
+}
@@ -7,6 +7,10 @@
 #include <QString>
 #include <QThread>
 #include <opencv2/opencv.hpp>
+#include <vector>
+#include "SonarDvrBuffer.hh"
+#include "SonarLiveSource.hh"
+#include "SonarLog.hh"
 
 class SonarThread : public QThread
 {
@@ -27,22 +31,42 @@ public:
     void run() override;
 
     void setParams(int minI, int maxI);
+    // ファイルパスまたはライブ入力の URI (udp://, shm://)
     void setFilePath(const QString& path);
+    // ライブ入力の DVR バッファの上限
+    void setDvrBufferBytes(size_t bytes);
 
     void play();
     void pause();
     void stop();
     void fastForward();
     void rewind();
+    // ライブ入力: 最新のフレームへ戻る
+    void goLive();
 
     int totalFrameCount() const;
     int currentFrameIndex() const;
     std::chrono::milliseconds elapsedDuration() const;
     QString currentFilePath() const;
 
+    // ライブ入力の状態 (ファイル再生中は isLive() が false)
+    bool isLive() const;
+    bool isFollowingLive() const;
+    std::chrono::milliseconds behindLive() const;
+    std::chrono::milliseconds bufferedDuration() const;
+    size_t bufferedBytes() const;
+
     void setFramePosition(int pos);
     void terminate();
 
+private:
+    bool openSource(const QString& path);
+    bool scanFrameTimes(const QString& path, std::vector<double>& frameMsec);
+    int frameIndexAt(double msec) const;
+    bool readFrame(int index, bool sequential, cv::Mat& frame);
+    unsigned long stepLive();
+    void emitFrame(cv::Mat& frame);
+
 signals:
     void frameReady(const QImage& frame);
     void fileChanged(const QString& newPath);
@@ -55,14 +79,32 @@ private:
     int mMaxIntensity;
 
     cv::VideoCapture mCapture;
+    // 生データログ (.slog) は mmap して読む
+    SonarLogReader mLogReader;
+    bool mIsLog;
+    int64_t mLogStartUs;
     int mFrameIndex;
     int mTotalFrames;
     double mFps;
+    double mPositionMsec;
+    // 動画の各フレームの表示時刻 [ms] (VFR でも時刻でシークし、返ったフレームから位置を決める)
+    std::vector<double> mFrameMsec;
+    // 次の readFrame() で mFrameIndex のフレームへシークする
+    bool mSeekPending;
 
     PlaybackState mState;
     bool mIsRunning;
     bool mIsPending;
     QString mPendingFilePath;
+
+    // ライブ入力 (受信は mLiveSource のスレッドが続け、ここでは DVR バッファから読む)
+    SonarDvrBuffer mDvrBuffer;
+    SonarLiveSource mLiveSource;
+    bool mIsLive;
+    bool mFollowLive;     // 最新のフレームを表示し続ける
+    int64_t mLiveIndex;   // 表示中のフレームの DVR バッファ上の通し番号 (-1: まだ無い)
+    int64_t mLiveStartUs; // 最初に届いたフレームの取得時刻
+    std::vector<uint8_t> mLivePixels;
 };
 
 #endif // #if !defined(SONAR_THREAD_HH)
@@ -12,14 +12,24 @@ main(int argc, char* argv[])
     QCoreApplication::setApplicationName("SonarPlayer");
     QCoreApplication::setApplicationVersion("1.0");
     QCommandLineParser parser;
-    parser.setApplicationDescription("Play and visualize sonar data from an MKV file");
+    parser.setApplicationDescription(
+        "Play and visualize sonar data from an MKV file or a live UDP / shared memory source");
     parser.addHelpOption();
     parser.addVersionOption();
 
-    // MKV ファイルパス
-    QCommandLineOption mkvOpt(QStringList{"m", "mkv"}, "Sonar data MKV file path", "MKV");
+    // MKV ファイルパス (またはライブ入力の URI)
+    QCommandLineOption mkvOpt(QStringList{"m", "mkv"},
+                              "Sonar data MKV (or raw .slog) file path, or a live source: "
+                              "udp://[ADDRESS][:PORT][?stream=N&iface=IFACE&source=ADDRESS] "
+                              "or shm://NAME[?stream=N]",
+                              "MKV");
     parser.addOption(mkvOpt);
 
+    // ライブ入力の DVR バッファ (一時停止・巻き戻しできる範囲)
+    QCommandLineOption dvrOpt("dvr-mb", "Memory kept for pausing and rewinding a live source [MiB]",
+                              "MB", "512");
+    parser.addOption(dvrOpt);
+
     // 扇形開口角度
     QCommandLineOption swathOpt(QStringList{"s", "swath"}, "Fan opening angle [deg]", "SWATH");
     parser.addOption(swathOpt);
@@ -47,8 +57,8 @@ main(int argc, char* argv[])
     }
     else
     {
-        mkvPath =
-            QFileDialog::getOpenFileName(nullptr, "MKVファイルを選択", "", "動画ファイル (*.mkv)");
+        mkvPath = QFileDialog::getOpenFileName(nullptr, "MKVファイルを選択", "",
+                                               "ソナーファイル (*.mkv *.slog)");
     }
     if (mkvPath.isEmpty())
     {
@@ -62,6 +72,7 @@ main(int argc, char* argv[])
     int maxIntensity = parser.isSet(maxIntOpt) ? parser.value(maxIntOpt).toInt() : 255;
 
     SonarPlayer w(mkvPath, swath, range, minIntensity, maxIntensity);
+    w.setDvrBufferBytes(size_t(qMax(1, parser.value(dvrOpt).toInt())) << 20);
     w.show();
     app.exec();
     return 0;
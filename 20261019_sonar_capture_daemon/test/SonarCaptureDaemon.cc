@@ -0,0 +1,448 @@
+#include "SonarCaptureDaemon.hh"
+#include "SonarLog.hh"
+#include <algorithm>
+#include <arpa/inet.h>
+#include <condition_variable>
+#include <cstdio>
+#include <ctime>
+#include <deque>
+#include <iostream>
+#include <poll.h>
+#include <thread>
+#if defined(SONAR_HAVE_FFMPEG)
+#include "SonarRecorder.hh"
+#endif
+
+namespace {
+// How long a receive thread sleeps in poll() before expiring incomplete frames
+constexpr int kPollMs = 50;
+
+// <dir>/sonar_<local time>_<address>-<port>_s<stream>.<ext>
+std::string outputFilename(const std::string& dir, const SonarStreamKey& key,
+                           const char* extension) {
+    timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    tm local;
+    localtime_r(&ts.tv_sec, &local);
+    char when[32];
+    strftime(when, sizeof(when), "%Y-%m-%d_%H-%M-%S", &local);
+    char address[INET_ADDRSTRLEN] = "0.0.0.0";
+    in_addr in;
+    in.s_addr = key.address;
+    inet_ntop(AF_INET, &in, address, sizeof(address));
+    char name[128];
+    snprintf(name, sizeof(name), "sonar_%s.%03ld_%s-%u_s%u%s", when, ts.tv_nsec / 1000000,
+             address, unsigned(ntohs(key.port)), unsigned(key.streamId), extension);
+    return dir.empty() ? std::string(name) : dir + "/" + name;
+}
+} // namespace
+
+// ---------------------------------------------------------------------------
+// Receiver: one socket shard, receiving and reassembling on its own thread
+// ---------------------------------------------------------------------------
+
+class SonarCaptureDaemon::Receiver {
+public:
+    Receiver(int shard, const SonarCaptureConfig& config, const SonarUdpReceiverConfig& socket,
+             int poolFrames, const std::shared_ptr<SonarMetricsRegistry>& registry,
+             SonarCaptureDaemon* daemon)
+        : receiver(socket),
+          pool((config.maxFrameBytes + config.reassembler.maxPayload - 1) /
+                   config.reassembler.maxPayload * config.reassembler.maxPayload,
+               poolFrames),
+          reassembler(pool, config.reassembler,
+                      [daemon](const SonarFramePtr& frame) { daemon->deliver(frame); }, registry),
+          metrics(registry->addSocket(shard)) {}
+
+    ~Receiver() { stop(); }
+
+    bool isOpen() const { return receiver.isOpen(); }
+
+    void start() { thread = std::thread(&Receiver::run, this); }
+
+    void stop() {
+        stopping = true;
+        if (thread.joinable())
+            thread.join();
+    }
+
+private:
+    void run() {
+        pollfd p;
+        p.fd = receiver.fd();
+        p.events = POLLIN;
+        while (!stopping) {
+            p.revents = 0;
+            if (poll(&p, 1, kPollMs) <= 0) {
+                reassembler.expire();
+                continue;
+            }
+            int n;
+            do {
+                reassembler.prepare(receiver);
+                n = receiver.receiveBatch();
+                if (n > 0) {
+                    ++metrics->batches;
+                    metrics->datagrams += uint64_t(n);
+                    reassembler.process(receiver, n);
+                }
+            } while (n == receiver.batchSize());
+            metrics->kernelDrops.set(receiver.kernelDrops());
+        }
+    }
+
+    SonarUdpReceiver receiver;
+    SonarFramePool pool;
+    SonarReassembler reassembler;
+    std::shared_ptr<SonarSocketMetrics> metrics;
+    std::thread thread;
+    std::atomic<bool> stopping{false};
+};
+
+// ---------------------------------------------------------------------------
+// Recording: one stream's encode and write threads
+// ---------------------------------------------------------------------------
+
+class SonarCaptureDaemon::Recording {
+public:
+    Recording(const SonarStreamKey& key, const SonarCaptureConfig& config)
+        : key(key), config(config) {
+        lastUs = nowUs();
+        encoder = std::thread(&Recording::encodeLoop, this);
+        if (config.format == kSonarCaptureSlog)
+            writer = std::thread(&Recording::writeLoop, this);
+    }
+
+    ~Recording() { finish(); }
+
+    // Called from the receive threads; never blocks on the encoder
+    bool push(const SonarFramePtr& frame) {
+        lastUs = nowUs();
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (frames.size() >= config.queueFrames) {
+                ++dropped;
+                return false;
+            }
+            frames.push_back(frame);
+        }
+        framesCond.notify_one();
+        return true;
+    }
+
+    // Encodes and writes what is queued, then closes the file
+    void finish() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            finished = true;
+        }
+        framesCond.notify_all();
+        if (encoder.joinable())
+            encoder.join();
+        if (writer.joinable())
+            writer.join();
+    }
+
+    int64_t lastDeliveryUs() const { return lastUs; }
+
+    SonarCaptureStreamStats stats() const {
+        SonarCaptureStreamStats s;
+        s.key = key;
+        std::lock_guard<std::mutex> lock(mutex);
+        s.filename = filename;
+        s.framesWritten = written;
+        s.framesDropped = dropped;
+        s.files = files;
+        return s;
+    }
+
+private:
+    // An encoded .slog record on its way to the writer. Uncompressed records keep the
+    // pool frame alive and are written straight from it.
+    struct Record {
+        std::shared_ptr<SonarLogWriter> log;
+        SonarLogRecordHeader header;
+        bool compressed = false;
+        std::vector<char> buffer;
+        SonarFramePtr frame;
+    };
+
+    void encodeLoop() {
+        for (;;) {
+            SonarFramePtr frame;
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                framesCond.wait(lock, [this] { return finished || !frames.empty(); });
+                if (frames.empty())
+                    break;
+                frame = std::move(frames.front());
+                frames.pop_front();
+            }
+            if (config.format == kSonarCaptureSlog)
+                encodeSlog(frame);
+            else
+                encodeMkv(frame);
+        }
+        log.reset();
+#if defined(SONAR_HAVE_FFMPEG)
+        video.reset();
+#endif
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            encodeDone = true;
+        }
+        recordsCond.notify_all();
+    }
+
+    bool sameGeometry(const SonarFrame& frame) const {
+        return frame.width == width && frame.height == height && frame.is16bit == is16bit;
+    }
+
+    void startFile(const SonarFrame& frame, const std::string& name) {
+        width = frame.width;
+        height = frame.height;
+        is16bit = frame.is16bit;
+        std::lock_guard<std::mutex> lock(mutex);
+        filename = name;
+        ++files;
+    }
+
+    void encodeSlog(const SonarFramePtr& frame) {
+        if (!log || !sameGeometry(*frame)) {
+            // The writer closes the previous file once its last record is written
+            std::string name = outputFilename(config.outputDir, key, ".slog");
+            log = std::make_shared<SonarLogWriter>(name, frame->width, frame->height, config.fps,
+                                                   frame->is16bit, config.compress);
+            startFile(*frame, name);
+        }
+        if (!log->isOpen())
+            return;
+
+        Record record;
+        record.log = log;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (!spareBuffers.empty()) {
+                record.buffer = std::move(spareBuffers.back());
+                spareBuffers.pop_back();
+            }
+        }
+        log->setGeometry(float(frame->swath), float(frame->range));
+        record.compressed = log->encodeFrame(frame->pixels(), int64_t(frame->timestampUs),
+                                             record.header, record.buffer);
+        // A compressed record no longer needs the frame; give it back to the pool early
+        if (!record.compressed)
+            record.frame = frame;
+
+        std::unique_lock<std::mutex> lock(mutex);
+        spaceCond.wait(lock, [this] { return records.size() < config.writeQueueRecords; });
+        records.push_back(std::move(record));
+        lock.unlock();
+        recordsCond.notify_one();
+    }
+
+    void encodeMkv(const SonarFramePtr& frame) {
+#if defined(SONAR_HAVE_FFMPEG)
+        if (!video || !sameGeometry(*frame)) {
+            video.reset();
+            std::string name = outputFilename(config.outputDir, key, ".mkv");
+            video.reset(new SonarRecorder(frame->width, frame->height, config.fps,
+                                          frame->is16bit, AsyncFileWriterConfig(), name));
+            startFile(*frame, name);
+        }
+        video->recordFrame(frame->pixels(), int64_t(frame->timestampUs));
+        std::lock_guard<std::mutex> lock(mutex);
+        ++written;
+#else
+        (void)frame;
+#endif
+    }
+
+    void writeLoop() {
+        for (;;) {
+            Record record;
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                recordsCond.wait(lock, [this] { return encodeDone || !records.empty(); });
+                if (records.empty())
+                    break;
+                record = std::move(records.front());
+                records.pop_front();
+            }
+            spaceCond.notify_one();
+            const void* payload = record.compressed ? static_cast<const void*>(record.buffer.data())
+                                                    : record.frame->pixels();
+            record.log->writeRecord(record.header, payload);
+            record.frame.reset();
+            record.log.reset();
+            std::lock_guard<std::mutex> lock(mutex);
+            ++written;
+            if (record.compressed && spareBuffers.size() < config.writeQueueRecords)
+                spareBuffers.push_back(std::move(record.buffer));
+        }
+    }
+
+    const SonarStreamKey key;
+    const SonarCaptureConfig& config;
+    std::atomic<int64_t> lastUs{0};
+
+    // Owned by the encode thread
+    int width = 0;
+    int height = 0;
+    bool is16bit = false;
+    std::shared_ptr<SonarLogWriter> log;
+#if defined(SONAR_HAVE_FFMPEG)
+    std::unique_ptr<SonarRecorder> video;
+#endif
+
+    mutable std::mutex mutex;
+    std::condition_variable framesCond;  // frames or finished
+    std::condition_variable recordsCond; // records or encodeDone
+    std::condition_variable spaceCond;   // room in records
+    std::deque<SonarFramePtr> frames;
+    std::deque<Record> records;
+    std::vector<std::vector<char>> spareBuffers;
+    bool finished = false;
+    bool encodeDone = false;
+    std::string filename;
+    uint64_t written = 0;
+    uint64_t dropped = 0;
+    uint64_t files = 0;
+
+    std::thread encoder;
+    std::thread writer;
+};
+
+// ---------------------------------------------------------------------------
+// SonarCaptureDaemon
+// ---------------------------------------------------------------------------
+
+SonarCaptureDaemon::SonarCaptureDaemon(const SonarCaptureConfig& config)
+    : config(config), registry(std::make_shared<SonarMetricsRegistry>()) {
+    this->config.queueFrames = std::max<size_t>(1, config.queueFrames);
+    this->config.writeQueueRecords = std::max<size_t>(1, config.writeQueueRecords);
+#if !defined(SONAR_HAVE_FFMPEG)
+    if (config.format == kSonarCaptureMkv) {
+        std::cerr << "Warning: Built without FFmpeg, recording .slog instead of .mkv"
+                  << std::endl;
+        this->config.format = kSonarCaptureSlog;
+    }
+#endif
+}
+
+SonarCaptureDaemon::~SonarCaptureDaemon() {
+    stop();
+}
+
+// static
+int64_t SonarCaptureDaemon::nowUs() {
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return int64_t(ts.tv_sec) * 1000000 + ts.tv_nsec / 1000;
+}
+
+bool SonarCaptureDaemon::start() {
+    int shards = std::max(1, config.receiveThreads);
+    // Multicast is copied to every SO_REUSEPORT socket, so it cannot be sharded
+    if (shards > 1 && !config.receiver.multicastGroup.empty()) {
+        std::cerr << "Warning: Multicast reception uses a single receive thread" << std::endl;
+        shards = 1;
+    }
+    SonarUdpReceiverConfig socket = config.receiver;
+    socket.reusePort = shards > 1;
+
+    // Each stream holds its frames in flight, its delta reference and its encoder queue
+    const int streams = std::max(1, config.reassembler.maxStreams);
+    const int poolFrames =
+        streams * (config.reassembler.maxFramesInFlight + 2 + int(config.queueFrames) +
+                   int(config.writeQueueRecords)) + 2;
+
+    running = true;
+    for (int i = 0; i < shards; ++i) {
+        std::unique_ptr<Receiver> receiver(
+            new Receiver(i, config, socket, poolFrames, registry, this));
+        if (!receiver->isOpen()) {
+            stop();
+            return false;
+        }
+        receiver->start();
+        receivers.push_back(std::move(receiver));
+    }
+    return true;
+}
+
+void SonarCaptureDaemon::stop() {
+    running = false;
+    for (std::unique_ptr<Receiver>& receiver : receivers)
+        receiver->stop();
+    receivers.clear();
+
+    std::map<SonarStreamKey, std::unique_ptr<Recording>> closing;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        closing.swap(recordings);
+    }
+    for (auto& entry : closing) {
+        entry.second->finish();
+        std::lock_guard<std::mutex> lock(mutex);
+        closedFrames += entry.second->stats().framesWritten;
+    }
+}
+
+void SonarCaptureDaemon::closeIdle(int64_t idleUs) {
+    const int64_t now = nowUs();
+    std::vector<std::unique_ptr<Recording>> closing;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        for (auto it = recordings.begin(); it != recordings.end();) {
+            if (now - it->second->lastDeliveryUs() > idleUs) {
+                closing.push_back(std::move(it->second));
+                it = recordings.erase(it);
+            } else {
+                ++it;
+            }
+        }
+    }
+    // Draining may take a while; do it without holding up the receive threads
+    for (std::unique_ptr<Recording>& recording : closing) {
+        recording->finish();
+        SonarCaptureStreamStats s = recording->stats();
+        std::cerr << "Closed " << s.filename << " (" << s.framesWritten << " frames in "
+                  << s.files << " files, " << s.framesDropped << " dropped)" << std::endl;
+        std::lock_guard<std::mutex> lock(mutex);
+        closedFrames += s.framesWritten;
+    }
+}
+
+std::vector<SonarCaptureStreamStats> SonarCaptureDaemon::streamStats() const {
+    std::lock_guard<std::mutex> lock(mutex);
+    std::vector<SonarCaptureStreamStats> result;
+    for (const auto& entry : recordings)
+        result.push_back(entry.second->stats());
+    return result;
+}
+
+uint64_t SonarCaptureDaemon::framesWritten() const {
+    std::lock_guard<std::mutex> lock(mutex);
+    uint64_t total = closedFrames;
+    for (const auto& entry : recordings)
+        total += entry.second->stats().framesWritten;
+    return total;
+}
+
+const SonarMetricsRegistry& SonarCaptureDaemon::metrics() const {
+    return *registry;
+}
+
+// Called from the receive threads
+void SonarCaptureDaemon::deliver(const SonarFramePtr& frame) {
+    if (!running)
+        return;
+    const SonarStreamKey key = SonarStreamKey::of(*frame);
+    // Pushing under the lock keeps closeIdle() from finishing the recording meanwhile
+    std::lock_guard<std::mutex> lock(mutex);
+    std::unique_ptr<Recording>& recording = recordings[key];
+    if (!recording)
+        recording.reset(new Recording(key, config));
+    recording->push(frame);
+}
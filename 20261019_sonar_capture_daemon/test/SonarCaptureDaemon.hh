@@ -0,0 +1,94 @@
+#if !defined(SONAR_CAPTURE_DAEMON_HH)
+#define SONAR_CAPTURE_DAEMON_HH
+
+#include "SonarFrame.hh"
+#include "SonarMetrics.hh"
+#include "SonarReassembler.hh"
+#include "SonarUdpReceiver.hh"
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+enum SonarCaptureFormat {
+    kSonarCaptureSlog, // raw frames (SonarLogWriter), optionally LZ4 per record
+    kSonarCaptureMkv,  // H.264 / FFV1 (SonarRecorder), needs SONAR_HAVE_FFMPEG
+};
+
+struct SonarCaptureConfig {
+    SonarUdpReceiverConfig receiver;
+    SonarReassemblerConfig reassembler;
+    int receiveThreads = 1;              // SO_REUSEPORT shards (multicast: always 1)
+    size_t maxFrameBytes = kSonarImageHeaderSize + 1024 * 1024 * 2;
+
+    std::string outputDir = ".";
+    SonarCaptureFormat format = kSonarCaptureSlog;
+    bool compress = false;               // LZ4 records in .slog (needs SONAR_HAVE_LZ4)
+    int fps = 15;                        // nominal rate written to the file headers
+    size_t queueFrames = 4;              // frames waiting for the encoder, per stream
+    size_t writeQueueRecords = 8;        // encoded records waiting for the writer (.slog)
+};
+
+// One stream's recording
+struct SonarCaptureStreamStats {
+    SonarStreamKey key;
+    std::string filename;                // current (or last) output file
+    uint64_t framesWritten = 0;
+    uint64_t framesDropped = 0;          // the encoder queue was full
+    uint64_t files = 0;                  // a new file starts when the geometry changes
+};
+
+// Headless UDP-to-disk capture
+//
+// Every source (address, port and stream ID) is recorded into its own file, opened when its
+// first frame arrives and closed when it goes idle or the daemon stops. Stages:
+//   receive + reassembly  one thread per socket shard; chunks land in pool frames directly
+//                         (SonarReassembler), so the two are not split across threads
+//   encode                one thread per stream (LZ4 for .slog, the video codec for .mkv)
+//   write                 one thread per stream (.slog) or AsyncFileWriter's thread (.mkv)
+// Frames move between stages by reference (pool buffers, no copies). A stage that falls
+// behind never blocks reception: the encoder queue is bounded and a full queue drops the
+// newest frame, which is counted in framesDropped.
+class SonarCaptureDaemon {
+public:
+    explicit SonarCaptureDaemon(const SonarCaptureConfig& config);
+    ~SonarCaptureDaemon();
+
+    SonarCaptureDaemon(const SonarCaptureDaemon&) = delete;
+    SonarCaptureDaemon& operator=(const SonarCaptureDaemon&) = delete;
+
+    // Opens the sockets and starts receiving
+    bool start();
+    // Stops receiving, then drains and closes every recording
+    void stop();
+    // Closes the recordings of streams that delivered nothing for idleUs
+    void closeIdle(int64_t idleUs);
+
+    // Open recordings
+    std::vector<SonarCaptureStreamStats> streamStats() const;
+    // All recordings, including closed ones
+    uint64_t framesWritten() const;
+    const SonarMetricsRegistry& metrics() const;
+
+private:
+    class Receiver;
+    class Recording;
+
+    static int64_t nowUs();
+    void deliver(const SonarFramePtr& frame);
+
+    SonarCaptureConfig config;
+    std::shared_ptr<SonarMetricsRegistry> registry;
+    std::vector<std::unique_ptr<Receiver>> receivers;
+    std::atomic<bool> running{false};
+
+    mutable std::mutex mutex;
+    std::map<SonarStreamKey, std::unique_ptr<Recording>> recordings;
+    uint64_t closedFrames = 0;
+};
+
+#endif // !defined(SONAR_CAPTURE_DAEMON_HH)
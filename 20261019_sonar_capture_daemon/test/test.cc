@@ -0,0 +1,194 @@
+// sonar_capture.cc
+// Headless capture daemon: receives chunked sonar frames over UDP (protocol v2) from any
+// number of heads and records each one to its own file. Needs no display.
+// Compile with: make   (make FFMPEG=1 for --format mkv, make LZ4=1 for --lz4)
+// Stop with SIGINT or SIGTERM; every file is closed with its index.
+
+#include "SonarCaptureDaemon.hh"
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <getopt.h>
+#include <iostream>
+#include <string>
+#include <unistd.h>
+
+static volatile sig_atomic_t stopRequested = 0;
+
+static void onSignal(int) {
+    stopRequested = 1;
+}
+
+static void usage(const char *program) {
+    fprintf(stderr,
+            "Usage: %s [options]\n"
+            "  -b, --bind ADDRESS       Bind address (default 0.0.0.0)\n"
+            "  -p, --port PORT          UDP port (default 5700)\n"
+            "  -g, --group GROUP        Multicast group to join\n"
+            "      --iface IFACE        Multicast interface (name or address)\n"
+            "      --source ADDRESS     Accept multicast only from this sender (SSM)\n"
+            "  -t, --threads N          Receive threads sharing the port (default 1)\n"
+            "      --rcvbuf BYTES       Socket receive buffer (default 8 MiB)\n"
+            "      --batch N            Datagrams per recvmmsg call (default 64)\n"
+            "      --max-streams N      Streams per receive thread (default 8)\n"
+            "      --timeout MS         Incomplete frame timeout (default 200)\n"
+            "      --no-crc             Skip CRC32C verification of chunks\n"
+            "  -o, --output DIR         Output directory (default .)\n"
+            "  -f, --format slog|mkv    Raw frame log or encoded video (default slog)\n"
+            "      --lz4                LZ4-compress .slog records\n"
+            "      --fps FPS            Nominal frame rate for file headers (default 15)\n"
+            "      --queue N            Frames buffered per stream before encoding (default 4)\n"
+            "      --idle SECONDS       Close a stream's file after this long without frames "
+            "(default 10)\n"
+            "      --stats-file PATH    Write receive metrics as JSON every second\n",
+            program);
+}
+
+int main(int argc, char *argv[]) {
+    SonarCaptureConfig config;
+    config.receiver.bindAddress = "0.0.0.0";
+    double idleSeconds = 10.0;
+    std::string statsFile;
+
+    enum {
+        kOptIface = 256,
+        kOptSource,
+        kOptRcvbuf,
+        kOptBatch,
+        kOptMaxStreams,
+        kOptTimeout,
+        kOptNoCrc,
+        kOptLz4,
+        kOptFps,
+        kOptQueue,
+        kOptIdle,
+        kOptStatsFile,
+    };
+    static const option options[] = {
+        {"bind", required_argument, nullptr, 'b'},
+        {"port", required_argument, nullptr, 'p'},
+        {"group", required_argument, nullptr, 'g'},
+        {"iface", required_argument, nullptr, kOptIface},
+        {"source", required_argument, nullptr, kOptSource},
+        {"threads", required_argument, nullptr, 't'},
+        {"rcvbuf", required_argument, nullptr, kOptRcvbuf},
+        {"batch", required_argument, nullptr, kOptBatch},
+        {"max-streams", required_argument, nullptr, kOptMaxStreams},
+        {"timeout", required_argument, nullptr, kOptTimeout},
+        {"no-crc", no_argument, nullptr, kOptNoCrc},
+        {"output", required_argument, nullptr, 'o'},
+        {"format", required_argument, nullptr, 'f'},
+        {"lz4", no_argument, nullptr, kOptLz4},
+        {"fps", required_argument, nullptr, kOptFps},
+        {"queue", required_argument, nullptr, kOptQueue},
+        {"idle", required_argument, nullptr, kOptIdle},
+        {"stats-file", required_argument, nullptr, kOptStatsFile},
+        {"help", no_argument, nullptr, 'h'},
+        {nullptr, 0, nullptr, 0},
+    };
+    int opt;
+    while ((opt = getopt_long(argc, argv, "b:p:g:t:o:f:h", options, nullptr)) != -1) {
+        switch (opt) {
+        case 'b':
+            config.receiver.bindAddress = optarg;
+            break;
+        case 'p':
+            config.receiver.port = uint16_t(atoi(optarg));
+            break;
+        case 'g':
+            config.receiver.multicastGroup = optarg;
+            break;
+        case kOptIface:
+            config.receiver.multicastInterface = optarg;
+            break;
+        case kOptSource:
+            config.receiver.multicastSource = optarg;
+            break;
+        case 't':
+            config.receiveThreads = atoi(optarg);
+            break;
+        case kOptRcvbuf:
+            config.receiver.receiveBufferBytes = atoi(optarg);
+            break;
+        case kOptBatch:
+            config.receiver.batchSize = atoi(optarg);
+            break;
+        case kOptMaxStreams:
+            config.reassembler.maxStreams = atoi(optarg);
+            break;
+        case kOptTimeout:
+            config.reassembler.timeoutUs = int64_t(atoi(optarg)) * 1000;
+            break;
+        case kOptNoCrc:
+            config.reassembler.verifyCrc = false;
+            break;
+        case 'o':
+            config.outputDir = optarg;
+            break;
+        case 'f':
+            if (strcmp(optarg, "slog") == 0) {
+                config.format = kSonarCaptureSlog;
+            } else if (strcmp(optarg, "mkv") == 0) {
+                config.format = kSonarCaptureMkv;
+            } else {
+                std::cerr << "Unknown format: " << optarg << std::endl;
+                return 1;
+            }
+            break;
+        case kOptLz4:
+            config.compress = true;
+            break;
+        case kOptFps:
+            config.fps = atoi(optarg);
+            break;
+        case kOptQueue:
+            config.queueFrames = size_t(atoi(optarg));
+            break;
+        case kOptIdle:
+            idleSeconds = atof(optarg);
+            break;
+        case kOptStatsFile:
+            statsFile = optarg;
+            break;
+        default:
+            usage(argv[0]);
+            return opt == 'h' ? 0 : 1;
+        }
+    }
+
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = onSignal;
+    sigaction(SIGINT, &action, nullptr);
+    sigaction(SIGTERM, &action, nullptr);
+
+    SonarCaptureDaemon daemon(config);
+    if (!daemon.start())
+        return 1;
+    std::cerr << "Capturing on port " << config.receiver.port << " into " << config.outputDir
+              << std::endl;
+
+    // Housekeeping once a second: metrics file, idle streams, drop warnings
+    uint64_t reportedDropped = 0;
+    while (!stopRequested) {
+        sleep(1);
+        if (!statsFile.empty() && !daemon.metrics().writeJson(statsFile))
+            std::cerr << "Warning: Failed to write " << statsFile << std::endl;
+        daemon.closeIdle(int64_t(idleSeconds * 1e6));
+
+        uint64_t dropped = 0;
+        for (const SonarCaptureStreamStats &s : daemon.streamStats())
+            dropped += s.framesDropped;
+        if (dropped != reportedDropped) {
+            std::cerr << "Warning: " << dropped
+                      << " frames dropped because encoding or storage fell behind" << std::endl;
+            reportedDropped = dropped;
+        }
+    }
+
+    std::cerr << "Stopping..." << std::endl;
+    daemon.stop();
+    std::cerr << "Wrote " << daemon.framesWritten() << " frames" << std::endl;
+    return 0;
+}
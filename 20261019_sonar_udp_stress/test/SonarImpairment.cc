@@ -0,0 +1,226 @@
+#include "SonarImpairment.hh"
+#include "SonarProtocol.hh"
+#include <arpa/inet.h>
+#include <cerrno>
+#include <cstring>
+#include <iostream>
+#include <netinet/in.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+namespace {
+const int kBatch = 64;
+const size_t kDatagramBytes = 65536;
+// Held datagrams are released when the input goes quiet for this long
+const int kPollMs = 20;
+// DeltaChain::groupLosses
+const uint8_t kLostData = 0x01;
+const uint8_t kLostParity = 0x02;
+} // namespace
+
+SonarImpairedRelay::SonarImpairedRelay(const SonarImpairmentConfig& config)
+    : config(config), rng(config.seed) {}
+
+SonarImpairedRelay::~SonarImpairedRelay() {
+    stop();
+}
+
+bool SonarImpairedRelay::start() {
+    stop();
+    fd = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        std::cerr << "Error: socket() failed (" << strerror(errno) << ")" << std::endl;
+        return false;
+    }
+    int bytes = config.receiveBufferBytes;
+    if (setsockopt(fd, SOL_SOCKET, SO_RCVBUFFORCE, &bytes, sizeof(bytes)) != 0)
+        setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &bytes, sizeof(bytes));
+    sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(config.listenPort);
+    if (inet_pton(AF_INET, config.bindAddress.c_str(), &addr.sin_addr) != 1 ||
+        bind(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0) {
+        std::cerr << "Error: Relay cannot bind " << config.bindAddress << ":"
+                  << config.listenPort << " (" << strerror(errno) << ")" << std::endl;
+        close(fd);
+        fd = -1;
+        return false;
+    }
+    running = true;
+    thread = std::thread(&SonarImpairedRelay::run, this);
+    return true;
+}
+
+void SonarImpairedRelay::stop() {
+    running = false;
+    if (thread.joinable())
+        thread.join();
+    for (const std::pair<const uint16_t, int>& output : outputs)
+        close(output.second);
+    outputs.clear();
+    held.clear();
+    chains.clear();
+    if (fd >= 0)
+        close(fd);
+    fd = -1;
+}
+
+uint64_t SonarImpairedRelay::forwarded() const {
+    return forwardedCount;
+}
+
+uint64_t SonarImpairedRelay::dropped() const {
+    return droppedCount;
+}
+
+uint64_t SonarImpairedRelay::reordered() const {
+    return reorderedCount;
+}
+
+std::vector<uint64_t> SonarImpairedRelay::takeDamagedFrames() {
+    std::vector<uint64_t> frames;
+    std::lock_guard<std::mutex> lock(damagedMutex);
+    frames.swap(damaged);
+    return frames;
+}
+
+void SonarImpairedRelay::run() {
+    std::vector<uint8_t> buffers(kBatch * kDatagramBytes);
+    std::vector<iovec> iov(kBatch);
+    std::vector<mmsghdr> msgs(kBatch);
+    std::vector<sockaddr_in> sources(kBatch);
+    std::uniform_real_distribution<double> uniform(0.0, 1.0);
+    pollfd p;
+    p.fd = fd;
+    p.events = POLLIN;
+
+    while (running) {
+        p.revents = 0;
+        if (poll(&p, 1, kPollMs) <= 0) {
+            // Nothing left to overtake the held datagrams
+            for (Held& h : held)
+                send(h.fd, h.data.data(), h.data.size(), 0);
+            forwardedCount += held.size();
+            held.clear();
+            continue;
+        }
+        for (int i = 0; i < kBatch; ++i) {
+            iov[i].iov_base = &buffers[size_t(i) * kDatagramBytes];
+            iov[i].iov_len = kDatagramBytes;
+            memset(&msgs[i], 0, sizeof(msgs[i]));
+            msgs[i].msg_hdr.msg_iov = &iov[i];
+            msgs[i].msg_hdr.msg_iovlen = 1;
+            msgs[i].msg_hdr.msg_name = &sources[i];
+            msgs[i].msg_hdr.msg_namelen = sizeof(sockaddr_in);
+        }
+        const int n = recvmmsg(fd, msgs.data(), kBatch, MSG_DONTWAIT, nullptr);
+        for (int i = 0; i < n; ++i) {
+            const uint8_t* data = &buffers[size_t(i) * kDatagramBytes];
+            const size_t size = msgs[i].msg_len;
+            const bool drop = uniform(rng) < config.lossRate;
+            noteChunk(data, size, drop);
+            if (drop)
+                continue;
+            const int out = outputFor(sources[i].sin_port);
+            if (out < 0)
+                continue;
+            if (config.reorderDepth > 0 && uniform(rng) < config.reorderRate) {
+                Held h;
+                h.fd = out;
+                h.remaining = config.reorderDepth;
+                h.data.assign(data, data + size);
+                held.push_back(std::move(h));
+                ++reorderedCount;
+                continue;
+            }
+            forward(out, data, size);
+        }
+    }
+}
+
+// Sends one datagram, then releases the held ones it was the last to overtake
+void SonarImpairedRelay::forward(int out, const uint8_t* data, size_t size) {
+    send(out, data, size, 0);
+    ++forwardedCount;
+    for (size_t i = 0; i < held.size();) {
+        if (--held[i].remaining > 0) {
+            ++i;
+            continue;
+        }
+        send(held[i].fd, held[i].data.data(), held[i].data.size(), 0);
+        ++forwardedCount;
+        held.erase(held.begin() + long(i));
+    }
+}
+
+int SonarImpairedRelay::outputFor(uint16_t sourcePort) {
+    std::map<uint16_t, int>::iterator it = outputs.find(sourcePort);
+    if (it != outputs.end())
+        return it->second;
+    int out = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+    sockaddr_in dest;
+    memset(&dest, 0, sizeof(dest));
+    dest.sin_family = AF_INET;
+    dest.sin_port = htons(config.destPort);
+    if (out < 0 || inet_pton(AF_INET, config.destAddress.c_str(), &dest.sin_addr) != 1 ||
+        connect(out, reinterpret_cast<sockaddr*>(&dest), sizeof(dest)) != 0) {
+        std::cerr << "Error: Relay cannot reach " << config.destAddress << ":" << config.destPort
+                  << std::endl;
+        if (out >= 0)
+            close(out);
+        return -1;
+    }
+    int bytes = 8 * 1024 * 1024;
+    setsockopt(out, SOL_SOCKET, SO_SNDBUF, &bytes, sizeof(bytes));
+    outputs[sourcePort] = out;
+    return out;
+}
+
+// A lost data chunk damages its frame. If FEC cannot repair it (no parity, or its interleaved
+// group also lost another data chunk or its parity chunk), every delta frame that follows on
+// the stream is damaged too, up to the next self-contained frame: the receiver cannot decode
+// a delta whose reference never completed. The generator's datagrams arrive in order, so a
+// new frame ID starts a frame.
+void SonarImpairedRelay::noteChunk(const uint8_t* data, size_t size, bool dropped) {
+    if (dropped)
+        ++droppedCount;
+    SonarChunkHeader header;
+    if (!decodeSonarChunkHeader(data, size, header))
+        return;
+    DeltaChain& chain = chains[header.streamId];
+    if (!chain.started || header.frameId != chain.frameId) {
+        const int codec = (header.flags & kSonarFlagCodecMask) >> kSonarFlagCodecShift;
+        chain.started = true;
+        chain.frameId = header.frameId;
+        chain.marked = false;
+        chain.groupLosses.assign(header.fecGroups, 0);
+        if (codec != kSonarCodecDeltaRle)
+            chain.broken = false;
+        else if (chain.broken)
+            markDamaged(header.streamId, chain);
+    }
+    if (!dropped)
+        return;
+    const bool parity = (header.flags & kSonarFlagParity) != 0;
+    if (chain.groupLosses.empty()) {
+        chain.broken = true;
+    } else {
+        // Parity chunks carry their group in chunkIndex
+        uint8_t& losses = chain.groupLosses[header.chunkIndex % chain.groupLosses.size()];
+        if (losses & kLostData || (!parity && losses != 0))
+            chain.broken = true;
+        losses |= parity ? kLostParity : kLostData;
+    }
+    if (!parity)
+        markDamaged(header.streamId, chain);
+}
+
+void SonarImpairedRelay::markDamaged(uint16_t streamId, DeltaChain& chain) {
+    if (chain.marked)
+        return;
+    chain.marked = true;
+    std::lock_guard<std::mutex> lock(damagedMutex);
+    damaged.push_back(uint64_t(streamId) << 32 | chain.frameId);
+}
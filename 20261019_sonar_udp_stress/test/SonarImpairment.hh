@@ -0,0 +1,86 @@
+#if !defined(SONAR_IMPAIRMENT_HH)
+#define SONAR_IMPAIRMENT_HH
+
+#include <atomic>
+#include <cstdint>
+#include <map>
+#include <mutex>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+struct SonarImpairmentConfig {
+    std::string bindAddress = "127.0.0.1";
+    uint16_t listenPort = 5799;          // the generator sends here
+    std::string destAddress = "127.0.0.1";
+    uint16_t destPort = 5700;            // the receiver under test
+    double lossRate = 0.0;               // probability that a datagram is dropped
+    double reorderRate = 0.0;            // probability that a datagram is held back
+    int reorderDepth = 3;                // datagrams that overtake a held one
+    uint32_t seed = 1;
+    int receiveBufferBytes = 32 * 1024 * 1024;
+};
+
+// Loopback relay that drops and reorders datagrams between a generator and a receiver
+//
+// Each source is forwarded from its own socket, so the receiver still sees one address and
+// port per head (and SO_REUSEPORT still spreads the heads over its shards). The relay
+// parses every chunk header, so a harness can tell frames the network damaged (directly or
+// through the delta frames that depend on them) from frames the receiver lost by itself.
+class SonarImpairedRelay {
+public:
+    explicit SonarImpairedRelay(const SonarImpairmentConfig& config);
+    ~SonarImpairedRelay();
+
+    SonarImpairedRelay(const SonarImpairedRelay&) = delete;
+    SonarImpairedRelay& operator=(const SonarImpairedRelay&) = delete;
+
+    bool start();
+    void stop();
+
+    uint64_t forwarded() const;
+    uint64_t dropped() const;
+    uint64_t reordered() const;
+    // Frames damaged since the last call: (streamId << 32) | frameId
+    // (a lost data chunk, or a delta frame whose chain back to the last keyframe lost one)
+    std::vector<uint64_t> takeDamagedFrames();
+
+private:
+    struct Held {
+        int fd;
+        int remaining;
+        std::vector<uint8_t> data;
+    };
+    // Delta chain of one stream, as seen by the relay thread
+    struct DeltaChain {
+        bool started = false;
+        uint32_t frameId = 0;
+        bool marked = false;             // frameId is already in damaged
+        bool broken = false;             // FEC could not repair a frame since the last keyframe
+        std::vector<uint8_t> groupLosses; // chunks of frameId lost per FEC group
+    };
+
+    void run();
+    int outputFor(uint16_t sourcePort);
+    void forward(int fd, const uint8_t* data, size_t size);
+    void noteChunk(const uint8_t* data, size_t size, bool dropped);
+    void markDamaged(uint16_t streamId, DeltaChain& chain);
+
+    SonarImpairmentConfig config;
+    int fd = -1;
+    std::map<uint16_t, int> outputs;     // source port -> forwarding socket
+    std::vector<Held> held;
+    std::map<uint16_t, DeltaChain> chains;  // stream ID -> delta chain
+    std::mt19937 rng;
+    std::thread thread;
+    std::atomic<bool> running{false};
+
+    std::atomic<uint64_t> forwardedCount{0};
+    std::atomic<uint64_t> droppedCount{0};
+    std::atomic<uint64_t> reorderedCount{0};
+    std::mutex damagedMutex;
+    std::vector<uint64_t> damaged;
+};
+
+#endif // !defined(SONAR_IMPAIRMENT_HH)
@@ -0,0 +1,242 @@
+#include "SonarLoadGenerator.hh"
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cmath>
+#include <cstring>
+#include <ctime>
+#include <iostream>
+#include <random>
+
+struct SonarLoadGenerator::Head {
+    std::unique_ptr<SonarSender> sender;
+    std::thread thread;
+    // Copies of the sender's counters that other threads may read
+    std::atomic<uint64_t> issued{0};
+    std::atomic<uint64_t> frames{0};
+    std::atomic<uint64_t> bytes{0};
+    std::atomic<uint64_t> errors{0};
+    std::atomic<uint64_t> behind{0};
+    std::atomic<bool> idle{true};
+};
+
+namespace {
+const int64_t kNsPerSec = 1000000000;
+
+int64_t monotonicNs() {
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return int64_t(ts.tv_sec) * kNsPerSec + ts.tv_nsec;
+}
+
+void sleepUntilNs(int64_t ns) {
+    timespec ts;
+    ts.tv_sec = ns / kNsPerSec;
+    ts.tv_nsec = ns % kNsPerSec;
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, nullptr) == EINTR) {
+    }
+}
+} // namespace
+
+SonarLoadGenerator::SonarLoadGenerator(const SonarLoadConfig& config)
+    : config(config), fps(config.fps) {
+    this->config.heads = std::max(1, config.heads);
+    this->config.bankFrames = std::max(1, config.bankFrames);
+}
+
+SonarLoadGenerator::~SonarLoadGenerator() {
+    stop();
+}
+
+int64_t SonarLoadGenerator::unixTimeUs() {
+    return std::chrono::duration_cast<std::chrono::microseconds>(
+               std::chrono::system_clock::now().time_since_epoch())
+        .count();
+}
+
+size_t SonarLoadGenerator::frameBytes() const {
+    return kSonarImageHeaderSize +
+           size_t(config.width) * config.height * (config.is16bit ? 2 : 1);
+}
+
+uint16_t SonarLoadGenerator::streamId(int head) const {
+    return uint16_t(config.firstStreamId + head);
+}
+
+void SonarLoadGenerator::setFps(double value) {
+    fps = value;
+}
+
+bool SonarLoadGenerator::start() {
+    stop();
+    if (bank.empty())
+        renderBank();
+
+    heads.clear();
+    for (int i = 0; i < config.heads; ++i) {
+        SonarSenderConfig senderConfig;
+        senderConfig.destAddress = config.destAddress;
+        senderConfig.port = config.port;
+        senderConfig.streamId = streamId(i);
+        senderConfig.chunkSize = config.chunkSize;
+        senderConfig.crc = config.crc;
+        senderConfig.gso = config.gso;
+        senderConfig.fecGroupSize = config.fecGroupSize;
+        senderConfig.codec = config.codec;
+        std::unique_ptr<Head> head(new Head);
+        head->sender.reset(new SonarSender(senderConfig));
+        if (!head->sender->isOpen())
+            return false;
+        heads.push_back(std::move(head));
+    }
+    running = true;
+    paused = false;
+    for (int i = 0; i < config.heads; ++i)
+        heads[i]->thread = std::thread(&SonarLoadGenerator::run, this, heads[i].get(), i);
+    return true;
+}
+
+void SonarLoadGenerator::stop() {
+    running = false;
+    for (std::unique_ptr<Head>& head : heads) {
+        if (head->thread.joinable())
+            head->thread.join();
+    }
+}
+
+void SonarLoadGenerator::pause() {
+    paused = true;
+    for (const std::unique_ptr<Head>& head : heads) {
+        while (!head->idle)
+            std::this_thread::yield();
+    }
+}
+
+void SonarLoadGenerator::resume() {
+    paused = false;
+}
+
+// Paces one head on an absolute schedule. A head that falls more than a frame behind skips
+// ahead instead of bursting to catch up, and counts the frames it skipped.
+void SonarLoadGenerator::run(Head* head, int index) {
+    head->idle = false;
+    SonarImageInfo info;
+    info.width = config.width;
+    info.height = config.height;
+    info.is16bit = config.is16bit;
+
+    double rate = fps;
+    int64_t periodNs = rate > 0 ? int64_t(kNsPerSec / rate) : 0;
+    int64_t next = monotonicNs() + periodNs * index / config.heads;
+    size_t frame = size_t(index) * bank.size() / size_t(config.heads);
+    while (running) {
+        if (periodNs > 0)
+            sleepUntilNs(next);
+        if (!running)
+            break;
+        if (paused) {
+            head->idle = true;
+            while (paused && running)
+                std::this_thread::sleep_for(std::chrono::milliseconds(1));
+            head->idle = false;
+            next = monotonicNs() + periodNs * index / config.heads;
+            continue;
+        }
+        const std::vector<uint8_t>& pixels = bank[frame++ % bank.size()];
+        head->sender->sendFrame(info, pixels.data(), uint64_t(unixTimeUs()));
+        ++head->issued;
+        head->frames = head->sender->framesSent();
+        head->bytes = head->sender->bytesSent();
+        head->errors = head->sender->sendErrors();
+
+        rate = fps;
+        periodNs = rate > 0 ? int64_t(kNsPerSec / rate) : 0;
+        next += periodNs;
+        const int64_t now = monotonicNs();
+        if (periodNs > 0 && now > next + periodNs) {
+            head->behind += uint64_t((now - next) / periodNs);
+            next = now;
+        }
+    }
+}
+
+uint64_t SonarLoadGenerator::framesSent() const {
+    uint64_t total = 0;
+    for (const std::unique_ptr<Head>& head : heads)
+        total += head->frames;
+    return total;
+}
+
+uint64_t SonarLoadGenerator::headFramesIssued(int head) const {
+    return heads[size_t(head)]->issued;
+}
+
+int SonarLoadGenerator::headCount() const {
+    return int(heads.size());
+}
+
+uint64_t SonarLoadGenerator::bytesSent() const {
+    uint64_t total = 0;
+    for (const std::unique_ptr<Head>& head : heads)
+        total += head->bytes;
+    return total;
+}
+
+uint64_t SonarLoadGenerator::sendErrors() const {
+    uint64_t total = 0;
+    for (const std::unique_ptr<Head>& head : heads)
+        total += head->errors;
+    return total;
+}
+
+uint64_t SonarLoadGenerator::framesBehind() const {
+    uint64_t total = 0;
+    for (const std::unique_ptr<Head>& head : heads)
+        total += head->behind;
+    return total;
+}
+
+// Water column speckle, an undulating seabed and a drifting target, one bank entry per phase
+void SonarLoadGenerator::renderBank() {
+    const int w = config.width;
+    const int h = config.height;
+    const int frames = config.bankFrames;
+    const double pi = 3.14159265358979323846;
+    std::mt19937 rng(12345);
+    std::uniform_int_distribution<int> speckle(0, 63);
+    std::uniform_int_distribution<int> grain(0, 40);
+
+    bank.assign(size_t(frames), std::vector<uint8_t>(frameBytes() - kSonarImageHeaderSize));
+    for (int f = 0; f < frames; ++f) {
+        const double phase = 2.0 * pi * f / frames;
+        const double targetBeam = w * (0.3 + 0.4 * (0.5 + 0.5 * std::sin(phase)));
+        const double targetRow = h * 0.4;
+        const double targetRadius = std::max(2.0, h * 0.01);
+        std::vector<int> bottom(size_t(w), 0);
+        for (int b = 0; b < w; ++b)
+            bottom[size_t(b)] = int(h * (0.7 + 0.05 * std::sin(2.0 * pi * b / w + phase)));
+        std::vector<uint8_t>& pixels = bank[size_t(f)];
+        for (int r = 0; r < h; ++r) {
+            for (int b = 0; b < w; ++b) {
+                int v = 0;
+                if (r >= bottom[size_t(b)]) {
+                    v = std::max(0, 220 - (r - bottom[size_t(b)]) * 400 / h) + grain(rng);
+                } else if (speckle(rng) == 0) {
+                    v = grain(rng) / 4;
+                }
+                const double db = b - targetBeam;
+                const double dr = r - targetRow;
+                if (db * db + dr * dr <= targetRadius * targetRadius)
+                    v = 255;
+                v = std::min(v, 255);
+                const size_t i = size_t(r) * w + b;
+                if (config.is16bit) {
+                    const uint16_t v16 = uint16_t(v * 256 + (v ? grain(rng) : 0));
+                    memcpy(&pixels[i * 2], &v16, 2);
+                } else {
+                    pixels[i] = uint8_t(v);
+                }
+            }
+        }
+    }
+}
@@ -0,0 +1,83 @@
+#if !defined(SONAR_LOAD_GENERATOR_HH)
+#define SONAR_LOAD_GENERATOR_HH
+
+#include "SonarSender.hh"
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+struct SonarLoadConfig {
+    std::string destAddress = "127.0.0.1";
+    uint16_t port = 5700;
+    int heads = 1;                       // one sender (socket, stream ID and thread) per head
+    uint16_t firstStreamId = 0;          // head i sends stream firstStreamId + i
+    int width = 512;
+    int height = 1000;
+    bool is16bit = false;
+    double fps = 15.0;                   // per head
+    int bankFrames = 32;                 // distinct synthetic frames, sent in a loop
+
+    // Passed to every SonarSender
+    size_t chunkSize = 60000;
+    bool crc = true;
+    bool gso = true;
+    size_t fecGroupSize = 0;
+    SonarCodec codec = kSonarCodecRaw;
+};
+
+// Synthetic sonar traffic for load tests
+//
+// Frames look like the 20250329_sonar_simulated_data scenes: a mostly empty water column
+// with speckle, a seabed band that undulates across the beams, and a target that drifts
+// through the fan. They are rendered once into a bank (so generation costs nothing
+// while sending) and every head sends the bank in a loop at its own rate, phase shifted
+// so the heads do not burst in lockstep. Timestamps are the send time (UNIX [us]), so a
+// receiver's latency is measured from the moment the frame left the generator.
+class SonarLoadGenerator {
+public:
+    explicit SonarLoadGenerator(const SonarLoadConfig& config);
+    ~SonarLoadGenerator();
+
+    SonarLoadGenerator(const SonarLoadGenerator&) = delete;
+    SonarLoadGenerator& operator=(const SonarLoadGenerator&) = delete;
+
+    bool start();
+    void stop();
+    // Holds every head between frames (returns once none is sending) and lets them go again
+    void pause();
+    void resume();
+    // May be changed while running; takes effect from the next frame (0: as fast as possible)
+    void setFps(double fps);
+
+    uint64_t framesSent() const;
+    // Frames a head handed to its sender, failed sends included. The sender numbers
+    // frames from 0, so this is also the head's next frame ID.
+    uint64_t headFramesIssued(int head) const;
+    int headCount() const;
+    uint64_t bytesSent() const;          // UDP payload bytes, chunk headers included
+    uint64_t sendErrors() const;
+    // Frames skipped because a head could not keep up with the requested rate
+    uint64_t framesBehind() const;
+    size_t frameBytes() const;           // image header + pixels
+    uint16_t streamId(int head) const;
+
+    static int64_t unixTimeUs();
+
+private:
+    struct Head;
+
+    void renderBank();
+    void run(Head* head, int index);
+
+    SonarLoadConfig config;
+    std::vector<std::vector<uint8_t>> bank;
+    std::vector<std::unique_ptr<Head>> heads;
+    std::atomic<double> fps;
+    std::atomic<bool> running{false};
+    std::atomic<bool> paused{false};
+};
+
+#endif // !defined(SONAR_LOAD_GENERATOR_HH)
@@ -0,0 +1,140 @@
+#include "SonarStressReceiver.hh"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <poll.h>
+#include <thread>
+
+namespace {
+// How long a shard sleeps in poll() before expiring incomplete frames
+const int kPollMs = 50;
+
+int64_t unixTimeUs() {
+    return std::chrono::duration_cast<std::chrono::microseconds>(
+               std::chrono::system_clock::now().time_since_epoch())
+        .count();
+}
+} // namespace
+
+class SonarStressReceiver::Shard {
+public:
+    Shard(const SonarStressReceiverConfig& config, const SonarUdpReceiverConfig& socket)
+        : receiver(socket),
+          pool((config.maxFrameBytes + config.reassembler.maxPayload - 1) /
+                   config.reassembler.maxPayload * config.reassembler.maxPayload,
+               std::max(1, config.reassembler.maxStreams) *
+                       (config.reassembler.maxFramesInFlight + 1) +
+                   2),
+          reassembler(pool, config.reassembler,
+                      [this](const SonarFramePtr& frame) { onFrame(*frame); }) {}
+
+    ~Shard() { stop(); }
+
+    bool isOpen() const { return receiver.isOpen(); }
+
+    void start() { thread = std::thread(&Shard::run, this); }
+
+    void stop() {
+        stopping = true;
+        if (thread.joinable())
+            thread.join();
+    }
+
+    // Moves this shard's frames into sample and adds its counters
+    void take(SonarStressSample& sample) {
+        std::lock_guard<std::mutex> lock(mutex);
+        sample.frames.insert(sample.frames.end(), frames.begin(), frames.end());
+        sample.latencyUs.insert(sample.latencyUs.end(), latencyUs.begin(), latencyUs.end());
+        frames.clear();
+        latencyUs.clear();
+        sample.stats += stats;
+        sample.datagrams += datagrams;
+        sample.kernelDrops += kernelDrops;
+    }
+
+private:
+    void run() {
+        pollfd p;
+        p.fd = receiver.fd();
+        p.events = POLLIN;
+        while (!stopping) {
+            p.revents = 0;
+            uint64_t received = 0;
+            if (poll(&p, 1, kPollMs) <= 0) {
+                reassembler.expire();
+            } else {
+                int n;
+                do {
+                    reassembler.prepare(receiver);
+                    n = receiver.receiveBatch();
+                    if (n > 0) {
+                        reassembler.process(receiver, n);
+                        received += uint64_t(n);
+                    }
+                } while (n == receiver.batchSize());
+            }
+            std::lock_guard<std::mutex> lock(mutex);
+            stats = reassembler.stats();
+            datagrams += received;
+            kernelDrops = receiver.kernelDrops();
+        }
+    }
+
+    // On the shard's thread, from process() or expire()
+    void onFrame(const SonarFrame& frame) {
+        const int64_t latency = unixTimeUs() - int64_t(frame.timestampUs);
+        std::lock_guard<std::mutex> lock(mutex);
+        frames.push_back(uint64_t(frame.streamId) << 32 | frame.frameId);
+        latencyUs.push_back(uint32_t(std::max<int64_t>(0, latency)));
+    }
+
+    SonarUdpReceiver receiver;
+    SonarFramePool pool;
+    SonarReassembler reassembler;
+    std::thread thread;
+    std::atomic<bool> stopping{false};
+
+    std::mutex mutex;
+    std::vector<uint64_t> frames;
+    std::vector<uint32_t> latencyUs;
+    SonarReassemblerStats stats;
+    uint64_t datagrams = 0;
+    uint64_t kernelDrops = 0;
+};
+
+SonarStressReceiver::SonarStressReceiver(const SonarStressReceiverConfig& config)
+    : config(config) {}
+
+SonarStressReceiver::~SonarStressReceiver() {
+    stop();
+}
+
+bool SonarStressReceiver::start() {
+    stop();
+    shards.clear();
+    const int threads = std::max(1, config.threads);
+    SonarUdpReceiverConfig socket = config.socket;
+    socket.reusePort = threads > 1;
+    for (int i = 0; i < threads; ++i) {
+        std::unique_ptr<Shard> shard(new Shard(config, socket));
+        if (!shard->isOpen())
+            return false;
+        shards.push_back(std::move(shard));
+    }
+    for (std::unique_ptr<Shard>& shard : shards)
+        shard->start();
+    return true;
+}
+
+void SonarStressReceiver::stop() {
+    for (std::unique_ptr<Shard>& shard : shards)
+        shard->stop();
+}
+
+SonarStressSample SonarStressReceiver::takeSample() {
+    SonarStressSample sample;
+    for (std::unique_ptr<Shard>& shard : shards)
+        shard->take(sample);
+    return sample;
+}
@@ -0,0 +1,50 @@
+#if !defined(SONAR_STRESS_RECEIVER_HH)
+#define SONAR_STRESS_RECEIVER_HH
+
+#include "SonarReassembler.hh"
+#include "SonarUdpReceiver.hh"
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+struct SonarStressReceiverConfig {
+    SonarUdpReceiverConfig socket;
+    SonarReassemblerConfig reassembler;
+    int threads = 1;                     // SO_REUSEPORT shards
+    size_t maxFrameBytes = kSonarImageHeaderSize + 1024 * 1024 * 2;
+};
+
+// What the receiver delivered between two takeSample() calls
+struct SonarStressSample {
+    std::vector<uint64_t> frames;        // (streamId << 32) | frameId of every completed frame
+    std::vector<uint32_t> latencyUs;     // send timestamp to reassembly, per completed frame
+    // Cumulative since start, summed over the shards
+    SonarReassemblerStats stats;
+    uint64_t datagrams = 0;
+    uint64_t kernelDrops = 0;
+};
+
+// The receive chain under test: the same SonarUdpReceiver + SonarReassembler pair the
+// receiver, player and capture daemon run, one poll loop per shard, with nothing behind it
+// but a callback that records which frames completed and how late.
+class SonarStressReceiver {
+public:
+    explicit SonarStressReceiver(const SonarStressReceiverConfig& config);
+    ~SonarStressReceiver();
+
+    SonarStressReceiver(const SonarStressReceiver&) = delete;
+    SonarStressReceiver& operator=(const SonarStressReceiver&) = delete;
+
+    bool start();
+    void stop();
+
+    SonarStressSample takeSample();
+
+private:
+    class Shard;
+
+    SonarStressReceiverConfig config;
+    std::vector<std::unique_ptr<Shard>> shards;
+};
+
+#endif // !defined(SONAR_STRESS_RECEIVER_HH)
@@ -0,0 +1,479 @@
+// sonar_stress.cc
+// Load generator and stress benchmark for the sonar UDP receive chain (protocol v2).
+// Synthesizes frames from any number of heads on loopback, optionally through a relay that
+// drops and reorders datagrams, and finds the highest frame rate the receiver sustains
+// without losing frames, with latency percentiles at every rate tried.
+// Compile with: make   (make LZ4=1 for --compress lz4)
+//
+//   ./test --heads 4 --width 512 --height 1000             sweep, report max loss-free rate
+//   ./test --fixed --fps 30 --loss 0.001 --fec 8           one run at a fixed rate
+//   ./test --send-only --ip 10.0.0.5 --port 5700 --fps 15  load an external receiver
+
+#include "SonarCodec.hh"
+#include "SonarImpairment.hh"
+#include "SonarLoadGenerator.hh"
+#include "SonarStressReceiver.hh"
+#include <algorithm>
+#include <chrono>
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <getopt.h>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+static volatile sig_atomic_t stopRequested = 0;
+
+static void onSignal(int) {
+    stopRequested = 1;
+}
+
+struct StepResult {
+    double fps = 0;                      // requested, per head
+    double seconds = 0;
+    uint64_t sent = 0;
+    uint64_t delivered = 0;
+    uint64_t receiverLost = 0;           // every chunk reached the receiver, no frame came out
+    uint64_t networkLost = 0;            // the relay damaged it or its delta reference
+    uint64_t recovered = 0;              // the relay dropped a chunk, the frame came out anyway
+    uint64_t behind = 0;                 // the generator could not keep the requested rate
+    uint64_t kernelDrops = 0;
+    double megabytesPerSec = 0;
+    uint32_t p50 = 0, p90 = 0, p99 = 0, p999 = 0, max = 0;
+
+    bool generatorLimited() const { return behind * 20 > sent; }
+    bool lossFree(double tolerance) const {
+        return double(receiverLost) <= tolerance * double(sent);
+    }
+};
+
+static uint32_t percentile(std::vector<uint32_t>& sorted, double q) {
+    if (sorted.empty())
+        return 0;
+    size_t i = std::min(sorted.size() - 1, size_t(q * double(sorted.size())));
+    return sorted[i];
+}
+
+static void sleepSeconds(double seconds) {
+    const auto until = std::chrono::steady_clock::now() +
+                       std::chrono::microseconds(int64_t(seconds * 1e6));
+    while (!stopRequested && std::chrono::steady_clock::now() < until)
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+}
+
+// Runs the generator at fps for duration, waits for the receiver to drain and matches every
+// frame ID the generator issued against what completed and what the relay damaged
+static StepResult runStep(SonarLoadGenerator& generator, SonarStressReceiver& receiver,
+                          SonarImpairedRelay* relay, double fps, double duration,
+                          double drainSeconds) {
+    StepResult r;
+    r.fps = fps;
+    const int heads = generator.headCount();
+    std::vector<uint64_t> first(static_cast<size_t>(heads)), last(first);
+    for (int h = 0; h < heads; ++h)
+        first[size_t(h)] = generator.headFramesIssued(h);
+    const SonarStressSample before = receiver.takeSample();
+    if (relay)
+        relay->takeDamagedFrames();
+    const uint64_t bytes0 = generator.bytesSent();
+    const uint64_t behind0 = generator.framesBehind();
+
+    generator.setFps(fps);
+    const auto t0 = std::chrono::steady_clock::now();
+    generator.resume();
+    sleepSeconds(duration);
+    generator.pause();
+    r.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+    for (int h = 0; h < heads; ++h)
+        last[size_t(h)] = generator.headFramesIssued(h);
+    r.megabytesPerSec = double(generator.bytesSent() - bytes0) / r.seconds / 1e6;
+    r.behind = generator.framesBehind() - behind0;
+
+    sleepSeconds(drainSeconds);
+    SonarStressSample sample = receiver.takeSample();
+    std::vector<uint64_t> damaged;
+    if (relay)
+        damaged = relay->takeDamagedFrames();
+    r.kernelDrops = sample.kernelDrops - before.kernelDrops;
+
+    std::sort(sample.frames.begin(), sample.frames.end());
+    std::sort(damaged.begin(), damaged.end());
+    for (int h = 0; h < heads; ++h) {
+        const uint64_t stream = uint64_t(generator.streamId(h)) << 32;
+        for (uint64_t id = first[size_t(h)]; id < last[size_t(h)]; ++id) {
+            const uint64_t key = stream | uint32_t(id);
+            const bool completed =
+                std::binary_search(sample.frames.begin(), sample.frames.end(), key);
+            const bool hit = std::binary_search(damaged.begin(), damaged.end(), key);
+            ++r.sent;
+            if (completed)
+                ++r.delivered;
+            if (completed && hit)
+                ++r.recovered;
+            else if (hit)
+                ++r.networkLost;
+            else if (!completed)
+                ++r.receiverLost;
+        }
+    }
+
+    std::sort(sample.latencyUs.begin(), sample.latencyUs.end());
+    r.p50 = percentile(sample.latencyUs, 0.5);
+    r.p90 = percentile(sample.latencyUs, 0.9);
+    r.p99 = percentile(sample.latencyUs, 0.99);
+    r.p999 = percentile(sample.latencyUs, 0.999);
+    r.max = sample.latencyUs.empty() ? 0 : sample.latencyUs.back();
+    return r;
+}
+
+static void printHeader() {
+    printf("%9s %9s %8s %8s %8s %7s %8s %7s %7s %7s %7s %7s %8s %8s\n", "fps/head", "frames/s",
+           "MB/s", "sent", "deliver", "rx-lost", "net-lost", "fec-fix", "kdrops", "behind",
+           "p50us", "p90us", "p99us", "maxus");
+}
+
+static void printRow(const StepResult& r, int heads) {
+    printf("%9.1f %9.1f %8.1f %8llu %8llu %7llu %8llu %7llu %7llu %7llu %7u %7u %8u %8u%s\n",
+           r.fps, r.fps * heads, r.megabytesPerSec, (unsigned long long)r.sent,
+           (unsigned long long)r.delivered, (unsigned long long)r.receiverLost,
+           (unsigned long long)r.networkLost, (unsigned long long)r.recovered,
+           (unsigned long long)r.kernelDrops, (unsigned long long)r.behind, r.p50, r.p90,
+           r.p99, r.max, r.generatorLimited() ? "  (generator limited)" : "");
+    fflush(stdout);
+}
+
+static void usage(const char *program) {
+    fprintf(stderr,
+            "Usage: %s [options]\n"
+            "Traffic\n"
+            "      --heads N            Sonar heads, one stream and socket each (default 1)\n"
+            "      --width PIXELS       Beams per frame (default 512)\n"
+            "      --height PIXELS      Range samples per frame (default 1000)\n"
+            "      --16bit              16-bit pixels\n"
+            "      --fps FPS            Per-head rate: start of the sweep, or the fixed rate "
+            "(default 15)\n"
+            "      --chunk BYTES        Frame bytes per datagram (default 60000)\n"
+            "      --compress CODEC     raw, rle, delta or lz4 (default raw)\n"
+            "      --fec N              One XOR parity chunk per N data chunks (default 0)\n"
+            "      --no-crc             Do not compute or verify CRC32C\n"
+            "      --no-gso             Disable UDP generic segmentation offload\n"
+            "Impairment (through a loopback relay)\n"
+            "      --loss P             Drop each datagram with probability P (e.g. 0.001)\n"
+            "      --reorder P          Hold each datagram back with probability P\n"
+            "      --reorder-depth N    Datagrams that overtake a held one (default 3)\n"
+            "      --relay-port PORT    Port the relay listens on (default 5799)\n"
+            "      --seed N             Random seed for the relay (default 1)\n"
+            "Receiver\n"
+            "      --ip ADDRESS         Receiver address (default 127.0.0.1)\n"
+            "      --port PORT          Receiver port (default 5700)\n"
+            "  -t, --threads N          Receive threads sharing the port (default 1)\n"
+            "      --rcvbuf BYTES       Socket receive buffer (default 8 MiB)\n"
+            "      --batch N            Datagrams per recvmmsg call (default 64)\n"
+            "      --timeout MS         Incomplete frame timeout (default 200)\n"
+            "Run\n"
+            "      --duration SECONDS   Length of each step (default 2)\n"
+            "      --growth X           Rate multiplier until the first loss (default 1.5)\n"
+            "      --precision X        Stop when loss-free and lossy rates are this close "
+            "(default 0.05)\n"
+            "      --tolerance X        Receiver-lost fraction still counted as loss-free "
+            "(default 0)\n"
+            "      --fixed              Run once at --fps instead of sweeping\n"
+            "      --send-only          Only generate traffic (to --ip:--port) until stopped\n",
+            program);
+}
+
+int main(int argc, char *argv[]) {
+    SonarLoadConfig load;
+    SonarImpairmentConfig impairment;
+    SonarStressReceiverConfig rx;
+    rx.socket.bindAddress = "127.0.0.1";
+    double duration = 2.0;
+    double growth = 1.5;
+    double precision = 0.05;
+    double tolerance = 0.0;
+    bool fixed = false;
+    bool sendOnly = false;
+
+    enum {
+        kOptHeads = 256,
+        kOptWidth,
+        kOptHeight,
+        kOpt16bit,
+        kOptFps,
+        kOptChunk,
+        kOptCompress,
+        kOptFec,
+        kOptNoCrc,
+        kOptNoGso,
+        kOptLoss,
+        kOptReorder,
+        kOptReorderDepth,
+        kOptRelayPort,
+        kOptSeed,
+        kOptIp,
+        kOptPort,
+        kOptRcvbuf,
+        kOptBatch,
+        kOptTimeout,
+        kOptDuration,
+        kOptGrowth,
+        kOptPrecision,
+        kOptTolerance,
+        kOptFixed,
+        kOptSendOnly,
+    };
+    static const option options[] = {
+        {"heads", required_argument, nullptr, kOptHeads},
+        {"width", required_argument, nullptr, kOptWidth},
+        {"height", required_argument, nullptr, kOptHeight},
+        {"16bit", no_argument, nullptr, kOpt16bit},
+        {"fps", required_argument, nullptr, kOptFps},
+        {"chunk", required_argument, nullptr, kOptChunk},
+        {"compress", required_argument, nullptr, kOptCompress},
+        {"fec", required_argument, nullptr, kOptFec},
+        {"no-crc", no_argument, nullptr, kOptNoCrc},
+        {"no-gso", no_argument, nullptr, kOptNoGso},
+        {"loss", required_argument, nullptr, kOptLoss},
+        {"reorder", required_argument, nullptr, kOptReorder},
+        {"reorder-depth", required_argument, nullptr, kOptReorderDepth},
+        {"relay-port", required_argument, nullptr, kOptRelayPort},
+        {"seed", required_argument, nullptr, kOptSeed},
+        {"ip", required_argument, nullptr, kOptIp},
+        {"port", required_argument, nullptr, kOptPort},
+        {"threads", required_argument, nullptr, 't'},
+        {"rcvbuf", required_argument, nullptr, kOptRcvbuf},
+        {"batch", required_argument, nullptr, kOptBatch},
+        {"timeout", required_argument, nullptr, kOptTimeout},
+        {"duration", required_argument, nullptr, kOptDuration},
+        {"growth", required_argument, nullptr, kOptGrowth},
+        {"precision", required_argument, nullptr, kOptPrecision},
+        {"tolerance", required_argument, nullptr, kOptTolerance},
+        {"fixed", no_argument, nullptr, kOptFixed},
+        {"send-only", no_argument, nullptr, kOptSendOnly},
+        {"help", no_argument, nullptr, 'h'},
+        {nullptr, 0, nullptr, 0},
+    };
+    int opt;
+    while ((opt = getopt_long(argc, argv, "t:h", options, nullptr)) != -1) {
+        switch (opt) {
+        case kOptHeads:
+            load.heads = atoi(optarg);
+            break;
+        case kOptWidth:
+            load.width = atoi(optarg);
+            break;
+        case kOptHeight:
+            load.height = atoi(optarg);
+            break;
+        case kOpt16bit:
+            load.is16bit = true;
+            break;
+        case kOptFps:
+            load.fps = atof(optarg);
+            break;
+        case kOptChunk:
+            load.chunkSize = size_t(atoi(optarg));
+            break;
+        case kOptCompress: {
+            const std::string name = optarg;
+            if (name == "raw") {
+                load.codec = kSonarCodecRaw;
+            } else if (name == "rle") {
+                load.codec = kSonarCodecZeroRle;
+            } else if (name == "delta") {
+                load.codec = kSonarCodecDeltaRle;
+            } else if (name == "lz4") {
+                load.codec = kSonarCodecLz4;
+            } else {
+                std::cerr << "Unknown codec: " << name << std::endl;
+                return 1;
+            }
+            break;
+        }
+        case kOptFec:
+            load.fecGroupSize = size_t(atoi(optarg));
+            break;
+        case kOptNoCrc:
+            load.crc = false;
+            rx.reassembler.verifyCrc = false;
+            break;
+        case kOptNoGso:
+            load.gso = false;
+            break;
+        case kOptLoss:
+            impairment.lossRate = atof(optarg);
+            break;
+        case kOptReorder:
+            impairment.reorderRate = atof(optarg);
+            break;
+        case kOptReorderDepth:
+            impairment.reorderDepth = atoi(optarg);
+            break;
+        case kOptRelayPort:
+            impairment.listenPort = uint16_t(atoi(optarg));
+            break;
+        case kOptSeed:
+            impairment.seed = uint32_t(atoi(optarg));
+            break;
+        case kOptIp:
+            load.destAddress = optarg;
+            rx.socket.bindAddress = optarg;
+            break;
+        case kOptPort:
+            load.port = uint16_t(atoi(optarg));
+            rx.socket.port = load.port;
+            break;
+        case 't':
+            rx.threads = atoi(optarg);
+            break;
+        case kOptRcvbuf:
+            rx.socket.receiveBufferBytes = atoi(optarg);
+            break;
+        case kOptBatch:
+            rx.socket.batchSize = atoi(optarg);
+            break;
+        case kOptTimeout:
+            rx.reassembler.timeoutUs = int64_t(atoi(optarg)) * 1000;
+            break;
+        case kOptDuration:
+            duration = atof(optarg);
+            break;
+        case kOptGrowth:
+            growth = std::max(1.01, atof(optarg));
+            break;
+        case kOptPrecision:
+            precision = atof(optarg);
+            break;
+        case kOptTolerance:
+            tolerance = atof(optarg);
+            break;
+        case kOptFixed:
+            fixed = true;
+            break;
+        case kOptSendOnly:
+            sendOnly = true;
+            break;
+        default:
+            usage(argv[0]);
+            return opt == 'h' ? 0 : 1;
+        }
+    }
+    if (!sonarCodecAvailable(load.codec)) {
+        std::cerr << sonarCodecName(load.codec) << " is not built in" << std::endl;
+        return 1;
+    }
+    // Chunks must fit one datagram on the receiving side
+    rx.reassembler.maxPayload = load.chunkSize;
+    rx.reassembler.maxStreams = std::max(rx.reassembler.maxStreams, load.heads);
+
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = onSignal;
+    sigaction(SIGINT, &action, nullptr);
+    sigaction(SIGTERM, &action, nullptr);
+
+    // Impaired traffic goes generator -> relay -> receiver
+    std::unique_ptr<SonarImpairedRelay> relay;
+    if (impairment.lossRate > 0 || impairment.reorderRate > 0) {
+        impairment.bindAddress = "127.0.0.1";
+        impairment.destAddress = load.destAddress;
+        impairment.destPort = load.port;
+        relay.reset(new SonarImpairedRelay(impairment));
+        if (!relay->start())
+            return 1;
+        load.destAddress = "127.0.0.1";
+        load.port = impairment.listenPort;
+    }
+
+    SonarLoadGenerator generator(load);
+    if (sendOnly) {
+        if (!generator.start())
+            return 1;
+        std::cerr << "Sending " << load.heads << " x " << load.width << "x" << load.height
+                  << (load.is16bit ? " 16-bit" : " 8-bit") << " at " << load.fps
+                  << " fps per head; stop with Ctrl-C" << std::endl;
+        uint64_t frames = 0, bytes = 0;
+        while (!stopRequested) {
+            sleepSeconds(1.0);
+            const uint64_t f = generator.framesSent(), b = generator.bytesSent();
+            fprintf(stderr, "%8llu frames/s %8.1f MB/s   %llu behind, %llu send errors\n",
+                    (unsigned long long)(f - frames), double(b - bytes) / 1e6,
+                    (unsigned long long)generator.framesBehind(),
+                    (unsigned long long)generator.sendErrors());
+            frames = f;
+            bytes = b;
+        }
+        generator.stop();
+        return 0;
+    }
+
+    SonarStressReceiver receiver(rx);
+    if (!receiver.start())
+        return 1;
+    if (!generator.start())
+        return 1;
+    generator.pause();
+
+    const double drainSeconds = double(rx.reassembler.timeoutUs) / 1e6 + 0.2;
+    printf("%d head(s), %dx%d %s, %s, chunk %zu, fec %zu, loss %g, reorder %g, %d rx thread(s)\n",
+           load.heads, load.width, load.height, load.is16bit ? "16-bit" : "8-bit",
+           sonarCodecName(load.codec), load.chunkSize, load.fecGroupSize, impairment.lossRate,
+           impairment.reorderRate, rx.threads);
+    printHeader();
+
+    StepResult best;
+    bool haveBest = false;
+    double good = 0, bad = 0;
+    double fps = load.fps;
+    for (int step = 0; step < 30 && !stopRequested; ++step) {
+        const StepResult r = runStep(generator, receiver, relay.get(), fps, duration,
+                                     drainSeconds);
+        if (stopRequested)
+            break;
+        printRow(r, load.heads);
+        if (fixed)
+            break;
+        if (r.lossFree(tolerance)) {
+            good = fps;
+            best = r;
+            haveBest = true;
+            if (r.generatorLimited()) {
+                printf("The generator cannot offer more than %.1f frames/s; "
+                       "the receiver kept up\n",
+                       double(r.sent) / r.seconds);
+                break;
+            }
+        } else {
+            bad = fps;
+        }
+        if (bad == 0) {
+            fps *= growth;
+        } else if (good == 0) {
+            fps = bad / growth / growth;
+            if (fps < 0.1)
+                break;
+        } else if (bad / good <= 1.0 + precision) {
+            break;
+        } else {
+            fps = (good + bad) / 2;
+        }
+    }
+
+    generator.stop();
+    receiver.stop();
+    if (!fixed) {
+        if (haveBest) {
+            printf("Max loss-free: %.1f frames/s (%d x %.1f fps), %.1f MB/s; "
+                   "latency p50 %u us, p90 %u us, p99 %u us, p99.9 %u us, max %u us\n",
+                   best.fps * load.heads, load.heads, best.fps, best.megabytesPerSec, best.p50,
+                   best.p90, best.p99, best.p999, best.max);
+        } else {
+            printf("No loss-free rate found\n");
+        }
+    }
+    return 0;
+}